@@ -2,74 +2,1619 @@
 // Created by user on 8/3/15.
 //
 
+#define _GNU_SOURCE
 #include <stddef.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <poll.h>
 
 #include "xpdma.h"
 #include <stdio.h>
+
+#define XPDMA_PARALLEL_COOKIE   0x7870646d00000000ULL // Cookies of xpdma_send_parallel/xpdma_recv_parallel chunks
+#define XPDMA_CACHE_QUEUE       256     // Read-ahead blocks queued at most
+#define XPDMA_CACHE_DIRTY       16      // Asynchronous send ranges tracked, more - nothing is cached
 #include "../driver/xpdma_driver.h"
 
+// Worker threads copying parts of a range between user memory and DMA buffers
+typedef struct {
+    pthread_t threads[XPDMA_MAX_COPY_THREADS];
+    int count;                  // Workers, the calling thread copies one more part
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned int generation;    // Incremented for every copy
+    int pending;                // Workers not finished with the current copy
+    int stop;
+    char *dst;
+    const char *src;
+    size_t size;
+    size_t part;
+} xpdma_copier_t;
+
+// Block of the host-side read cache
+typedef struct {
+    uint32_t addr;              // DDR address, block size aligned
+    int state;                  // CACHE_FREE, CACHE_LOADING or CACHE_VALID
+    int referenced;             // CLOCK bit, set on every hit
+    int stale;                  // Written or failed while loading, dropped when the load ends
+    int prefetched;             // Loaded by read-ahead, not used yet
+    int next;                   // Hash chain, -1 - end
+    char *data;
+} xpdma_block_t;
+
+// Read cache of a handle (xpdma_cache_setup): blocks keyed by DDR address, CLOCK
+// eviction, read-ahead of sequential receives in its own thread
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;      // A block left CACHE_LOADING
+    pthread_cond_t work;        // Read-ahead queued or stop
+    pthread_t thread;
+    int threadStarted;
+    int stop;
+    unsigned int blockSize;
+    unsigned int count;         // Blocks
+    unsigned int readahead;     // Blocks read ahead of a sequential stream, 0 - off
+    xpdma_block_t *blocks;
+    char *mem;
+    size_t memSize;
+    int *hash;
+    unsigned int hashMask;
+    unsigned int hand;          // CLOCK hand
+    uint64_t lastEnd;           // End of the previous receive
+    uint64_t readaheadEnd;      // End of the blocks queued for read-ahead
+    uint32_t queue[XPDMA_CACHE_QUEUE];
+    unsigned int queueHead;
+    unsigned int queueTail;
+    unsigned int asyncInflight; // Asynchronous requests of the handle not reaped
+    uint64_t dirty[XPDMA_CACHE_DIRTY][2]; // Ranges of asynchronous sends in flight
+    int dirtyCount;             // XPDMA_CACHE_DIRTY + 1 - overflow, everything is dirty
+    xpdma_cache_stats_t stats;
+} xpdma_cache_t;
+
+enum {
+    CACHE_FREE,
+    CACHE_LOADING,
+    CACHE_VALID,
+};
+
 struct xpdma_t {
-    int fd;
+    const xpdma_backend_t *backend;
+    void *dev;                  // Backend state
+    int fd;                     // Kernel driver file, -1 with user-space backends
+    cdmaRing_t *ring;           // Shared rings (xpdma_ring_setup)
+    cdmaRequest_t *sq;
+    cdmaCompletion_t *cq;
+    unsigned int ringEntries;
+    unsigned int ringSize;
+    int sqpoll;
+    xpdma_copier_t *copier;     // xpdma_set_copy_threads
+    xpdma_buffer_t *staging[2]; // Pool buffers of xpdma_send_parallel/xpdma_recv_parallel
+    cdmaStream_t *stream;       // Stream mapping: control page, then the slots
+    unsigned int streamSize;
+    unsigned int streamSlots;
+    unsigned int streamSlotSize;
+    volatile uint32_t *regs;    // BAR0 mapping (xpdma_map_regs)
+    unsigned int regsSize;
+    int regsWritable;
+    xpdma_cache_t *cache;       // Read cache (xpdma_cache_setup)
+};
+
+// Kernel backend: the state is the device file
+static void *xpdma_kernel_open(int index)
+{
+    int *fd;
+    char path[32];
+
+    fd = (int *)malloc(sizeof(int));
+    if (fd == NULL)
+        return NULL;
+
+    snprintf(path, sizeof(path), "/dev/" DEVICE_NAME "%d", index);
+    *fd = open(path, O_RDWR | O_SYNC);
+
+    if (*fd < 0) {
+        free(fd);
+        return NULL;
+    }
+    return fd;
+}
+
+static void xpdma_kernel_close(void *dev)
+{
+    close(*(int *)dev);
+    free(dev);
+}
+
+static int xpdma_kernel_fd(void *dev)
+{
+    return *(int *)dev;
+}
+
+static int xpdma_kernel_send(void *dev, void *data, unsigned int count, unsigned int addr)
+{
+    cdmaBuffer_t buffer = {data, count, addr};
+    return ioctl(*(int *)dev, IOCTL_SEND, &buffer);
+}
+
+static int xpdma_kernel_recv(void *dev, void *data, unsigned int count, unsigned int addr)
+{
+    cdmaBuffer_t buffer = {data, count, addr};
+    return ioctl(*(int *)dev, IOCTL_RECV, &buffer);
+}
+
+static uint32_t xpdma_kernel_readReg(void *dev, uint32_t addr)
+{
+    uint32_t ret = addr;
+    if (ioctl(*(int *)dev, IOCTL_RDCDMAREG, &ret) < 0)
+        return 0xFFFFFFFF;
+    return ret;
+}
+
+static void xpdma_kernel_writeReg(void *dev, uint32_t addr, uint32_t value)
+{
+    cdmaReg_t data;
+    data.reg = addr;
+    data.value = value;
+    ioctl(*(int *)dev, IOCTL_WRCDMAREG, &data);
+}
+
+const xpdma_backend_t xpdma_backend_kernel = {
+    "kernel",
+    xpdma_kernel_open,
+    xpdma_kernel_close,
+    xpdma_kernel_fd,
+    xpdma_kernel_send,
+    xpdma_kernel_recv,
+    xpdma_kernel_readReg,
+    xpdma_kernel_writeReg,
 };
 
-xpdma_t *xpdma_open() 
+const xpdma_backend_t *xpdma_find_backend(const char *name)
+{
+    static const xpdma_backend_t *backends[] = {&xpdma_backend_kernel, &xpdma_backend_vfio, &xpdma_backend_mock,
+                                                     &xpdma_backend_sim};
+    unsigned int c;
+
+    for (c = 0; c < sizeof(backends) / sizeof(backends[0]); ++c) {
+        if (strcmp(backends[c]->name, name) == 0)
+            return backends[c];
+    }
+    return NULL;
+}
+
+xpdma_t *xpdma_open_backend(const xpdma_backend_t *backend, int index)
 {
     xpdma_t * device;
-    device = (xpdma_t *)malloc(sizeof(xpdma_t));
+
+    device = (xpdma_t *)calloc(1, sizeof(xpdma_t));
     if (device == NULL)
         return NULL;
 
-    device->fd = open("/dev/" DEVICE_NAME, O_RDWR | O_SYNC);
-
-    if (device->fd < 0) {
+    device->backend = backend;
+    device->dev = backend->open(index);
+    if (device->dev == NULL) {
         free(device);
         return NULL;
     }
+    device->fd = backend->fd ? backend->fd(device->dev) : -1;
     return device;
 }
 
+xpdma_t *xpdma_open(int index)
+{
+    const char *name = getenv("XPDMA_BACKEND");
+    const xpdma_backend_t *backend = &xpdma_backend_kernel;
+
+    if (name != NULL && *name) {
+        backend = xpdma_find_backend(name);
+        if (backend == NULL) {
+            errno = ENODEV;
+            return NULL;
+        }
+    }
+    return xpdma_open_backend(backend, index);
+}
+
+static int xpdma_cache_lookup(xpdma_cache_t *cache, uint32_t addr)
+{
+    int b = cache->hash[(addr / cache->blockSize) & cache->hashMask];
+
+    while (b >= 0 && cache->blocks[b].addr != addr)
+        b = cache->blocks[b].next;
+    return b;
+}
+
+static void xpdma_cache_unhash(xpdma_cache_t *cache, int b)
+{
+    int *link = &cache->hash[(cache->blocks[b].addr / cache->blockSize) & cache->hashMask];
+
+    while (*link != b)
+        link = &cache->blocks[*link].next;
+    *link = cache->blocks[b].next;
+    cache->blocks[b].state = CACHE_FREE;
+}
+
+// CLOCK: a free block, or the first valid one not referenced since the hand passed
+// it; loading blocks are skipped, -1 when all of them are loading
+static int xpdma_cache_evict(xpdma_cache_t *cache, uint32_t addr)
+{
+    xpdma_block_t *block;
+    unsigned int c;
+    int b = -1;
+
+    for (c = 0; c < 2 * cache->count && b < 0; ++c) {
+        block = &cache->blocks[cache->hand];
+        if (block->state == CACHE_FREE) {
+            b = cache->hand;
+        } else if (block->state == CACHE_VALID && block->referenced) {
+            block->referenced = 0;
+        } else if (block->state == CACHE_VALID) {
+            xpdma_cache_unhash(cache, cache->hand);
+            cache->stats.evictions++;
+            b = cache->hand;
+        }
+        cache->hand = (cache->hand + 1) % cache->count;
+    }
+    if (b < 0)
+        return -1;
+
+    block = &cache->blocks[b];
+    block->addr = addr;
+    block->state = CACHE_LOADING;
+    block->referenced = 0;
+    block->stale = 0;
+    block->prefetched = 0;
+    block->next = cache->hash[(addr / cache->blockSize) & cache->hashMask];
+    cache->hash[(addr / cache->blockSize) & cache->hashMask] = b;
+    return b;
+}
+
+static int xpdma_cache_dirty(xpdma_cache_t *cache, uint32_t addr)
+{
+    int c;
+
+    if (cache->dirtyCount > XPDMA_CACHE_DIRTY)
+        return 1;
+    for (c = 0; c < cache->dirtyCount; ++c) {
+        if (addr < cache->dirty[c][1] && addr + (uint64_t)cache->blockSize > cache->dirty[c][0])
+            return 1;
+    }
+    return 0;
+}
+
+// Read count loading blocks from DDR, one vectored request per VEC_MAX blocks on the
+// kernel backend; failed blocks are marked stale
+static void xpdma_cache_fill(xpdma_t *fpga, xpdma_cache_t *cache, const int *blocks, unsigned int count)
+{
+    cdmaVec_t vec[64];
+    unsigned int n;
+    unsigned int c;
+
+    if (fpga->fd < 0 || count == 1) {
+        for (c = 0; c < count; ++c) {
+            if (fpga->backend->recv(fpga->dev, cache->blocks[blocks[c]].data, cache->blockSize,
+                                    cache->blocks[blocks[c]].addr))
+                cache->blocks[blocks[c]].stale = 1;
+        }
+        return;
+    }
+
+    for (; count; count -= n, blocks += n) {
+        n = (count < sizeof(vec) / sizeof(vec[0])) ? count : sizeof(vec) / sizeof(vec[0]);
+        for (c = 0; c < n; ++c) {
+            vec[c].data = cache->blocks[blocks[c]].data;
+            vec[c].count = cache->blockSize;
+            vec[c].addr = cache->blocks[blocks[c]].addr;
+            vec[c].status = CRIT_ERR;
+        }
+        xpdma_recvv(fpga, vec, n);
+        for (c = 0; c < n; ++c) {
+            if (vec[c].status != SUCCESS)
+                cache->blocks[blocks[c]].stale = 1;
+        }
+    }
+}
+
+// Loaded blocks become valid unless written meanwhile (lock held)
+static void xpdma_cache_loaded(xpdma_cache_t *cache, const int *blocks, unsigned int count)
+{
+    xpdma_block_t *block;
+    unsigned int c;
+
+    for (c = 0; c < count; ++c) {
+        block = &cache->blocks[blocks[c]];
+        if (block->stale || xpdma_cache_dirty(cache, block->addr))
+            xpdma_cache_unhash(cache, blocks[c]);
+        else
+            block->state = CACHE_VALID;
+    }
+    pthread_cond_broadcast(&cache->loaded);
+}
+
+static void *xpdma_cache_run(void *arg)
+{
+    xpdma_t *fpga = (xpdma_t *)arg;
+    xpdma_cache_t *cache = fpga->cache;
+    int blocks[XPDMA_CACHE_QUEUE];
+    unsigned int count;
+    uint32_t addr;
+    int b;
+
+    xpdma_bind_node(fpga);
+
+    pthread_mutex_lock(&cache->lock);
+    while (1) {
+        while (!cache->stop && cache->queueHead == cache->queueTail)
+            pthread_cond_wait(&cache->work, &cache->lock);
+        if (cache->stop)
+            break;
+
+        // everything queued goes in one request
+        for (count = 0; cache->queueHead != cache->queueTail; ) {
+            addr = cache->queue[cache->queueHead++ % XPDMA_CACHE_QUEUE];
+            if (xpdma_cache_lookup(cache, addr) >= 0)
+                continue;
+            b = xpdma_cache_evict(cache, addr);
+            if (b < 0)
+                continue;
+            cache->blocks[b].prefetched = 1;
+            blocks[count++] = b;
+        }
+        cache->stats.readahead += count;
+        pthread_mutex_unlock(&cache->lock);
+
+        xpdma_cache_fill(fpga, cache, blocks, count);
+
+        pthread_mutex_lock(&cache->lock);
+        xpdma_cache_loaded(cache, blocks, count);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+// Block b overlaps a written range: update it with data (NULL - drop it); a block
+// being loaded is dropped when its load ends
+static void xpdma_cache_written(xpdma_cache_t *cache, int b, const char *data, uint64_t addr, uint64_t end)
+{
+    xpdma_block_t *block = &cache->blocks[b];
+    uint64_t from = (block->addr > addr) ? block->addr : addr;
+    uint64_t to = block->addr + (uint64_t)cache->blockSize;
+
+    cache->stats.invalidations++;
+    if (block->state == CACHE_LOADING) {
+        block->stale = 1;
+    } else if (data == NULL) {
+        xpdma_cache_unhash(cache, b);
+    } else {
+        to = (to < end) ? to : end;
+        memcpy(block->data + (from - block->addr), data + (from - addr), to - from);
+    }
+}
+
+static void xpdma_cache_write(xpdma_t *fpga, const void *data, unsigned int count, unsigned int addr)
+{
+    xpdma_cache_t *cache = fpga->cache;
+    uint64_t end = (uint64_t)addr + count;
+    uint64_t a;
+    unsigned int c;
+    int b;
+
+    if (cache == NULL || count == 0)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    if (count / cache->blockSize >= cache->count) {
+        // a range larger than the cache walks the blocks instead of the addresses
+        for (c = 0; c < cache->count; ++c) {
+            if (cache->blocks[c].state != CACHE_FREE && cache->blocks[c].addr < end &&
+                    cache->blocks[c].addr + (uint64_t)cache->blockSize > addr)
+                xpdma_cache_written(cache, c, (const char *)data, addr, end);
+        }
+    } else {
+        for (a = addr & ~(uint64_t)(cache->blockSize - 1); a < end; a += cache->blockSize) {
+            b = xpdma_cache_lookup(cache, (uint32_t)a);
+            if (b >= 0)
+                xpdma_cache_written(cache, b, (const char *)data, addr, end);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Asynchronous request queued: a send drops the blocks of its range, which are not
+// cached again until every request of the handle is reaped
+static void xpdma_cache_submitted(xpdma_t *fpga, int direction, unsigned int count, unsigned int addr)
+{
+    xpdma_cache_t *cache = fpga->cache;
+
+    if (cache == NULL)
+        return;
+
+    if (direction == REQUEST_SEND)
+        xpdma_cache_write(fpga, NULL, count, addr);
+
+    pthread_mutex_lock(&cache->lock);
+    cache->asyncInflight++;
+    if (direction == REQUEST_SEND && cache->dirtyCount < XPDMA_CACHE_DIRTY) {
+        cache->dirty[cache->dirtyCount][0] = addr;
+        cache->dirty[cache->dirtyCount][1] = (uint64_t)addr + count;
+        cache->dirtyCount++;
+    } else if (direction == REQUEST_SEND) {
+        cache->dirtyCount = XPDMA_CACHE_DIRTY + 1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void xpdma_cache_reaped(xpdma_t *fpga, int count)
+{
+    xpdma_cache_t *cache = fpga->cache;
+
+    if (cache == NULL || count <= 0)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->asyncInflight -= ((unsigned int)count < cache->asyncInflight) ? (unsigned int)count : cache->asyncInflight;
+    if (cache->asyncInflight == 0)
+        cache->dirtyCount = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Receive through the cache: hits are copied out, missing blocks are read in one
+// request, a sequential stream queues read-ahead of the blocks after it
+static int xpdma_cache_recv(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr)
+{
+    xpdma_cache_t *cache = fpga->cache;
+    uint64_t end = (uint64_t)addr + count;
+    uint64_t first = addr & ~(uint64_t)(cache->blockSize - 1);
+    unsigned int nblocks = (unsigned int)((end - first + cache->blockSize - 1) / cache->blockSize);
+    uint64_t last = first + (uint64_t)nblocks * cache->blockSize;
+    int local[64];
+    int *blocks = local;
+    unsigned int misses = 0;
+    unsigned int hits = 0;
+    uint64_t saved = 0;
+    uint64_t from;
+    uint64_t to;
+    uint64_t a;
+    xpdma_block_t *block;
+    int direct = 0;
+    int b;
+
+    // large receives would flush the cache, they go to DDR
+    if (count == 0 || nblocks > cache->count / 2) {
+        pthread_mutex_lock(&cache->lock);
+        cache->stats.bypassed++;
+        cache->lastEnd = end;
+        pthread_mutex_unlock(&cache->lock);
+        return fpga->backend->recv(fpga->dev, data, count, addr);
+    }
+    if (nblocks > sizeof(local) / sizeof(local[0])) {
+        blocks = (int *)malloc(nblocks * sizeof(int));
+        if (blocks == NULL)
+            return fpga->backend->recv(fpga->dev, data, count, addr);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    for (a = first; a < end; a += cache->blockSize) {
+        b = xpdma_cache_lookup(cache, (uint32_t)a);
+        if (b >= 0) {
+            // the misses of this request must not evict its hits
+            cache->blocks[b].referenced = 1;
+            from = (a > addr) ? a : addr;
+            to = (a + cache->blockSize < end) ? a + cache->blockSize : end;
+            saved += to - from;
+            hits++;
+        } else if (!xpdma_cache_dirty(cache, (uint32_t)a)) {
+            b = xpdma_cache_evict(cache, (uint32_t)a);
+            if (b >= 0)
+                blocks[misses++] = b;
+        }
+    }
+
+    if (cache->readahead && addr == cache->lastEnd) {
+        a = (cache->readaheadEnd > last) ? cache->readaheadEnd : last;
+        while (a < last + (uint64_t)cache->readahead * cache->blockSize && a <= 0xFFFFFFFFULL &&
+                cache->queueTail - cache->queueHead < XPDMA_CACHE_QUEUE) {
+            cache->queue[cache->queueTail++ % XPDMA_CACHE_QUEUE] = (uint32_t)a;
+            a += cache->blockSize;
+        }
+        if (a > cache->readaheadEnd)
+            pthread_cond_signal(&cache->work);
+        cache->readaheadEnd = a;
+    } else {
+        cache->readaheadEnd = 0;
+    }
+    cache->lastEnd = end;
+    cache->stats.misses += misses;
+    pthread_mutex_unlock(&cache->lock);
+
+    xpdma_cache_fill(fpga, cache, blocks, misses);
+
+    pthread_mutex_lock(&cache->lock);
+    xpdma_cache_loaded(cache, blocks, misses);
+    for (a = first; a < end; a += cache->blockSize) {
+        b = xpdma_cache_lookup(cache, (uint32_t)a);
+        while (b >= 0 && cache->blocks[b].state == CACHE_LOADING) {
+            pthread_cond_wait(&cache->loaded, &cache->lock);
+            b = xpdma_cache_lookup(cache, (uint32_t)a);
+        }
+        if (b < 0) {
+            // evicted, written or failed meanwhile: the whole range from DDR
+            direct = 1;
+            break;
+        }
+
+        block = &cache->blocks[b];
+        from = (a > addr) ? a : addr;
+        to = (a + cache->blockSize < end) ? a + cache->blockSize : end;
+        memcpy((char *)data + (from - addr), block->data + (from - a), to - from);
+        block->referenced = 1;
+        if (block->prefetched) {
+            block->prefetched = 0;
+            cache->stats.readaheadHits++;
+        }
+    }
+    if (!direct) {
+        cache->stats.hits += hits;
+        cache->stats.bytesSaved += saved;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (blocks != local)
+        free(blocks);
+    return direct ? fpga->backend->recv(fpga->dev, data, count, addr) : 0;
+}
+
+static void xpdma_cache_destroy(xpdma_t *fpga)
+{
+    xpdma_cache_t *cache = fpga->cache;
+
+    if (cache == NULL)
+        return;
+
+    if (cache->threadStarted) {
+        pthread_mutex_lock(&cache->lock);
+        cache->stop = 1;
+        pthread_cond_signal(&cache->work);
+        pthread_mutex_unlock(&cache->lock);
+        pthread_join(cache->thread, NULL);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->loaded);
+    pthread_cond_destroy(&cache->work);
+    xpdma_free_local(cache->mem, cache->memSize);
+    free(cache->hash);
+    free(cache->blocks);
+    free(cache);
+    fpga->cache = NULL;
+}
+
+int xpdma_cache_setup(xpdma_t *fpga, unsigned int block_size, size_t capacity, unsigned int readahead)
+{
+    xpdma_cache_t *cache;
+    unsigned int size;
+    unsigned int c;
+
+    xpdma_cache_destroy(fpga);
+    if (capacity == 0)
+        return 0;
+    if (block_size < 4096 || (block_size & (block_size - 1)) || capacity / block_size < 2 ||
+            capacity / block_size > 0x7FFFFFFF) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    cache = (xpdma_cache_t *)calloc(1, sizeof(xpdma_cache_t));
+    if (cache == NULL)
+        return -1;
+    cache->blockSize = block_size;
+    cache->count = capacity / block_size;
+    cache->readahead = (readahead < XPDMA_CACHE_QUEUE) ? readahead : XPDMA_CACHE_QUEUE;
+    for (size = 1; size < cache->count; size <<= 1);
+    cache->hashMask = size - 1;
+    cache->memSize = (size_t)cache->count * block_size;
+    cache->mem = (char *)xpdma_alloc_local(fpga, cache->memSize);
+    cache->blocks = (xpdma_block_t *)calloc(cache->count, sizeof(xpdma_block_t));
+    cache->hash = (int *)malloc(size * sizeof(int));
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+    pthread_cond_init(&cache->work, NULL);
+    fpga->cache = cache;
+    if (cache->mem == NULL || cache->blocks == NULL || cache->hash == NULL) {
+        xpdma_cache_destroy(fpga);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (c = 0; c < size; ++c)
+        cache->hash[c] = -1;
+    for (c = 0; c < cache->count; ++c)
+        cache->blocks[c].data = cache->mem + (size_t)c * block_size;
+
+    // without the read-ahead thread sequential receives are only cached
+    if (cache->readahead && pthread_create(&cache->thread, NULL, xpdma_cache_run, fpga) == 0)
+        cache->threadStarted = 1;
+    else
+        cache->readahead = 0;
+    return 0;
+}
+
+int xpdma_cache_stats(xpdma_t *fpga, xpdma_cache_stats_t *stats)
+{
+    xpdma_cache_t *cache = fpga->cache;
+
+    if (cache == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    memset(&cache->stats, 0, sizeof(cache->stats));
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+void xpdma_cache_invalidate(xpdma_t *fpga, unsigned int addr, unsigned int count)
+{
+    xpdma_cache_write(fpga, NULL, count, addr);
+}
+
 void xpdma_close(xpdma_t * device) {
-    close(device->fd);
+    int c;
+
+    xpdma_cache_destroy(device);
+    xpdma_stream_stop(device);
+    xpdma_set_copy_threads(device, 0);
+    for (c = 0; c < 2; ++c) {
+        if (device->staging[c])
+            xpdma_buffer_free(device, device->staging[c]);
+    }
+    if (device->ring)
+        munmap(device->ring, device->ringSize);
+    if (device->regs)
+        munmap((void *)device->regs, device->regsSize);
+    device->backend->close(device->dev);
     free(device);
 }
 
 int xpdma_send(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr)
 {
-    cdmaBuffer_t buffer = {data, count, addr};
-    ioctl(fpga->fd, IOCTL_SEND, &buffer);
-    return 0;
+    int ret = fpga->backend->send(fpga->dev, data, count, addr);
+
+    // a failed send may have written part of the range
+    xpdma_cache_write(fpga, ret ? NULL : data, count, addr);
+    return ret;
 }
 
 int xpdma_recv(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr)
 {
-    cdmaBuffer_t buffer = {data, count, addr};
-    ioctl(fpga->fd, IOCTL_RECV, &buffer);
+    if (fpga->cache)
+        return xpdma_cache_recv(fpga, data, count, addr);
+    return fpga->backend->recv(fpga->dev, data, count, addr);
+}
+
+// Part of a striped transfer handled by one card
+typedef struct {
+    xpdma_t *fpga;
+    char *data;
+    unsigned int count;
+    unsigned int addr;
+    int send;
+    int bind;       // Own thread: run on the CPUs of the card node
+    int ret;
+} xpdma_stripe_t;
+
+static void *xpdma_stripe_run(void *arg)
+{
+    xpdma_stripe_t *stripe = (xpdma_stripe_t *)arg;
+
+    if (stripe->bind)
+        xpdma_bind_node(stripe->fpga);
+    if (stripe->send)
+        stripe->ret = xpdma_send(stripe->fpga, stripe->data, stripe->count, stripe->addr);
+    else
+        stripe->ret = xpdma_recv(stripe->fpga, stripe->data, stripe->count, stripe->addr);
+    return NULL;
+}
+
+// Split data into contiguous 16-byte aligned stripes, stripe i goes to/from card i at addr
+static int xpdma_stripe(xpdma_t **fpgas, int count, int send, void *data, unsigned int size, unsigned int addr)
+{
+    xpdma_stripe_t stripes[XPDMA_MAX_STRIPES];
+    pthread_t threads[XPDMA_MAX_STRIPES];
+    unsigned int part;
+    unsigned int offset = 0;
+    int ret = 0;
+    int c;
+    int s;
+
+    if (count < 1 || count > XPDMA_MAX_STRIPES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    part = ((size + count - 1) / count + 15) & ~15u;
+    for (c = 0; c < count && offset < size; ++c) {
+        stripes[c].fpga = fpgas[c];
+        stripes[c].data = (char *)data + offset;
+        stripes[c].count = (size - offset < part) ? size - offset : part;
+        stripes[c].addr = addr;
+        stripes[c].send = send;
+        stripes[c].ret = -1;
+        offset += stripes[c].count;
+
+        // the last stripe runs in the calling thread, so does one whose thread failed to start
+        stripes[c].bind = 1;
+        if (offset >= size || 0 != pthread_create(&threads[c], NULL, xpdma_stripe_run, &stripes[c])) {
+            stripes[c].bind = 0;
+            xpdma_stripe_run(&stripes[c]);
+        }
+    }
+
+    // stripes with their own thread are the bound ones
+    for (s = 0; s < c; ++s) {
+        if (stripes[s].bind)
+            pthread_join(threads[s], NULL);
+        if (stripes[s].ret < 0)
+            ret = -1;
+    }
+    return ret;
+}
+
+int xpdma_send_striped(xpdma_t **fpgas, int count, void *data, unsigned int size, unsigned int addr)
+{
+    return xpdma_stripe(fpgas, count, 1, data, size, addr);
+}
+
+int xpdma_recv_striped(xpdma_t **fpgas, int count, void *data, unsigned int size, unsigned int addr)
+{
+    return xpdma_stripe(fpgas, count, 0, data, size, addr);
+}
+
+// Part of the current copy: worker index, the calling thread takes the last one
+static void xpdma_copy_part(xpdma_copier_t *copier, int index)
+{
+    size_t offset = (size_t)index * copier->part;
+    size_t size;
+
+    if (offset >= copier->size)
+        return;
+    size = copier->size - offset;
+    if (size > copier->part)
+        size = copier->part;
+    memcpy(copier->dst + offset, copier->src + offset, size);
+}
+
+typedef struct {
+    xpdma_t *fpga;
+    int index;
+} xpdma_copy_worker_t;
+
+static void *xpdma_copy_run(void *arg)
+{
+    xpdma_copy_worker_t worker = *(xpdma_copy_worker_t *)arg;
+    xpdma_copier_t *copier = worker.fpga->copier;
+    unsigned int generation = 0;    // copies started before this thread ran are not missed
+
+    free(arg);
+    xpdma_bind_node(worker.fpga);
+
+    pthread_mutex_lock(&copier->lock);
+    while (1) {
+        while (!copier->stop && generation == copier->generation)
+            pthread_cond_wait(&copier->start, &copier->lock);
+        if (copier->stop)
+            break;
+        generation = copier->generation;
+        pthread_mutex_unlock(&copier->lock);
+
+        xpdma_copy_part(copier, worker.index);
+
+        pthread_mutex_lock(&copier->lock);
+        if (--copier->pending == 0)
+            pthread_cond_signal(&copier->done);
+    }
+    pthread_mutex_unlock(&copier->lock);
+    return NULL;
+}
+
+// Copy size bytes with all workers, returns when every part is done
+static void xpdma_copy_parallel(xpdma_t *fpga, void *dst, const void *src, size_t size)
+{
+    xpdma_copier_t *copier = fpga->copier;
+    int parts;
+
+    if (copier == NULL || copier->count == 0) {
+        memcpy(dst, src, size);
+        return;
+    }
+
+    // cache line multiple parts, fewer of them for small copies
+    parts = copier->count + 1;
+    pthread_mutex_lock(&copier->lock);
+    copier->dst = (char *)dst;
+    copier->src = (const char *)src;
+    copier->size = size;
+    copier->part = ((size + parts - 1) / parts + 63) & ~(size_t)63;
+    copier->pending = copier->count;
+    copier->generation++;
+    pthread_cond_broadcast(&copier->start);
+    pthread_mutex_unlock(&copier->lock);
+
+    xpdma_copy_part(copier, copier->count);
+
+    pthread_mutex_lock(&copier->lock);
+    while (copier->pending)
+        pthread_cond_wait(&copier->done, &copier->lock);
+    pthread_mutex_unlock(&copier->lock);
+}
+
+int xpdma_set_copy_threads(xpdma_t *fpga, int threads)
+{
+    xpdma_copier_t *copier = fpga->copier;
+    xpdma_copy_worker_t *worker;
+    int c;
+
+    if (threads < 0 || threads > XPDMA_MAX_COPY_THREADS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (copier) {
+        pthread_mutex_lock(&copier->lock);
+        copier->stop = 1;
+        pthread_cond_broadcast(&copier->start);
+        pthread_mutex_unlock(&copier->lock);
+        for (c = 0; c < copier->count; ++c)
+            pthread_join(copier->threads[c], NULL);
+        pthread_mutex_destroy(&copier->lock);
+        pthread_cond_destroy(&copier->start);
+        pthread_cond_destroy(&copier->done);
+        free(copier);
+        fpga->copier = NULL;
+    }
+
+    if (threads == 0)
+        return 0;
+
+    copier = (xpdma_copier_t *)calloc(1, sizeof(xpdma_copier_t));
+    if (copier == NULL)
+        return -1;
+    pthread_mutex_init(&copier->lock, NULL);
+    pthread_cond_init(&copier->start, NULL);
+    pthread_cond_init(&copier->done, NULL);
+    fpga->copier = copier;
+
+    // the calling thread is one of them
+    for (c = 0; c < threads - 1; ++c) {
+        worker = (xpdma_copy_worker_t *)malloc(sizeof(xpdma_copy_worker_t));
+        if (worker == NULL)
+            break;
+        worker->fpga = fpga;
+        worker->index = c;
+        if (pthread_create(&copier->threads[c], NULL, xpdma_copy_run, worker)) {
+            free(worker);
+            break;
+        }
+        copier->count++;
+    }
     return 0;
 }
 
-void xpdma_writeReg(xpdma_t *fpga, uint32_t addr, uint32_t value)
+// Two pool buffers, one filled/drained while CDMA moves the other
+static int xpdma_staging(xpdma_t *fpga)
 {
-    cdmaReg_t data;
-    data.reg = addr;
-    data.value = value;
-    ioctl(fpga->fd, IOCTL_WRCDMAREG, &data);
+    int c;
+
+    for (c = 0; c < 2; ++c) {
+        if (fpga->staging[c] == NULL)
+            fpga->staging[c] = xpdma_buffer_alloc(fpga);
+        if (fpga->staging[c] == NULL)
+            return -1;
+    }
+    return 0;
 }
 
-uint32_t xpdma_readReg(xpdma_t *fpga, uint32_t addr)
+// Wait for the completion of the parallel transfer request
+static int xpdma_wait_chunk(xpdma_t *fpga, uint64_t cookie)
 {
-    uint32_t ret = addr;
-    ioctl(fpga->fd, IOCTL_RDCDMAREG, &ret);
+    cdmaCompletion_t done;
+
+    while (1) {
+        if (xpdma_wait(fpga, &done, 1) != 1)
+            return -1;
+        if (done.cookie == cookie)
+            return (done.status == SUCCESS) ? 0 : -1;
+    }
+}
+
+int xpdma_send_parallel(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr)
+{
+    const char *src = (const char *)data;
+    unsigned int size = 0;
+    unsigned int chunk = 0;
+    unsigned int next = 0;
+    unsigned int c = 0;
+
+    // unaligned DDR3 address, shared rings or no pool buffers: staged in the driver
+    if (fpga->copier == NULL || fpga->ring || (addr & 15) || xpdma_staging(fpga))
+        return xpdma_send(fpga, data, count, addr);
+
+    size = fpga->staging[0]->size;
+    if (count == 0)
+        return 0;
+
+    chunk = (count < size) ? count : size;
+    xpdma_copy_parallel(fpga, fpga->staging[0]->data, src, chunk);
+    if (xpdma_submit(fpga, REQUEST_SEND, fpga->staging[0], 0, chunk, addr, XPDMA_PARALLEL_COOKIE))
+        return -1;
+
+    // chunk c + 1 is copied by all workers while CDMA moves chunk c
+    for (c = 0; ; ++c) {
+        src += chunk;
+        addr += chunk;
+        count -= chunk;
+        next = (count < size) ? count : size;
+        if (next)
+            xpdma_copy_parallel(fpga, fpga->staging[(c + 1) & 1]->data, src, next);
+
+        if (xpdma_wait_chunk(fpga, XPDMA_PARALLEL_COOKIE + c))
+            return -1;
+        if (next == 0)
+            return 0;
+
+        chunk = next;
+        if (xpdma_submit(fpga, REQUEST_SEND, fpga->staging[(c + 1) & 1], 0, chunk, addr, XPDMA_PARALLEL_COOKIE + c + 1))
+            return -1;
+    }
+}
+
+int xpdma_recv_parallel(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr)
+{
+    char *dst = (char *)data;
+    unsigned int size = 0;
+    unsigned int chunks = 0;
+    unsigned int chunk = 0;
+    unsigned int c = 0;
+    int ret = 0;
+
+    if (fpga->copier == NULL || fpga->ring || (addr & 15) || xpdma_staging(fpga))
+        return xpdma_recv(fpga, data, count, addr);
+
+    size = fpga->staging[0]->size;
+    chunks = (count + size - 1) / size;
+
+    // two chunks in flight, chunk c is copied out by all workers while CDMA moves chunk c + 1
+    for (c = 0; c < chunks && c < 2; ++c) {
+        chunk = (count - c * size < size) ? count - c * size : size;
+        if (xpdma_submit(fpga, REQUEST_RECV, fpga->staging[c], 0, chunk, addr + c * size, XPDMA_PARALLEL_COOKIE + c))
+            return -1;
+    }
+
+    for (c = 0; c < chunks; ++c) {
+        if (xpdma_wait_chunk(fpga, XPDMA_PARALLEL_COOKIE + c))
+            ret = -1;
+        if (ret) {
+            // drain the one still in flight
+            if (c + 1 < chunks)
+                xpdma_wait_chunk(fpga, XPDMA_PARALLEL_COOKIE + c + 1);
+            return -1;
+        }
+
+        chunk = (count - c * size < size) ? count - c * size : size;
+        xpdma_copy_parallel(fpga, dst + (size_t)c * size, fpga->staging[c & 1]->data, chunk);
+
+        if (c + 2 < chunks) {
+            chunk = (count - (c + 2) * size < size) ? count - (c + 2) * size : size;
+            if (xpdma_submit(fpga, REQUEST_RECV, fpga->staging[c & 1], 0, chunk, addr + (c + 2) * size,
+                             XPDMA_PARALLEL_COOKIE + c + 2)) {
+                xpdma_wait_chunk(fpga, XPDMA_PARALLEL_COOKIE + c + 1);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int xpdma_sendv(xpdma_t *fpga, cdmaVec_t *vec, unsigned int count)
+{
+    cdmaVecBuffer_t buffer = {vec, count, 0};
+    int ret = ioctl(fpga->fd, IOCTL_SENDV, &buffer);
+    unsigned int c;
+
+    for (c = 0; fpga->cache && c < count; ++c)
+        xpdma_cache_write(fpga, NULL, vec[c].count, vec[c].addr);
+    return ret;
+}
+
+int xpdma_recvv(xpdma_t *fpga, cdmaVec_t *vec, unsigned int count)
+{
+    cdmaVecBuffer_t buffer = {vec, count, 0};
+    return ioctl(fpga->fd, IOCTL_RECVV, &buffer);
+}
+
+int xpdma_copy(xpdma_t *fpga, unsigned int src_addr, unsigned int dst_addr, unsigned int count)
+{
+    cdmaCopy_t copy = {src_addr, dst_addr, count};
+    int ret = ioctl(fpga->fd, IOCTL_COPY, &copy);
+
+    xpdma_cache_write(fpga, NULL, count, dst_addr);
+    return ret;
+}
+
+int xpdma_stats(xpdma_t *fpga, cdmaStats_t *stats)
+{
+    return ioctl(fpga->fd, IOCTL_STATS, stats);
+}
+
+int xpdma_set_wait_mode(xpdma_t *fpga, int mode)
+{
+    return ioctl(fpga->fd, IOCTL_WAITMODE, mode);
+}
+
+int xpdma_set_sched(xpdma_t *fpga, int priority, unsigned int weight)
+{
+    cdmaSched_t sched = {priority, weight};
+    return ioctl(fpga->fd, IOCTL_SCHED, &sched);
+}
+
+int xpdma_sched_stats(xpdma_t *fpga, cdmaSchedStats_t *stats)
+{
+    return ioctl(fpga->fd, IOCTL_SCHED_STATS, stats);
+}
+
+xpdma_buffer_t *xpdma_buffer_alloc(xpdma_t *fpga)
+{
+    cdmaPoolBuffer_t pool;
+    xpdma_buffer_t *buffer;
+
+    buffer = (xpdma_buffer_t *)malloc(sizeof(xpdma_buffer_t));
+    if (buffer == NULL)
+        return NULL;
+
+    if (ioctl(fpga->fd, IOCTL_BUF_ALLOC, &pool) < 0) {
+        free(buffer);
+        return NULL;
+    }
+
+    buffer->data = mmap(NULL, pool.size, PROT_READ | PROT_WRITE, MAP_SHARED, fpga->fd, pool.offset);
+    if (buffer->data == MAP_FAILED) {
+        ioctl(fpga->fd, IOCTL_BUF_FREE, pool.index);
+        free(buffer);
+        return NULL;
+    }
+    buffer->size = pool.size;
+    buffer->index = pool.index;
+    return buffer;
+}
+
+void xpdma_buffer_free(xpdma_t *fpga, xpdma_buffer_t *buffer)
+{
+    munmap(buffer->data, buffer->size);
+    ioctl(fpga->fd, IOCTL_BUF_FREE, buffer->index);
+    free(buffer);
+}
+
+int xpdma_send_buffer(xpdma_t *fpga, xpdma_buffer_t *buffer, unsigned int offset, unsigned int count, unsigned int addr)
+{
+    cdmaBufferRef_t ref = {buffer->index, offset, count, addr};
+    int ret = ioctl(fpga->fd, IOCTL_SEND_BUF, &ref);
+
+    xpdma_cache_write(fpga, NULL, count, addr);
+    return ret;
+}
+
+int xpdma_recv_buffer(xpdma_t *fpga, xpdma_buffer_t *buffer, unsigned int offset, unsigned int count, unsigned int addr)
+{
+    cdmaBufferRef_t ref = {buffer->index, offset, count, addr};
+    return ioctl(fpga->fd, IOCTL_RECV_BUF, &ref);
+}
+
+int xpdma_submit(xpdma_t *fpga, int direction, xpdma_buffer_t *buffer, unsigned int offset,
+                 unsigned int count, unsigned int addr, uint64_t cookie)
+{
+    cdmaRequest_t request = {cookie, direction, {buffer->index, offset, count, addr}};
+    int ret = ioctl(fpga->fd, IOCTL_SUBMIT, &request);
+
+    if (ret == 0)
+        xpdma_cache_submitted(fpga, direction, count, addr);
+    return ret;
+}
+
+int xpdma_wait(xpdma_t *fpga, cdmaCompletion_t *done, unsigned int max)
+{
+    ssize_t ret = read(fpga->fd, done, max * sizeof(cdmaCompletion_t));
+    if (ret < 0)
+        return -1;
+    xpdma_cache_reaped(fpga, ret / sizeof(cdmaCompletion_t));
+    return ret / sizeof(cdmaCompletion_t);
+}
+
+int xpdma_poll(xpdma_t *fpga, cdmaCompletion_t *done, unsigned int max)
+{
+    // test readiness instead of flipping O_NONBLOCK under other threads of the handle
+    struct pollfd pfd = {fpga->fd, POLLIN, 0};
+    ssize_t ret;
+
+    ret = poll(&pfd, 1, 0);
+    if (ret <= 0)
+        return (ret < 0) ? -1 : 0;
+
+    ret = read(fpga->fd, done, max * sizeof(cdmaCompletion_t));
+    if (ret < 0)
+        return -1;
+    xpdma_cache_reaped(fpga, ret / sizeof(cdmaCompletion_t));
+    return ret / sizeof(cdmaCompletion_t);
+}
+
+int xpdma_ring_setup(xpdma_t *fpga, unsigned int entries, int sqpoll)
+{
+    cdmaRingSetup_t setup;
+    char *mem;
+
+    memset(&setup, 0, sizeof(setup));
+    setup.entries = entries;
+    setup.flags = sqpoll ? RING_SQPOLL : 0;
+    if (ioctl(fpga->fd, IOCTL_RING_SETUP, &setup) < 0)
+        return -1;
+
+    mem = mmap(NULL, setup.size, PROT_READ | PROT_WRITE, MAP_SHARED, fpga->fd, setup.offset);
+    if (mem == MAP_FAILED)
+        return -1;
+
+    fpga->ring = (cdmaRing_t *)mem;
+    fpga->sq = (cdmaRequest_t *)(mem + setup.sqOffset);
+    fpga->cq = (cdmaCompletion_t *)(mem + setup.cqOffset);
+    fpga->ringEntries = setup.entries;
+    fpga->ringSize = setup.size;
+    fpga->sqpoll = sqpoll;
+    return 0;
+}
+
+int xpdma_ring_queue(xpdma_t *fpga, int direction, xpdma_buffer_t *buffer, unsigned int offset,
+                     unsigned int count, unsigned int addr, uint64_t cookie)
+{
+    uint32_t tail = fpga->ring->sqTail;
+    cdmaRequest_t *request;
+
+    if (tail - __atomic_load_n(&fpga->ring->sqHead, __ATOMIC_ACQUIRE) >= fpga->ringEntries)
+        return -1;
+
+    request = &fpga->sq[tail & (fpga->ringEntries - 1)];
+    request->cookie = cookie;
+    request->direction = direction;
+    request->buffer.index = buffer->index;
+    request->buffer.offset = offset;
+    request->buffer.count = count;
+    request->buffer.addr = addr;
+    xpdma_cache_submitted(fpga, direction, count, addr);
+
+    // entry is visible to the driver before the tail
+    __atomic_store_n(&fpga->ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int xpdma_ring_submit(xpdma_t *fpga, unsigned int wait)
+{
+    // poll thread takes the submissions itself until it falls asleep
+    if (fpga->sqpoll && !wait) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!(__atomic_load_n(&fpga->ring->flags, __ATOMIC_RELAXED) & RING_NEED_WAKEUP))
+            return 0;
+    }
+    return ioctl(fpga->fd, IOCTL_RING_ENTER, wait);
+}
+
+int xpdma_ring_reap(xpdma_t *fpga, cdmaCompletion_t *done, unsigned int max)
+{
+    uint32_t head = fpga->ring->cqHead;
+    uint32_t tail = __atomic_load_n(&fpga->ring->cqTail, __ATOMIC_ACQUIRE);
+    unsigned int n = 0;
+
+    while (head != tail && n < max)
+        done[n++] = fpga->cq[head++ & (fpga->ringEntries - 1)];
+
+    // entries are copied before the driver may reuse them
+    __atomic_store_n(&fpga->ring->cqHead, head, __ATOMIC_RELEASE);
+    xpdma_cache_reaped(fpga, n);
+    return n;
+}
+
+int xpdma_set_eventfd(xpdma_t *fpga, int eventfd)
+{
+    return ioctl(fpga->fd, IOCTL_EVENTFD, eventfd);
+}
+
+int xpdma_fd(xpdma_t *fpga)
+{
+    return fpga->fd;
+}
+
+int xpdma_stream_start(xpdma_t *fpga, unsigned int ddr_addr, unsigned int ddr_size,
+                       unsigned int slot_size, unsigned int slots)
+{
+    cdmaStreamSetup_t setup;
+    size_t offset, piece = 0;
+    void *mem;
+
+    if (fpga->stream) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    memset(&setup, 0, sizeof(setup));
+    setup.ddrAddr = ddr_addr;
+    setup.ddrSize = ddr_size;
+    setup.slotSize = slot_size;
+    setup.slots = slots;
+    if (ioctl(fpga->fd, IOCTL_STREAM_START, &setup) < 0)
+        return -1;
+
+    // slots are separate DMA buffers: reserve the range, then map the pieces into it
+    mem = mmap(NULL, setup.size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        ioctl(fpga->fd, IOCTL_STREAM_STOP, 0);
+        return -1;
+    }
+    for (offset = 0; offset < setup.size; offset += piece) {
+        piece = offset ? slot_size : STREAM_CTL_SIZE;
+        if (mmap((char *)mem + offset, piece, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 fpga->fd, setup.offset + offset) == MAP_FAILED) {
+            munmap(mem, setup.size);
+            ioctl(fpga->fd, IOCTL_STREAM_STOP, 0);
+            return -1;
+        }
+    }
+    fpga->stream = (cdmaStream_t *)mem;
+    fpga->streamSize = setup.size;
+    fpga->streamSlots = slots;
+    fpga->streamSlotSize = slot_size;
+    return 0;
+}
+
+void *xpdma_stream_next(xpdma_t *fpga, int timeout_ms)
+{
+    volatile cdmaStream_t *stream = fpga->stream;
+    struct pollfd pfd;
+
+    if (stream == NULL)
+        return NULL;
+
+    pfd.fd = fpga->fd;
+    pfd.events = POLLIN;
+    while (stream->head == stream->tail) {
+        if (stream->status == STREAM_ERROR)
+            return NULL;
+        if (poll(&pfd, 1, timeout_ms) <= 0 || (pfd.revents & POLLERR))
+            return NULL;
+    }
+    // slot data is read after the head that published it
+    __sync_synchronize();
+
+    return (char *)fpga->stream + STREAM_CTL_SIZE + (size_t)(stream->tail % fpga->streamSlots) * fpga->streamSlotSize;
+}
+
+void xpdma_stream_release(xpdma_t *fpga)
+{
+    // done with the slot data before the driver may refill it
+    __sync_synchronize();
+    ((volatile cdmaStream_t *)fpga->stream)->tail++;
+}
+
+int xpdma_stream_status(xpdma_t *fpga, cdmaStream_t *status)
+{
+    if (fpga->stream == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(status, (const void *)fpga->stream, sizeof(cdmaStream_t));
+    return 0;
+}
+
+int xpdma_stream_stop(xpdma_t *fpga)
+{
+    if (fpga->stream == NULL)
+        return 0;
+
+    munmap(fpga->stream, fpga->streamSize);
+    fpga->stream = NULL;
+    return ioctl(fpga->fd, IOCTL_STREAM_STOP, 0);
+}
+
+int xpdma_node(xpdma_t *fpga)
+{
+    int node = -1;
+
+    if (ioctl(fpga->fd, IOCTL_NODE, &node) < 0)
+        return -1;
+    return node;
+}
+
+int xpdma_bind_node(xpdma_t *fpga)
+{
+    char path[64];
+    char list[1024];
+    char *pntr = list;
+    cpu_set_t set;
+    FILE *file;
+    int node = xpdma_node(fpga);
+    int first;
+    int last;
+
+    if (node < 0)
+        return 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+    if (fgets(list, sizeof(list), file) == NULL) {
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    // "0-7,16-23"
+    CPU_ZERO(&set);
+    while (*pntr >= '0' && *pntr <= '9') {
+        first = last = (int)strtol(pntr, &pntr, 10);
+        if (*pntr == '-')
+            last = (int)strtol(pntr + 1, &pntr, 10);
+        for (; first <= last && first < CPU_SETSIZE; ++first)
+            CPU_SET(first, &set);
+        if (*pntr == ',')
+            ++pntr;
+    }
+    if (CPU_COUNT(&set) == 0)
+        return 0;
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) ? -1 : 0;
+}
+
+#define XPDMA_MPOL_PREFERRED    1   // MPOL_PREFERRED of <numaif.h>, no libnuma needed
+
+void *xpdma_alloc_local(xpdma_t *fpga, size_t size)
+{
+    unsigned long mask[4] = {0};
+    int node = xpdma_node(fpga);
+    void *data;
+
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    // a hint only: memory comes from the other nodes when the card node is full
+    if (node >= 0 && node < (int)(sizeof(mask) * 8)) {
+        mask[node / (sizeof(mask[0]) * 8)] = 1UL << (node % (sizeof(mask[0]) * 8));
+        syscall(SYS_mbind, data, size, XPDMA_MPOL_PREFERRED, mask, sizeof(mask) * 8, 0);
+    }
+    return data;
+}
+
+void xpdma_free_local(void *data, size_t size)
+{
+    if (data != NULL)
+        munmap(data, size);
+}
+
+int xpdma_send_file(xpdma_t *fpga, int fd, uint64_t offset, unsigned int count, unsigned int addr)
+{
+    cdmaFile_t file = {fd, count, offset, addr, 0};
+    int ret = ioctl(fpga->fd, IOCTL_FILE_SEND, &file);
+
+    xpdma_cache_write(fpga, NULL, count, addr);
     return ret;
 }
 
-void xpdma_read(xpdma_t *fpga, void *data, unsigned int count)
+int xpdma_recv_file(xpdma_t *fpga, int fd, uint64_t offset, unsigned int count, unsigned int addr)
+{
+    cdmaFile_t file = {fd, count, offset, addr, 0};
+    return ioctl(fpga->fd, IOCTL_FILE_RECV, &file);
+}
+
+// One file read/write of a chunk, runs next to the DMA of the previous chunk
+typedef struct {
+    int fd;
+    char *data;
+    size_t count;       // Bytes needed
+    size_t length;      // Bytes issued (O_DIRECT block multiple)
+    off_t offset;
+    int write;
+    int ret;
+} xpdma_fileio_t;
+
+static void *xpdma_fileio_run(void *arg)
+{
+    xpdma_fileio_t *io = (xpdma_fileio_t *)arg;
+    size_t done = 0;
+    ssize_t ret = 0;
+
+    io->ret = 0;
+    while (done < io->count) {
+        if (io->write)
+            ret = pwrite(io->fd, io->data + done, io->length - done, io->offset + done);
+        else
+            ret = pread(io->fd, io->data + done, io->length - done, io->offset + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        // a read past the end of file returns short
+        if (ret <= 0) {
+            io->ret = -1;
+            break;
+        }
+        done += ret;
+    }
+    return NULL;
+}
+
+static void xpdma_fileio_init(xpdma_fileio_t *io, int fd, char *data, uint64_t offset, size_t count, int write)
+{
+    io->fd = fd;
+    io->data = data;
+    io->count = count;
+    io->length = (count + 4095) & ~(size_t)4095;
+    io->offset = offset;
+    io->write = write;
+    // the unaligned tail of a dump can't go with O_DIRECT
+    if (write && io->length != count) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        io->length = count;
+    }
+}
+
+// Chunk c + 1 is read while chunk c is sent, chunk c is written while chunk c + 1 is received
+static int xpdma_file_pipeline(xpdma_t *fpga, int fd, uint64_t offset, unsigned int count, unsigned int addr, int send)
+{
+    char *buffer[2] = {NULL, NULL};
+    xpdma_fileio_t io;
+    pthread_t thread;
+    unsigned int chunk = 0;
+    unsigned int next = 0;
+    unsigned int c = 0;
+    int own = 0;
+    int ret = 0;
+
+    if (count == 0)
+        return 0;
+
+    buffer[0] = (char *)xpdma_alloc_local(fpga, XPDMA_FILE_CHUNK);
+    buffer[1] = (char *)xpdma_alloc_local(fpga, XPDMA_FILE_CHUNK);
+    if (buffer[0] == NULL || buffer[1] == NULL) {
+        ret = -1;
+        goto out;
+    }
+
+    chunk = (count < XPDMA_FILE_CHUNK) ? count : XPDMA_FILE_CHUNK;
+    if (send) {
+        xpdma_fileio_init(&io, fd, buffer[0], offset, chunk, 0);
+        xpdma_fileio_run(&io);
+        ret = io.ret;
+    } else {
+        ret = xpdma_recv(fpga, buffer[0], chunk, addr);
+    }
+
+    for (c = 0; ret == 0 && count; ++c) {
+        next = count - chunk;
+        next = (next < XPDMA_FILE_CHUNK) ? next : XPDMA_FILE_CHUNK;
+
+        // file I/O of one buffer in its own thread, DMA of the other one here
+        own = 0;
+        if (send && next)
+            xpdma_fileio_init(&io, fd, buffer[(c + 1) & 1], offset + chunk, next, 0);
+        else if (!send)
+            xpdma_fileio_init(&io, fd, buffer[c & 1], offset, chunk, 1);
+        if ((!send || next) && pthread_create(&thread, NULL, xpdma_fileio_run, &io) == 0)
+            own = 1;
+
+        if (send)
+            ret = xpdma_send(fpga, buffer[c & 1], chunk, addr);
+        else if (next)
+            ret = xpdma_recv(fpga, buffer[(c + 1) & 1], next, addr + chunk);
+
+        if (own)
+            pthread_join(thread, NULL);
+        else if (!send || next)
+            xpdma_fileio_run(&io);
+        if ((!send || next) && io.ret)
+            ret = -1;
+
+        offset += chunk;
+        addr += chunk;
+        count -= chunk;
+        chunk = next;
+    }
+
+out:
+    xpdma_free_local(buffer[0], XPDMA_FILE_CHUNK);
+    xpdma_free_local(buffer[1], XPDMA_FILE_CHUNK);
+    return ret;
+}
+
+int xpdma_load_file(xpdma_t *fpga, const char *path, uint64_t offset, unsigned int count, unsigned int addr)
+{
+    int fd = 0;
+    int ret = 0;
+
+    if (offset & 4095) {
+        errno = EINVAL;
+        return -1;
+    }
+    fd = open(path, O_RDONLY | O_DIRECT);
+    if (fd < 0)
+        return -1;
+    ret = xpdma_file_pipeline(fpga, fd, offset, count, addr, 1);
+    close(fd);
+    return ret;
+}
+
+int xpdma_dump_file(xpdma_t *fpga, const char *path, uint64_t offset, unsigned int count, unsigned int addr)
+{
+    int fd = 0;
+    int ret = 0;
+
+    if (offset & 4095) {
+        errno = EINVAL;
+        return -1;
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_DIRECT, 0644);
+    if (fd < 0)
+        return -1;
+    ret = xpdma_file_pipeline(fpga, fd, offset, count, addr, 0);
+    close(fd);
+    return ret;
+}
+
+int xpdma_map_regs(xpdma_t *fpga, int writable)
+{
+    cdmaRegMap_t map;
+    void *regs;
+
+    if (fpga->regs)
+        return 0;
+    if (ioctl(fpga->fd, IOCTL_REG_MAP, &map))
+        return -1;
+    if (writable && !map.writable) {
+        errno = EPERM;
+        return -1;
+    }
+
+    regs = mmap(NULL, map.size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fpga->fd, map.offset);
+    if (regs == MAP_FAILED)
+        return -1;
+    fpga->regs = (volatile uint32_t *)regs;
+    fpga->regsSize = map.size;
+    fpga->regsWritable = writable;
+    return 0;
+}
+
+int xpdma_reg_batch(xpdma_t *fpga, cdmaRegOp_t *ops, unsigned int count)
+{
+    cdmaRegBatch_t batch = {ops, count, 0};
+    return ioctl(fpga->fd, IOCTL_REG_BATCH, &batch);
+}
+
+void xpdma_writeReg(xpdma_t *fpga, uint32_t addr, uint32_t value)
+{
+    if (fpga->regsWritable && addr < fpga->regsSize) {
+        fpga->regs[addr / 4] = value;
+        return;
+    }
+    fpga->backend->writeReg(fpga->dev, addr, value);
+}
+
+uint32_t xpdma_readReg(xpdma_t *fpga, uint32_t addr)
 {
-    read(fpga->fd, data, count);
+    if (fpga->regs && addr < fpga->regsSize)
+        return fpga->regs[addr / 4];
+    return fpga->backend->readReg(fpga->dev, addr);
 }
 
 void xpdma_write(xpdma_t *fpga, void *data, unsigned int count)
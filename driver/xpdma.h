@@ -5,15 +5,69 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
+#include "xpdma_driver.h"
 
 struct xpdma_t;
 typedef struct xpdma_t xpdma_t;
 
+#define XPDMA_MAX_STRIPES   8   // Max cards a transfer is striped across
+#define XPDMA_MAX_COPY_THREADS 16 // Max threads copying a parallel transfer
+#define XPDMA_FILE_CHUNK    (16 * 1024 * 1024) // Chunk of xpdma_load_file/xpdma_dump_file
+
+// DMA buffer from the driver pool, mapped into the process
+typedef struct {
+    void *data;         // Mapped DMA memory, fill/read in place
+    unsigned int size;  // Buffer size
+    unsigned int index; // Pool buffer index
+} xpdma_buffer_t;
+
+// Read cache counters (xpdma_cache_stats)
+typedef struct {
+    uint64_t hits;          // Blocks of receives found in the cache
+    uint64_t misses;        // Blocks read from DDR for receives
+    uint64_t readahead;     // Blocks read ahead of sequential receives
+    uint64_t readaheadHits; // Read-ahead blocks used by a receive
+    uint64_t bytesSaved;    // Received bytes copied from the cache instead of DDR
+    uint64_t evictions;
+    uint64_t invalidations; // Blocks updated or dropped by writes to DDR
+    uint64_t bypassed;      // Receives larger than half of the cache, not cached
+} xpdma_cache_stats_t;
+
+// Backend of a device handle, selected at open time. Every backend moves data and
+// accesses registers; the other calls need the kernel driver (fd) and fail without it
+typedef struct {
+    const char *name;
+    void *(*open)(int index);   // State of card index, NULL on failure
+    void (*close)(void *dev);
+    int (*fd)(void *dev);       // Kernel driver file of the card, -1 - none (may be NULL)
+    int (*send)(void *dev, void *data, unsigned int count, unsigned int addr);
+    int (*recv)(void *dev, void *data, unsigned int count, unsigned int addr);
+    uint32_t (*readReg)(void *dev, uint32_t addr);
+    void (*writeReg)(void *dev, uint32_t addr, uint32_t value);
+} xpdma_backend_t;
+
+extern const xpdma_backend_t xpdma_backend_kernel; // "kernel": /dev/xpdmaN
+extern const xpdma_backend_t xpdma_backend_vfio;   // "vfio": user-space driver, card bound to vfio-pci
+extern const xpdma_backend_t xpdma_backend_mock;   // "mock": DDR in host memory, no hardware
+extern const xpdma_backend_t xpdma_backend_sim;    // "sim": vfio driver on a software model of the card
+
+/**
+ * Open device with PCIe DMA (index - card number, /dev/xpdmaN); the XPDMA_BACKEND
+ * environment variable selects another backend by name
+ */
+xpdma_t *xpdma_open(int index);
+
+/**
+ * Open card index through the given backend (a mock of the tests may be plugged in)
+ */
+xpdma_t *xpdma_open_backend(const xpdma_backend_t *backend, int index);
+
 /**
- * Open device with PCIe DMA
+ * Built-in backend by name, NULL when unknown
  */
-xpdma_t *xpdma_open();
+const xpdma_backend_t *xpdma_find_backend(const char *name);
 
 /**
  * Close device with PCIe DMA
@@ -30,6 +84,255 @@ int xpdma_send(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr)
  */
 int xpdma_recv(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr); 
 
+/**
+ * Send many records {data, count, addr} in one request (up to VEC_MAX), the status
+ * of every element is returned in it; -1 if any element failed
+ */
+int xpdma_sendv(xpdma_t *fpga, cdmaVec_t *vec, unsigned int count);
+
+/**
+ * Receive many records {data, count, addr} in one request, see xpdma_sendv
+ */
+int xpdma_recvv(xpdma_t *fpga, cdmaVec_t *vec, unsigned int count);
+
+/**
+ * Copy between DDR regions on the card without crossing PCIe
+ * (src_addr and dst_addr 16-byte aligned, regions must not overlap)
+ */
+int xpdma_copy(xpdma_t *fpga, unsigned int src_addr, unsigned int dst_addr, unsigned int count);
+
+/**
+ * Send data striped across cards in parallel: card i gets the i-th contiguous
+ * part (16-byte aligned size) at DDR address addr
+ */
+int xpdma_send_striped(xpdma_t **fpgas, int count, void *data, unsigned int size, unsigned int addr);
+
+/**
+ * Receive data striped by xpdma_send_striped from the cards in parallel
+ */
+int xpdma_recv_striped(xpdma_t **fpgas, int count, void *data, unsigned int size, unsigned int addr);
+
+/**
+ * Threads copying between user memory and DMA buffers in xpdma_send_parallel and
+ * xpdma_recv_parallel, the calling thread included (0 - off, they fall back to
+ * xpdma_send/xpdma_recv)
+ */
+int xpdma_set_copy_threads(xpdma_t *fpga, int threads);
+
+/**
+ * Send data through two mapped pool buffers: every chunk is copied by all copy threads,
+ * then handed to CDMA while the next one is copied (addr 16-byte aligned, no other
+ * asynchronous requests of the handle in flight); falls back to xpdma_send otherwise
+ */
+int xpdma_send_parallel(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr);
+
+/**
+ * Receive data through two mapped pool buffers, see xpdma_send_parallel
+ */
+int xpdma_recv_parallel(xpdma_t *fpga, void *data, unsigned int count, unsigned int addr);
+
+/**
+ * Cache receives of the handle in host memory: capacity bytes of block_size blocks
+ * (power of two, 4 KBytes at least) keyed by DDR address, CLOCK eviction; readahead
+ * blocks are read in the background after sequential receives (0 - off, capacity 0 -
+ * no cache). Sends of the handle update or drop the blocks they overlap
+ */
+int xpdma_cache_setup(xpdma_t *fpga, unsigned int block_size, size_t capacity, unsigned int readahead);
+
+/**
+ * Read and clear the cache counters (hit rate, bytes saved, read-ahead use)
+ */
+int xpdma_cache_stats(xpdma_t *fpga, xpdma_cache_stats_t *stats);
+
+/**
+ * Drop cached blocks of a DDR range written by other handles, cards or processes
+ */
+void xpdma_cache_invalidate(xpdma_t *fpga, unsigned int addr, unsigned int count);
+
+/**
+ * Map the BAR0 registers: xpdma_readReg (and xpdma_writeReg with writable, allowed by
+ * the regs_writable module parameter) become plain loads/stores instead of ioctls
+ */
+int xpdma_map_regs(xpdma_t *fpga, int writable);
+
+/**
+ * Read/write many registers in one ioctl, in order (up to REG_BATCH_MAX, values read
+ * are returned in ops). Writes outside of the CDMA window need regs_writable, a bad
+ * access fails the batch before any register is touched
+ */
+int xpdma_reg_batch(xpdma_t *fpga, cdmaRegOp_t *ops, unsigned int count);
+
+/**
+ * Read a register at BAR0 offset addr (the kernel backend reaches the CDMA registers
+ * only, unless the registers are mapped with xpdma_map_regs)
+ */
+uint32_t xpdma_readReg(xpdma_t *fpga, uint32_t addr);
+
+/**
+ * Write a register at BAR0 offset addr (same limit as xpdma_readReg)
+ */
+void xpdma_writeReg(xpdma_t *fpga, uint32_t addr, uint32_t value);
+
+/**
+ * Read and clear copy/DMA pipeline statistics
+ */
+int xpdma_stats(xpdma_t *fpga, cdmaStats_t *stats);
+
+/**
+ * Set completion wait mode (WAIT_MODE_*) for this device handle
+ */
+int xpdma_set_wait_mode(xpdma_t *fpga, int mode);
+
+/**
+ * Set scheduling class (SCHED_LATENCY, SCHED_BULK, SCHED_AUTO) and weight of
+ * synchronous transfers of this device handle
+ */
+int xpdma_set_sched(xpdma_t *fpga, int priority, unsigned int weight);
+
+/**
+ * Read and clear scheduler metrics (queue depth, wait time per class)
+ */
+int xpdma_sched_stats(xpdma_t *fpga, cdmaSchedStats_t *stats);
+
+/**
+ * Allocate DMA buffer from the driver pool and map it
+ */
+xpdma_buffer_t *xpdma_buffer_alloc(xpdma_t *fpga);
+
+/**
+ * Unmap DMA buffer and return it to the driver pool
+ */
+void xpdma_buffer_free(xpdma_t *fpga, xpdma_buffer_t *buffer);
+
+/**
+ * Send data from DMA buffer to DDR without copy (offset and addr 16-byte aligned)
+ */
+int xpdma_send_buffer(xpdma_t *fpga, xpdma_buffer_t *buffer, unsigned int offset, unsigned int count, unsigned int addr);
+
+/**
+ * Receive data from DDR to DMA buffer without copy (offset and addr 16-byte aligned)
+ */
+int xpdma_recv_buffer(xpdma_t *fpga, xpdma_buffer_t *buffer, unsigned int offset, unsigned int count, unsigned int addr);
+
+/**
+ * Queue asynchronous transfer (REQUEST_SEND/REQUEST_RECV) of a DMA buffer range,
+ * returns without waiting (-1 with errno EAGAIN when the queue is full)
+ */
+int xpdma_submit(xpdma_t *fpga, int direction, xpdma_buffer_t *buffer, unsigned int offset,
+                 unsigned int count, unsigned int addr, uint64_t cookie);
+
+/**
+ * Wait for completions of asynchronous transfers, returns number of records
+ * (0 - nothing in flight)
+ */
+int xpdma_wait(xpdma_t *fpga, cdmaCompletion_t *done, unsigned int max);
+
+/**
+ * Reap completions of asynchronous transfers without waiting, returns number of records
+ */
+int xpdma_poll(xpdma_t *fpga, cdmaCompletion_t *done, unsigned int max);
+
+/**
+ * Signal eventfd on every completion (-1 - detach)
+ */
+int xpdma_set_eventfd(xpdma_t *fpga, int eventfd);
+
+/**
+ * Create shared submission/completion rings of the handle (sqpoll - kernel thread
+ * drains the submission ring), completions are reaped from the ring afterwards
+ */
+int xpdma_ring_setup(xpdma_t *fpga, unsigned int entries, int sqpoll);
+
+/**
+ * Queue request to the submission ring without a syscall (-1 when the ring is full)
+ */
+int xpdma_ring_queue(xpdma_t *fpga, int direction, xpdma_buffer_t *buffer, unsigned int offset,
+                     unsigned int count, unsigned int addr, uint64_t cookie);
+
+/**
+ * Hand queued requests to the driver and wait for wait completions (one
+ * doorbell syscall per batch, none with a running poll thread and wait 0)
+ */
+int xpdma_ring_submit(xpdma_t *fpga, unsigned int wait);
+
+/**
+ * Reap completions from the completion ring without a syscall, returns number of records
+ */
+int xpdma_ring_reap(xpdma_t *fpga, cdmaCompletion_t *done, unsigned int max);
+
+/**
+ * File descriptor of the device, becomes readable (poll/select/epoll) on completions
+ */
+int xpdma_fd(xpdma_t *fpga);
+
+/**
+ * Start cyclic streaming of the DDR ring [ddr_addr, +ddr_size) into slots host ring
+ * slots of slot_size bytes (4 KBytes multiple); the handle owns CDMA until it stops
+ */
+int xpdma_stream_start(xpdma_t *fpga, unsigned int ddr_addr, unsigned int ddr_size,
+                       unsigned int slot_size, unsigned int slots);
+
+/**
+ * Next filled slot in ring order, waits up to timeout_ms (-1 - forever); NULL on
+ * timeout or stream error. The slot stays valid until xpdma_stream_release
+ */
+void *xpdma_stream_next(xpdma_t *fpga, int timeout_ms);
+
+/**
+ * Hand the oldest slot back to the driver for refilling
+ */
+void xpdma_stream_release(xpdma_t *fpga);
+
+/**
+ * Head/tail, bytes streamed and overrun counters of the stream
+ */
+int xpdma_stream_status(xpdma_t *fpga, cdmaStream_t *status);
+
+/**
+ * Stop streaming and unmap the slots
+ */
+int xpdma_stream_stop(xpdma_t *fpga);
+
+/**
+ * NUMA node of the card (-1 - unknown), the driver keeps its buffers and threads there
+ */
+int xpdma_node(xpdma_t *fpga);
+
+/**
+ * Run the calling thread on the CPUs of the card node (no-op when the node is unknown)
+ */
+int xpdma_bind_node(xpdma_t *fpga);
+
+/**
+ * Allocate page-aligned host memory preferring the card node, release with xpdma_free_local
+ */
+void *xpdma_alloc_local(xpdma_t *fpga, size_t size);
+
+void xpdma_free_local(void *data, size_t size);
+
+/**
+ * Send a range of file fd to DDR in the driver: file data goes from the page cache to the
+ * staging buffers without a user buffer (fd opened without O_DIRECT)
+ */
+int xpdma_send_file(xpdma_t *fpga, int fd, uint64_t offset, unsigned int count, unsigned int addr);
+
+/**
+ * Receive from DDR into a range of file fd in the driver, see xpdma_send_file
+ */
+int xpdma_recv_file(xpdma_t *fpga, int fd, uint64_t offset, unsigned int count, unsigned int addr);
+
+/**
+ * Load a range of a file to DDR bypassing the page cache: O_DIRECT reads of the next
+ * chunk run while the current one is sent zero-copy (offset 4 KBytes aligned)
+ */
+int xpdma_load_file(xpdma_t *fpga, const char *path, uint64_t offset, unsigned int count, unsigned int addr);
+
+/**
+ * Dump DDR into a range of a file (created when missing) bypassing the page cache,
+ * see xpdma_load_file
+ */
+int xpdma_dump_file(xpdma_t *fpga, const char *path, uint64_t offset, unsigned int count, unsigned int addr);
+
 
 
 #ifdef __cplusplus
@@ -7,115 +7,444 @@
 #include <linux/init.h>		/* Needed for the macros */
 #include <linux/fs.h>       /* Needed for files operations */
 #include <linux/pci.h>      /* Needed for PCI */
-#include <asm/uaccess.h>    /* Needed for copy_to_user & copy_from_user */
+#include <linux/uaccess.h>  /* Needed for copy_to_user & copy_from_user */
 #include <linux/delay.h>    /* udelay, mdelay */
 #include <linux/dma-mapping.h>
+#include <linux/ktime.h>    /* ktime_get for pipeline statistics */
+#include <linux/mm.h>       /* get_user_pages_fast, put_page */
+#include <linux/pagemap.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>     /* kmalloc, kfree */
+#include <linux/interrupt.h>
+#include <linux/completion.h>
+#include <linux/hrtimer.h>  /* schedule_hrtimeout_range */
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/kthread.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/kref.h>
+#include <linux/rwsem.h>
 
 #include "xpdma_driver.h"
+#include "xpdma_regs.h"
+
+#define CREATE_TRACE_POINTS
+#include "xpdma_trace.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_DESCRIPTION("PCIe driver for Xilinx CDMA subsystem (XAPP1171), Linux");
 MODULE_AUTHOR("Strezhik Iurii");
 
 // Max CDMA buffer size
-#define MAX_BTT             0x007FFFFF   // 8 MBytes maximum for DMA Transfer */
-#define BUF_SIZE            (4<<20)      // 4 MBytes read/write buffer size
-#define TRANSFER_SIZE       (4<<20)      // 4 MBytes transfer size for scatter gather
-#define DESCRIPTOR_SIZE     64           // 64-byte aligned Transfer Descriptor
-
-#define BRAM_OFFSET         0x00000000   // Translation BRAM offset
-#define PCIE_CTL_OFFSET     0x00008000   // AXI PCIe control offset
-#define CDMA_OFFSET         0x0000c000   // AXI CDMA LITE control offset
-
-// AXI CDMA Register Offsets
-#define CDMA_CONTROL_OFFSET	0x00         // Control Register
-#define CDMA_STATUS_OFFSET	0x04         // Status Register
-#define CDMA_CDESC_OFFSET	0x08         // Current descriptor Register
-#define CDMA_TDESC_OFFSET	0x10         // Tail descriptor Register
-#define CDMA_SRCADDR_OFFSET	0x18         // Source Address Register
-#define CDMA_DSTADDR_OFFSET	0x20         // Dest Address Register
-#define CDMA_BTT_OFFSET		0x28         // Bytes to transfer Register
-
-#define AXI_PCIE_DM_ADDR    0x80000000   // AXI:BAR1 Address
-#define AXI_PCIE_SG_ADDR    0x80800000   // AXI:BAR0 Address
-#define AXI_BRAM_ADDR       0x81000000   // AXI Translation BRAM Address
-#define AXI_DDR3_ADDR       0x00000000   // AXI DDR3 Address
-
-#define SG_COMPLETE_MASK    0xF0000000   // Scatter Gather Operation Complete status flag mask
-#define SG_DEC_ERR_MASK     0x40000000   // Scatter Gather Operation Decode Error flag mask
-#define SG_SLAVE_ERR_MASK   0x20000000   // Scatter Gather Operation Slave Error flag mask
-#define SG_INT_ERR_MASK     0x10000000   // Scatter Gather Operation Internal Error flag mask
-
-#define BRAM_STEP           0x8          // Translation Vector Length
-#define ADDR_BTT            0x00000008   // 64 bit address translation descriptor control length
-
-#define CDMA_CR_SG_EN       0x00000008   // Scatter gather mode enable
-#define CDMA_CR_IDLE_MASK   0x00000002   // CDMA Idle mask
-#define CDMA_CR_RESET_MASK  0x00000004   // CDMA Reset mask
-#define AXIBAR2PCIEBAR_0U   0x208        // AXI:BAR0 Upper Address Translation (bits [63:32])
-#define AXIBAR2PCIEBAR_0L   0x20C        // AXI:BAR0 Lower Address Translation (bits [31:0])
-#define AXIBAR2PCIEBAR_1U   0x210        // AXI:BAR1 Upper Address Translation (bits [63:32])
-#define AXIBAR2PCIEBAR_1L   0x214        // AXI:BAR1 Lower Address Translation (bits [31:0])
+#define BUF_SIZE            (4<<20)      // 4 MBytes read/write buffer block size
+#define TRANSFER_SIZE       (4<<20)      // 4 MBytes default transfer size of a data descriptor
+#define CHUNK_SIZE          (4<<20)      // 4 MBytes default bytes per CDMA operation (staging buffer size)
+#define STAGE_MAX_BLOCKS    64           // Max BUF_SIZE blocks per staging buffer (256 MBytes chunk)
+#define DESC_CHAIN_SIZE     (2 * BRAM_VECTORS * DESCRIPTOR_SIZE) // Descriptor pair per translation vector
+
+// Every chain slot owns a range of descriptor pairs and the same range of translation vectors
+#define STAGE_MAX           2            // Max staging buffers per direction (CDMA runs one staging chain at a time)
+#define STAGE_SEND          0            // Host to device staging buffers (writeBuffer)
+#define STAGE_RECV          1            // Device to host staging buffers (readBuffer)
+#define STAGE_DIR(d)        ((DMA_TO_DEVICE == (d)) ? STAGE_SEND : STAGE_RECV)
+#define STAGE_NODES         4            // Max NUMA nodes with their own staging buffers
+#define ZC_COUNT            2            // Pinned user windows per transfer (pin/DMA pipeline depth)
+#define ZC_WINDOW_PAGES     1024         // User pages pinned per zero-copy window
+#define ZC_VECTORS          (ZC_WINDOW_PAGES + 2) // Vectors per window (one per page + aperture splits)
+#define POOL_SLOT           (STAGE_MAX + ZC_COUNT) // Transfers from/to mmap-ed pool buffers
+#define ASYNC_DEPTH         16           // Default asynchronous requests handed to CDMA at once
+#define ASYNC_MAX           64           // Max asynchronous requests in flight (per device and per file)
+#define ASYNC_SLOT(r)       (POOL_SLOT + 1 + (r)) // Ring of asynchronous request chains
+#define FAST_SLOT           ASYNC_SLOT(ASYNC_MAX) // Low-latency path: one descriptor pair, last BRAM vector
+#define SLOT_COUNT          (FAST_SLOT + 1)
+#define FAST_SIZE           (64<<10)     // Low-latency path buffer, coherent and naturally aligned (one aperture)
+#define FAST_SPIN_NS        (20 * NSEC_PER_USEC) // Busy poll of the low-latency path before it sleeps
+#define RING_MAX_ENTRIES    1024         // Max entries of shared submission/completion rings
+#define RING_MMAP_OFFSET    ((unsigned long)POOL_MAX * BUF_SIZE) // mmap offset of the rings, after pool buffers
+#define RING_IDLE_US        1000         // Poll thread spins this long without submissions before sleeping
+#define STREAM_IDLE_NS      (50LL * NSEC_PER_USEC) // Stream looks for freed slots this often while CDMA waits
+#define REGS_MMAP_OFFSET    (RING_MMAP_OFFSET + BUF_SIZE) // mmap offset of the BAR0 registers, after the rings
+#define STREAM_MMAP_OFFSET  (REGS_MMAP_OFFSET + BUF_SIZE) // mmap offset of the stream, last: control page, then the slots
+#define ZC_SLOT(w)          (STAGE_MAX + (w))
+
+#define POOL_COUNT          8            // Default DMA buffers in the mmap-able pool
+#define POOL_MAX            64           // Max DMA buffers in the pool (BUF_SIZE each)
+#define MAX_DEVICES         8            // Max probed cards, /dev/xpdma0 .. /dev/xpdma7
+
+#define SCHED_SMALL_SIZE    (64<<10)     // Transfers up to this size go to the latency class by default
+#define SCHED_STARVE_US     10000        // Bulk transfer waiting longer runs ahead of the latency class
+
+#define VEC_ALIGN           ZEROCOPY_ALIGN // Vectored elements start aligned in the staging buffer
+#define COPY_BTT            (MAX_BTT & ~(ZEROCOPY_ALIGN - 1)) // Max bytes per DDR-to-DDR data descriptor
+
+#define ZEROCOPY_MIN_SIZE   (256<<10)    // Smaller transfers are cheaper to copy than to pin
+#define ZEROCOPY_ALIGN      16           // AXI data width (128 bit), CDMA is built without DRE
+
+#define SG_LAYOUT_NONE      0            // Slot chain not built
+#define SG_LAYOUT_PAIRS     1            // Translation and data descriptor pairs, links and translation fields prebuilt
+#define SG_LAYOUT_DATA      2            // MEM2MEM data descriptors only
+#define SG_ADDR_SEGS        0xFFFFFFFF   // Chain address: every segment carries its own DDR3 address
 
 #define CDMA_RESET_LOOP	    1000000      // Reset timeout counter limit
 #define SG_TRANSFER_LOOP	1000000      // Scatter Gather Transfer timeout counter limit
+#define SG_TIMEOUT_NS       (10LL * NSEC_PER_SEC) // Scatter Gather Transfer timeout for sleeping waits
+#define SG_POLL_NS          2000         // Default short poll period after expected completion
+#define SG_EXPECTED_MBPS    1000         // Initial bandwidth guess before the first completion
+
+// Transfer phases with per-CPU latency histograms (debugfs xpdma/xpdmaN/stats)
+enum {
+    PHASE_COPY,         // User copy (or file read/write) of a staging buffer
+    PHASE_PIN,          // Pinning and mapping user pages of a zero-copy window
+    PHASE_CHAIN,        // Building the descriptor chain
+    PHASE_MMIO,         // Translation vectors written to BRAM
+    PHASE_START,        // Kick to the first descriptor seen completed
+    PHASE_DMA,          // Kick to the tail descriptor seen completed
+    PHASE_TRANSFER,     // Whole synchronous request, from the ioctl to its end
+    PHASE_COUNT
+};
+#define HIST_BUCKETS        40           // log2 buckets: bucket b counts [2^(b-1), 2^b) ns, the last one everything longer
+
+// Contiguous host memory segment of a transfer
+typedef struct {
+    dma_addr_t hwAddr;  // Bus address of the segment
+    u32 length;         // Never crosses AXI:BAR1 aperture nor exceeds desc_size
+    u32 ddrAddr;        // DDR3 side of the segment, used by chains built with SG_ADDR_SEGS only
+} sg_seg_t;
+
+// User pages pinned and mapped for a zero-copy window
+typedef struct {
+    struct page **pages;
+    struct scatterlist *sgl;
+    sg_seg_t *segs;
+    int nrPages;        // Pinned pages
+    int nents;          // Mapped scatterlist entries
+    u32 nsegs;          // Segments built from the mapped entries
+    int direction;
+} zc_window_t;
+
+// Staging buffers of one NUMA node
+typedef struct {
+    int node;                       // NUMA node of the memory
+    char *readBuffer[STAGE_MAX][STAGE_MAX_BLOCKS];  // DMA Read staging buffers (BUF_SIZE blocks)
+    char *writeBuffer[STAGE_MAX][STAGE_MAX_BLOCKS]; // DMA Write staging buffers (BUF_SIZE blocks)
+    dma_addr_t readHWAddr[STAGE_MAX][STAGE_MAX_BLOCKS];
+    dma_addr_t writeHWAddr[STAGE_MAX][STAGE_MAX_BLOCKS];
+    size_t readContig[STAGE_MAX];   // Bytes of the one coherent allocation behind all blocks, 0 - streaming-mapped blocks
+    size_t writeContig[STAGE_MAX];
+} stage_set_t;
 
-// Scatter Gather Transfer descriptor
+// Phase histograms and counters of one CPU, updated without locks; readers sum all CPUs
 typedef struct {
-    u32 nextDesc;   /* 0x00 */
-    u32 na1;	    /* 0x04 */
-    u32 srcAddr;    /* 0x08 */
-    u32 na2;        /* 0x0C */
-    u32 destAddr;   /* 0x10 */
-    u32 na3;        /* 0x14 */
-    u32 control;    /* 0x18 */
-    u32 status;     /* 0x1C */
-} __aligned(DESCRIPTOR_SIZE) sg_desc_t;
+    u64 count[PHASE_COUNT];
+    u64 sumNs[PHASE_COUNT];
+    u64 hist[PHASE_COUNT][HIST_BUCKETS];
+    u64 bytes;          // Bytes of completed requests
+    u64 ops;            // Completed requests
+    u64 errors;         // Failed requests
+    u64 timeouts;       // Chains not completed in time
+} phase_stats_t;
 
 #define HAVE_KERNEL_REG     0x01    // Kernel registration
 #define HAVE_MEM_REGION     0x02    // I/O Memory region
+#define HAVE_IRQ            0x04    // MSI interrupt requested
+#define HAVE_PCI_ENABLED    0x08    // pci_enable_device succeeded
+
+struct xpdma_dev;
+
+// Per open file state
+typedef struct {
+    struct xpdma_dev *dev;          // Card the file was opened on
+    int waitMode;                   // Completion wait mode, WAIT_MODE_DEFAULT - module-wide
+    u32 priority;                   // Scheduling class of synchronous transfers, SCHED_AUTO - by size
+    u32 weight;                     // Share of CDMA time within the class
+    u64 vtime;                      // Virtual finish time of the last queued transfer
+    u32 inflight;                   // Submitted asynchronous requests not completed yet
+    u32 doneHead;                   // Completion records written (by the completion timer)
+    u32 doneTail;                   // Completion records read
+    cdmaCompletion_t done[ASYNC_MAX];
+    wait_queue_head_t wait;         // read()/poll()/release waiters
+    struct eventfd_ctx *eventfd;    // Signaled on every completion
+    struct mutex ringLock;          // Ring setup and submission ring consumers
+    cdmaRing_t *ring;               // Shared rings, completions go to the ring instead of done[]
+    cdmaRequest_t *sq;
+    cdmaCompletion_t *cq;
+    u32 ringEntries;
+    u32 ringSize;
+    struct task_struct *ringThread; // Submission ring poll thread
+    struct file *filp;              // Mappings to zap on card removal
+    struct list_head list;          // Open files of the card
+} xpdma_file_t;
+
+// Synchronous transfer waiting for CDMA
+typedef struct {
+    struct list_head list;
+    xpdma_file_t *file;
+    u64 start;                      // Virtual start time
+    u64 finish;                     // Virtual finish time, the lowest in the class runs first
+    ktime_t queued;
+    int priority;
+    int granted;
+} sched_waiter_t;
+
+// Asynchronous request in the CDMA ring
+typedef struct {
+    xpdma_file_t *file;             // Submitting file
+    u64 cookie;
+    u32 count;
+} async_req_t;
+
+// Per card state, every probed KC705 gets its own CDMA, buffers and chains
+typedef struct xpdma_dev {
+    int index;                      // Minor number, /dev/xpdmaN
+    struct pci_dev *pdev;           // PCI device structure
+    struct cdev cdev;
+    struct device *device;
+    struct kref ref;                // Probe and every open file, the last put frees the card
+    struct rw_semaphore removeLock; // Read - file operation in progress, write - card removal
+    int removed;                    // Card is gone, file operations fail with -ENODEV
+    struct mutex filesLock;
+    struct list_head files;         // Open files, their mappings are zapped on removal
+    unsigned int statFlags;         // Status flags used for cleanup
+    unsigned long baseHdwr;         // Base register address (Hardware address)
+    unsigned long baseLen;          // Base register address Length
+    void *baseVirt;                 // Base register address (Virtual address, for I/O)
+    int node;                       // NUMA node of the card, buffers and threads are placed there
+    stage_set_t *stageSet[STAGE_NODES]; // Staging buffers, the first one on the card node
+    u32 stageSets;
+    stage_set_t *stage;             // Staging buffers of the transfer owning CDMA
+    u32 stageCount[2];              // Staging buffers (pipeline depth) per direction, STAGE_SEND/STAGE_RECV
+    u32 stageBlocks[2];             // BUF_SIZE blocks per staging buffer
+    size_t chunkBytes[2];           // Bytes per CDMA operation on the staging path
+    u32 stageSlots;                 // Staging chain slots, the deeper direction
+    u32 stageVectors;               // Translation vectors (descriptor pairs) per staging buffer chain
+    sg_seg_t stageSegs[BRAM_VECTORS]; // Segments of the staging chain being built
+
+    sg_desc_t *descChain;           // Translation Descriptors chain (one region per slot)
+    dma_addr_t descChainHWAddr;
+    u32 descChainAddr;              // descChain seen through AXI:BAR0
+    size_t descChainLength[SLOT_COUNT]; // Descriptors in the slot chain
+    int descLayout[SLOT_COUNT];     // Static fields of the slot chain: SG_LAYOUT_*
+    u32 descTail[SLOT_COUNT];       // Pair whose data descriptor ends the slot chain (links to the head)
+    u64 bramVector[BRAM_VECTORS];   // Translation vectors written to BRAM, unchanged ones are not rewritten
+    u32 cdmaControl;                // Last value written to the CDMA control register
+    int chainWindow;                // AXI:BAR0 (SG window) points at the descriptor chains
+    ktime_t kickTime[SLOT_COUNT];   // Time the slot chain was handed to CDMA
+    u32 chainBytes[SLOT_COUNT];     // Bytes moved by the slot chain
+    zc_window_t zcWindow[ZC_COUNT]; // Zero-copy windows
+
+    char *poolBuffer[POOL_MAX];     // mmap-able DMA buffers (BUF_SIZE each)
+    dma_addr_t poolHWAddr[POOL_MAX];
+    struct file *poolOwner[POOL_MAX]; // File the buffer is allocated to, NULL - free
+    atomic_t poolMaps[POOL_MAX];    // User mappings of the buffer
+    u32 poolVectors;                // Translation vectors (descriptor pairs) of the pool chain
+
+    char *fastBuffer;               // Low-latency path buffer (FAST_SIZE)
+    dma_addr_t fastHWAddr;
+    int cdmaIdle;                   // Last chain was seen completed by the low-latency path
+
+    // Asynchronous ring: [tail, +running) handed to CDMA, then [.., +ready) built and waiting
+    // for the end of a synchronous transfer; chain tails are linked to the next ring slot
+    async_req_t asyncReq[ASYNC_MAX];
+    u32 asyncDepth;                 // Ring slots fitting into BRAM
+    u32 asyncTail;                  // Oldest running request
+    u32 asyncRunning;
+    u32 asyncReady;
+    int syncActive;                 // Synchronous transfer owns CDMA
+    int asyncArmed;                 // Completion timer is running
+    sg_seg_t asyncSegs[BRAM_VECTORS]; // Segments of the request chain being built
+    spinlock_t asyncLock;           // Ring state, shared with the completion timer
+    struct mutex asyncSubmit;       // Serializes chain building of submitters
+    wait_queue_head_t asyncIdle;    // Synchronous transfers wait for running requests
+    struct hrtimer asyncTimer;      // Polls the running requests for completion
+    struct work_struct asyncFault;  // Reports a failed request and resets CDMA out of the timer
+    int asyncResetting;             // Requests failed, CDMA waits for asyncFault
+    int asyncFaultSlot;             // Chain of the failed request
+    u32 asyncFaultStatus;           // Its tail status, 0 - timeout
+
+    // Scheduler of synchronous transfers (send/receive, pool buffer transfers, reset):
+    // one owner of CDMA at a time, start-time fair queueing by file weight within a class
+    spinlock_t schedLock;
+    struct list_head schedQueue[SCHED_CLASSES];
+    wait_queue_head_t schedWait;    // Waiters check their granted flag
+    int schedBusy;                  // CDMA is granted to a transfer
+    u64 schedVtime;                 // Virtual start time of the granted transfer
+    cdmaSchedStats_t schedStats;
+
+    // Device to host streaming over a cyclic chain in the synchronous slots range:
+    // [head, armed) handed to CDMA, [tail, head) filled and owned by the application
+    xpdma_file_t *streamFile;       // Streaming file, owns CDMA until it stops
+    cdmaStream_t *streamCtl;        // Control page shared with the application
+    char *streamBuffer[STREAM_MAX_SLOTS]; // Host ring slots
+    dma_addr_t streamHWAddr[STREAM_MAX_SLOTS];
+    u32 streamSlots;
+    u32 streamSlotSize;
+    u32 streamDdrAddr;              // DDR3 ring
+    u32 streamDdrSize;
+    u32 streamDdrNext;              // DDR3 ring offset of the next armed slot
+    u32 streamHead;
+    u32 streamArmed;
+    int streamStalled;              // Every slot full, CDMA stopped since streamStall
+    ktime_t streamStall;
+    ktime_t streamKick;             // Last progress of the running slots
+    atomic_t streamMaps;            // User mappings of the stream
+    spinlock_t streamLock;          // Stream state, shared with the stream timer
+    struct hrtimer streamTimer;     // Collects filled slots and re-arms freed ones
+
+    atomic_t regsWriters;           // Writable register mappings, cached CDMA/BRAM state can't be trusted
+
+    struct completion dmaDone;      // Signaled by the interrupt when the IRQ slot chain finished
+    int irqSlot;                    // Slot waited for by interrupt
+    int irqMissed;                  // Chain completed without interrupt: MSI is not wired
+    int waitMode;                   // Completion wait mode of the current transfer
+    u64 psPerByte;                  // Observed CDMA speed (EWMA), picoseconds per byte
+
+    cdmaStats_t stats;              // Copy/DMA pipeline statistics
+    phase_stats_t __percpu *phase;  // Phase histograms, NULL - not allocated
+    int kickSeen[SLOT_COUNT];       // First descriptor of the slot chain seen completed since the kick
+    struct dentry *debugfs;         // xpdma/xpdmaN
+} xpdma_dev_t;
 
-int gDrvrMajor = 241;               // Major number not dynamic
-struct pci_dev *gDev = NULL;        // PCI device structure
-unsigned int gStatFlags = 0x00;     // Status flags used for cleanup
-unsigned long gBaseHdwr;            // Base register address (Hardware address)
-unsigned long gBaseLen;             // Base register address Length
-void *gBaseVirt = NULL;             // Base register address (Virtual address, for I/O)
-char *gReadBuffer = NULL;           // Pointer to dword aligned DMA Read buffer
-char *gWriteBuffer = NULL;          // Pointer to dword aligned DMA Write buffer
+dev_t gDevNum;                      // First device number, major is dynamic
+struct class *gClass = NULL;
+xpdma_dev_t *gDevices[MAX_DEVICES]; // Probed cards by minor number
+DEFINE_MUTEX(gDevicesLock);
+struct dentry *gDebugfs = NULL;     // debugfs root of the cards
 
-sg_desc_t *gDescChain;              // Translation Descriptors chain
-size_t gDescChainLength;
+static unsigned int zerocopy_min = ZEROCOPY_MIN_SIZE;
+module_param(zerocopy_min, uint, 0644);
+MODULE_PARM_DESC(zerocopy_min, "Minimal transfer size for zero-copy DMA from user pages (0 - disabled)");
 
-dma_addr_t gReadHWAddr;
-dma_addr_t gWriteHWAddr;
-dma_addr_t gDescChainHWAddr;
+static unsigned int chunk_size = CHUNK_SIZE;
+module_param(chunk_size, uint, 0444);
+MODULE_PARM_DESC(chunk_size, "Bytes per CDMA operation on the staging path (multiple of 4 MBytes, max 256 MBytes)");
+
+static unsigned int send_chunk = 0;
+module_param(send_chunk, uint, 0444);
+MODULE_PARM_DESC(send_chunk, "Staging buffer size (bytes) of host to device transfers (0 - chunk_size)");
+
+static unsigned int recv_chunk = 0;
+module_param(recv_chunk, uint, 0444);
+MODULE_PARM_DESC(recv_chunk, "Staging buffer size (bytes) of device to host transfers (0 - chunk_size)");
+
+static int node_stages = 0;
+module_param(node_stages, int, 0444);
+MODULE_PARM_DESC(node_stages, "Staging buffers on every NUMA node, used by transfers submitted there (0 - card node only)");
+
+static int stage_contig = 1;
+module_param(stage_contig, int, 0444);
+MODULE_PARM_DESC(stage_contig, "Allocate every card node staging buffer as one contiguous region (CMA when configured), 0 - 4 MBytes blocks");
+
+static unsigned int desc_size = TRANSFER_SIZE;
+module_param(desc_size, uint, 0444);
+MODULE_PARM_DESC(desc_size, "Max bytes per data descriptor (4 KBytes .. 4 MBytes AXI:BAR1 aperture)");
+
+static int wait_mode = WAIT_MODE_SLEEP;
+module_param(wait_mode, int, 0644);
+MODULE_PARM_DESC(wait_mode, "Completion wait mode: 1 - busy poll, 2 - hrtimer sleep/poll, 3 - interrupt");
+
+static unsigned int pool_count = POOL_COUNT;
+module_param(pool_count, uint, 0444);
+MODULE_PARM_DESC(pool_count, "DMA buffers (4 MBytes each) in the mmap-able pool, max 64");
+
+static unsigned int async_depth = ASYNC_DEPTH;
+module_param(async_depth, uint, 0444);
+MODULE_PARM_DESC(async_depth, "Asynchronous requests handed to CDMA at once, max 64 (limited by BRAM)");
+
+static unsigned int ring_idle_us = RING_IDLE_US;
+module_param(ring_idle_us, uint, 0644);
+MODULE_PARM_DESC(ring_idle_us, "Submission ring poll thread spins this long (us) without submissions before sleeping");
+
+static unsigned int sched_small = SCHED_SMALL_SIZE;
+module_param(sched_small, uint, 0644);
+MODULE_PARM_DESC(sched_small, "Transfers up to this size (bytes) go to the latency class unless the file selects a class");
+
+static unsigned int sched_starve_us = SCHED_STARVE_US;
+module_param(sched_starve_us, uint, 0644);
+MODULE_PARM_DESC(sched_starve_us, "Bulk transfer waiting longer (us) runs ahead of the latency class (0 - strict priority)");
+
+static unsigned int fast_max = 0;
+module_param(fast_max, uint, 0644);
+MODULE_PARM_DESC(fast_max, "Transfers up to this size (bytes, max 64 KBytes) take the low-latency path (0 - disabled, default)");
+
+static unsigned int poll_ns = SG_POLL_NS;
+module_param(poll_ns, uint, 0644);
+MODULE_PARM_DESC(poll_ns, "Poll period (ns) after the expected completion time in sleep mode");
+
+static unsigned int regs_writable = 0;
+module_param(regs_writable, uint, 0444);
+MODULE_PARM_DESC(regs_writable, "Allow writable mmap of the BAR0 registers (0 - read only)");
 
 // Prototypes
-static int xpdma_reset(void);
+static int xpdma_reset(xpdma_dev_t *dev);
+static void xpdma_free (xpdma_dev_t *dev);
 ssize_t xpdma_write (struct file *filp, const char *buf, size_t count, loff_t *f_pos);
 ssize_t xpdma_read (struct file *filp, char *buf, size_t count, loff_t *f_pos);
 long xpdma_ioctl (struct file *filp, unsigned int cmd, unsigned long arg);
 int xpdma_open(struct inode *inode, struct file *filp);
 int xpdma_release(struct inode *inode, struct file *filp);
-static inline u32 xpdma_readReg (u32 reg);
-static inline void xpdma_writeReg (u32 reg, u32 val);
-ssize_t xpdma_send (void *data, size_t count, u32 addr);
-ssize_t xpdma_recv (void *data, size_t count, u32 addr);
-void xpdma_showInfo (void);
+int xpdma_mmap(struct file *filp, struct vm_area_struct *vma);
+__poll_t xpdma_poll(struct file *filp, poll_table *wait);
+static inline u32 xpdma_readReg (xpdma_dev_t *dev, u32 reg);
+static inline void xpdma_writeReg (xpdma_dev_t *dev, u32 reg, u32 val);
+static inline int cdma_regValid(u32 reg);
+ssize_t xpdma_send (xpdma_dev_t *dev, void *data, size_t count, u32 addr);
+ssize_t xpdma_recv (xpdma_dev_t *dev, void *data, size_t count, u32 addr);
+void xpdma_showInfo (xpdma_dev_t *dev);
+static int pool_alloc(struct file *filp, cdmaPoolBuffer_t *pool);
+static int pool_free(struct file *filp, u32 index);
+static int pool_block(struct file *filp, int direction, cdmaBufferRef_t *ref);
+static int copy_block(xpdma_dev_t *dev, cdmaCopy_t *copy);
+static int vec_block(xpdma_dev_t *dev, int direction, cdmaVec_t *vec, u32 count);
+static int file_block(xpdma_dev_t *dev, int direction, cdmaFile_t *req);
+static void async_hold(xpdma_dev_t *dev);
+static inline int async_fileRoom(xpdma_file_t *file);
+static void async_release(xpdma_dev_t *dev);
+static int async_submit(struct file *filp, cdmaRequest_t *req, int kick);
+static int ring_setup(struct file *filp, cdmaRingSetup_t *setup);
+static int ring_enter(struct file *filp, u32 wait);
+static void ring_free(xpdma_file_t *file);
+static int async_eventfd(xpdma_file_t *file, int fd);
+static int sched_acquire(xpdma_dev_t *dev, xpdma_file_t *file, size_t count);
+static void sched_release(xpdma_dev_t *dev);
+static void sg_invalidate(xpdma_dev_t *dev);
+static inline void sg_setControl(xpdma_dev_t *dev, u32 control);
+static inline void sg_setChainWindow(xpdma_dev_t *dev);
+static int sched_stats(xpdma_dev_t *dev, cdmaSchedStats_t *user);
+static int stream_start(struct file *filp, cdmaStreamSetup_t *setup);
+static int stream_stop(struct file *filp);
+static int stream_mmap(struct file *filp, struct vm_area_struct *vma);
+static int regs_mmap(struct file *filp, struct vm_area_struct *vma);
+static int regs_batch(struct file *filp, cdmaRegBatch_t *batch);
+static ssize_t guard_read(struct file *filp, char *buf, size_t count, loff_t *f_pos);
+static ssize_t guard_write(struct file *filp, const char *buf, size_t count, loff_t *f_pos);
+static long guard_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static int guard_mmap(struct file *filp, struct vm_area_struct *vma);
+static __poll_t guard_poll(struct file *filp, poll_table *wait);
 
 // Aliasing write, read, ioctl, etc...
 struct file_operations xpdma_intf = {
-        read           : xpdma_read,
-        write          : xpdma_write,
-        unlocked_ioctl : xpdma_ioctl,
+        read           : guard_read,
+        write          : guard_write,
+        unlocked_ioctl : guard_ioctl,
         //llseek         : xpdma_lseek,
         open           : xpdma_open,
         release        : xpdma_release,
+        mmap           : guard_mmap,
+        poll           : guard_poll,
 };
 
 ssize_t xpdma_write (struct file *filp, const char *buf, size_t count, loff_t *f_pos)
 {
+    xpdma_dev_t *dev = ((xpdma_file_t *)filp->private_data)->dev;
 //    dma_addr_t dma_addr;
 
     /*if ( (count % 4) != 0 )  {
@@ -123,62 +452,140 @@ ssize_t xpdma_write (struct file *filp, const char *buf, size_t count, loff_t *f
         return (CRIT_ERR);
     }*/
 
+    // Staging buffer belongs to the transfer owning CDMA
+    if (sched_acquire(dev, filp->private_data, min(count, (size_t)BUF_SIZE)))
+        return (-ERESTARTSYS);
+
     // Now it is safe to copy the data from user space.
-    if ( copy_from_user(gWriteBuffer, buf, count) )  {
-        printk("%s: xpdma_writeMem: Failed copy from user.\n", DEVICE_NAME);
+    if ( copy_from_user(dev->stage->writeBuffer[0][0], buf, min(count, (size_t)BUF_SIZE)) )  {
+        sched_release(dev);
+        pr_debug("%s: xpdma_writeMem: Failed copy from user.\n", DEVICE_NAME);
         return (CRIT_ERR);
     }
 
-    //TODO: set DMA semaphore
-
-    printk("%s: xpdma_writeMem: WriteBuf Virt Addr = %lX Phy Addr = %lX.\n",
-           DEVICE_NAME, (size_t)gWriteBuffer, (size_t)gWriteHWAddr);
+    pr_debug("%s: xpdma_writeMem: WriteBuf Virt Addr = %lX Phy Addr = %lX.\n",
+             DEVICE_NAME, (size_t)dev->stage->writeBuffer[0][0], (size_t)dev->stage->writeHWAddr[0][0]);
 
-    //TODO: release DMA semaphore
+    sched_release(dev);
 
-    printk(KERN_INFO"%s: XPCIe_Write: %lu bytes have been written...\n", DEVICE_NAME, count);
+    pr_debug("%s: XPCIe_Write: %lu bytes have been written...\n", DEVICE_NAME, count);
 
     return (SUCCESS);
 }
 
+// Read completion records of asynchronous requests (0 - nothing in flight)
 ssize_t xpdma_read (struct file *filp, char *buf, size_t count, loff_t *f_pos)
 {
-    //TODO: set DMA semaphore
+    xpdma_file_t *file = filp->private_data;
+    xpdma_dev_t *dev = file->dev;
+    cdmaCompletion_t done;
+    unsigned long flags;
+    size_t n = 0;
 
-    printk("%s: xpdma_readMem: ReadBuf Virt Addr = %lX Phy Addr = %lX.\n",
-           DEVICE_NAME, (size_t)gReadBuffer, (size_t)gReadHWAddr);
+    // completions of a file with shared rings go to its completion ring
+    if (count < sizeof(cdmaCompletion_t) || file->ring)
+        return (CRIT_ERR);
 
-    //TODO: release DMA semaphore
+    if (file->doneHead == file->doneTail) {
+        if (!file->inflight)
+            return (0);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(file->wait, file->doneHead != file->doneTail))
+            return -ERESTARTSYS;
+    }
 
-    // copy the data to user space.
-    if ( copy_to_user(buf, gReadBuffer, count) )  {
-        printk("%s: xpdma_readMem: Failed copy to user.\n", DEVICE_NAME);
-        return (CRIT_ERR);
+    while (n + sizeof(cdmaCompletion_t) <= count) {
+        spin_lock_irqsave(&dev->asyncLock, flags);
+        if (file->doneHead == file->doneTail) {
+            spin_unlock_irqrestore(&dev->asyncLock, flags);
+            break;
+        }
+        done = file->done[file->doneTail % ASYNC_MAX];
+        file->doneTail++;
+        spin_unlock_irqrestore(&dev->asyncLock, flags);
+
+        if ( copy_to_user(buf + n, &done, sizeof(done)) )
+            return (CRIT_ERR);
+        n += sizeof(done);
     }
 
-    printk(KERN_INFO"%s: XPCIe_Read: %lu bytes have been read...\n", DEVICE_NAME, count);
-    return (SUCCESS);
+    return (n);
 }
 
+__poll_t xpdma_poll(struct file *filp, poll_table *wait)
+{
+    xpdma_file_t *file = filp->private_data;
+    xpdma_dev_t *dev = file->dev;
+    __poll_t mask = 0;
+    unsigned long flags;
+
+    poll_wait(filp, &file->wait, wait);
+
+    if (file->ring ? (file->ring->cqTail != READ_ONCE(file->ring->cqHead)) : (file->doneHead != file->doneTail))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (dev->asyncRunning + dev->asyncReady < dev->asyncDepth && async_fileRoom(file))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    // IOCTL_STREAM_STOP of another thread frees the stream
+    spin_lock_irqsave(&dev->streamLock, flags);
+    if (dev->streamFile == file) {
+        if (READ_ONCE(dev->streamCtl->head) != READ_ONCE(dev->streamCtl->tail))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        if (STREAM_ERROR == dev->streamCtl->status)
+            mask |= EPOLLERR;
+    }
+    spin_unlock_irqrestore(&dev->streamLock, flags);
+
+    return (mask);
+}
 long xpdma_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 {
     u32 regx = 0;
+    long ret = SUCCESS;
+    xpdma_file_t *file = filp->private_data;
+    xpdma_dev_t *dev = file->dev;
+    cdmaPoolBuffer_t pool;
+    cdmaBufferRef_t ref;
+    cdmaRequest_t request;
+    cdmaRingSetup_t ring;
+    cdmaSched_t sched;
+    cdmaCopy_t copy;
+    cdmaVecBuffer_t vecBuffer;
+    cdmaStreamSetup_t stream;
+    cdmaFile_t fileReq;
+    cdmaRegBatch_t regBatch;
+    cdmaRegMap_t regMap;
+    cdmaReg_t reg;
+    cdmaBuffer_t buffer;
+    cdmaVec_t *vec = NULL;
+    size_t count = 0;
+    u32 c = 0;
 
 //    printk(KERN_INFO"%s: Ioctl command: %d \n", DEVICE_NAME, cmd);
     switch (cmd) {
         case IOCTL_RESET:
-            xpdma_reset();
+            if (sched_acquire(dev, file, 0))
+                return (-ERESTARTSYS);
+            xpdma_reset(dev);
+            sched_release(dev);
             break;
         case IOCTL_RDCDMAREG: // Read CDMA config registers
-            printk(KERN_INFO"%s: Read Register 0x%X\n", DEVICE_NAME, (*(u32 *)arg));
-            regx = xpdma_readReg(*((u32 *)arg));
-            *((u32 *)arg) = regx;
-            printk(KERN_INFO"%s: Readed value 0x%X\n", DEVICE_NAME, regx);
+            if (get_user(reg.reg, (u32 __user *)arg) || !cdma_regValid(reg.reg))
+                return (CRIT_ERR);
+            regx = xpdma_readReg(dev, reg.reg);
+            if (put_user(regx, (u32 __user *)arg))
+                return (CRIT_ERR);
             break;
         case IOCTL_WRCDMAREG: // Write CDMA config registers
-            printk(KERN_INFO"%s: Write Register 0x%X\n", DEVICE_NAME, (*(cdmaReg_t *)arg).reg);
-            printk(KERN_INFO"%s: Write Value 0x%X\n", DEVICE_NAME, (*(cdmaReg_t *)arg).value);
-            xpdma_writeReg((*(cdmaReg_t *)arg).reg, (*(cdmaReg_t *)arg).value);
+            if (get_user(reg.reg, &((cdmaReg_t __user *)arg)->reg) ||
+                    get_user(reg.value, &((cdmaReg_t __user *)arg)->value) || !cdma_regValid(reg.reg))
+                return (CRIT_ERR);
+            // not under a running transfer, the cached chains go with the write
+            if (sched_acquire(dev, file, 0))
+                return (-ERESTARTSYS);
+            xpdma_writeReg(dev, reg.reg, reg.value);
+            sg_invalidate(dev);
+            sched_release(dev);
             break;
         case IOCTL_RDCFGREG:
             // TODO: Read PCIe config registers
@@ -190,512 +597,3636 @@ long xpdma_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
             // Send data from Host system to AXI CDMA
 //            printk(KERN_INFO"%s: Send Data size 0x%X\n", DEVICE_NAME, (*(cdmaBuffer_t *)arg).count);
 //            printk(KERN_INFO"%s: Send Data address 0x%X\n", DEVICE_NAME, (*(cdmaBuffer_t *)arg).addr);
-            xpdma_send ((*(cdmaBuffer_t *)arg).data, (*(cdmaBuffer_t *)arg).count, (*(cdmaBuffer_t *)arg).addr);
+            // one copy: the charged size is the transferred one
+            if ( copy_from_user(&buffer, (void *)arg, sizeof(buffer)) )
+                return (CRIT_ERR);
+            if (sched_acquire(dev, file, buffer.count))
+                return (-ERESTARTSYS);
+            ret = xpdma_send (dev, buffer.data, buffer.count, buffer.addr);
+            sched_release(dev);
 //            printk(KERN_INFO"%s: Sended\n", DEVICE_NAME);
             break;
         case IOCTL_RECV:
             // Receive data from AXI CDMA to Host system
 //            printk(KERN_INFO"%s: Receive Data size 0x%X\n", DEVICE_NAME, (*(cdmaBuffer_t *)arg).count);
 //            printk(KERN_INFO"%s: Receive Data address 0x%X\n", DEVICE_NAME, (*(cdmaBuffer_t *)arg).addr);
-            xpdma_recv ((*(cdmaBuffer_t *)arg).data, (*(cdmaBuffer_t *)arg).count, (*(cdmaBuffer_t *)arg).addr);
+            if ( copy_from_user(&buffer, (void *)arg, sizeof(buffer)) )
+                return (CRIT_ERR);
+            if (sched_acquire(dev, file, buffer.count))
+                return (-ERESTARTSYS);
+            ret = xpdma_recv (dev, buffer.data, buffer.count, buffer.addr);
+            sched_release(dev);
 //            printk(KERN_INFO"%s: Received\n", DEVICE_NAME);
             break;
         case IOCTL_INFO:
-            xpdma_showInfo ();
+            xpdma_showInfo (dev);
+            break;
+        case IOCTL_WAITMODE:
+            // Select completion wait mode for this file
+            if (arg > WAIT_MODE_IRQ)
+                return (CRIT_ERR);
+            file->waitMode = arg;
+            break;
+        case IOCTL_STATS:
+            // Read and clear copy/DMA pipeline statistics
+            if ( copy_to_user((void *)arg, &dev->stats, sizeof(dev->stats)) )
+                return (CRIT_ERR);
+            memset(&dev->stats, 0, sizeof(dev->stats));
+            break;
+        case IOCTL_BUF_ALLOC:
+            // Allocate pool buffer to the file, mmap it at the returned offset
+            if (pool_alloc(filp, &pool))
+                return (CRIT_ERR);
+            if ( copy_to_user((void *)arg, &pool, sizeof(pool)) ) {
+                pool_free(filp, pool.index);
+                return (CRIT_ERR);
+            }
+            break;
+        case IOCTL_BUF_FREE:
+            ret = pool_free(filp, arg);
+            break;
+        case IOCTL_SUBMIT:
+            // Queue asynchronous transfer from/to a pool buffer, does not wait
+            if ( copy_from_user(&request, (void *)arg, sizeof(request)) )
+                return (CRIT_ERR);
+            ret = async_submit(filp, &request, 1);
+            break;
+        case IOCTL_EVENTFD:
+            ret = async_eventfd(file, (int)arg);
+            break;
+        case IOCTL_RING_SETUP:
+            if ( copy_from_user(&ring, (void *)arg, sizeof(ring)) )
+                return (CRIT_ERR);
+            if (ring_setup(filp, &ring))
+                return (CRIT_ERR);
+            if ( copy_to_user((void *)arg, &ring, sizeof(ring)) )
+                return (CRIT_ERR);
+            break;
+        case IOCTL_RING_ENTER:
+            ret = ring_enter(filp, arg);
+            break;
+        case IOCTL_SEND_BUF:
+        case IOCTL_RECV_BUF:
+            // Transfer from/to a pool buffer, data is already in DMA memory
+            if ( copy_from_user(&ref, (void *)arg, sizeof(ref)) )
+                return (CRIT_ERR);
+            if (sched_acquire(dev, file, ref.count))
+                return (-ERESTARTSYS);
+            ret = pool_block(filp, (IOCTL_SEND_BUF == cmd) ? DMA_TO_DEVICE : DMA_FROM_DEVICE, &ref);
+            sched_release(dev);
+            break;
+        case IOCTL_SENDV:
+        case IOCTL_RECVV:
+            // Many records from/to scattered DDR3 regions, one chain per staging buffer full
+            if ( copy_from_user(&vecBuffer, (void *)arg, sizeof(vecBuffer)) )
+                return (CRIT_ERR);
+            if (!vecBuffer.count || vecBuffer.count > VEC_MAX)
+                return (CRIT_ERR);
+            vec = kmalloc(vecBuffer.count * sizeof(cdmaVec_t), GFP_KERNEL);
+            if (NULL == vec)
+                return (CRIT_ERR);
+            if ( copy_from_user(vec, vecBuffer.vec, vecBuffer.count * sizeof(cdmaVec_t)) ) {
+                kfree(vec);
+                return (CRIT_ERR);
+            }
+            for (c = 0, count = 0; c < vecBuffer.count; ++c)
+                count += vec[c].count;
+            if (sched_acquire(dev, file, count)) {
+                kfree(vec);
+                return (-ERESTARTSYS);
+            }
+            ret = vec_block(dev, (IOCTL_SENDV == cmd) ? DMA_TO_DEVICE : DMA_FROM_DEVICE, vec, vecBuffer.count);
+            sched_release(dev);
+            // per element status goes back even when some elements failed
+            if ( copy_to_user(vecBuffer.vec, vec, vecBuffer.count * sizeof(cdmaVec_t)) )
+                ret = CRIT_ERR;
+            kfree(vec);
+            break;
+        case IOCTL_COPY:
+            // Copy between DDR3 regions on the card
+            if ( copy_from_user(&copy, (void *)arg, sizeof(copy)) )
+                return (CRIT_ERR);
+            if (sched_acquire(dev, file, copy.count))
+                return (-ERESTARTSYS);
+            ret = copy_block(dev, &copy);
+            sched_release(dev);
+            break;
+        case IOCTL_SCHED:
+            // Select scheduling class and weight of synchronous transfers of the file
+            if ( copy_from_user(&sched, (void *)arg, sizeof(sched)) )
+                return (CRIT_ERR);
+            if (sched.priority > SCHED_AUTO || sched.weight < 1 || sched.weight > SCHED_MAX_WEIGHT)
+                return (CRIT_ERR);
+            file->priority = sched.priority;
+            file->weight = sched.weight;
+            break;
+        case IOCTL_SCHED_STATS:
+            // Read and clear scheduler metrics, current queue depth stays
+            if ( sched_stats(dev, (cdmaSchedStats_t *)arg) )
+                return (CRIT_ERR);
+            break;
+        case IOCTL_NODE:
+            if ( put_user(dev->node, (int *)arg) )
+                return (CRIT_ERR);
+            break;
+        case IOCTL_STREAM_START:
+            if ( copy_from_user(&stream, (void *)arg, sizeof(stream)) )
+                return (CRIT_ERR);
+            ret = stream_start(filp, &stream);
+            if (SUCCESS == ret && copy_to_user((void *)arg, &stream, sizeof(stream))) {
+                stream_stop(filp);
+                return (CRIT_ERR);
+            }
+            break;
+        case IOCTL_STREAM_STOP:
+            ret = stream_stop(filp);
+            break;
+        case IOCTL_REG_BATCH:
+            if ( copy_from_user(&regBatch, (void *)arg, sizeof(regBatch)) )
+                return (CRIT_ERR);
+            ret = regs_batch(filp, &regBatch);
+            break;
+        case IOCTL_REG_MAP:
+            regMap.offset = REGS_MMAP_OFFSET;
+            regMap.size = dev->baseLen;
+            regMap.writable = regs_writable;
+            if ( copy_to_user((void *)arg, &regMap, sizeof(regMap)) )
+                return (CRIT_ERR);
+            break;
+        case IOCTL_FILE_SEND:
+        case IOCTL_FILE_RECV:
+            // File range from/to DDR3, file data goes between the page cache and the staging buffers
+            if ( copy_from_user(&fileReq, (void *)arg, sizeof(fileReq)) )
+                return (CRIT_ERR);
+            if (sched_acquire(dev, file, fileReq.count))
+                return (-ERESTARTSYS);
+            ret = file_block(dev, (IOCTL_FILE_SEND == cmd) ? DMA_TO_DEVICE : DMA_FROM_DEVICE, &fileReq);
+            sched_release(dev);
+            break;
         default:
             break;
     }
 
-    return (SUCCESS);
+    return (ret);
 }
 
-void xpdma_showInfo (void)
+void xpdma_showInfo (xpdma_dev_t *dev)
 {
     uint32_t c = 0;
+    uint32_t set = 0;
+    stage_set_t *stage = NULL;
 
-    printk(KERN_INFO"%s: INFORMATION\n", DEVICE_NAME);
+    printk(KERN_INFO"%s: INFORMATION (card %d, %s, node %d)\n", DEVICE_NAME, dev->index, pci_name(dev->pdev), dev->node);
     printk(KERN_INFO"%s: HOST REGIONS:\n", DEVICE_NAME);
-    printk(KERN_INFO"%s: gBaseVirt: 0x%lX\n", DEVICE_NAME, (size_t) gBaseVirt);
-    printk(KERN_INFO"%s: gReadBuffer address: 0x%lX\n", DEVICE_NAME, (size_t) gReadBuffer);
-    printk(KERN_INFO"%s: gReadBuffer: %s\n", DEVICE_NAME, gReadBuffer);
-    printk(KERN_INFO"%s: gWriteBuffer address: 0x%lX\n", DEVICE_NAME, (size_t) gWriteBuffer);
-    printk(KERN_INFO"%s: gWriteBuffer: %s\n", DEVICE_NAME, gWriteBuffer);
-    printk(KERN_INFO"%s: gDescChain:          0x%lX\n", DEVICE_NAME, (size_t) gDescChain);
-    printk(KERN_INFO"%s: gDescChainLength:   0x%lX\n", DEVICE_NAME, (size_t) gDescChainLength);
+    printk(KERN_INFO"%s: baseVirt: 0x%lX\n", DEVICE_NAME, (size_t) dev->baseVirt);
+    for (set = 0; set < dev->stageSets; ++set) {
+        stage = dev->stageSet[set];
+        for (c = 0; c < dev->stageCount[STAGE_RECV]; ++c)
+            printk(KERN_INFO"%s: node %d readBuffer[%u] address: 0x%lX, contiguous 0x%lX\n", DEVICE_NAME, stage->node,
+                   c, (size_t) stage->readBuffer[c][0], stage->readContig[c]);
+        for (c = 0; c < dev->stageCount[STAGE_SEND]; ++c)
+            printk(KERN_INFO"%s: node %d writeBuffer[%u] address: 0x%lX, contiguous 0x%lX\n", DEVICE_NAME, stage->node,
+                   c, (size_t) stage->writeBuffer[c][0], stage->writeContig[c]);
+    }
+    for (c = 0; c < ASYNC_SLOT(dev->asyncDepth); ++c)
+        printk(KERN_INFO"%s: descChainLength[%u]: 0x%lX\n", DEVICE_NAME, c, (size_t) dev->descChainLength[c]);
+    printk(KERN_INFO"%s: descChain:          0x%lX (0x%X bytes)\n", DEVICE_NAME, (size_t) dev->descChain, DESC_CHAIN_SIZE);
+    printk(KERN_INFO"%s: send %u x %lu bytes, recv %u x %lu bytes, descriptor %u bytes, %u vectors per stage\n",
+           DEVICE_NAME, dev->stageCount[STAGE_SEND], dev->chunkBytes[STAGE_SEND],
+           dev->stageCount[STAGE_RECV], dev->chunkBytes[STAGE_RECV], desc_size, dev->stageVectors);
+    for (c = 0; c < pool_count; ++c)
+        printk(KERN_INFO"%s: poolBuffer[%u] address: 0x%lX, owner 0x%lX, maps %d\n", DEVICE_NAME, c,
+               (size_t) dev->poolBuffer[c], (size_t) dev->poolOwner[c], atomic_read(&dev->poolMaps[c]));
+
+    printk(KERN_INFO"%s: PIPELINE:\n", DEVICE_NAME);
+    printk(KERN_INFO"%s: bytes %llu (zero-copy %llu), chunks %llu\n", DEVICE_NAME,
+           dev->stats.bytes, dev->stats.zeroCopyBytes, dev->stats.chunks);
+    printk(KERN_INFO"%s: wall %llu ns, copy %llu ns, dma %llu ns, overlap %llu ns\n", DEVICE_NAME,
+           dev->stats.wallNs, dev->stats.copyNs, dev->stats.dmaNs, dev->stats.overlapNs);
+    printk(KERN_INFO"%s: dma waits %llu, copy stalls %llu, pin %llu ns\n", DEVICE_NAME,
+           dev->stats.dmaWaits, dev->stats.copyStalls, dev->stats.pinNs);
+    printk(KERN_INFO"%s: transfers %llu, sleep %llu ns, wait mode %d, irq %s\n", DEVICE_NAME,
+           dev->stats.transfers, dev->stats.sleepNs, wait_mode, (dev->statFlags & HAVE_IRQ) ? "on" : "off");
+    printk(KERN_INFO"%s: asynchronous ring %u: tail %u, running %u, ready %u\n", DEVICE_NAME,
+           dev->asyncDepth, dev->asyncTail, dev->asyncRunning, dev->asyncReady);
 
     printk(KERN_INFO"%s: REGISTERS:\n", DEVICE_NAME);
 
     printk(KERN_INFO"%s: BRAM:\n", DEVICE_NAME);
     for (c = 0; c <= 8*4; c += 4)
-        printk(KERN_INFO"%s: 0x%08X: 0x%08X\n", DEVICE_NAME, BRAM_OFFSET + c, xpdma_readReg(BRAM_OFFSET + c));
+        printk(KERN_INFO"%s: 0x%08X: 0x%08X\n", DEVICE_NAME, BRAM_OFFSET + c, xpdma_readReg(dev, BRAM_OFFSET + c));
 
     printk(KERN_INFO"%s: PCIe CTL:\n", DEVICE_NAME);
-    printk(KERN_INFO"%s: 0x%08X: 0x%08X\n", DEVICE_NAME, PCIE_CTL_OFFSET, xpdma_readReg(PCIE_CTL_OFFSET));
+    printk(KERN_INFO"%s: 0x%08X: 0x%08X\n", DEVICE_NAME, PCIE_CTL_OFFSET, xpdma_readReg(dev, PCIE_CTL_OFFSET));
     for (c = 0x208; c <= 0x234 ; c += 4)
-        printk(KERN_INFO"%s: 0x%08X: 0x%08X\n", DEVICE_NAME, PCIE_CTL_OFFSET + c, xpdma_readReg(PCIE_CTL_OFFSET + c));
+        printk(KERN_INFO"%s: 0x%08X: 0x%08X\n", DEVICE_NAME, PCIE_CTL_OFFSET + c, xpdma_readReg(dev, PCIE_CTL_OFFSET + c));
 
     printk(KERN_INFO"%s: CDMA CTL:\n", DEVICE_NAME);
     for (c = 0; c <= 0x28; c += 4)
-        printk(KERN_INFO"%s: 0x%08X: 0x%08X\n", DEVICE_NAME, CDMA_OFFSET + c, xpdma_readReg(CDMA_OFFSET + c));
+        printk(KERN_INFO"%s: 0x%08X: 0x%08X\n", DEVICE_NAME, CDMA_OFFSET + c, xpdma_readReg(dev, CDMA_OFFSET + c));
 }
 
-ssize_t create_desc_chain(int direction, u32 size, u32 addr)
-{
-    // length of desctriptors chain
-    u32 count = 0;
-    u32 sgAddr = AXI_PCIE_SG_ADDR; // current descriptor address in chain
-    u32 bramAddr = AXI_BRAM_ADDR ; // Translation BRAM Address
-    u32 btt = 0;                   // current descriptor BTT
-    u32 unmappedSize = size;       // unmapped data size
-    u32 srcAddr = 0;               // source address (SG_DM of DDR3)
-    u32 destAddr = 0;              // destination address (SG_DM of DDR3)
-
-    gDescChainLength = (size + (u32)(TRANSFER_SIZE) - 1) / (u32)(TRANSFER_SIZE);
-//    printk(KERN_INFO"%s: gDescChainLength = %lu\n", DEVICE_NAME, gDescChainLength);
-
-    // TODO: future: add PCI_DMA_NONE as indicator of MEM 2 MEM transitions
-    if (direction == PCI_DMA_FROMDEVICE) {
-        srcAddr  = AXI_DDR3_ADDR + addr;
-        destAddr = AXI_PCIE_DM_ADDR;
-    } else if (direction == PCI_DMA_TODEVICE) {
-        srcAddr  = AXI_PCIE_DM_ADDR;
-        destAddr = AXI_DDR3_ADDR + addr;
-    } else {
-        printk(KERN_INFO"%s: Descriptors Chain create error: unknown direction\n", DEVICE_NAME);
-        return (CRIT_ERR);
-    }
-
-    // fill descriptor chain
-//    printk(KERN_INFO"%s: fill descriptor chain\n", DEVICE_NAME);
-    for (count = 0; count < gDescChainLength; ++count) {
-        sg_desc_t *addrDesc = gDescChain + 2 * count; // address translation descriptor
-        sg_desc_t *dataDesc = addrDesc + 1;                // target data transfer descriptor
-        btt = (unmappedSize > TRANSFER_SIZE) ? TRANSFER_SIZE : unmappedSize;
-
-        // fill address translation descriptor
-//        printk(KERN_INFO"%s: fill address translation descriptor\n", DEVICE_NAME);
-        addrDesc->nextDesc  = sgAddr + DESCRIPTOR_SIZE;
-        addrDesc->srcAddr   = bramAddr;
-        addrDesc->destAddr  = AXI_BRAM_ADDR + PCIE_CTL_OFFSET + AXIBAR2PCIEBAR_1U;
-        addrDesc->control   = ADDR_BTT;
-        addrDesc->status    = 0x00000000;
-        sgAddr += DESCRIPTOR_SIZE;
-
-        // fill target data transfer descriptor
-//        printk(KERN_INFO"%s: fill address data transfer descriptor\n", DEVICE_NAME);
-        dataDesc->nextDesc  = sgAddr + DESCRIPTOR_SIZE;
-        dataDesc->srcAddr   = srcAddr;
-        dataDesc->destAddr  = destAddr;
-        dataDesc->control   = btt;
-        dataDesc->status    = 0x00000000;
-        sgAddr += DESCRIPTOR_SIZE;
+static const char *phase_names[PHASE_COUNT] = {
+    "copy", "pin", "chain", "mmio", "start", "dma", "transfer",
+};
 
-//        printk(KERN_INFO"%s: update counters\n", DEVICE_NAME);
-        bramAddr += BRAM_STEP;
-        unmappedSize -= btt;
-        srcAddr += btt;
-        destAddr += btt;
-    }
+// Account a phase duration on the current CPU
+static inline void phase_account(xpdma_dev_t *dev, int phase, s64 ns)
+{
+    int bucket = 0;
 
-    gDescChain[2 * gDescChainLength - 1].nextDesc = AXI_PCIE_SG_ADDR; // tail descriptor pointed to chain head
+    if (NULL == dev->phase)
+        return;
+    if (ns < 0)
+        ns = 0;
 
-    return (SUCCESS);
+    bucket = min(fls64(ns), HIST_BUCKETS - 1);
+    this_cpu_inc(dev->phase->count[phase]);
+    this_cpu_add(dev->phase->sumNs[phase], ns);
+    this_cpu_inc(dev->phase->hist[phase][bucket]);
 }
 
-void show_descriptors(void)
+static inline void phase_since(xpdma_dev_t *dev, int phase, ktime_t start)
 {
-    int c = 0;
-    sg_desc_t *descriptor = gDescChain;
+    phase_account(dev, phase, ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
 
-    printk(KERN_INFO
-    "%s: Translation vectors:\n", DEVICE_NAME);
-    printk(KERN_INFO
-    "%s: Operation_1 Upper: %08X\n", DEVICE_NAME, xpdma_readReg(0));
-    printk(KERN_INFO
-    "%s: Operation_1 Lower: %08X\n", DEVICE_NAME, xpdma_readReg(4));
-    printk(KERN_INFO
-    "%s: Operation_2 Upper: %08X\n", DEVICE_NAME, xpdma_readReg(8));
-    printk(KERN_INFO
-    "%s: Operation_2 Lower: %08X\n", DEVICE_NAME, xpdma_readReg(12));
+// Count a finished request: bytes on success, an error otherwise
+static inline void phase_done(xpdma_dev_t *dev, size_t bytes, int err)
+{
+    if (NULL == dev->phase)
+        return;
 
-    for (c = 0; c < 4; ++c) {
-        printk(KERN_INFO
-        "%s: Descriptor %d\n", DEVICE_NAME, c);
-        printk(KERN_INFO
-        "%s: nextDesc 0x%08X\n", DEVICE_NAME, descriptor->nextDesc);
-        printk(KERN_INFO
-        "%s: srcAddr 0x%08X\n", DEVICE_NAME, descriptor->srcAddr);
-        printk(KERN_INFO
-        "%s: destAddr 0x%08X\n", DEVICE_NAME, descriptor->destAddr);
-        printk(KERN_INFO
-        "%s: control 0x%08X\n", DEVICE_NAME, descriptor->control);
-        printk(KERN_INFO
-        "%s: status 0x%08X\n", DEVICE_NAME, descriptor->status);
-        descriptor++;        // target data transfer descriptor
-    }
+    this_cpu_inc(dev->phase->ops);
+    if (err)
+        this_cpu_inc(dev->phase->errors);
+    else
+        this_cpu_add(dev->phase->bytes, bytes);
 }
 
-int xpdma_open(struct inode *inode, struct file *filp)
+static inline void phase_timeout(xpdma_dev_t *dev)
 {
-    printk(KERN_INFO"%s: Open: module opened\n", DEVICE_NAME);
-    return (SUCCESS);
+    if (NULL != dev->phase)
+        this_cpu_inc(dev->phase->timeouts);
 }
 
-static int xpdma_reset(void)
+// debugfs stats: counters, then per phase "name count sumNs bucket0 .. bucketN"
+static int phase_show(struct seq_file *m, void *v)
 {
-    int loop = CDMA_RESET_LOOP;
-    u32 tmp;
-
-    printk(KERN_INFO"%s: RESET CDMA\n", DEVICE_NAME);
+    xpdma_dev_t *dev = m->private;
+    phase_stats_t *total = NULL;
+    u64 *src = NULL;
+    u64 *dst = NULL;
+    int cpu = 0;
+    int p = 0;
+    int b = 0;
+    size_t c = 0;
 
-    xpdma_writeReg((CDMA_OFFSET + CDMA_CONTROL_OFFSET),
-                   xpdma_readReg(CDMA_OFFSET + CDMA_CONTROL_OFFSET) | CDMA_CR_RESET_MASK);
+    total = kzalloc(sizeof(phase_stats_t), GFP_KERNEL);
+    if (NULL == total)
+        return (-ENOMEM);
 
-    tmp = xpdma_readReg(CDMA_OFFSET + CDMA_CONTROL_OFFSET) & CDMA_CR_RESET_MASK;
-
-    /* Wait for the hardware to finish reset */
-    while (loop && tmp) {
-        tmp = xpdma_readReg(CDMA_OFFSET + CDMA_CONTROL_OFFSET) & CDMA_CR_RESET_MASK;
-        loop--;
+    // every field is a u64 counter
+    dst = (u64 *)total;
+    for_each_possible_cpu(cpu) {
+        src = (u64 *)per_cpu_ptr(dev->phase, cpu);
+        for (c = 0; c < sizeof(phase_stats_t) / sizeof(u64); ++c)
+            dst[c] += src[c];
     }
 
-    if (!loop) {
-        printk(KERN_INFO"%s: reset timeout, CONTROL_REG: 0x%08X, STATUS_REG 0x%08X\n",
-                DEVICE_NAME,
-                xpdma_readReg(CDMA_OFFSET + CDMA_CONTROL_OFFSET),
-                xpdma_readReg(CDMA_OFFSET + CDMA_STATUS_OFFSET));
-        return (CRIT_ERR);
+    seq_printf(m, "bytes %llu\nops %llu\nerrors %llu\ntimeouts %llu\n",
+               total->bytes, total->ops, total->errors, total->timeouts);
+    for (p = 0; p < PHASE_COUNT; ++p) {
+        seq_printf(m, "%s %llu %llu", phase_names[p], total->count[p], total->sumNs[p]);
+        for (b = 0; b < HIST_BUCKETS; ++b)
+            seq_printf(m, " %llu", total->hist[p][b]);
+        seq_puts(m, "\n");
     }
 
-    // For Axi CDMA, always do sg transfers if sg mode is built in
-    xpdma_writeReg(CDMA_OFFSET + CDMA_CONTROL_OFFSET, tmp | CDMA_CR_SG_EN);
-
-    printk(KERN_INFO"%s: SUCCESSFULLY RESET CDMA!\n", DEVICE_NAME);
+    kfree(total);
+    return (0);
+}
 
-    return (SUCCESS);
+static int phase_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, phase_show, inode->i_private);
 }
 
-static int xpdma_isIdle(void)
+static int phase_resetOpen(struct inode *inode, struct file *file)
 {
-    return xpdma_readReg(CDMA_OFFSET + CDMA_STATUS_OFFSET) &
-           CDMA_CR_IDLE_MASK;
+    file->private_data = inode->i_private;
+    return (0);
 }
 
-static int sg_operation(int direction, size_t count, u32 addr)
+// Any write clears every CPU; increments racing with it may survive
+static ssize_t phase_reset(struct file *file, const char *buf, size_t count, loff_t *ppos)
 {
-    u32 status = 0;
-    size_t pntr = 0;
-    size_t delayTime = 0;
-    u32 countBuf = count;
-    size_t bramOffset = 0;
+    xpdma_dev_t *dev = file->private_data;
+    int cpu = 0;
 
-    if (!xpdma_isIdle()){
-        printk(KERN_INFO"%s: CDMA is not idle\n", DEVICE_NAME);
-        return (SUCCESS);
-    }
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(dev->phase, cpu), 0, sizeof(phase_stats_t));
 
-    // 1. Set DMA to Scatter Gather Mode
-//    printk(KERN_INFO"%s: 1. Set DMA to Scatter Gather Mode\n", DEVICE_NAME);
-    xpdma_writeReg (CDMA_OFFSET + CDMA_CONTROL_OFFSET, CDMA_CR_SG_EN);
+    return (count);
+}
 
-    // 2. Create Descriptors chain
-//    printk(KERN_INFO"%s: 2. Create Descriptors chain\n", DEVICE_NAME);
-    create_desc_chain(direction, count, addr);
+static const struct file_operations phase_fops = {
+        owner          : THIS_MODULE,
+        open           : phase_open,
+        read           : seq_read,
+        llseek         : seq_lseek,
+        release        : single_release,
+};
 
-    // 3. Update PCIe Translation vector
-    pntr =  (size_t) (gDescChainHWAddr);
-//    printk(KERN_INFO"%s: 3. Update PCIe Translation vector\n", DEVICE_NAME);
-//    printk(KERN_INFO"%s: gDescChain 0x%016lX\n", DEVICE_NAME, pntr);
-    xpdma_writeReg ((PCIE_CTL_OFFSET + AXIBAR2PCIEBAR_0L), (pntr >> 0)  & 0xFFFFFFFF); // Lower 32 bit
-    xpdma_writeReg ((PCIE_CTL_OFFSET + AXIBAR2PCIEBAR_0U), (pntr >> 32) & 0xFFFFFFFF); // Upper 32 bit
-
-    // 4. Write appropriate Translation Vectors
-//    printk(KERN_INFO"%s: 4. Write Translation Vectors to BRAM\n", DEVICE_NAME);
-    if (PCI_DMA_FROMDEVICE == direction) {
-        pntr = (size_t)(gReadHWAddr);
-    } else if (PCI_DMA_TODEVICE == direction) {
-        pntr = (size_t)(gWriteHWAddr);
-    } else {
-        printk(KERN_INFO"%s: Write Translation Vectors to BRAM error: unknown direction\n", DEVICE_NAME);
-        return (CRIT_ERR);
-    }
+static const struct file_operations phase_resetFops = {
+        owner          : THIS_MODULE,
+        open           : phase_resetOpen,
+        write          : phase_reset,
+};
 
-    countBuf = gDescChainLength;
-    while (countBuf) {
-//        printk(KERN_INFO"%s: pntr 0x%016lX\n", DEVICE_NAME, pntr);
-//        printk(KERN_INFO"%s: bramOffset 0x%016lX\n", DEVICE_NAME, bramOffset);
-//        printk(KERN_INFO"%s: countBuf 0x%08X\n", DEVICE_NAME, countBuf);
-        xpdma_writeReg ((BRAM_OFFSET + bramOffset + 4), (pntr >> 0 ) & 0xFFFFFFFF); // Lower 32 bit
-        xpdma_writeReg ((BRAM_OFFSET + bramOffset + 0), (pntr >> 32) & 0xFFFFFFFF); // Upper 32 bit
+// Phase histograms and their debugfs files; statistics are optional, a failure only disables them
+static void phase_setup(xpdma_dev_t *dev)
+{
+    char name[16];
 
-        pntr += TRANSFER_SIZE;
-        bramOffset += BRAM_STEP;
-        countBuf--;
+    dev->phase = alloc_percpu(phase_stats_t);
+    if (NULL == dev->phase) {
+        printk(KERN_WARNING"%s: Init: no phase statistics\n", DEVICE_NAME);
+        return;
     }
 
-    // 5. Write a valid pointer to DMA CURDESC_PNTR
-//    printk(KERN_INFO"%s: 5. Write a valid pointer to DMA CURDESC_PNTR\n", DEVICE_NAME);
-    xpdma_writeReg ((CDMA_OFFSET + CDMA_CDESC_OFFSET), (AXI_PCIE_SG_ADDR));
-
-    // 6. Write a valid pointer to DMA TAILDESC_PNTR
-//    printk(KERN_INFO"%s: 6. Write a valid pointer to DMA TAILDESC_PNTR\n", DEVICE_NAME);
-    xpdma_writeReg ((CDMA_OFFSET + CDMA_TDESC_OFFSET), (AXI_PCIE_SG_ADDR) + ((2 * gDescChainLength - 1) * (DESCRIPTOR_SIZE)));
-
-    // wait for Scatter Gather operation...
-//    printk(KERN_INFO"%s: Scatter Gather must be started!\n", DEVICE_NAME);
-
-    delayTime = SG_TRANSFER_LOOP;
-    while (delayTime) {
-        delayTime--;
-        udelay(10);// TODO: can it be less?
-
-        status = (gDescChain + 2 * gDescChainLength - 1)->status;
-
-//        printk(KERN_INFO
-//        "%s: Scatter Gather Operation: loop counter %08X\n", DEVICE_NAME, SG_TRANSFER_LOOP - delayTime);
+    if (NULL == gDebugfs)
+        return;
 
-//        printk(KERN_INFO
-//        "%s: Scatter Gather Operation: status 0x%08X\n", DEVICE_NAME, status);
-
-        if (status & SG_DEC_ERR_MASK) {
-            printk(KERN_INFO
-            "%s: Scatter Gather Operation: Decode Error\n", DEVICE_NAME);
-            show_descriptors();
-            return (CRIT_ERR);
-        }
+    snprintf(name, sizeof(name), DEVICE_NAME"%d", dev->index);
+    dev->debugfs = debugfs_create_dir(name, gDebugfs);
+    if (IS_ERR_OR_NULL(dev->debugfs)) {
+        dev->debugfs = NULL;
+        return;
+    }
+    debugfs_create_file("stats", 0444, dev->debugfs, dev, &phase_fops);
+    debugfs_create_file("reset", 0200, dev->debugfs, dev, &phase_resetFops);
+}
 
-        if (status & SG_SLAVE_ERR_MASK) {
-            printk(KERN_INFO
-            "%s: Scatter Gather Operation: Slave Error\n", DEVICE_NAME);
-            show_descriptors();
-            return (CRIT_ERR);
-        }
+static void phase_free(xpdma_dev_t *dev)
+{
+    debugfs_remove_recursive(dev->debugfs);
+    dev->debugfs = NULL;
+    free_percpu(dev->phase);
+    dev->phase = NULL;
+}
 
-        if (status & SG_INT_ERR_MASK) {
-            printk(KERN_INFO
-            "%s: Scatter Gather Operation: Internal Error\n", DEVICE_NAME);
-            show_descriptors();
-            return (CRIT_ERR);
-        }
+// First descriptor pair and translation vector of the slot; each slot owns
+// its own range, so the next chain can be prepared while another one runs
+static inline u32 slot_first(xpdma_dev_t *dev, int slot)
+{
+    if (FAST_SLOT == slot)
+        return BRAM_VECTORS - 1;
+    if (slot < STAGE_MAX)
+        return min(slot, (int)dev->stageSlots) * dev->stageVectors;
+    if (slot < POOL_SLOT)
+        return dev->stageSlots * dev->stageVectors + (slot - STAGE_MAX) * ZC_VECTORS;
+    return dev->stageSlots * dev->stageVectors + ZC_COUNT * ZC_VECTORS + (slot - POOL_SLOT) * dev->poolVectors;
+}
 
-        if (status & SG_COMPLETE_MASK) {
-//            printk(KERN_INFO
-//            "%s: Scatter Gather Operation: Completed successfully\n", DEVICE_NAME);
-            return (SUCCESS);
-        }
-    }
-//    printk(KERN_INFO
-//    "%s: gReadBuffer: %s\n", DEVICE_NAME, gReadBuffer);
-//    printk(KERN_INFO
-//    "%s: gWriteBuffer: %s\n", DEVICE_NAME, gWriteBuffer);
+static inline sg_desc_t *slot_chain(xpdma_dev_t *dev, int slot)
+{
+    return dev->descChain + 2 * slot_first(dev, slot);
+}
 
-    printk(KERN_INFO"%s: Scatter Gather Operation error: Timeout Error\n", DEVICE_NAME);
-    show_descriptors();
-    return (CRIT_ERR);
+static inline u32 slot_chainAddr(xpdma_dev_t *dev, int slot)
+{
+    return dev->descChainAddr + 2 * slot_first(dev, slot) * DESCRIPTOR_SIZE;
 }
 
-static int sg_block(int direction, void *data, size_t count, u32 addr)
+static inline u32 slot_bramOffset(xpdma_dev_t *dev, int slot)
 {
-    size_t unsended = count;
-    char *curData = data;
-    u32 curAddr = addr;
-    u32 btt = BUF_SIZE;
+    return slot_first(dev, slot) * BRAM_STEP;
+}
 
-    // divide block
-    while (unsended) {
-        btt = (unsended < BUF_SIZE) ? unsended : BUF_SIZE;
-//        printk(KERN_INFO"%s: SG Block: BTT=%u\tunsended=%lu \n", DEVICE_NAME, btt, unsended);
+// Translation vectors (descriptor pairs) owned by the slot
+static inline u32 slot_vectors(xpdma_dev_t *dev, int slot)
+{
+    if (FAST_SLOT == slot)
+        return 1;
+    if (slot < STAGE_MAX)
+        return (slot < dev->stageSlots) ? dev->stageVectors : 0;
+    if (slot < POOL_SLOT)
+        return ZC_VECTORS;
+    return dev->poolVectors;
+}
 
-        // TODO: remove this multiple checks
-        if (PCI_DMA_TODEVICE == direction)
-            if ( copy_from_user(gWriteBuffer, curData, btt) )  {
-                printk("%s: sg_block: Failed copy from user.\n", DEVICE_NAME);
-                return (CRIT_ERR);
-            }
+// Append host memory to the segment list, merging with the previous segment
+// when contiguous and splitting at desc_size and AXI:BAR1 aperture borders
+static int sg_addSegment(sg_seg_t *segs, u32 *nsegs, u32 maxSegs, dma_addr_t hwAddr, u32 length)
+{
+    sg_seg_t *last = (*nsegs) ? &segs[*nsegs - 1] : NULL;
+    u32 room = 0;
+    u32 btt = 0;
 
-        sg_operation(direction, btt, curAddr);
+    while (length) {
+        room = AXI_PCIE_DM_SIZE - (hwAddr & (AXI_PCIE_DM_SIZE - 1));
 
-        // TODO: remove this multiple checks
-        if (PCI_DMA_FROMDEVICE == direction)
-            if ( copy_to_user(curData, gReadBuffer, btt) )  {
-                printk("%s: sg_block: Failed copy to user.\n", DEVICE_NAME);
+        if (last && (last->hwAddr + last->length == hwAddr) &&
+                (hwAddr & (AXI_PCIE_DM_SIZE - 1)) && (last->length < desc_size)) {
+            btt = min3(length, room, (u32)(desc_size - last->length));
+            last->length += btt;
+        } else {
+            if (*nsegs == maxSegs)
                 return (CRIT_ERR);
-            }
+            btt = min3(length, room, (u32)desc_size);
+            last = &segs[(*nsegs)++];
+            last->hwAddr = hwAddr;
+            last->length = btt;
+        }
 
-        curData += BUF_SIZE;
-        curAddr += BUF_SIZE;
-        unsended -= btt;
+        hwAddr += btt;
+        length -= btt;
     }
 
     return (SUCCESS);
 }
 
-ssize_t xpdma_send (void *data, size_t count, u32 addr)
+// Descriptors of a chain over nsegs segments: translation and data pairs, data only for MEM2MEM
+static inline u32 sg_descCount(int direction, u32 nsegs)
 {
-    sg_block(PCI_DMA_TODEVICE, (void *)data, count, addr);
-    return (SUCCESS);
+    return (DMA_NONE == direction) ? nsegs : 2 * nsegs;
 }
 
-ssize_t xpdma_recv (void *data, size_t count, u32 addr)
+// Build the static part of the slot chain: every pair is linked to the next one (the last
+// to the head), translation descriptors load their BRAM vector into AXIBAR2PCIEBAR_1
+static void slot_build(xpdma_dev_t *dev, int slot)
 {
-    sg_block(PCI_DMA_FROMDEVICE, (void *)data, count, addr);
-    return (SUCCESS);
-}
+    sg_desc_t *chain = slot_chain(dev, slot);
+    u32 sgAddr = slot_chainAddr(dev, slot);
+    u32 bramAddr = AXI_BRAM_ADDR + slot_bramOffset(dev, slot);
+    u32 pairs = slot_vectors(dev, slot);
+    u32 c = 0;
 
-int xpdma_release(struct inode *inode, struct file *filp)
-{
-    printk(KERN_INFO"%s: Release: module released\n", DEVICE_NAME);
-    return (SUCCESS);
-}
+    // staging slot of neither direction
+    if (!pairs)
+        return;
 
-// IO access (with byte addressing)
-static inline u32 xpdma_readReg (u32 reg)
-{
-//    printk(KERN_INFO"%s: xpdma_readReg: address:0x%08X\t\n", DEVICE_NAME, reg);
-    return readl(gBaseVirt + reg);
-}
+    for (c = 0; c < pairs; ++c) {
+        chain[2 * c].nextDesc     = sgAddr + (2 * c + 1) * DESCRIPTOR_SIZE;
+        chain[2 * c].srcAddr      = bramAddr + c * BRAM_STEP;
+        chain[2 * c].destAddr     = AXI_BRAM_ADDR + PCIE_CTL_OFFSET + AXIBAR2PCIEBAR_1U;
+        chain[2 * c].control      = ADDR_BTT;
+        chain[2 * c].status       = 0x00000000;
+        chain[2 * c + 1].nextDesc = sgAddr + (2 * c + 2) * DESCRIPTOR_SIZE;
+        chain[2 * c + 1].control  = 0;
+        chain[2 * c + 1].status   = 0x00000000;
+    }
+    chain[2 * pairs - 1].nextDesc = sgAddr;
 
-static inline void xpdma_writeReg (u32 reg, u32 val)
-{
-//    u32 prev = xpdma_readReg(reg);
-//    printk(KERN_INFO"%s: xpdma_writeReg: address:0x%08X\t data:0x%08X -> 0x%08X\n", DEVICE_NAME, reg, prev, val);
-    writel(val, (gBaseVirt + reg));
+    dev->descTail[slot] = pairs - 1;
+    dev->descLayout[slot] = SG_LAYOUT_PAIRS;
 }
 
-static int xpdma_init (void)
+ssize_t create_desc_chain(xpdma_dev_t *dev, int slot, int direction, sg_seg_t *segs, u32 nsegs, u32 addr)
 {
-    gDev = pci_get_device(VENDOR_ID, DEVICE_ID, gDev);
-    if (NULL == gDev) {
-        printk(KERN_WARNING"%s: Init: Hardware not found.\n", DEVICE_NAME);
+    // length of desctriptors chain
+    u32 count = 0;
+    sg_desc_t *chain = slot_chain(dev, slot);
+    u32 sgAddr = slot_chainAddr(dev, slot); // current descriptor address in chain
+    u32 btt = 0;                   // current descriptor BTT
+    u32 hostAddr = 0;              // host side address (SG_DM window)
+    u32 ddrAddr = AXI_DDR3_ADDR + addr; // device side address (DDR3), SG_ADDR_SEGS - per segment
+
+    if (!nsegs)
         return (CRIT_ERR);
+    dev->descChainLength[slot] = sg_descCount(direction, nsegs);
+//    printk(KERN_INFO"%s: descChainLength = %lu\n", DEVICE_NAME, dev->descChainLength[slot]);
+
+    // DMA_NONE - MEM 2 MEM: segments are DDR3 sources, data descriptors only
+    if (DMA_NONE == direction) {
+        dev->descLayout[slot] = SG_LAYOUT_DATA;
+        for (count = 0; count < nsegs; ++count) {
+            sgAddr += DESCRIPTOR_SIZE;
+            chain[count].nextDesc  = sgAddr;
+            chain[count].srcAddr   = segs[count].hwAddr;
+            chain[count].destAddr  = ddrAddr;
+            chain[count].control   = segs[count].length;
+            chain[count].status    = 0x00000000;
+            ddrAddr += segs[count].length;
+        }
+        chain[nsegs - 1].nextDesc = slot_chainAddr(dev, slot); // tail descriptor pointed to chain head
+        return (SUCCESS);
     }
 
+    if (direction != DMA_FROM_DEVICE && direction != DMA_TO_DEVICE) {
+        printk(KERN_INFO"%s: Descriptors Chain create error: unknown direction\n", DEVICE_NAME);
+        return (CRIT_ERR);
+    }
+
+    // links and translation descriptors never change: build them once per slot layout
+    if (SG_LAYOUT_PAIRS != dev->descLayout[slot])
+        slot_build(dev, slot);
+
+    // per transfer only data descriptors and status words are patched
+//    printk(KERN_INFO"%s: patch descriptor chain\n", DEVICE_NAME);
+    for (count = 0; count < nsegs; ++count) {
+        sg_desc_t *addrDesc = chain + 2 * count;      // address translation descriptor
+        sg_desc_t *dataDesc = addrDesc + 1;           // target data transfer descriptor
+        btt = segs[count].length;
+        hostAddr = AXI_PCIE_DM_ADDR + (segs[count].hwAddr & (AXI_PCIE_DM_SIZE - 1));
+        if (SG_ADDR_SEGS == addr)
+            ddrAddr = AXI_DDR3_ADDR + segs[count].ddrAddr;
+
+        addrDesc->status    = 0x00000000;
+        dataDesc->srcAddr   = (direction == DMA_TO_DEVICE) ? hostAddr : ddrAddr;
+        dataDesc->destAddr  = (direction == DMA_TO_DEVICE) ? ddrAddr : hostAddr;
+        dataDesc->control   = btt;
+        dataDesc->status    = 0x00000000;
+
+        ddrAddr += btt;
+    }
+
+    // old tail links to its next pair again when the chain length changed
+    if (dev->descTail[slot] != nsegs - 1) {
+        if (dev->descTail[slot] + 1 < slot_vectors(dev, slot))
+            chain[2 * dev->descTail[slot] + 1].nextDesc = sgAddr + 2 * (dev->descTail[slot] + 1) * DESCRIPTOR_SIZE;
+        dev->descTail[slot] = nsegs - 1;
+    }
+    chain[2 * nsegs - 1].nextDesc = sgAddr; // tail descriptor pointed to chain head
+
+    return (SUCCESS);
+}
+
+void show_descriptors(xpdma_dev_t *dev, int slot)
+{
+    int c = 0;
+    sg_desc_t *descriptor = slot_chain(dev, slot);
+
+    printk(KERN_INFO
+    "%s: Slot %d translation vectors:\n", DEVICE_NAME, slot);
+    printk(KERN_INFO
+    "%s: Operation_1 Upper: %08X\n", DEVICE_NAME, xpdma_readReg(dev, BRAM_OFFSET + slot_bramOffset(dev, slot) + 0));
+    printk(KERN_INFO
+    "%s: Operation_1 Lower: %08X\n", DEVICE_NAME, xpdma_readReg(dev, BRAM_OFFSET + slot_bramOffset(dev, slot) + 4));
+
+    for (c = 0; c < dev->descChainLength[slot] && c < 4; ++c) {
+        printk(KERN_INFO
+        "%s: Descriptor %d\n", DEVICE_NAME, c);
+        printk(KERN_INFO
+        "%s: nextDesc 0x%08X\n", DEVICE_NAME, descriptor->nextDesc);
+        printk(KERN_INFO
+        "%s: srcAddr 0x%08X\n", DEVICE_NAME, descriptor->srcAddr);
+        printk(KERN_INFO
+        "%s: destAddr 0x%08X\n", DEVICE_NAME, descriptor->destAddr);
+        printk(KERN_INFO
+        "%s: control 0x%08X\n", DEVICE_NAME, descriptor->control);
+        printk(KERN_INFO
+        "%s: status 0x%08X\n", DEVICE_NAME, descriptor->status);
+        descriptor++;        // target data transfer descriptor
+    }
+}
+
+// Hand CDMA to the next waiter: lowest virtual finish time of the latency class,
+// unless the oldest bulk waiter starves (dev->schedLock held)
+static void sched_grant(xpdma_dev_t *dev)
+{
+    sched_waiter_t *waiter = NULL;
+    sched_waiter_t *next = NULL;
+    s64 waited = 0;
+    int prio = 0;
+
+    if (dev->schedBusy)
+        return;
+
+    if (sched_starve_us && !list_empty(&dev->schedQueue[SCHED_BULK]) &&
+            !list_empty(&dev->schedQueue[SCHED_LATENCY])) {
+        // bulk queue is in arrival order
+        waiter = list_first_entry(&dev->schedQueue[SCHED_BULK], sched_waiter_t, list);
+        if (ktime_to_us(ktime_sub(ktime_get(), waiter->queued)) > sched_starve_us) {
+            next = waiter;
+            dev->schedStats.aged++;
+        }
+    }
+
+    for (prio = 0; !next && prio < SCHED_CLASSES; ++prio) {
+        list_for_each_entry(waiter, &dev->schedQueue[prio], list) {
+            if (!next || waiter->finish < next->finish)
+                next = waiter;
+        }
+    }
+    if (!next)
+        return;
+
+    list_del(&next->list);
+    prio = next->priority;
+    waited = ktime_to_ns(ktime_sub(ktime_get(), next->queued));
+    dev->schedStats.queued[prio]--;
+    dev->schedStats.granted[prio]++;
+    dev->schedStats.waitNs[prio] += waited;
+    dev->schedStats.maxWaitNs[prio] = max_t(u64, dev->schedStats.maxWaitNs[prio], waited);
+    dev->schedVtime = next->start;
+    dev->schedBusy = 1;
+    next->granted = 1;
+    wake_up_all(&dev->schedWait);
+}
+
+// Staging buffers on the node of the submitting CPU, the card node ones when it has none
+static inline stage_set_t *stage_local(xpdma_dev_t *dev)
+{
+    int node = numa_node_id();
+    u32 set = 0;
+
+    for (set = 1; set < dev->stageSets; ++set) {
+        if (dev->stageSet[set]->node == node)
+            return dev->stageSet[set];
+    }
+    return dev->stageSet[0];
+}
+
+// Queue synchronous transfer of count bytes and sleep until it owns CDMA
+static int sched_acquire(xpdma_dev_t *dev, xpdma_file_t *file, size_t count)
+{
+    sched_waiter_t waiter;
+    int prio = file->priority;
+
+    if (SCHED_AUTO == prio)
+        prio = (count <= sched_small) ? SCHED_LATENCY : SCHED_BULK;
+
+    waiter.file = file;
+    waiter.priority = prio;
+    waiter.granted = 0;
+    waiter.queued = ktime_get();
+
+    spin_lock(&dev->schedLock);
+    waiter.start = max(dev->schedVtime, file->vtime);
+    waiter.finish = waiter.start + div_u64((u64)max_t(size_t, count, PAGE_SIZE) * SCHED_MAX_WEIGHT, file->weight);
+    file->vtime = waiter.finish;
+    list_add_tail(&waiter.list, &dev->schedQueue[prio]);
+    dev->schedStats.queued[prio]++;
+    dev->schedStats.maxQueued[prio] = max(dev->schedStats.maxQueued[prio], dev->schedStats.queued[prio]);
+    sched_grant(dev);
+    spin_unlock(&dev->schedLock);
+
+    if (wait_event_interruptible(dev->schedWait, waiter.granted)) {
+        spin_lock(&dev->schedLock);
+        if (!waiter.granted) {
+            list_del(&waiter.list);
+            dev->schedStats.queued[prio]--;
+            spin_unlock(&dev->schedLock);
+            return (-ERESTARTSYS);
+        }
+        spin_unlock(&dev->schedLock);
+    }
+
+    // registers may have been changed behind the driver through a writable mapping
+    if (atomic_read(&dev->regsWriters))
+        sg_invalidate(dev);
+
+    // per file mode overrides module-wide one
+    dev->waitMode = (file->waitMode != WAIT_MODE_DEFAULT) ? file->waitMode : wait_mode;
+    dev->stage = stage_local(dev);
+    return (SUCCESS);
+}
+
+static void sched_release(xpdma_dev_t *dev)
+{
+    spin_lock(&dev->schedLock);
+    dev->schedBusy = 0;
+    sched_grant(dev);
+    spin_unlock(&dev->schedLock);
+}
+
+static int sched_stats(xpdma_dev_t *dev, cdmaSchedStats_t *user)
+{
+    cdmaSchedStats_t stats;
+
+    spin_lock(&dev->schedLock);
+    stats = dev->schedStats;
+    memset(&dev->schedStats, 0, offsetof(cdmaSchedStats_t, queued));
+    memset(dev->schedStats.maxQueued, 0, sizeof(dev->schedStats.maxQueued));
+    spin_unlock(&dev->schedLock);
+
+    if ( copy_to_user(user, &stats, sizeof(stats)) )
+        return (CRIT_ERR);
+    return (SUCCESS);
+}
+
+// Last reference to a removed card is gone
+static void xpdma_devFree(struct kref *ref)
+{
+    xpdma_dev_t *dev = container_of(ref, xpdma_dev_t, ref);
+
+    xpdma_free(dev);
+    pci_dev_put(dev->pdev);
+    kfree(dev);
+}
+
+// Every file operation runs with the card present
+static int xpdma_enter(xpdma_dev_t *dev)
+{
+    down_read(&dev->removeLock);
+    if (READ_ONCE(dev->removed)) {
+        up_read(&dev->removeLock);
+        return (-ENODEV);
+    }
+    return (SUCCESS);
+}
+
+static inline void xpdma_leave(xpdma_dev_t *dev)
+{
+    up_read(&dev->removeLock);
+}
+
+static ssize_t guard_read(struct file *filp, char *buf, size_t count, loff_t *f_pos)
+{
+    xpdma_dev_t *dev = ((xpdma_file_t *)filp->private_data)->dev;
+    ssize_t ret = xpdma_enter(dev);
+
+    if (ret)
+        return (ret);
+    ret = xpdma_read(filp, buf, count, f_pos);
+    xpdma_leave(dev);
+    return (ret);
+}
+
+static ssize_t guard_write(struct file *filp, const char *buf, size_t count, loff_t *f_pos)
+{
+    xpdma_dev_t *dev = ((xpdma_file_t *)filp->private_data)->dev;
+    ssize_t ret = xpdma_enter(dev);
+
+    if (ret)
+        return (ret);
+    ret = xpdma_write(filp, buf, count, f_pos);
+    xpdma_leave(dev);
+    return (ret);
+}
+
+static long guard_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    xpdma_dev_t *dev = ((xpdma_file_t *)filp->private_data)->dev;
+    long ret = xpdma_enter(dev);
+
+    if (ret)
+        return (ret);
+    ret = xpdma_ioctl(filp, cmd, arg);
+    xpdma_leave(dev);
+    return (ret);
+}
+
+static int guard_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    xpdma_dev_t *dev = ((xpdma_file_t *)filp->private_data)->dev;
+    int ret = xpdma_enter(dev);
+
+    if (ret)
+        return (ret);
+    ret = xpdma_mmap(filp, vma);
+    xpdma_leave(dev);
+    return (ret);
+}
+
+static __poll_t guard_poll(struct file *filp, poll_table *wait)
+{
+    xpdma_dev_t *dev = ((xpdma_file_t *)filp->private_data)->dev;
+    __poll_t mask = 0;
+
+    // a removed card has nothing more to report
+    if (xpdma_enter(dev))
+        return (EPOLLERR | EPOLLHUP);
+    mask = xpdma_poll(filp, wait);
+    xpdma_leave(dev);
+    return (mask);
+}
+
+int xpdma_open(struct inode *inode, struct file *filp)
+{
+    xpdma_file_t *file = kzalloc(sizeof(xpdma_file_t), GFP_KERNEL);
+
+    if (NULL == file)
+        return (CRIT_ERR);
+    file->dev = container_of(inode->i_cdev, xpdma_dev_t, cdev);
+    if (xpdma_enter(file->dev)) {
+        kfree(file);
+        return (-ENODEV);
+    }
+    kref_get(&file->dev->ref);
+    file->filp = filp;
+    mutex_lock(&file->dev->filesLock);
+    list_add(&file->list, &file->dev->files);
+    mutex_unlock(&file->dev->filesLock);
+    xpdma_leave(file->dev);
+    file->waitMode = WAIT_MODE_DEFAULT;
+    file->priority = SCHED_AUTO;
+    file->weight = 1;
+    init_waitqueue_head(&file->wait);
+    mutex_init(&file->ringLock);
+    filp->private_data = file;
+
+    printk(KERN_INFO"%s%d: Open: module opened\n", DEVICE_NAME, file->dev->index);
+    return (SUCCESS);
+}
+
+static int xpdma_reset(xpdma_dev_t *dev)
+{
+    int loop = CDMA_RESET_LOOP;
+    u32 tmp;
+
+    pr_debug("%s: RESET CDMA\n", DEVICE_NAME);
+
+    xpdma_writeReg(dev, (CDMA_OFFSET + CDMA_CONTROL_OFFSET),
+                   xpdma_readReg(dev, CDMA_OFFSET + CDMA_CONTROL_OFFSET) | CDMA_CR_RESET_MASK);
+
+    tmp = xpdma_readReg(dev, CDMA_OFFSET + CDMA_CONTROL_OFFSET) & CDMA_CR_RESET_MASK;
+
+    /* Wait for the hardware to finish reset */
+    while (loop && tmp) {
+        tmp = xpdma_readReg(dev, CDMA_OFFSET + CDMA_CONTROL_OFFSET) & CDMA_CR_RESET_MASK;
+        loop--;
+    }
+
+    if (!loop) {
+        printk(KERN_INFO"%s: reset timeout, CONTROL_REG: 0x%08X, STATUS_REG 0x%08X\n",
+                DEVICE_NAME,
+                xpdma_readReg(dev, CDMA_OFFSET + CDMA_CONTROL_OFFSET),
+                xpdma_readReg(dev, CDMA_OFFSET + CDMA_STATUS_OFFSET));
+        trace_xpdma_reset(dev->index, xpdma_readReg(dev, CDMA_OFFSET + CDMA_STATUS_OFFSET), CRIT_ERR);
+        return (CRIT_ERR);
+    }
+
+    // For Axi CDMA, always do sg transfers if sg mode is built in
+    sg_invalidate(dev);
+    sg_setControl(dev, tmp | CDMA_CR_SG_EN);
+    sg_setChainWindow(dev);
+    dev->cdmaIdle = 1;
+
+    trace_xpdma_reset(dev->index, xpdma_readReg(dev, CDMA_OFFSET + CDMA_STATUS_OFFSET), SUCCESS);
+    pr_debug("%s: SUCCESSFULLY RESET CDMA!\n", DEVICE_NAME);
+
+    return (SUCCESS);
+}
+
+static int xpdma_isIdle(xpdma_dev_t *dev)
+{
+    return xpdma_readReg(dev, CDMA_OFFSET + CDMA_STATUS_OFFSET) &
+           CDMA_CR_IDLE_MASK;
+}
+
+// Status word of the slot chain tail descriptor
+static inline u32 sg_tailStatus(xpdma_dev_t *dev, int slot)
+{
+    return slot_chain(dev, slot)[dev->descChainLength[slot] - 1].status;
+}
+
+// Write translation vector at bramOffset; staging, pool and low-latency buffers keep
+// their vectors, so only new apertures cost MMIO
+static inline void sg_setVector(xpdma_dev_t *dev, size_t bramOffset, size_t pntr)
+{
+    if (dev->bramVector[bramOffset / BRAM_STEP] == pntr)
+        return;
+
+    xpdma_writeReg (dev, (BRAM_OFFSET + bramOffset + 4), (pntr >> 0 ) & 0xFFFFFFFF); // Lower 32 bit
+    xpdma_writeReg (dev, (BRAM_OFFSET + bramOffset + 0), (pntr >> 32) & 0xFFFFFFFF); // Upper 32 bit
+    dev->bramVector[bramOffset / BRAM_STEP] = pntr;
+}
+
+// Build the slot chain over the host segments and write its translation
+// vectors (CDMA registers are not touched)
+static int sg_prepare(xpdma_dev_t *dev, int slot, int direction, sg_seg_t *segs, u32 nsegs, u32 addr)
+{
+    size_t pntr = 0;
+    u32 countBuf = 0;
+    size_t bramOffset = slot_bramOffset(dev, slot);
+    ktime_t start = ktime_get();
+
+    if (create_desc_chain(dev, slot, direction, segs, nsegs, addr))
+        return (CRIT_ERR);
+    phase_since(dev, PHASE_CHAIN, start);
+    start = ktime_get();
+
+    // Write appropriate Translation Vectors (aperture base of every segment)
+//    printk(KERN_INFO"%s: Write Translation Vectors to BRAM\n", DEVICE_NAME);
+    dev->chainBytes[slot] = 0;
+    for (countBuf = 0; countBuf < nsegs; ++countBuf) {
+        dev->chainBytes[slot] += segs[countBuf].length;
+        if (DMA_NONE == direction)
+            continue;
+        pntr = (size_t)(segs[countBuf].hwAddr) & ~((size_t)AXI_PCIE_DM_SIZE - 1);
+//        printk(KERN_INFO"%s: pntr 0x%016lX\n", DEVICE_NAME, pntr);
+//        printk(KERN_INFO"%s: bramOffset 0x%016lX\n", DEVICE_NAME, bramOffset);
+        sg_setVector(dev, bramOffset, pntr);
+
+        bramOffset += BRAM_STEP;
+    }
+    phase_since(dev, PHASE_MMIO, start);
+    trace_xpdma_chain(dev->index, slot, direction, nsegs, dev->descChainLength[slot], dev->chainBytes[slot]);
+
+    return (SUCCESS);
+}
+
+// Point AXI:BAR0 (SG window) at the descriptor chains, they never move: once after
+// reset or after a user register write
+static inline void sg_setChainWindow(xpdma_dev_t *dev)
+{
+    size_t pntr = (size_t) (dev->descChainHWAddr & ~((dma_addr_t)AXI_PCIE_SG_SIZE - 1));
+
+    if (dev->chainWindow)
+        return;
+
+//    printk(KERN_INFO"%s: descChain 0x%016lX\n", DEVICE_NAME, pntr);
+    xpdma_writeReg (dev, (PCIE_CTL_OFFSET + AXIBAR2PCIEBAR_0L), (pntr >> 0)  & 0xFFFFFFFF); // Lower 32 bit
+    xpdma_writeReg (dev, (PCIE_CTL_OFFSET + AXIBAR2PCIEBAR_0U), (pntr >> 32) & 0xFFFFFFFF); // Upper 32 bit
+    dev->chainWindow = 1;
+}
+
+// Write the CDMA control register only when the value changes
+static inline void sg_setControl(xpdma_dev_t *dev, u32 control)
+{
+    if (dev->cdmaControl == control)
+        return;
+
+    xpdma_writeReg (dev, CDMA_OFFSET + CDMA_CONTROL_OFFSET, control);
+    dev->cdmaControl = control;
+}
+
+// Forget cached device state: BRAM vectors, control register and SG window are written again
+static void sg_invalidate(xpdma_dev_t *dev)
+{
+    memset(dev->bramVector, 0xFF, sizeof(dev->bramVector));
+    dev->cdmaControl = ~0U;
+    dev->chainWindow = 0;
+    dev->cdmaIdle = 0;
+}
+
+// Build the slot chain over the host segments and hand it to CDMA
+// (does not wait for completion)
+static int sg_operation(xpdma_dev_t *dev, int slot, int direction, sg_seg_t *segs, u32 nsegs, u32 addr)
+{
+    if (!xpdma_isIdle(dev)){
+        printk(KERN_INFO"%s: CDMA is not idle\n", DEVICE_NAME);
+        return (CRIT_ERR);
+    }
+
+    // 1. Set DMA to Scatter Gather Mode (and arm interrupts if completion waits for them)
+//    printk(KERN_INFO"%s: 1. Set DMA to Scatter Gather Mode\n", DEVICE_NAME);
+    if (WAIT_MODE_IRQ == dev->waitMode && (dev->statFlags & HAVE_IRQ) && !dev->irqMissed) {
+        init_completion(&dev->dmaDone);
+        dev->irqSlot = slot;
+        sg_setControl(dev, CDMA_CR_SG_EN |
+                      CDMA_CR_IOC_IRQ_EN | CDMA_CR_DLY_IRQ_EN | CDMA_CR_ERR_IRQ_EN |
+                      CDMA_CR_IRQ_THRESHOLD(min(sg_descCount(direction, nsegs), 255U)) | CDMA_CR_IRQ_DELAY(1));
+    } else {
+        dev->irqSlot = -1;
+        sg_setControl(dev, CDMA_CR_SG_EN);
+    }
+
+    // 2. Create Descriptors chain and write Translation Vectors
+//    printk(KERN_INFO"%s: 2. Create Descriptors chain\n", DEVICE_NAME);
+    if (sg_prepare(dev, slot, direction, segs, nsegs, addr))
+        return (CRIT_ERR);
+
+    // 3. SG window is programmed after reset only
+//    printk(KERN_INFO"%s: 3. Update PCIe Translation vector\n", DEVICE_NAME);
+    sg_setChainWindow(dev);
+
+    // 4. Write a valid pointer to DMA CURDESC_PNTR
+//    printk(KERN_INFO"%s: 4. Write a valid pointer to DMA CURDESC_PNTR\n", DEVICE_NAME);
+    xpdma_writeReg (dev, (CDMA_OFFSET + CDMA_CDESC_OFFSET), slot_chainAddr(dev, slot));
+
+    // 5. Write a valid pointer to DMA TAILDESC_PNTR
+//    printk(KERN_INFO"%s: 5. Write a valid pointer to DMA TAILDESC_PNTR\n", DEVICE_NAME);
+    dev->cdmaIdle = 0;
+    dev->kickSeen[slot] = 0;
+    trace_xpdma_kick(dev->index, slot, slot_chainAddr(dev, slot),
+                     slot_chainAddr(dev, slot) + ((dev->descChainLength[slot] - 1) * (DESCRIPTOR_SIZE)));
+    dev->kickTime[slot] = ktime_get();
+    xpdma_writeReg (dev, (CDMA_OFFSET + CDMA_TDESC_OFFSET),
+                    slot_chainAddr(dev, slot) + ((dev->descChainLength[slot] - 1) * (DESCRIPTOR_SIZE)));
+
+    return (SUCCESS);
+}
+
+// Start a bounce transfer of count bytes from/to the stage staging buffer,
+// the whole chunk goes as one chain over all blocks of the buffer
+static int stage_operation(xpdma_dev_t *dev, int stage, int direction, size_t count, u32 addr)
+{
+    sg_seg_t *segs = dev->stageSegs;
+    u32 nsegs = 0;
+    u32 block = 0;
+    u32 length = 0;
+    dma_addr_t hwAddr;
+
+    for (block = 0; count; ++block) {
+        hwAddr = (DMA_TO_DEVICE == direction) ? dev->stage->writeHWAddr[stage][block] : dev->stage->readHWAddr[stage][block];
+        length = min(count, (size_t)BUF_SIZE);
+        if (sg_addSegment(segs, &nsegs, dev->stageVectors, hwAddr, length))
+            return (CRIT_ERR);
+        count -= length;
+    }
+
+    dev->stats.descriptors += nsegs;
+    return sg_operation(dev, stage, direction, segs, nsegs, addr);
+}
+
+// Hand a block range of a streaming-mapped staging buffer to the CPU (cpu) or back
+// to CDMA; contiguous staging buffers are coherent and need nothing
+static inline void stage_sync(xpdma_dev_t *dev, int stage, int direction, u32 block, size_t offset, size_t length, int cpu)
+{
+    size_t contig = (DMA_TO_DEVICE == direction) ? dev->stage->writeContig[stage] : dev->stage->readContig[stage];
+    dma_addr_t hwAddr = (DMA_TO_DEVICE == direction) ? dev->stage->writeHWAddr[stage][block] : dev->stage->readHWAddr[stage][block];
+    enum dma_data_direction dir = direction;
+
+    if (contig)
+        return;
+    if (cpu)
+        dma_sync_single_range_for_cpu(&dev->pdev->dev, hwAddr, offset, length, dir);
+    else
+        dma_sync_single_range_for_device(&dev->pdev->dev, hwAddr, offset, length, dir);
+}
+
+// Copy between user memory and the blocks of a staging buffer, starting offset bytes in
+static int stage_copyAt(xpdma_dev_t *dev, int stage, int direction, size_t offset, char *user, size_t count)
+{
+    u32 block = offset / BUF_SIZE;
+    u32 length = 0;
+    int err = 0;
+
+    for (offset %= BUF_SIZE; count; ++block, offset = 0) {
+        length = min(count, (size_t)BUF_SIZE - offset);
+        stage_sync(dev, stage, direction, block, offset, length, 1);
+        if (DMA_TO_DEVICE == direction)
+            err = copy_from_user(dev->stage->writeBuffer[stage][block] + offset, user, length);
+        else
+            err = copy_to_user(user, dev->stage->readBuffer[stage][block] + offset, length);
+        stage_sync(dev, stage, direction, block, offset, length, 0);
+        if (err)
+            return (CRIT_ERR);
+        user += length;
+        count -= length;
+    }
+
+    return (SUCCESS);
+}
+
+static int stage_copy(xpdma_dev_t *dev, int stage, int direction, char *user, size_t count)
+{
+    return stage_copyAt(dev, stage, direction, 0, user, count);
+}
+
+// File range from/to the staging buffer, through the page cache (no user buffer in between)
+static int stage_file(xpdma_dev_t *dev, int stage, int direction, struct file *filp, loff_t *pos, size_t count)
+{
+    u32 block = 0;
+    size_t contig = (DMA_TO_DEVICE == direction) ? dev->stage->writeContig[stage] : dev->stage->readContig[stage];
+    size_t length = 0;
+    size_t blockBytes = 0;
+    ssize_t done = 0;
+    char *buffer = NULL;
+    int err = SUCCESS;
+
+    for (block = 0; count && !err; ++block) {
+        // one contiguous allocation takes the whole chunk in one call
+        length = contig ? count : min(count, (size_t)BUF_SIZE);
+        blockBytes = length;
+        buffer = (DMA_TO_DEVICE == direction) ? dev->stage->writeBuffer[stage][block] : dev->stage->readBuffer[stage][block];
+        count -= length;
+        stage_sync(dev, stage, direction, block, 0, blockBytes, 1);
+        while (length) {
+            // staging buffers are kernel memory
+            if (DMA_TO_DEVICE == direction)
+                done = kernel_read(filp, buffer, length, pos);
+            else
+                done = kernel_write(filp, buffer, length, pos);
+            // short file or full disk
+            if (done <= 0) {
+                err = CRIT_ERR;
+                break;
+            }
+            buffer += done;
+            length -= done;
+        }
+        stage_sync(dev, stage, direction, block, 0, blockBytes, 0);
+    }
+
+    return (err);
+}
+
+// Fill (to device) or drain (from device) a staging buffer, file when given, user memory otherwise
+static inline int stage_move(xpdma_dev_t *dev, int stage, int direction, char *user, struct file *filp, loff_t *pos, size_t count)
+{
+    if (filp)
+        return stage_file(dev, stage, direction, filp, pos, count);
+    return stage_copy(dev, stage, direction, user, count);
+}
+
+// Check the tail status without reporting: 1 - completed, 0 - in flight, CRIT_ERR - failed
+static int sg_pollStatus(xpdma_dev_t *dev, int slot)
+{
+    u32 status = sg_tailStatus(dev, slot);
+
+    // CDMA start latency, as seen by the waiter
+    if (!dev->kickSeen[slot] && (slot_chain(dev, slot)[0].status & SG_COMPLETE_MASK)) {
+        dev->kickSeen[slot] = 1;
+        phase_since(dev, PHASE_START, dev->kickTime[slot]);
+    }
+
+    if (status & SG_ERR_MASK) {
+        trace_xpdma_error(dev->index, slot, status, ktime_to_ns(ktime_sub(ktime_get(), dev->kickTime[slot])));
+        return (CRIT_ERR);
+    }
+
+    if (status & SG_COMPLETE_MASK)
+        return (1);
+
+    return (0);
+}
+
+// Log the error of a failed slot chain and dump its descriptors
+static void sg_showError(xpdma_dev_t *dev, int slot, u32 status)
+{
+    if (status & SG_DEC_ERR_MASK)
+        printk(KERN_INFO
+        "%s: Scatter Gather Operation: Decode Error\n", DEVICE_NAME);
+    else if (status & SG_SLAVE_ERR_MASK)
+        printk(KERN_INFO
+        "%s: Scatter Gather Operation: Slave Error\n", DEVICE_NAME);
+    else
+        printk(KERN_INFO
+        "%s: Scatter Gather Operation: Internal Error\n", DEVICE_NAME);
+    show_descriptors(dev, slot);
+}
+
+// Check the tail status and report failures
+static int sg_checkStatus(xpdma_dev_t *dev, int slot)
+{
+    int done = sg_pollStatus(dev, slot);
+
+    if (CRIT_ERR == done)
+        sg_showError(dev, slot, sg_tailStatus(dev, slot));
+    return (done);
+}
+
+// Sleep the caller for ns nanoseconds on an hrtimer
+static void sg_sleep(xpdma_dev_t *dev, u64 ns)
+{
+    ktime_t start = ktime_get();
+    ktime_t timeout = ns_to_ktime(ns);
+
+    set_current_state(TASK_UNINTERRUPTIBLE);
+    schedule_hrtimeout_range(&timeout, ns / 4, HRTIMER_MODE_REL);
+    dev->stats.sleepNs += ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+// Busy poll of the tail status word (legacy mode)
+static int sg_waitPoll(xpdma_dev_t *dev, int slot)
+{
+    int done = 0;
+    size_t delayTime = SG_TRANSFER_LOOP;
+
+    while (delayTime) {
+        delayTime--;
+
+        done = sg_checkStatus(dev, slot);
+        if (done)
+            return (done);
+
+        udelay(10);// TODO: can it be less?
+    }
+
+    return (0);
+}
+
+// Sleep until the expected completion time of the chain (by its size and
+// the observed CDMA speed), then poll with short hrtimer sleeps
+static int sg_waitSleep(xpdma_dev_t *dev, int slot)
+{
+    int done = 0;
+    s64 elapsed = ktime_to_ns(ktime_sub(ktime_get(), dev->kickTime[slot]));
+    s64 expected = div_u64((u64)dev->chainBytes[slot] * dev->psPerByte, 1000);
+
+    // wake up a bit early: waking late costs latency, early costs one poll
+    if (expected - expected / 8 > elapsed + (s64)poll_ns) {
+        sg_sleep(dev, expected - expected / 8 - elapsed);
+    }
+
+    while (1) {
+        done = sg_checkStatus(dev, slot);
+        if (done)
+            return (done);
+
+        elapsed = ktime_to_ns(ktime_sub(ktime_get(), dev->kickTime[slot]));
+        if (elapsed > SG_TIMEOUT_NS)
+            return (0);
+
+        if (poll_ns)
+            sg_sleep(dev, poll_ns);
+        else
+            cpu_relax();
+    }
+}
+
+// Sleep on the completion signaled by the CDMA interrupt; the stock
+// XAPP1171 design does not route CDMA interrupt to MSI, so if nothing
+// arrives for the expected time, keep waiting in sleep/poll mode
+static int sg_waitIrq(xpdma_dev_t *dev, int slot)
+{
+    int done = 0;
+    ktime_t start;
+    u64 expected = div_u64((u64)dev->chainBytes[slot] * dev->psPerByte, 1000);
+    unsigned long timeout = usecs_to_jiffies(div_u64(expected, NSEC_PER_USEC) * 4 + 1000);
+
+    while (1) {
+        start = ktime_get();
+        if (!wait_for_completion_timeout(&dev->dmaDone, timeout)) {
+            dev->stats.sleepNs += ktime_to_ns(ktime_sub(ktime_get(), start));
+            if (1 == sg_checkStatus(dev, slot)) {
+                printk(KERN_INFO"%s: CDMA interrupt is not delivered, using sleep/poll mode\n", DEVICE_NAME);
+                dev->irqMissed = 1;
+            }
+            return sg_waitSleep(dev, slot);
+        }
+        dev->stats.sleepNs += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+        done = sg_checkStatus(dev, slot);
+        if (done)
+            return (done);
+        init_completion(&dev->dmaDone);
+        // interrupt raced with descriptor write back, recheck before sleeping again
+        done = sg_checkStatus(dev, slot);
+        if (done)
+            return (done);
+    }
+}
+
+// Wait for the slot chain started by sg_operation(dev)
+static int sg_wait(xpdma_dev_t *dev, int slot)
+{
+    int done = 0;
+    s64 elapsed = 0;
+
+    // wait for Scatter Gather operation...
+//    printk(KERN_INFO"%s: Scatter Gather must be started!\n", DEVICE_NAME);
+
+    if (slot == dev->irqSlot)
+        done = sg_waitIrq(dev, slot);
+    else if (WAIT_MODE_POLL == dev->waitMode)
+        done = sg_waitPoll(dev, slot);
+    else
+        done = sg_waitSleep(dev, slot);
+    dev->irqSlot = -1;
+
+    if (done < 0)
+        return (CRIT_ERR);
+
+    if (!done) {
+        trace_xpdma_error(dev->index, slot, sg_tailStatus(dev, slot),
+                          ktime_to_ns(ktime_sub(ktime_get(), dev->kickTime[slot])));
+        printk(KERN_INFO"%s: Scatter Gather Operation error: Timeout Error\n", DEVICE_NAME);
+        phase_timeout(dev);
+        show_descriptors(dev, slot);
+        return (CRIT_ERR);
+    }
+
+    // learn CDMA speed for the next expected completion time
+    elapsed = ktime_to_ns(ktime_sub(ktime_get(), dev->kickTime[slot]));
+    dev->stats.dmaNs += elapsed;
+    phase_account(dev, PHASE_DMA, elapsed);
+    trace_xpdma_complete(dev->index, slot, sg_tailStatus(dev, slot), elapsed);
+    if (dev->chainBytes[slot] >= PAGE_SIZE)
+        dev->psPerByte = (7 * dev->psPerByte + div_u64((u64)elapsed * 1000, dev->chainBytes[slot])) / 8;
+
+    return (SUCCESS);
+}
+
+// CDMA interrupt (IOC, delay or error): wake up the waiter once the tail is done
+static irqreturn_t xpdma_isr(int irq, void *dev_id)
+{
+    xpdma_dev_t *dev = dev_id;
+    u32 status = xpdma_readReg(dev, CDMA_OFFSET + CDMA_STATUS_OFFSET);
+
+    if (!(status & CDMA_SR_IRQ_MASK))
+        return (IRQ_NONE);
+
+    xpdma_writeReg(dev, CDMA_OFFSET + CDMA_STATUS_OFFSET, status & CDMA_SR_IRQ_MASK);
+
+    if (dev->irqSlot >= 0 && sg_tailStatus(dev, dev->irqSlot) & SG_COMPLETE_MASK)
+        complete(&dev->dmaDone);
+
+    return (IRQ_HANDLED);
+}
+
+// Account a user copy; if a chain was in flight on the slot, check whether
+// the copy was hidden behind it (CDMA still busy when the copy finished)
+static void sg_accountCopy(xpdma_dev_t *dev, int slot, ktime_t start, int inflight)
+{
+    s64 copyNs = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    dev->stats.copyNs += copyNs;
+    phase_account(dev, PHASE_COPY, copyNs);
+    if (!inflight)
+        return;
+
+    if (!(sg_tailStatus(dev, slot) & SG_COMPLETE_MASK)) {
+        dev->stats.overlapNs += copyNs;
+        dev->stats.dmaWaits++;
+    } else {
+        dev->stats.copyStalls++;
+    }
+}
+
+// Host to device: chunk N+1 is copied from user (or read from filp) while CDMA moves chunk N
+static int sg_block_to_device(xpdma_dev_t *dev, const char *data, size_t count, u32 addr, struct file *filp, loff_t *pos)
+{
+    size_t unstaged = count;
+    const char *curData = data;
+    u32 curAddr = addr;
+    u32 btt[STAGE_MAX];
+    size_t chunk = dev->chunkBytes[STAGE_SEND];
+    int stage = 0;
+    int next = 0;
+    int err = SUCCESS;
+    ktime_t start;
+
+    btt[stage] = min(unstaged, chunk);
+    start = ktime_get();
+    if ( stage_move(dev, stage, DMA_TO_DEVICE, (char *)curData, filp, pos, btt[stage]) )  {
+        printk("%s: sg_block: Failed copy from user.\n", DEVICE_NAME);
+        return (CRIT_ERR);
+    }
+    sg_accountCopy(dev, stage, start, 0);
+
+    if (stage_operation(dev, stage, DMA_TO_DEVICE, btt[stage], curAddr))
+        return (CRIT_ERR);
+
+    while (1) {
+        dev->stats.chunks++;
+        curData += btt[stage];
+        unstaged -= btt[stage];
+
+        // stage next chunk while the current one is in flight
+        next = (stage + 1) % dev->stageCount[STAGE_SEND];
+        if (unstaged) {
+            btt[next] = min(unstaged, chunk);
+            start = ktime_get();
+            if ( stage_move(dev, next, DMA_TO_DEVICE, (char *)curData, filp, pos, btt[next]) )  {
+                printk("%s: sg_block: Failed copy from user.\n", DEVICE_NAME);
+                err = CRIT_ERR;
+            }
+            sg_accountCopy(dev, stage, start, 1);
+        }
+
+        if (sg_wait(dev, stage))
+            return (CRIT_ERR);
+
+        if (!unstaged || err)
+            break;
+
+        curAddr += btt[stage];
+        stage = next;
+        if (stage_operation(dev, stage, DMA_TO_DEVICE, btt[stage], curAddr))
+            return (CRIT_ERR);
+    }
+
+    return (err);
+}
+
+// Device to host: CDMA moves chunk N+1 while chunk N is copied to user (or written to filp)
+static int sg_block_from_device(xpdma_dev_t *dev, char *data, size_t count, u32 addr, struct file *filp, loff_t *pos)
+{
+    size_t unqueued = count;
+    char *curData = data;
+    u32 curAddr = addr;
+    u32 btt[STAGE_MAX];
+    size_t chunk = dev->chunkBytes[STAGE_RECV];
+    int stage = 0;
+    int next = 0;
+    int inflight = 0;
+    ktime_t start;
+
+    btt[stage] = min(unqueued, chunk);
+    if (stage_operation(dev, stage, DMA_FROM_DEVICE, btt[stage], curAddr))
+        return (CRIT_ERR);
+    unqueued -= btt[stage];
+    curAddr += btt[stage];
+
+    while (1) {
+        if (sg_wait(dev, stage))
+            return (CRIT_ERR);
+        dev->stats.chunks++;
+
+        // queue next chunk before draining the current one
+        next = (stage + 1) % dev->stageCount[STAGE_RECV];
+        inflight = 0;
+        if (unqueued) {
+            btt[next] = min(unqueued, chunk);
+            if (stage_operation(dev, next, DMA_FROM_DEVICE, btt[next], curAddr))
+                return (CRIT_ERR);
+            unqueued -= btt[next];
+            curAddr += btt[next];
+            inflight = 1;
+        }
+
+        start = ktime_get();
+        if ( stage_move(dev, stage, DMA_FROM_DEVICE, curData, filp, pos, btt[stage]) )  {
+            printk("%s: sg_block: Failed copy to user.\n", DEVICE_NAME);
+            if (inflight)
+                sg_wait(dev, next);
+            return (CRIT_ERR);
+        }
+        sg_accountCopy(dev, next, start, inflight);
+        curData += btt[stage];
+
+        if (!inflight)
+            break;
+        stage = next;
+    }
+
+    return (SUCCESS);
+}
+
+// Pin and DMA-map up to ZC_WINDOW_PAGES of the user buffer, returns mapped bytes
+static ssize_t zc_map(xpdma_dev_t *dev, int w, int direction, unsigned long data, size_t count)
+{
+    zc_window_t *win = &dev->zcWindow[w];
+    struct scatterlist *sg = NULL;
+    size_t offset = offset_in_page(data);
+    size_t length = 0;
+    size_t mapped = 0;
+    ktime_t start = ktime_get();
+    int pinned = 0;
+    int c = 0;
+
+    length = min(count, (size_t)ZC_WINDOW_PAGES * PAGE_SIZE - offset);
+    win->nrPages = (offset + length + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    win->direction = direction;
+    win->nsegs = 0;
+    win->nents = 0;
+
+    pinned = get_user_pages_fast(data & PAGE_MASK, win->nrPages,
+                                 (DMA_FROM_DEVICE == direction) ? FOLL_WRITE : 0, win->pages);
+    if (pinned < win->nrPages) {
+        for (c = 0; c < pinned; ++c)
+            put_page(win->pages[c]);
+        win->nrPages = 0;
+        return (CRIT_ERR);
+    }
+
+    sg_init_table(win->sgl, win->nrPages);
+    for (c = 0; c < win->nrPages; ++c) {
+        size_t len = min(length - mapped, (size_t)PAGE_SIZE - offset);
+
+        sg_set_page(&win->sgl[c], win->pages[c], len, offset);
+        mapped += len;
+        offset = 0;
+    }
+
+    win->nents = dma_map_sg(&dev->pdev->dev, win->sgl, win->nrPages, direction);
+    if (!win->nents)
+        goto unpin;
+
+    // every contiguous bus segment gets its own translation vector
+    for_each_sg(win->sgl, sg, win->nents, c) {
+        if (sg_addSegment(win->segs, &win->nsegs, ZC_VECTORS, sg_dma_address(sg), sg_dma_len(sg)))
+            goto unmap;
+    }
+
+    dev->stats.pinNs += ktime_to_ns(ktime_sub(ktime_get(), start));
+    phase_since(dev, PHASE_PIN, start);
+    return (length);
+
+unmap:
+    dma_unmap_sg(&dev->pdev->dev, win->sgl, win->nrPages, direction);
+unpin:
+    for (c = 0; c < win->nrPages; ++c)
+        put_page(win->pages[c]);
+    win->nrPages = 0;
+    win->nents = 0;
+    return (CRIT_ERR);
+}
+
+static void zc_unmap(xpdma_dev_t *dev, int w)
+{
+    zc_window_t *win = &dev->zcWindow[w];
+    int c = 0;
+
+    if (!win->nrPages)
+        return;
+
+    dma_unmap_sg(&dev->pdev->dev, win->sgl, win->nrPages, win->direction);
+    for (c = 0; c < win->nrPages; ++c) {
+        if (DMA_FROM_DEVICE == win->direction)
+            set_page_dirty_lock(win->pages[c]);
+        put_page(win->pages[c]);
+    }
+    win->nrPages = 0;
+    win->nents = 0;
+}
+
+// Zero-copy transfer straight from/to pinned user pages, the next window is
+// pinned while the current one is in flight. Returns bytes transferred, which
+// may be less than count if pages could not be pinned (rest goes bounce path)
+static ssize_t zc_block(xpdma_dev_t *dev, int direction, char *data, size_t count, u32 addr)
+{
+    size_t done = 0;
+    ssize_t length[ZC_COUNT];
+    int w = 0;
+    int next = 0;
+
+    length[w] = zc_map(dev, w, direction, (unsigned long)data, count);
+    if (length[w] < 0)
+        return (0);
+
+    while (1) {
+        dev->stats.descriptors += dev->zcWindow[w].nsegs;
+        if (sg_operation(dev, ZC_SLOT(w), direction, dev->zcWindow[w].segs, dev->zcWindow[w].nsegs, addr + done)) {
+            zc_unmap(dev, w);
+            return (CRIT_ERR);
+        }
+        dev->stats.chunks++;
+
+        // pin next window while current one is in flight
+        next = (w + 1) % ZC_COUNT;
+        length[next] = 0;
+        if (done + length[w] < count) {
+            length[next] = zc_map(dev, next, direction, (unsigned long)(data + done + length[w]),
+                                  count - done - length[w]);
+            if (length[next] < 0)
+                length[next] = 0;
+        }
+
+        if (sg_wait(dev, ZC_SLOT(w))) {
+            zc_unmap(dev, w);
+            zc_unmap(dev, next);
+            return (CRIT_ERR);
+        }
+        zc_unmap(dev, w);
+
+        done += length[w];
+        dev->stats.zeroCopyBytes += length[w];
+        if (!length[next])
+            break;
+        w = next;
+    }
+
+    return (done);
+}
+
+// Low-latency path for small transfers: reserved descriptor pair and translation vector,
+// one contiguous buffer and three field patches. Poll mode spins on the status word
+// for a few microseconds, then the transfer sleeps like any chain
+static int fast_block(xpdma_dev_t *dev, int direction, char *data, size_t count, u32 addr)
+{
+    sg_desc_t *desc = slot_chain(dev, FAST_SLOT);
+    u32 hostAddr = AXI_PCIE_DM_ADDR + (dev->fastHWAddr & (AXI_PCIE_DM_SIZE - 1));
+    u32 ddrAddr = AXI_DDR3_ADDR + addr;
+    int done = 0;
+    ktime_t start;
+
+    if (DMA_TO_DEVICE == direction && copy_from_user(dev->fastBuffer, data, count))
+        return (CRIT_ERR);
+
+    desc[0].status = 0x00000000;
+    desc[1].srcAddr  = (DMA_TO_DEVICE == direction) ? hostAddr : ddrAddr;
+    desc[1].destAddr = (DMA_TO_DEVICE == direction) ? ddrAddr : hostAddr;
+    desc[1].control  = count;
+    desc[1].status   = 0x00000000;
+    sg_setVector(dev, slot_bramOffset(dev, FAST_SLOT), dev->fastHWAddr & ~((dma_addr_t)AXI_PCIE_DM_SIZE - 1));
+
+    // engine went idle after the last low-latency chain, the idle check is a PCIe read round trip
+    if (!dev->cdmaIdle && !xpdma_isIdle(dev)) {
+        printk(KERN_INFO"%s: CDMA is not idle\n", DEVICE_NAME);
+        return (CRIT_ERR);
+    }
+    dev->cdmaIdle = 0;
+    dev->irqSlot = -1;
+    sg_setControl(dev, CDMA_CR_SG_EN);
+    sg_setChainWindow(dev);
+    dev->descChainLength[FAST_SLOT] = 2;
+    dev->chainBytes[FAST_SLOT] = count;
+
+    wmb();
+    xpdma_writeReg (dev, (CDMA_OFFSET + CDMA_CDESC_OFFSET), slot_chainAddr(dev, FAST_SLOT));
+    trace_xpdma_kick(dev->index, FAST_SLOT, slot_chainAddr(dev, FAST_SLOT), slot_chainAddr(dev, FAST_SLOT) + DESCRIPTOR_SIZE);
+    start = ktime_get();
+    dev->kickTime[FAST_SLOT] = start;
+    dev->kickSeen[FAST_SLOT] = 0;
+    xpdma_writeReg (dev, (CDMA_OFFSET + CDMA_TDESC_OFFSET), slot_chainAddr(dev, FAST_SLOT) + DESCRIPTOR_SIZE);
+
+    // spin on the status word in host memory, not on CDMA registers
+    if (WAIT_MODE_POLL == dev->waitMode) {
+        preempt_disable();
+        while (!(READ_ONCE(desc[1].status) & SG_COMPLETE_MASK) &&
+               ktime_to_ns(ktime_sub(ktime_get(), start)) < FAST_SPIN_NS)
+            cpu_relax();
+        preempt_enable();
+    }
+    done = sg_waitSleep(dev, FAST_SLOT);
+    rmb();
+
+    if (1 != done) {
+        if (!done) {
+            trace_xpdma_error(dev->index, FAST_SLOT, desc[1].status, ktime_to_ns(ktime_sub(ktime_get(), start)));
+            printk(KERN_INFO"%s: fast_block: Timeout Error\n", DEVICE_NAME);
+            phase_timeout(dev);
+            show_descriptors(dev, FAST_SLOT);
+        }
+        return (CRIT_ERR);
+    }
+    dev->cdmaIdle = 1;
+    dev->stats.dmaNs += ktime_to_ns(ktime_sub(ktime_get(), start));
+    phase_since(dev, PHASE_DMA, start);
+    trace_xpdma_complete(dev->index, FAST_SLOT, desc[1].status, ktime_to_ns(ktime_sub(ktime_get(), start)));
+    dev->stats.descriptors++;
+    dev->stats.chunks++;
+
+    if (DMA_FROM_DEVICE == direction && copy_to_user(data, dev->fastBuffer, count))
+        return (CRIT_ERR);
+
+    return (SUCCESS);
+}
+
+static int sg_block(xpdma_dev_t *dev, int direction, void *data, size_t count, u32 addr)
+{
+    int err = SUCCESS;
+    ssize_t done = 0;
+    ktime_t start;
+
+    if (!count)
+        return (SUCCESS);
+
+    if (DMA_TO_DEVICE != direction && DMA_FROM_DEVICE != direction) {
+        printk(KERN_INFO"%s: sg_block: unknown direction\n", DEVICE_NAME);
+        return (CRIT_ERR);
+    }
+    trace_xpdma_submit(dev->index, (DMA_TO_DEVICE == direction) ? "send" : "recv", count, addr);
+
+    async_hold(dev);
+    start = ktime_get();
+
+    // small transfers: fixed setup cost dominates, take the low-latency path if enabled
+    if (count <= min(fast_max, (unsigned int)FAST_SIZE)) {
+        err = fast_block(dev, direction, data, count, addr);
+        done = count;
+    }
+
+    // large aligned transfers go straight from/to user pages
+    if (!done && zerocopy_min && count >= zerocopy_min &&
+            IS_ALIGNED((unsigned long)data | count | addr, ZEROCOPY_ALIGN)) {
+        done = zc_block(dev, direction, data, count, addr);
+        if (done < 0)
+            err = CRIT_ERR;
+    }
+
+    // small, unaligned or unpinnable remainder goes through staging buffers
+    if (!err && done < count) {
+        if (DMA_TO_DEVICE == direction)
+            err = sg_block_to_device(dev, (char *)data + done, count - done, addr + done, NULL, NULL);
+        else
+            err = sg_block_from_device(dev, (char *)data + done, count - done, addr + done, NULL, NULL);
+    }
+
+    dev->stats.wallNs += ktime_to_ns(ktime_sub(ktime_get(), start));
+    dev->stats.transfers++;
+    if (!err)
+        dev->stats.bytes += count;
+    phase_since(dev, PHASE_TRANSFER, start);
+    phase_done(dev, count, err);
+    async_release(dev);
+
+    return (err);
+}
+
+// File range to/from DDR3 through the staging pipeline, file I/O overlaps with DMA of the previous chunk
+static int file_block(xpdma_dev_t *dev, int direction, cdmaFile_t *req)
+{
+    struct file *filp = NULL;
+    loff_t pos = req->offset;
+    int err = SUCCESS;
+    ktime_t start;
+
+    if (!req->count)
+        return (SUCCESS);
+
+    filp = fget(req->fd);
+    if (NULL == filp)
+        return (CRIT_ERR);
+
+    // direct I/O can't target the kernel staging buffers
+    if ((filp->f_flags & O_DIRECT) || !(filp->f_mode & ((DMA_TO_DEVICE == direction) ? FMODE_READ : FMODE_WRITE))) {
+        printk(KERN_INFO"%s: file_block: fd %d is not usable\n", DEVICE_NAME, req->fd);
+        fput(filp);
+        return (CRIT_ERR);
+    }
+    trace_xpdma_submit(dev->index, (DMA_TO_DEVICE == direction) ? "file_send" : "file_recv", req->count, req->addr);
+
+    async_hold(dev);
+    start = ktime_get();
+
+    if (DMA_TO_DEVICE == direction)
+        err = sg_block_to_device(dev, NULL, req->count, req->addr, filp, &pos);
+    else
+        err = sg_block_from_device(dev, NULL, req->count, req->addr, filp, &pos);
+
+    dev->stats.wallNs += ktime_to_ns(ktime_sub(ktime_get(), start));
+    dev->stats.transfers++;
+    if (!err)
+        dev->stats.bytes += req->count;
+    phase_since(dev, PHASE_TRANSFER, start);
+    phase_done(dev, req->count, err);
+    async_release(dev);
+    fput(filp);
+
+    return (err);
+}
+
+ssize_t xpdma_send (xpdma_dev_t *dev, void *data, size_t count, u32 addr)
+{
+    return sg_block(dev, DMA_TO_DEVICE, (void *)data, count, addr);
+}
+
+ssize_t xpdma_recv (xpdma_dev_t *dev, void *data, size_t count, u32 addr)
+{
+    return sg_block(dev, DMA_FROM_DEVICE, (void *)data, count, addr);
+}
+
+// Vectored element packed into the staging buffer
+typedef struct {
+    u32 offset;                     // Staging buffer offset
+    u32 firstSeg;                   // Segments (descriptor pairs) of the element in the chain
+    u32 nsegs;
+} vec_state_t;
+
+// Segments of a vectored element in staging buffer 0, each with its DDR3 address
+static int vec_addElement(xpdma_dev_t *dev, int direction, u32 offset, cdmaVec_t *vec, u32 *nsegs)
+{
+    sg_seg_t *segs = dev->stageSegs + *nsegs;
+    u32 n = 0;
+    u32 c = 0;
+    u32 block = 0;
+    u32 length = 0;
+    u32 left = vec->count;
+    u32 ddrAddr = vec->addr;
+    dma_addr_t hwAddr;
+
+    // separate segment list: elements never merge, their DDR3 ranges differ
+    while (left) {
+        block = offset / BUF_SIZE;
+        length = min(left, BUF_SIZE - offset % BUF_SIZE);
+        hwAddr = ((DMA_TO_DEVICE == direction) ? dev->stage->writeHWAddr[0][block] : dev->stage->readHWAddr[0][block]) + offset % BUF_SIZE;
+        if (sg_addSegment(segs, &n, dev->stageVectors - *nsegs, hwAddr, length))
+            return (CRIT_ERR);
+        offset += length;
+        left -= length;
+    }
+
+    for (c = 0; c < n; ++c) {
+        segs[c].ddrAddr = ddrAddr;
+        ddrAddr += segs[c].length;
+    }
+    *nsegs += n;
+    return (SUCCESS);
+}
+
+// Element status from its descriptors: SUCCESS when every one completed without error
+static int vec_status(xpdma_dev_t *dev, vec_state_t *state, cdmaVec_t *vec)
+{
+    sg_desc_t *chain = slot_chain(dev, 0) + 2 * state->firstSeg;
+    u32 status = SG_CMPLT_MASK;
+    u32 c = 0;
+
+    for (c = 0; c < 2 * state->nsegs; ++c) {
+        status &= chain[c].status | ~SG_CMPLT_MASK;
+        status |= chain[c].status & SG_ERR_MASK;
+    }
+
+    vec->sgStatus = status & SG_ERR_MASK;
+    vec->status = (status == SG_CMPLT_MASK) ? SUCCESS : CRIT_ERR;
+    return (vec->status);
+}
+
+// Many records between user memory and scattered DDR3 regions: elements are packed
+// into staging buffer 0 and moved by one chain per staging buffer full
+static int vec_block(xpdma_dev_t *dev, int direction, cdmaVec_t *vec, u32 count)
+{
+    vec_state_t *state = NULL;
+    size_t chunk = dev->chunkBytes[STAGE_DIR(direction)];
+    int err = SUCCESS;
+    u32 first = 0;
+    u32 next = 0;
+    u32 c = 0;
+    u32 offset = 0;
+    u32 nsegs = 0;
+    size_t bytes = 0;
+    ktime_t start;
+
+    for (c = 0; c < count; ++c) {
+        vec[c].status = CRIT_ERR;
+        vec[c].sgStatus = 0;
+        if (vec[c].count > chunk) {
+            printk(KERN_INFO"%s: vec_block: element %u of %u bytes exceeds the staging buffer\n", DEVICE_NAME, c, vec[c].count);
+            return (CRIT_ERR);
+        }
+    }
+
+    state = kmalloc(count * sizeof(vec_state_t), GFP_KERNEL);
+    if (NULL == state)
+        return (CRIT_ERR);
+    trace_xpdma_submit(dev->index, (DMA_TO_DEVICE == direction) ? "vec_send" : "vec_recv", count, vec[0].addr);
+
+    async_hold(dev);
+    start = ktime_get();
+
+    for (first = 0; !err && first < count; first = next) {
+        offset = 0;
+        nsegs = 0;
+        for (next = first; next < count; ++next) {
+            offset = ALIGN(offset, VEC_ALIGN);
+            if (offset + vec[next].count > chunk)
+                break;
+            state[next].offset = offset;
+            state[next].firstSeg = nsegs;
+            if (vec_addElement(dev, direction, offset, &vec[next], &nsegs))
+                break;
+            state[next].nsegs = nsegs - state[next].firstSeg;
+            offset += vec[next].count;
+        }
+        if (next == first) {
+            // single element needs more translation vectors than a staging chain has
+            err = CRIT_ERR;
+            break;
+        }
+
+        if (DMA_TO_DEVICE == direction) {
+            for (c = first; !err && c < next; ++c)
+                err = stage_copyAt(dev, 0, direction, state[c].offset, vec[c].data, vec[c].count);
+        }
+
+        if (err)
+            break;
+        if (nsegs) {
+            dev->stats.descriptors += nsegs;
+            dev->stats.chunks++;
+            err = sg_operation(dev, 0, direction, dev->stageSegs, nsegs, SG_ADDR_SEGS);
+            if (err)
+                break;
+            // status words tell which elements made it even if the chain failed
+            err = sg_wait(dev, 0);
+        }
+
+        for (c = first; c < next; ++c) {
+            if (!vec[c].count) {
+                vec[c].status = SUCCESS;
+                continue;
+            }
+            if (SUCCESS != vec_status(dev, &state[c], &vec[c]))
+                continue;
+            dev->stats.bytes += vec[c].count;
+            bytes += vec[c].count;
+            if (DMA_FROM_DEVICE == direction &&
+                    stage_copyAt(dev, 0, direction, state[c].offset, vec[c].data, vec[c].count))
+                vec[c].status = CRIT_ERR;
+        }
+    }
+
+    dev->stats.wallNs += ktime_to_ns(ktime_sub(ktime_get(), start));
+    dev->stats.transfers++;
+    phase_since(dev, PHASE_TRANSFER, start);
+    async_release(dev);
+    kfree(state);
+
+    for (c = 0; !err && c < count; ++c) {
+        if (vec[c].status)
+            err = CRIT_ERR;
+    }
+    phase_done(dev, bytes, err);
+    return (err);
+}
+
+// Pool buffers are allocated to one file and mapped by it only
+static int pool_alloc(struct file *filp, cdmaPoolBuffer_t *pool)
+{
+    xpdma_dev_t *dev = ((xpdma_file_t *)filp->private_data)->dev;
+    u32 c = 0;
+
+    for (c = 0; c < pool_count; ++c) {
+        if (NULL == cmpxchg(&dev->poolOwner[c], NULL, filp)) {
+            pool->index = c;
+            pool->size = BUF_SIZE;
+            pool->offset = (u64)c * BUF_SIZE;
+            return (SUCCESS);
+        }
+    }
+
+    printk(KERN_INFO"%s: pool_alloc: all %u buffers in use\n", DEVICE_NAME, pool_count);
+    return (CRIT_ERR);
+}
+
+static int pool_free(struct file *filp, u32 index)
+{
+    xpdma_file_t *file = filp->private_data;
+    xpdma_dev_t *dev = file->dev;
+
+    if (index >= pool_count || dev->poolOwner[index] != filp)
+        return (CRIT_ERR);
+
+    // asynchronous requests of the file may still use it
+    if (file->inflight) {
+        printk(KERN_INFO"%s: pool_free: requests in flight\n", DEVICE_NAME);
+        return (CRIT_ERR);
+    }
+
+    // CDMA may still be asked to use a mapped buffer through another handle
+    if (atomic_read(&dev->poolMaps[index])) {
+        printk(KERN_INFO"%s: pool_free: buffer %u is still mapped\n", DEVICE_NAME, index);
+        return (CRIT_ERR);
+    }
+
+    dev->poolOwner[index] = NULL;
+    return (SUCCESS);
+}
+
+// Range of a pool buffer must belong to the file and meet CDMA alignment
+static int pool_check(struct file *filp, cdmaBufferRef_t *ref)
+{
+    xpdma_dev_t *dev = ((xpdma_file_t *)filp->private_data)->dev;
+    if (ref->index >= pool_count || dev->poolOwner[ref->index] != filp ||
+            ref->offset > BUF_SIZE || ref->count > BUF_SIZE - ref->offset ||
+            !IS_ALIGNED(ref->offset | ref->addr, ZEROCOPY_ALIGN)) {
+        printk(KERN_INFO"%s: bad pool buffer %u, offset 0x%X, count 0x%X, addr 0x%X\n",
+               DEVICE_NAME, ref->index, ref->offset, ref->count, ref->addr);
+        return (CRIT_ERR);
+    }
+
+    return (SUCCESS);
+}
+
+// Transfer between a pool buffer and DDR: a single chain, no copy and no pinning
+static int pool_block(struct file *filp, int direction, cdmaBufferRef_t *ref)
+{
+    xpdma_dev_t *dev = ((xpdma_file_t *)filp->private_data)->dev;
+    int err = SUCCESS;
+    u32 nsegs = 0;
+    ktime_t start;
+
+    if (pool_check(filp, ref))
+        return (CRIT_ERR);
+
+    if (!ref->count)
+        return (SUCCESS);
+    trace_xpdma_submit(dev->index, (DMA_TO_DEVICE == direction) ? "pool_send" : "pool_recv", ref->count, ref->addr);
+
+    async_hold(dev);
+    start = ktime_get();
+
+    err = sg_addSegment(dev->stageSegs, &nsegs, dev->poolVectors, dev->poolHWAddr[ref->index] + ref->offset, ref->count);
+    if (!err) {
+        dev->stats.descriptors += nsegs;
+        dev->stats.chunks++;
+        err = sg_operation(dev, POOL_SLOT, direction, dev->stageSegs, nsegs, ref->addr);
+    }
+    if (!err)
+        err = sg_wait(dev, POOL_SLOT);
+
+    dev->stats.wallNs += ktime_to_ns(ktime_sub(ktime_get(), start));
+    dev->stats.transfers++;
+    if (!err)
+        dev->stats.bytes += ref->count;
+    phase_since(dev, PHASE_TRANSFER, start);
+    phase_done(dev, ref->count, err);
+    async_release(dev);
+
+    return (err);
+}
+
+// Copy between two DDR3 regions of the card (MEM2MEM): data descriptors only, no
+// translation vectors, the data never crosses PCIe
+static int copy_block(xpdma_dev_t *dev, cdmaCopy_t *copy)
+{
+    int err = SUCCESS;
+    u32 src = copy->src;
+    u32 dst = copy->dst;
+    u32 count = copy->count;
+    u32 bytes = 0;
+    u32 nsegs = 0;
+    ktime_t start;
+
+    if (!IS_ALIGNED(src | dst, ZEROCOPY_ALIGN) ||
+            (u64)src + count > 0x100000000ULL || (u64)dst + count > 0x100000000ULL ||
+            (src < dst + count && dst < src + count)) {
+        printk(KERN_INFO"%s: bad copy 0x%X -> 0x%X, count 0x%X\n", DEVICE_NAME, src, dst, count);
+        return (CRIT_ERR);
+    }
+
+    if (!count)
+        return (SUCCESS);
+    trace_xpdma_submit(dev->index, "copy", count, dst);
+
+    async_hold(dev);
+    start = ktime_get();
+
+    // the pool slot has room for 2 * poolVectors data descriptors
+    while (!err && count) {
+        bytes = 0;
+        for (nsegs = 0; count && nsegs < 2 * dev->poolVectors; ++nsegs) {
+            dev->stageSegs[nsegs].hwAddr = AXI_DDR3_ADDR + src;
+            dev->stageSegs[nsegs].length = min(count, (u32)COPY_BTT);
+            src += dev->stageSegs[nsegs].length;
+            bytes += dev->stageSegs[nsegs].length;
+            count -= dev->stageSegs[nsegs].length;
+        }
+
+        dev->stats.descriptors += nsegs;
+        dev->stats.chunks++;
+        err = sg_operation(dev, POOL_SLOT, DMA_NONE, dev->stageSegs, nsegs, dst);
+        if (!err)
+            err = sg_wait(dev, POOL_SLOT);
+        dst += bytes;
+    }
+
+    dev->stats.wallNs += ktime_to_ns(ktime_sub(ktime_get(), start));
+    dev->stats.transfers++;
+    if (!err)
+        dev->stats.bytes += copy->count;
+    phase_since(dev, PHASE_TRANSFER, start);
+    phase_done(dev, copy->count, err);
+    async_release(dev);
+
+    return (err);
+}
+
+// Hand the ready request chains to CDMA after the running ones (dev->asyncLock held)
+static void async_kick(xpdma_dev_t *dev)
+{
+    u32 first = 0;
+    u32 last = 0;
+    u32 r = 0;
+    s64 expected = 0;
+
+    // moving TAILDESC of a running CDMA races with it stopping at the old tail (a
+    // refetch of the completed tail is an SG internal error): ready chains wait
+    // until async_complete has retired the running ones
+    if (dev->removed || dev->syncActive || dev->asyncResetting || dev->asyncRunning || !dev->asyncReady)
+        return;
+
+    first = (dev->asyncTail + dev->asyncRunning) % dev->asyncDepth;
+    last = (first + dev->asyncReady - 1) % dev->asyncDepth;
+
+    dev->cdmaIdle = 0;
+    sg_setControl(dev, CDMA_CR_SG_EN);
+    sg_setChainWindow(dev);
+    xpdma_writeReg (dev, (CDMA_OFFSET + CDMA_CDESC_OFFSET), slot_chainAddr(dev, ASYNC_SLOT(first)));
+
+    for (r = first; dev->asyncReady; r = (r + 1) % dev->asyncDepth) {
+        dev->kickSeen[ASYNC_SLOT(r)] = 0;
+        dev->kickTime[ASYNC_SLOT(r)] = ktime_get();
+        dev->asyncReady--;
+        dev->asyncRunning++;
+    }
+
+    wmb();
+    trace_xpdma_kick(dev->index, ASYNC_SLOT(last), slot_chainAddr(dev, ASYNC_SLOT(first)),
+                     slot_chainAddr(dev, ASYNC_SLOT(last)) + (dev->descChainLength[ASYNC_SLOT(last)] - 1) * DESCRIPTOR_SIZE);
+    xpdma_writeReg (dev, (CDMA_OFFSET + CDMA_TDESC_OFFSET),
+                    slot_chainAddr(dev, ASYNC_SLOT(last)) + (dev->descChainLength[ASYNC_SLOT(last)] - 1) * DESCRIPTOR_SIZE);
+
+    if (!dev->asyncArmed) {
+        dev->asyncArmed = 1;
+        expected = div_u64((u64)dev->chainBytes[ASYNC_SLOT(dev->asyncTail)] * dev->psPerByte, 1000);
+        hrtimer_start(&dev->asyncTimer, ns_to_ktime(max_t(s64, expected, poll_ns)), HRTIMER_MODE_REL);
+    }
+}
+
+// Synchronous transfer takes CDMA once the running requests have finished,
+// requests submitted meanwhile wait in the ring until async_release(dev)
+static void async_hold(xpdma_dev_t *dev)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->asyncLock, flags);
+    dev->syncActive = 1;
+    spin_unlock_irqrestore(&dev->asyncLock, flags);
+
+    wait_event(dev->asyncIdle, !dev->asyncRunning && !dev->asyncResetting);
+}
+
+static void async_release(xpdma_dev_t *dev)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->asyncLock, flags);
+    dev->syncActive = 0;
+    async_kick(dev);
+    spin_unlock_irqrestore(&dev->asyncLock, flags);
+}
+
+// Room for one more request of the file: its completion record must fit (dev->asyncLock held)
+static inline int async_fileRoom(xpdma_file_t *file)
+{
+    // pairs with the release store of cqHead by the application
+    if (file->ring)
+        return file->inflight + (file->ring->cqTail - smp_load_acquire(&file->ring->cqHead)) < file->ringEntries;
+    return file->inflight + (file->doneHead - file->doneTail) < ASYNC_MAX;
+}
+
+// Post completion record to the file (dev->asyncLock held)
+static void async_post(xpdma_file_t *file, u64 cookie, int status, u32 count)
+{
+    cdmaCompletion_t *done = NULL;
+
+    if (file->ring)
+        done = &file->cq[file->ring->cqTail & (file->ringEntries - 1)];
+    else
+        done = &file->done[file->doneHead % ASYNC_MAX];
+
+    done->cookie = cookie;
+    done->status = status;
+    done->count = count;
+
+    if (file->ring) {
+        // record is visible before the index that publishes it
+        smp_store_release(&file->ring->cqTail, file->ring->cqTail + 1);
+    } else {
+        file->doneHead++;
+    }
+
+    if (file->eventfd)
+        eventfd_signal(file->eventfd);
+    wake_up(&file->wait);
+}
+
+// Retire request of the ring slot (dev->asyncLock held)
+static void async_finish(xpdma_dev_t *dev, u32 r, int status)
+{
+    async_req_t *req = &dev->asyncReq[r];
+    xpdma_file_t *file = req->file;
+
+    dev->stats.transfers++;
+    if (SUCCESS == status)
+        dev->stats.bytes += req->count;
+    phase_done(dev, req->count, SUCCESS != status);
+
+    req->file = NULL;
+    file->inflight--;
+    async_post(file, req->cookie, status, (SUCCESS == status) ? req->count : 0);
+}
+
+// Report the failed request and reset CDMA in process context, then hand it the
+// requests submitted meanwhile
+static void async_fault(struct work_struct *work)
+{
+    xpdma_dev_t *dev = container_of(work, xpdma_dev_t, asyncFault);
+    unsigned long flags;
+
+    if (dev->asyncFaultStatus) {
+        sg_showError(dev, dev->asyncFaultSlot, dev->asyncFaultStatus);
+    } else {
+        printk(KERN_INFO"%s: Asynchronous request timeout\n", DEVICE_NAME);
+        show_descriptors(dev, dev->asyncFaultSlot);
+    }
+    xpdma_reset(dev);
+
+    spin_lock_irqsave(&dev->asyncLock, flags);
+    dev->asyncResetting = 0;
+    async_kick(dev);
+    spin_unlock_irqrestore(&dev->asyncLock, flags);
+    wake_up(&dev->asyncIdle);
+}
+
+// Completion timer: retire finished requests in ring order, then sleep until
+// the expected completion of the oldest running one. It runs in hard interrupt
+// context, failures are reported and CDMA reset by async_fault
+static enum hrtimer_restart async_complete(struct hrtimer *timer)
+{
+    xpdma_dev_t *dev = container_of(timer, xpdma_dev_t, asyncTimer);
+    unsigned long flags;
+    int slot = 0;
+    int done = 0;
+    s64 elapsed = 0;
+    s64 next = 0;
+    int restart = 0;
+
+    spin_lock_irqsave(&dev->asyncLock, flags);
+    while (dev->asyncRunning) {
+        slot = ASYNC_SLOT(dev->asyncTail);
+        done = sg_pollStatus(dev, slot);
+        elapsed = ktime_to_ns(ktime_sub(ktime_get(), dev->kickTime[slot]));
+
+        if (!done && elapsed < SG_TIMEOUT_NS) {
+            next = div_u64((u64)dev->chainBytes[slot] * dev->psPerByte, 1000) - elapsed;
+            break;
+        }
+
+        if (1 != done) {
+            // CDMA halts on errors: fail everything queued, reset it in the work item
+            if (!done) {
+                trace_xpdma_error(dev->index, slot, sg_tailStatus(dev, slot), elapsed);
+                phase_timeout(dev);
+            }
+            dev->asyncFaultSlot = slot;
+            dev->asyncFaultStatus = done ? sg_tailStatus(dev, slot) : 0;
+            while (dev->asyncRunning + dev->asyncReady) {
+                async_finish(dev, dev->asyncTail, CRIT_ERR);
+                dev->asyncTail = (dev->asyncTail + 1) % dev->asyncDepth;
+                if (dev->asyncRunning)
+                    dev->asyncRunning--;
+                else
+                    dev->asyncReady--;
+            }
+            dev->asyncResetting = 1;
+            schedule_work(&dev->asyncFault);
+            break;
+        }
+
+        dev->stats.dmaNs += elapsed;
+        phase_account(dev, PHASE_DMA, elapsed);
+        trace_xpdma_complete(dev->index, slot, sg_tailStatus(dev, slot), elapsed);
+        if (dev->chainBytes[slot] >= PAGE_SIZE)
+            dev->psPerByte = (7 * dev->psPerByte + div_u64((u64)elapsed * 1000, dev->chainBytes[slot])) / 8;
+
+        async_finish(dev, dev->asyncTail, SUCCESS);
+        dev->asyncTail = (dev->asyncTail + 1) % dev->asyncDepth;
+        dev->asyncRunning--;
+
+        // the next chain starts when this one is done
+        if (dev->asyncRunning && ktime_compare(dev->kickTime[ASYNC_SLOT(dev->asyncTail)], ktime_get()) < 0)
+            dev->kickTime[ASYNC_SLOT(dev->asyncTail)] = ktime_get();
+    }
+
+    // CDMA stopped at the tail of the retired chains, start the ones submitted meanwhile
+    if (!dev->asyncRunning)
+        async_kick(dev);
+
+    // decided under the lock: a submitter re-arms the timer once it is disarmed
+    if (dev->asyncRunning)
+        hrtimer_forward_now(timer, ns_to_ktime(max_t(s64, next, max(poll_ns, 1000U))));
+    else
+        dev->asyncArmed = 0;
+    restart = dev->asyncArmed;
+    spin_unlock_irqrestore(&dev->asyncLock, flags);
+
+    if (!restart) {
+        wake_up(&dev->asyncIdle);
+        return (HRTIMER_NORESTART);
+    }
+
+    return (HRTIMER_RESTART);
+}
+
+// Build the request chain in the next ring slot and start it (kick) when
+// CDMA is not owned by a synchronous transfer
+static int async_submit(struct file *filp, cdmaRequest_t *req, int kick)
+{
+    xpdma_file_t *file = filp->private_data;
+    xpdma_dev_t *dev = file->dev;
+    int direction = (REQUEST_SEND == req->direction) ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+    unsigned long flags;
+    u32 nsegs = 0;
+    u32 r = 0;
+    int err = SUCCESS;
+
+    if (READ_ONCE(dev->removed))
+        return (-ENODEV);
+    if (!dev->asyncDepth || req->direction > REQUEST_RECV || !req->buffer.count ||
+            pool_check(filp, &req->buffer))
+        return (CRIT_ERR);
+    trace_xpdma_submit(dev->index, (REQUEST_SEND == req->direction) ? "async_send" : "async_recv",
+                       req->buffer.count, req->buffer.addr);
+
+    mutex_lock(&dev->asyncSubmit);
+
+    // ring slot and room for the completion record
+    spin_lock_irqsave(&dev->asyncLock, flags);
+    if (dev->asyncRunning + dev->asyncReady >= dev->asyncDepth || !async_fileRoom(file)) {
+        spin_unlock_irqrestore(&dev->asyncLock, flags);
+        mutex_unlock(&dev->asyncSubmit);
+        return -EAGAIN;
+    }
+    r = (dev->asyncTail + dev->asyncRunning + dev->asyncReady) % dev->asyncDepth;
+    spin_unlock_irqrestore(&dev->asyncLock, flags);
+
+    // slot is not used by CDMA, build its chain outside of the lock
+    err = sg_addSegment(dev->asyncSegs, &nsegs, dev->poolVectors,
+                        dev->poolHWAddr[req->buffer.index] + req->buffer.offset, req->buffer.count);
+    if (!err)
+        err = sg_prepare(dev, ASYNC_SLOT(r), direction, dev->asyncSegs, nsegs, req->buffer.addr);
+    if (err) {
+        mutex_unlock(&dev->asyncSubmit);
+        return (CRIT_ERR);
+    }
+    slot_chain(dev, ASYNC_SLOT(r))[dev->descChainLength[ASYNC_SLOT(r)] - 1].nextDesc = slot_chainAddr(dev, ASYNC_SLOT((r + 1) % dev->asyncDepth));
+
+    dev->asyncReq[r].file = file;
+    dev->asyncReq[r].cookie = req->cookie;
+    dev->asyncReq[r].count = req->buffer.count;
+
+    spin_lock_irqsave(&dev->asyncLock, flags);
+    // xpdma_unplug failed the queued requests under this lock
+    if (dev->removed) {
+        spin_unlock_irqrestore(&dev->asyncLock, flags);
+        mutex_unlock(&dev->asyncSubmit);
+        return (-ENODEV);
+    }
+    dev->stats.descriptors += nsegs;
+    dev->stats.chunks++;
+    file->inflight++;
+    dev->asyncReady++;
+    if (kick)
+        async_kick(dev);
+    spin_unlock_irqrestore(&dev->asyncLock, flags);
+
+    mutex_unlock(&dev->asyncSubmit);
+    return (SUCCESS);
+}
+
+// Take the queued submissions of the shared ring into the asynchronous ring,
+// all of them start with a single TAILDESC write; returns submissions taken
+static int ring_submit(struct file *filp)
+{
+    xpdma_file_t *file = filp->private_data;
+    xpdma_dev_t *dev = file->dev;
+    cdmaRing_t *ring = file->ring;
+    cdmaRequest_t req;
+    unsigned long flags;
+    u32 head = 0;
+    u32 tail = 0;
+    int err = SUCCESS;
+    int n = 0;
+
+    mutex_lock(&file->ringLock);
+    head = ring->sqHead;
+    // entries are read after the index that published them
+    tail = smp_load_acquire(&ring->sqTail);
+
+    while (head != tail) {
+        req = file->sq[head & (file->ringEntries - 1)];
+        err = async_submit(filp, &req, 0);
+        if (-EAGAIN == err)
+            break;
+
+        // invalid submission completes at once with an error
+        if (err) {
+            spin_lock_irqsave(&dev->asyncLock, flags);
+            if (!async_fileRoom(file)) {
+                spin_unlock_irqrestore(&dev->asyncLock, flags);
+                break;
+            }
+            async_post(file, req.cookie, CRIT_ERR, 0);
+            spin_unlock_irqrestore(&dev->asyncLock, flags);
+        }
+        head++;
+        n++;
+    }
+
+    // entries are consumed before the application may reuse them
+    smp_store_release(&ring->sqHead, head);
+
+    spin_lock_irqsave(&dev->asyncLock, flags);
+    async_kick(dev);
+    spin_unlock_irqrestore(&dev->asyncLock, flags);
+    mutex_unlock(&file->ringLock);
+
+    return (n);
+}
+
+// Submission ring poll thread: drains the ring without syscalls, sleeps after
+// ring_idle_us without submissions until IOCTL_RING_ENTER wakes it up
+static int ring_thread(void *data)
+{
+    struct file *filp = data;
+    xpdma_file_t *file = filp->private_data;
+    cdmaRing_t *ring = file->ring;
+    unsigned long idle = jiffies + usecs_to_jiffies(ring_idle_us);
+
+    while (!kthread_should_stop()) {
+        if (ring_submit(filp))
+            idle = jiffies + usecs_to_jiffies(ring_idle_us);
+
+        if (time_before(jiffies, idle)) {
+            cond_resched();
+            continue;
+        }
+
+        set_current_state(TASK_INTERRUPTIBLE);
+        ring->flags |= RING_NEED_WAKEUP;
+        // flag is visible before the last look at the tail
+        smp_mb();
+        if (ring->sqHead == READ_ONCE(ring->sqTail) && !kthread_should_stop())
+            schedule();
+        __set_current_state(TASK_RUNNING);
+        ring->flags &= ~RING_NEED_WAKEUP;
+        idle = jiffies + usecs_to_jiffies(ring_idle_us);
+    }
+
+    return (SUCCESS);
+}
+
+static int ring_setup(struct file *filp, cdmaRingSetup_t *setup)
+{
+    xpdma_file_t *file = filp->private_data;
+    xpdma_dev_t *dev = file->dev;
+    u32 entries = roundup_pow_of_two(clamp_t(u32, setup->entries, 1, RING_MAX_ENTRIES));
+    u32 size = PAGE_ALIGN(sizeof(cdmaRing_t) + entries * (sizeof(cdmaRequest_t) + sizeof(cdmaCompletion_t)));
+    char *mem = NULL;
+    struct page *page = NULL;
+    unsigned long flags;
+
+    mutex_lock(&file->ringLock);
+    if (file->ring || file->inflight) {
+        mutex_unlock(&file->ringLock);
+        return (CRIT_ERR);
+    }
+
+    // polled by the card node thread and the submitter: on the card node
+    page = alloc_pages_node(dev->node, GFP_KERNEL | __GFP_ZERO, get_order(size));
+    mem = page ? (char *)page_address(page) : NULL;
+    if (NULL == mem) {
+        mutex_unlock(&file->ringLock);
+        return (CRIT_ERR);
+    }
+
+    file->sq = (cdmaRequest_t *)(mem + sizeof(cdmaRing_t));
+    file->cq = (cdmaCompletion_t *)(mem + sizeof(cdmaRing_t) + entries * sizeof(cdmaRequest_t));
+    file->ringEntries = entries;
+    file->ringSize = size;
+    spin_lock_irqsave(&dev->asyncLock, flags);
+    file->ring = (cdmaRing_t *)mem;
+    spin_unlock_irqrestore(&dev->asyncLock, flags);
+
+    if (setup->flags & RING_SQPOLL) {
+        file->ringThread = kthread_create_on_node(ring_thread, filp, dev->node, "xpdma_sq%d", dev->index);
+        if (IS_ERR(file->ringThread)) {
+            file->ringThread = NULL;
+            mutex_unlock(&file->ringLock);
+            ring_free(file);
+            return (CRIT_ERR);
+        }
+        // poll next to the card
+        if (0 <= dev->node)
+            set_cpus_allowed_ptr(file->ringThread, cpumask_of_node(dev->node));
+        wake_up_process(file->ringThread);
+    }
+    mutex_unlock(&file->ringLock);
+
+    setup->entries = entries;
+    setup->size = size;
+    setup->sqOffset = (char *)file->sq - mem;
+    setup->cqOffset = (char *)file->cq - mem;
+    setup->offset = RING_MMAP_OFFSET;
+    return (SUCCESS);
+}
+
+// Doorbell: take the queued submissions (or wake up the poll thread) and
+// wait until wait completions are in the ring; returns submissions taken
+static int ring_enter(struct file *filp, u32 wait)
+{
+    xpdma_file_t *file = filp->private_data;
+    cdmaRing_t *ring = file->ring;
+    int n = 0;
+
+    if (NULL == ring)
+        return (CRIT_ERR);
+
+    if (file->ringThread)
+        wake_up_process(file->ringThread);
+    else
+        n = ring_submit(filp);
+
+    if (wait && wait_event_interruptible(file->wait,
+            ring->cqTail - READ_ONCE(ring->cqHead) >= min(wait, file->ringEntries) || !file->inflight))
+        return -ERESTARTSYS;
+
+    return (n);
+}
+
+// Stop the poll thread and free the rings (mappings are gone, nothing in flight)
+static void ring_free(xpdma_file_t *file)
+{
+    if (file->ringThread)
+        kthread_stop(file->ringThread);
+    file->ringThread = NULL;
+
+    if (file->ring)
+        free_pages((unsigned long)file->ring, get_order(file->ringSize));
+    file->ring = NULL;
+}
+
+static int async_eventfd(xpdma_file_t *file, int fd)
+{
+    xpdma_dev_t *dev = file->dev;
+    struct eventfd_ctx *ctx = NULL;
+    struct eventfd_ctx *old = NULL;
+    unsigned long flags;
+
+    if (fd >= 0) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return (CRIT_ERR);
+    }
+
+    spin_lock_irqsave(&dev->asyncLock, flags);
+    old = file->eventfd;
+    file->eventfd = ctx;
+    spin_unlock_irqrestore(&dev->asyncLock, flags);
+
+    if (old)
+        eventfd_ctx_put(old);
+    return (SUCCESS);
+}
+
+static inline u32 stream_chainAddr(xpdma_dev_t *dev, u32 slot)
+{
+    return dev->descChainAddr + 2 * slot * DESCRIPTOR_SIZE;
+}
+
+// Slots CDMA filled since the last look, in ring order (dev->streamLock held)
+static int stream_collect(xpdma_dev_t *dev)
+{
+    cdmaStream_t *ctl = dev->streamCtl;
+    sg_desc_t *chain = dev->descChain;
+    u32 slot = 0;
+    u32 status = 0;
+    int filled = 0;
+
+    while (dev->streamHead != dev->streamArmed) {
+        slot = dev->streamHead % dev->streamSlots;
+        status = chain[2 * slot + 1].status;
+        if (!(status & SG_COMPLETE_MASK))
+            break;
+        if ((status | chain[2 * slot].status) & SG_ERR_MASK) {
+            printk(KERN_INFO"%s: Stream: slot %u status 0x%08X\n", DEVICE_NAME, dev->streamHead, status);
+            return (CRIT_ERR);
+        }
+        dev->streamHead++;
+        ctl->bytes += dev->streamSlotSize;
+        filled = 1;
+    }
+
+    if (filled) {
+        dev->streamKick = ktime_get();
+        // slot data is visible before the index that publishes it
+        smp_wmb();
+        ctl->head = dev->streamHead;
+        if (dev->streamFile->eventfd)
+            eventfd_signal(dev->streamFile->eventfd);
+        wake_up(&dev->streamFile->wait);
+    }
+    return (SUCCESS);
+}
+
+// Hand the slots the application released back to CDMA: clear their status,
+// point them at the next DDR3 ring position and move the tail (dev->streamLock held)
+static int stream_arm(xpdma_dev_t *dev)
+{
+    cdmaStream_t *ctl = dev->streamCtl;
+    sg_desc_t *chain = dev->descChain;
+    u32 tail = READ_ONCE(ctl->tail);
+    u32 armed = dev->streamArmed;
+    u32 slot = 0;
+
+    // slots never filled cannot be released
+    if ((s32)(tail - dev->streamHead) > 0 || dev->streamHead - tail > dev->streamSlots)
+        tail = dev->streamHead;
+
+    while (armed - tail < dev->streamSlots) {
+        slot = armed % dev->streamSlots;
+        chain[2 * slot].status = 0x00000000;
+        chain[2 * slot + 1].srcAddr = AXI_DDR3_ADDR + dev->streamDdrAddr + dev->streamDdrNext;
+        chain[2 * slot + 1].status = 0x00000000;
+        dev->streamDdrNext = (dev->streamDdrNext + dev->streamSlotSize) % dev->streamDdrSize;
+        armed++;
+    }
+    if (armed == dev->streamArmed)
+        return (SUCCESS);
+
+    if (dev->streamStalled) {
+        ctl->stallNs += ktime_to_ns(ktime_sub(ktime_get(), dev->streamStall));
+        dev->streamStalled = 0;
+    }
+
+    // CDMA that stopped at the old tail restarts from the first new slot, once
+    // everything it finished is collected (a completed descriptor must not be refetched)
+    if (dev->streamArmed != dev->streamHead && xpdma_isIdle(dev) && stream_collect(dev))
+        return (CRIT_ERR);
+
+    wmb();
+    if (dev->streamArmed == dev->streamHead) {
+        dev->streamKick = ktime_get();
+        sg_setControl(dev, CDMA_CR_SG_EN);
+        sg_setChainWindow(dev);
+        xpdma_writeReg (dev, (CDMA_OFFSET + CDMA_CDESC_OFFSET), stream_chainAddr(dev, dev->streamHead % dev->streamSlots));
+    }
+    dev->streamArmed = armed;
+    xpdma_writeReg (dev, (CDMA_OFFSET + CDMA_TDESC_OFFSET),
+                    stream_chainAddr(dev, (armed - 1) % dev->streamSlots) + DESCRIPTOR_SIZE);
+    return (SUCCESS);
+}
+
+// Stream timer: publish filled slots, re-arm released ones, account stalls
+static enum hrtimer_restart stream_complete(struct hrtimer *timer)
+{
+    xpdma_dev_t *dev = container_of(timer, xpdma_dev_t, streamTimer);
+    cdmaStream_t *ctl = dev->streamCtl;
+    unsigned long flags;
+    s64 next = 0;
+    int err = SUCCESS;
+
+    spin_lock_irqsave(&dev->streamLock, flags);
+    err = stream_collect(dev);
+    if (!err)
+        err = stream_arm(dev);
+
+    if (!err && dev->streamArmed != dev->streamHead &&
+            ktime_to_ns(ktime_sub(ktime_get(), dev->streamKick)) > SG_TIMEOUT_NS) {
+        printk(KERN_INFO"%s: Stream: timeout at slot %u\n", DEVICE_NAME, dev->streamHead);
+        err = CRIT_ERR;
+    }
+
+    if (err) {
+        // CDMA halted, the stream stays stopped until IOCTL_STREAM_STOP
+        ctl->status = STREAM_ERROR;
+        wake_up(&dev->streamFile->wait);
+        spin_unlock_irqrestore(&dev->streamLock, flags);
+        return (HRTIMER_NORESTART);
+    }
+
+    if (dev->streamArmed == dev->streamHead) {
+        // every slot is full: CDMA stopped, the DDR3 ring is not drained meanwhile
+        if (!dev->streamStalled) {
+            dev->streamStalled = 1;
+            dev->streamStall = ktime_get();
+            ctl->overruns++;
+        }
+        next = STREAM_IDLE_NS;
+    } else {
+        next = max_t(s64, div_u64((u64)dev->streamSlotSize * dev->psPerByte, 1000), poll_ns);
+    }
+    spin_unlock_irqrestore(&dev->streamLock, flags);
+
+    hrtimer_forward_now(timer, ns_to_ktime(next));
+    return (HRTIMER_RESTART);
+}
+
+static void stream_free(xpdma_dev_t *dev)
+{
+    u32 c = 0;
+
+    for (c = 0; c < STREAM_MAX_SLOTS; ++c) {
+        if (NULL != dev->streamBuffer[c])
+            dma_free_coherent( &dev->pdev->dev, dev->streamSlotSize, dev->streamBuffer[c], dev->streamHWAddr[c]);
+        dev->streamBuffer[c] = NULL;
+    }
+    if (dev->streamCtl)
+        free_pages((unsigned long)dev->streamCtl, 0);
+    dev->streamCtl = NULL;
+}
+
+// Start streaming the DDR3 ring into the host ring: one descriptor pair per slot
+// in a cyclic chain over the synchronous slots range, the file owns CDMA meanwhile
+static int stream_start(struct file *filp, cdmaStreamSetup_t *setup)
+{
+    xpdma_file_t *file = filp->private_data;
+    xpdma_dev_t *dev = file->dev;
+    u32 room = min_t(u32, STREAM_MAX_SLOTS, slot_first(dev, ASYNC_SLOT(0)));
+    sg_desc_t *chain = dev->descChain;
+    struct page *page = NULL;
+    unsigned long flags;
+    dma_addr_t hwAddr;
+    u32 c = 0;
+    int err = SUCCESS;
+
+    if (setup->slots < 2 || setup->slots > room || !setup->slotSize || setup->slotSize > BUF_SIZE ||
+            (setup->slotSize & (PAGE_SIZE - 1)) || (setup->ddrAddr & (ZEROCOPY_ALIGN - 1)) ||
+            !setup->ddrSize || (setup->ddrSize % setup->slotSize) || STREAM_CTL_SIZE != PAGE_SIZE) {
+        printk(KERN_INFO"%s: Stream: bad setup, %u slots of %u bytes max\n", DEVICE_NAME, room, BUF_SIZE);
+        return (CRIT_ERR);
+    }
+    if (dev->streamFile)
+        return (CRIT_ERR);
+
+    // synchronous transfers wait, asynchronous requests stay queued until the stream stops
+    if (sched_acquire(dev, file, (size_t)setup->slots * setup->slotSize))
+        return (-ERESTARTSYS);
+    if (dev->streamFile) {
+        sched_release(dev);
+        return (CRIT_ERR);
+    }
+    async_hold(dev);
+
+    dev->streamSlots = setup->slots;
+    dev->streamSlotSize = setup->slotSize;
+    dev->streamDdrAddr = setup->ddrAddr;
+    dev->streamDdrSize = setup->ddrSize;
+    dev->streamHead = 0;
+    dev->streamArmed = 0;
+    dev->streamDdrNext = 0;
+    dev->streamStalled = 0;
+
+    page = alloc_pages_node(dev->node, GFP_KERNEL | __GFP_ZERO, 0);
+    dev->streamCtl = page ? (cdmaStream_t *)page_address(page) : NULL;
+    for (c = 0; dev->streamCtl && c < dev->streamSlots; ++c) {
+        dev->streamBuffer[c] = dma_alloc_coherent( &dev->pdev->dev, dev->streamSlotSize, &dev->streamHWAddr[c], GFP_KERNEL );
+        if (NULL == dev->streamBuffer[c])
+            break;
+    }
+    if (c < dev->streamSlots) {
+        printk(KERN_INFO"%s: Stream: Unable to allocate %u slots\n", DEVICE_NAME, dev->streamSlots);
+        stream_free(dev);
+        async_release(dev);
+        sched_release(dev);
+        return (CRIT_ERR);
+    }
+
+    // translation vector per slot: the slot buffer never crosses AXI:BAR1 aperture
+    for (c = 0; c < dev->streamSlots; ++c) {
+        hwAddr = dev->streamHWAddr[c];
+        chain[2 * c].nextDesc     = stream_chainAddr(dev, c) + DESCRIPTOR_SIZE;
+        chain[2 * c].srcAddr      = AXI_BRAM_ADDR + c * BRAM_STEP;
+        chain[2 * c].destAddr     = AXI_BRAM_ADDR + PCIE_CTL_OFFSET + AXIBAR2PCIEBAR_1U;
+        chain[2 * c].control      = ADDR_BTT;
+        chain[2 * c + 1].nextDesc = stream_chainAddr(dev, (c + 1) % dev->streamSlots);
+        chain[2 * c + 1].destAddr = AXI_PCIE_DM_ADDR + (hwAddr & (AXI_PCIE_DM_SIZE - 1));
+        chain[2 * c + 1].control  = dev->streamSlotSize;
+        sg_setVector(dev, c * BRAM_STEP, (size_t)hwAddr & ~((size_t)AXI_PCIE_DM_SIZE - 1));
+    }
+    // synchronous slot chains are rebuilt on their next use
+    for (c = 0; c <= POOL_SLOT; ++c)
+        dev->descLayout[c] = SG_LAYOUT_NONE;
+
+    spin_lock_irqsave(&dev->streamLock, flags);
+    dev->streamFile = file;
+    dev->cdmaIdle = 0;
+    err = stream_arm(dev);
+    spin_unlock_irqrestore(&dev->streamLock, flags);
+    if (err) {
+        stream_stop(filp);
+        return (CRIT_ERR);
+    }
+    hrtimer_start(&dev->streamTimer, ns_to_ktime(poll_ns), HRTIMER_MODE_REL);
+
+    setup->size = STREAM_CTL_SIZE + dev->streamSlots * dev->streamSlotSize;
+    setup->offset = STREAM_MMAP_OFFSET;
+    printk(KERN_INFO"%s: Stream: %u slots of %u bytes from DDR3 0x%08X (%u bytes)\n", DEVICE_NAME,
+           dev->streamSlots, dev->streamSlotSize, dev->streamDdrAddr, dev->streamDdrSize);
+    return (SUCCESS);
+}
+
+// Halt CDMA in the middle of the ring and give it back to other transfers
+static int stream_stop(struct file *filp)
+{
+    xpdma_file_t *file = filp->private_data;
+    xpdma_dev_t *dev = file->dev;
+    unsigned long flags;
+
+    if (dev->streamFile != file)
+        return (CRIT_ERR);
+    if (atomic_read(&dev->streamMaps)) {
+        printk(KERN_INFO"%s: Stream: still mapped\n", DEVICE_NAME);
+        return (CRIT_ERR);
+    }
+
+    hrtimer_cancel(&dev->streamTimer);
+    // CDMA of a removed card was stopped by xpdma_unplug
+    if (!dev->removed)
+        xpdma_reset(dev);
+    printk(KERN_INFO"%s: Stream: stopped after %llu bytes, %llu overruns\n", DEVICE_NAME,
+           dev->streamCtl->bytes, dev->streamCtl->overruns);
+
+    spin_lock_irqsave(&dev->streamLock, flags);
+    dev->streamFile = NULL;
+    spin_unlock_irqrestore(&dev->streamLock, flags);
+    stream_free(dev);
+
+    async_release(dev);
+    sched_release(dev);
+    return (SUCCESS);
+}
+
+// Read/write many registers under one syscall, a write drops the cached CDMA/BRAM state.
+// Reads reach all of BAR0; writes the CDMA window, the rest only with regs_writable
+static int regs_batch(struct file *filp, cdmaRegBatch_t *batch)
+{
+    xpdma_file_t *file = filp->private_data;
+    xpdma_dev_t *dev = file->dev;
+    cdmaRegOp_t *ops = NULL;
+    u32 c = 0;
+    int written = 0;
+    int err = SUCCESS;
+
+    if (!batch->count || batch->count > REG_BATCH_MAX)
+        return (CRIT_ERR);
+
+    ops = kmalloc(batch->count * sizeof(cdmaRegOp_t), GFP_KERNEL);
+    if (NULL == ops)
+        return (CRIT_ERR);
+    if ( copy_from_user(ops, batch->ops, batch->count * sizeof(cdmaRegOp_t)) ) {
+        kfree(ops);
+        return (CRIT_ERR);
+    }
+
+    // a bad access fails the whole batch before any register is touched
+    for (c = 0; c < batch->count; ++c) {
+        if ((ops[c].reg & 3) || ops[c].reg >= dev->baseLen ||
+                (ops[c].write && !regs_writable && !cdma_regValid(ops[c].reg))) {
+            kfree(ops);
+            return (CRIT_ERR);
+        }
+        written |= !!ops[c].write;
+    }
+
+    // writes do not land under a running transfer
+    if (written && sched_acquire(dev, file, 0)) {
+        kfree(ops);
+        return (-ERESTARTSYS);
+    }
+    for (c = 0; c < batch->count; ++c) {
+        if (ops[c].write)
+            xpdma_writeReg(dev, ops[c].reg, ops[c].value);
+        else
+            ops[c].value = xpdma_readReg(dev, ops[c].reg);
+    }
+    if (written) {
+        sg_invalidate(dev);
+        sched_release(dev);
+    }
+
+    if ( copy_to_user(batch->ops, ops, batch->count * sizeof(cdmaRegOp_t)) )
+        err = CRIT_ERR;
+    kfree(ops);
+
+    return (err);
+}
+
+static void regs_vmaOpen(struct vm_area_struct *vma)
+{
+    xpdma_dev_t *dev = ((xpdma_file_t *)vma->vm_file->private_data)->dev;
+
+    atomic_inc(&dev->regsWriters);
+}
+
+static void regs_vmaClose(struct vm_area_struct *vma)
+{
+    xpdma_dev_t *dev = ((xpdma_file_t *)vma->vm_file->private_data)->dev;
+
+    atomic_dec(&dev->regsWriters);
+}
+
+// Writable mappings are counted, transfers rebuild CDMA/BRAM state while one exists
+static struct vm_operations_struct regs_vmOps = {
+        open           : regs_vmaOpen,
+        close          : regs_vmaClose,
+};
+
+// Map BAR0 uncached: read only unless regs_writable is set
+static int regs_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    xpdma_dev_t *dev = ((xpdma_file_t *)filp->private_data)->dev;
+    unsigned long size = vma->vm_end - vma->vm_start;
+
+    if (size > PAGE_ALIGN(dev->baseLen))
+        return (CRIT_ERR);
+
+    if ((vma->vm_flags & VM_WRITE) && !regs_writable)
+        return (CRIT_ERR);
+    // writable only when asked for at mmap(), so every writable mapping is counted
+    if (!(vma->vm_flags & VM_WRITE))
+        vm_flags_clear(vma, VM_MAYWRITE);
+
+    // io_remap_pfn_range marks the mapping VM_IO | VM_PFNMAP
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+    if (io_remap_pfn_range(vma, vma->vm_start, dev->baseHdwr >> PAGE_SHIFT, size, vma->vm_page_prot))
+        return (CRIT_ERR);
+
+    if (vma->vm_flags & VM_WRITE) {
+        vma->vm_ops = &regs_vmOps;
+        regs_vmaOpen(vma);
+    }
+
+    return (SUCCESS);
+}
+
+static void stream_vmaOpen(struct vm_area_struct *vma)
+{
+    xpdma_dev_t *dev = ((xpdma_file_t *)vma->vm_file->private_data)->dev;
+
+    atomic_inc(&dev->streamMaps);
+}
+
+static void stream_vmaClose(struct vm_area_struct *vma)
+{
+    xpdma_dev_t *dev = ((xpdma_file_t *)vma->vm_file->private_data)->dev;
+
+    atomic_dec(&dev->streamMaps);
+}
+
+static struct vm_operations_struct stream_vmOps = {
+        open           : stream_vmaOpen,
+        close          : stream_vmaClose,
+};
+
+// Map the control page or one slot: the offset of the piece in the stream layout
+// (control page, then the slots) selects it
+static int stream_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    xpdma_file_t *file = filp->private_data;
+    xpdma_dev_t *dev = file->dev;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    unsigned long pgoff = vma->vm_pgoff;
+    unsigned long offset = (pgoff << PAGE_SHIFT) - STREAM_MMAP_OFFSET;
+    u32 c = 0;
+    int err = 0;
+
+    if (dev->streamFile != file)
+        return (CRIT_ERR);
+
+    if (!offset) {
+        if (size > STREAM_CTL_SIZE)
+            return (CRIT_ERR);
+        err = remap_pfn_range(vma, vma->vm_start, page_to_pfn(virt_to_page(dev->streamCtl)), size, vma->vm_page_prot);
+    } else {
+        offset -= STREAM_CTL_SIZE;
+        c = offset / dev->streamSlotSize;
+        if ((offset % dev->streamSlotSize) || c >= dev->streamSlots || size > dev->streamSlotSize)
+            return (CRIT_ERR);
+        // the DMA API maps coherent memory (IOMMU, remapped or uncached) from the slot start
+        vma->vm_pgoff = 0;
+        err = dma_mmap_coherent(&dev->pdev->dev, vma, dev->streamBuffer[c], dev->streamHWAddr[c], dev->streamSlotSize);
+        vma->vm_pgoff = pgoff;
+    }
+    if (err)
+        return (CRIT_ERR);
+
+    vma->vm_ops = &stream_vmOps;
+    stream_vmaOpen(vma);
+    return (SUCCESS);
+}
+
+static void xpdma_vmaOpen(struct vm_area_struct *vma)
+{
+    xpdma_dev_t *dev = ((xpdma_file_t *)vma->vm_file->private_data)->dev;
+
+    atomic_inc(&dev->poolMaps[(unsigned long)vma->vm_private_data]);
+}
+
+static void xpdma_vmaClose(struct vm_area_struct *vma)
+{
+    xpdma_dev_t *dev = ((xpdma_file_t *)vma->vm_file->private_data)->dev;
+
+    atomic_dec(&dev->poolMaps[(unsigned long)vma->vm_private_data]);
+}
+
+static struct vm_operations_struct xpdma_vmOps = {
+        open           : xpdma_vmaOpen,
+        close          : xpdma_vmaClose,
+};
+
+// Map pool buffer allocated by IOCTL_BUF_ALLOC, mmap offset selects the buffer
+int xpdma_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    unsigned long size = vma->vm_end - vma->vm_start;
+    unsigned long index = vma->vm_pgoff / (BUF_SIZE >> PAGE_SHIFT);
+    xpdma_file_t *file = filp->private_data;
+    xpdma_dev_t *dev = file->dev;
+    int err = 0;
+
+    // streaming control page and slots
+    if (vma->vm_pgoff >= (STREAM_MMAP_OFFSET >> PAGE_SHIFT))
+        return stream_mmap(filp, vma);
+
+    // BAR0 registers
+    if (vma->vm_pgoff == (REGS_MMAP_OFFSET >> PAGE_SHIFT))
+        return regs_mmap(filp, vma);
+
+    // shared submission/completion rings
+    if (vma->vm_pgoff == (RING_MMAP_OFFSET >> PAGE_SHIFT)) {
+        if (NULL == file->ring || size > file->ringSize)
+            return (CRIT_ERR);
+        return remap_pfn_range(vma, vma->vm_start, virt_to_phys(file->ring) >> PAGE_SHIFT,
+                               size, vma->vm_page_prot);
+    }
+
+    if ((vma->vm_pgoff % (BUF_SIZE >> PAGE_SHIFT)) || index >= pool_count ||
+            dev->poolOwner[index] != filp || size > BUF_SIZE) {
+        printk(KERN_INFO"%s: mmap: bad pool buffer offset 0x%lX, size 0x%lX\n",
+               DEVICE_NAME, vma->vm_pgoff << PAGE_SHIFT, size);
+        return (CRIT_ERR);
+    }
+
+    // the DMA API maps coherent memory (IOMMU, remapped or uncached) from the buffer start
+    vma->vm_pgoff = 0;
+    err = dma_mmap_coherent(&dev->pdev->dev, vma, dev->poolBuffer[index], dev->poolHWAddr[index], BUF_SIZE);
+    vma->vm_pgoff = index * (BUF_SIZE >> PAGE_SHIFT);
+    if (err)
+        return (CRIT_ERR);
+
+    vma->vm_private_data = (void *)index;
+    vma->vm_ops = &xpdma_vmOps;
+    xpdma_vmaOpen(vma);
+
+    return (SUCCESS);
+}
+
+int xpdma_release(struct inode *inode, struct file *filp)
+{
+    u32 c = 0;
+    xpdma_file_t *file = filp->private_data;
+    xpdma_dev_t *dev = file->dev;
+
+    // xpdma_unplug fails the requests of the files, then waits for their releases
+    down_read(&dev->removeLock);
+    mutex_lock(&dev->filesLock);
+    list_del(&file->list);
+    mutex_unlock(&dev->filesLock);
+
+    // completion timer posts to the file until its last request is done
+    if (file->ringThread)
+        kthread_stop(file->ringThread);
+    file->ringThread = NULL;
+    wait_event(file->wait, !file->inflight);
+    ring_free(file);
+    if (dev->streamFile == file)
+        stream_stop(filp);
+    if (file->eventfd)
+        eventfd_ctx_put(file->eventfd);
+
+    // mappings hold the file, so none of its pool buffers is mapped anymore
+    for (c = 0; c < pool_count; ++c)
+        (void) cmpxchg(&dev->poolOwner[c], filp, NULL);
+
+    kfree(filp->private_data);
+    filp->private_data = NULL;
+    up_read(&dev->removeLock);
+    kref_put(&dev->ref, xpdma_devFree);
+
+    printk(KERN_INFO"%s: Release: module released\n", DEVICE_NAME);
+    return (SUCCESS);
+}
+
+// IO access (with byte addressing)
+static inline u32 xpdma_readReg (xpdma_dev_t *dev, u32 reg)
+{
+    u32 val = readl(dev->baseVirt + reg);
+
+    trace_xpdma_reg_read(dev->index, reg, val);
+    return (val);
+}
+
+static inline void xpdma_writeReg (xpdma_dev_t *dev, u32 reg, u32 val)
+{
+    trace_xpdma_reg_write(dev->index, reg, val);
+    writel(val, (dev->baseVirt + reg));
+}
+
+// BAR0 offset of a register of the CDMA window, the only one IOCTL_RDCDMAREG/WRCDMAREG reach
+static inline int cdma_regValid(u32 reg)
+{
+    return !(reg & 3) && reg >= CDMA_OFFSET && reg < CDMA_OFFSET + CDMA_REGS_SIZE;
+}
+
+// Allocate a staging buffer of blocks BUF_SIZE blocks on the node. Coherent memory
+// follows the device node, so only a card node buffer can be one contiguous region
+// (CMA or a large enough free page block); otherwise node local pages are
+// streaming-mapped block by block and handed over with stage_sync
+static int stage_alloc(xpdma_dev_t *dev, int node, int direction, char **buffer, dma_addr_t *hwAddr, size_t *contig, u32 blocks)
+{
+    enum dma_data_direction dir = direction;
+    struct page *page = NULL;
+    u32 block = 0;
+
+    *contig = 0;
+    if (stage_contig && (1 < blocks) && (node == dev->node)) {
+        buffer[0] = dma_alloc_coherent( &dev->pdev->dev, (size_t)blocks * BUF_SIZE, &hwAddr[0], GFP_KERNEL | __GFP_NOWARN );
+        if (NULL != buffer[0]) {
+            // blocks are views of one allocation; a block straddling an AXI:BAR1 aperture
+            // border takes the spare translation vector stageVectors counts per block
+            for (block = 1; block < blocks; ++block) {
+                buffer[block] = buffer[0] + (size_t)block * BUF_SIZE;
+                hwAddr[block] = hwAddr[0] + (dma_addr_t)block * BUF_SIZE;
+            }
+            *contig = (size_t)blocks * BUF_SIZE;
+            return (SUCCESS);
+        }
+    }
+
+    for (block = 0; block < blocks; ++block) {
+        page = alloc_pages_node(node, GFP_KERNEL, get_order(BUF_SIZE));
+        if (NULL == page)
+            return (CRIT_ERR);
+        hwAddr[block] = dma_map_page(&dev->pdev->dev, page, 0, BUF_SIZE, dir);
+        if (dma_mapping_error(&dev->pdev->dev, hwAddr[block])) {
+            __free_pages(page, get_order(BUF_SIZE));
+            return (CRIT_ERR);
+        }
+        buffer[block] = page_address(page);
+    }
+    return (SUCCESS);
+}
+
+static void stage_free(xpdma_dev_t *dev, int direction, char **buffer, dma_addr_t *hwAddr, size_t *contig)
+{
+    enum dma_data_direction dir = direction;
+    u32 block = 0;
+
+    if (*contig && (NULL != buffer[0]))
+        dma_free_coherent( &dev->pdev->dev, *contig, buffer[0], hwAddr[0]);
+
+    for (block = 0; block < STAGE_MAX_BLOCKS; ++block) {
+        if (!*contig && (NULL != buffer[block])) {
+            dma_unmap_page(&dev->pdev->dev, hwAddr[block], BUF_SIZE, dir);
+            __free_pages(virt_to_page(buffer[block]), get_order(BUF_SIZE));
+        }
+        buffer[block] = NULL;
+    }
+    *contig = 0;
+}
+
+// Allocate staging buffers on the node
+static int stage_setAlloc(xpdma_dev_t *dev, int node)
+{
+    stage_set_t *stage = kzalloc_node(sizeof(stage_set_t), GFP_KERNEL, node);
+    int err = SUCCESS;
+    u32 c = 0;
+
+    if (NULL == stage) {
+        printk(KERN_CRIT"%s: Init: Unable to allocate staging buffers of node %d\n", DEVICE_NAME, node);
+        return (CRIT_ERR);
+    }
+    stage->node = node;
+    dev->stageSet[dev->stageSets++] = stage;
+
+    for (c = 0; !err && c < dev->stageCount[STAGE_RECV]; ++c) {
+        err = stage_alloc(dev, node, DMA_FROM_DEVICE, stage->readBuffer[c], stage->readHWAddr[c], &stage->readContig[c], dev->stageBlocks[STAGE_RECV]);
+        if (err)
+            printk(KERN_CRIT"%s: Init: Unable to allocate readBuffer[%d] on node %d\n", DEVICE_NAME, c, node);
+        else
+            printk(KERN_CRIT"%s: Init: Read buffer %d allocated on node %d: 0x%016lX, Phy:0x%016lX, %s\n",
+                    DEVICE_NAME, c, node, (size_t) stage->readBuffer[c][0], (size_t) stage->readHWAddr[c][0],
+                    stage->readContig[c] ? "contiguous" : "blocks");
+    }
+    for (c = 0; !err && c < dev->stageCount[STAGE_SEND]; ++c) {
+        err = stage_alloc(dev, node, DMA_TO_DEVICE, stage->writeBuffer[c], stage->writeHWAddr[c], &stage->writeContig[c], dev->stageBlocks[STAGE_SEND]);
+        if (err)
+            printk(KERN_CRIT"%s: Init: Unable to allocate writeBuffer[%d] on node %d\n", DEVICE_NAME, c, node);
+        else
+            printk(KERN_CRIT"%s: Init: Write buffer %d allocated on node %d: 0x%016lX, Phy:0x%016lX, %s\n",
+                    DEVICE_NAME, c, node, (size_t) stage->writeBuffer[c][0], (size_t) stage->writeHWAddr[c][0],
+                    stage->writeContig[c] ? "contiguous" : "blocks");
+    }
+
+    return (err);
+}
+
+// Bring up one card: BAR0, buffers, chains, interrupt and the character device
+static int xpdma_setup (xpdma_dev_t *dev)
+{
+    int c = 0;
+    int node = 0;
+
+    // Enable the device before touching its resources
+    if (0 > pci_enable_device(dev->pdev)) {
+        printk(KERN_WARNING"%s: Init: Device not enabled.\n", DEVICE_NAME);
+        return (CRIT_ERR);
+    }
+    dev->statFlags = dev->statFlags | HAVE_PCI_ENABLED;
+
     // Set Bus Master Enable (BME) bit
-    pci_set_master(gDev);
+    pci_set_master(dev->pdev);
 
     // Get Base Address of BAR0 registers
-    gBaseHdwr = pci_resource_start(gDev, 0);
-    if (0 > gBaseHdwr) {
+    dev->baseHdwr = pci_resource_start(dev->pdev, 0);
+    if (0 > dev->baseHdwr) {
         printk(KERN_WARNING"%s: Init: Base Address not set.\n", DEVICE_NAME);
         return (CRIT_ERR);
     }
-    printk(KERN_INFO"%s: Init: Base hw val %X\n", DEVICE_NAME, (unsigned int) gBaseHdwr);
+    printk(KERN_INFO"%s: Init: Base hw val %X\n", DEVICE_NAME, (unsigned int) dev->baseHdwr);
 
     // Get the Base Address Length
-    gBaseLen = pci_resource_len(gDev, 0);
-    printk(KERN_INFO"%s: Init: Base hw len %d\n", DEVICE_NAME, (unsigned int) gBaseLen);
+    dev->baseLen = pci_resource_len(dev->pdev, 0);
+    printk(KERN_INFO"%s: Init: Base hw len %d\n", DEVICE_NAME, (unsigned int) dev->baseLen);
 
     // Get Virtual HW address
-    gBaseVirt = ioremap(gBaseHdwr, gBaseLen);
-    if (!gBaseVirt) {
+    dev->baseVirt = ioremap(dev->baseHdwr, dev->baseLen);
+    if (!dev->baseVirt) {
         printk(KERN_WARNING"%s: Init: Could not remap memory.\n", DEVICE_NAME);
         return (CRIT_ERR);
     }
-//    printk(KERN_INFO"%s: Init: Virt HW address %lX\n", DEVICE_NAME, (size_t) gBaseVirt);
+//    printk(KERN_INFO"%s: Init: Virt HW address %lX\n", DEVICE_NAME, (size_t) dev->baseVirt);
 
-    // Check the memory region to see if it is in use
-    if (0 > check_mem_region(gBaseHdwr, gBaseLen)) {
+    // Try to gain exclusive control of memory for demo hardware.
+    if (NULL == request_mem_region(dev->baseHdwr, dev->baseLen, "Xilinx_PCIe_CDMA_Driver")) {
         printk(KERN_WARNING"%s: Init: Memory in use.\n", DEVICE_NAME);
         return (CRIT_ERR);
     }
-
-    // Try to gain exclusive control of memory for demo hardware.
-    request_mem_region(gBaseHdwr, gBaseLen, "Xilinx_PCIe_CDMA_Driver");
-    gStatFlags = gStatFlags | HAVE_MEM_REGION;
+    dev->statFlags = dev->statFlags | HAVE_MEM_REGION;
     printk(KERN_INFO"%s: Init: Initialize Hardware Done..\n", DEVICE_NAME);
 
-    // Bus Master Enable
-    if (0 > pci_enable_device(gDev)) {
-        printk(KERN_WARNING"%s: Init: Device not enabled.\n", DEVICE_NAME);
-        return (CRIT_ERR);
-    }
-
     // Set DMA Mask
-    if (0 > pci_set_dma_mask(gDev, 0x7FFFFFFFFFFFFFFF)) {
+    if (0 > dma_set_mask_and_coherent(&dev->pdev->dev, DMA_BIT_MASK(63))) {
         printk("%s: Init: DMA not supported\n", DEVICE_NAME);
         return (CRIT_ERR);
     }
-    pci_set_consistent_dma_mask(gDev, 0x7FFFFFFFFFFFFFFF);
 
-    gReadBuffer = dma_alloc_coherent( &gDev->dev, BUF_SIZE, &gReadHWAddr, GFP_KERNEL );
-    if (NULL == gReadBuffer) {
-        printk(KERN_CRIT"%s: Init: Unable to allocate gReadBuffer\n", DEVICE_NAME);
+    // Size staging chains: count x chunk per direction, chunk in BUF_SIZE blocks,
+    // descriptors within AXI:BAR1 aperture; a staging slot serves either direction
+    desc_size = clamp_t(u32, desc_size, PAGE_SIZE, min(MAX_BTT + 1, AXI_PCIE_DM_SIZE)) & ~(ZEROCOPY_ALIGN - 1);
+    // one chunk is copied while the other one is in flight: a single buffer would be
+    // reused under CDMA, more would never be in flight
+    dev->stageCount[STAGE_SEND] = STAGE_MAX;
+    dev->stageCount[STAGE_RECV] = STAGE_MAX;
+    dev->stageBlocks[STAGE_SEND] = clamp_t(u32, ((send_chunk ? send_chunk : chunk_size) + BUF_SIZE - 1) / BUF_SIZE, 1, STAGE_MAX_BLOCKS);
+    dev->stageBlocks[STAGE_RECV] = clamp_t(u32, ((recv_chunk ? recv_chunk : chunk_size) + BUF_SIZE - 1) / BUF_SIZE, 1, STAGE_MAX_BLOCKS);
+    dev->chunkBytes[STAGE_SEND] = (size_t)dev->stageBlocks[STAGE_SEND] * BUF_SIZE;
+    dev->chunkBytes[STAGE_RECV] = (size_t)dev->stageBlocks[STAGE_RECV] * BUF_SIZE;
+    dev->stageSlots = max(dev->stageCount[STAGE_SEND], dev->stageCount[STAGE_RECV]);
+    dev->stageVectors = max(dev->stageBlocks[STAGE_SEND], dev->stageBlocks[STAGE_RECV]) * ((BUF_SIZE + desc_size - 1) / desc_size + 1);
+    dev->poolVectors = (BUF_SIZE + desc_size - 1) / desc_size + 1;
+    if (dev->stageSlots * dev->stageVectors + ZC_COUNT * ZC_VECTORS + dev->poolVectors + 1 > BRAM_VECTORS) {
+        printk(KERN_WARNING"%s: Init: staging chunk/desc_size need %u translation vectors per chunk, BRAM has %u\n",
+               DEVICE_NAME, dev->stageVectors, (BRAM_VECTORS - ZC_COUNT * ZC_VECTORS - dev->poolVectors - 1) / dev->stageSlots);
         return (CRIT_ERR);
     }
-    printk(KERN_CRIT"%s: Init: Read buffer allocated: 0x%016lX, Phy:0x%016lX\n",
-            DEVICE_NAME, (size_t) gReadBuffer, (size_t) gReadHWAddr);
+    // asynchronous ring takes the BRAM left
+    dev->asyncDepth = min3(async_depth, (unsigned int)ASYNC_MAX,
+                       (BRAM_VECTORS - 1 - slot_first(dev, ASYNC_SLOT(0))) / dev->poolVectors);
+    printk(KERN_INFO"%s: Init: send %u x %lu bytes, recv %u x %lu bytes, descriptor %u bytes, %u vectors per chunk, %u asynchronous requests\n",
+           DEVICE_NAME, dev->stageCount[STAGE_SEND], dev->chunkBytes[STAGE_SEND], dev->stageCount[STAGE_RECV],
+           dev->chunkBytes[STAGE_RECV], desc_size, dev->stageVectors, dev->asyncDepth);
 
-    gWriteBuffer = dma_alloc_coherent( &gDev->dev, BUF_SIZE, &gWriteHWAddr, GFP_KERNEL );
-    if (NULL == gWriteBuffer) {
-        printk(KERN_CRIT"%s: Init: Unable to allocate gWriteBuffer\n", DEVICE_NAME);
+    // Staging buffers on the card node, then optionally on every other node with memory
+    if (stage_setAlloc(dev, dev->node))
         return (CRIT_ERR);
+    if (node_stages) {
+        for_each_node_state(node, N_HIGH_MEMORY) {
+            if (node == dev->node)
+                continue;
+            if (STAGE_NODES == dev->stageSets) {
+                printk(KERN_INFO"%s: Init: no staging buffers on node %d, %d nodes max\n", DEVICE_NAME, node, STAGE_NODES);
+                break;
+            }
+            if (stage_setAlloc(dev, node))
+                return (CRIT_ERR);
+        }
+    }
+    dev->stage = dev->stageSet[0];
+
+    for (c = 0; c < ZC_COUNT; ++c) {
+        dev->zcWindow[c].pages = kmalloc_node(ZC_WINDOW_PAGES * sizeof(struct page *), GFP_KERNEL, dev->node);
+        dev->zcWindow[c].sgl = kmalloc_node(ZC_WINDOW_PAGES * sizeof(struct scatterlist), GFP_KERNEL, dev->node);
+        dev->zcWindow[c].segs = kmalloc_node(ZC_VECTORS * sizeof(sg_seg_t), GFP_KERNEL, dev->node);
+        if (!dev->zcWindow[c].pages || !dev->zcWindow[c].sgl || !dev->zcWindow[c].segs) {
+            printk(KERN_CRIT"%s: Init: Unable to allocate zero-copy window %d\n", DEVICE_NAME, c);
+            return (CRIT_ERR);
+        }
+    }
+
+    pool_count = min(pool_count, (unsigned int)POOL_MAX);
+    for (c = 0; c < pool_count; ++c) {
+        dev->poolBuffer[c] = dma_alloc_coherent( &dev->pdev->dev, BUF_SIZE, &dev->poolHWAddr[c], GFP_KERNEL );
+        if (NULL == dev->poolBuffer[c]) {
+            printk(KERN_CRIT"%s: Init: Unable to allocate poolBuffer[%d]\n", DEVICE_NAME, c);
+            return (CRIT_ERR);
+        }
+        atomic_set(&dev->poolMaps[c], 0);
     }
-    printk(KERN_CRIT"%s: Init: Write buffer allocated: 0x%016lX, Phy:0x%016lX\n",
-            DEVICE_NAME, (size_t) gWriteBuffer, (size_t) gWriteHWAddr);
+    printk(KERN_INFO"%s: Init: %u pool buffers allocated\n", DEVICE_NAME, pool_count);
 
-    gDescChain = dma_alloc_coherent( &gDev->dev, BUF_SIZE, &gDescChainHWAddr, GFP_KERNEL );
-    if (NULL == gDescChain) {
-        printk(KERN_CRIT"%s: Init: Unable to allocate gDescChain\n", DEVICE_NAME);
+    // A descriptor pair per translation vector, in one AXI:BAR0 aperture
+    dev->descChain = dma_alloc_coherent( &dev->pdev->dev, DESC_CHAIN_SIZE, &dev->descChainHWAddr, GFP_KERNEL );
+    if (NULL == dev->descChain) {
+        printk(KERN_CRIT"%s: Init: Unable to allocate descChain\n", DEVICE_NAME);
+        return (CRIT_ERR);
+    }
+    if ((dev->descChainHWAddr & (AXI_PCIE_SG_SIZE - 1)) + DESC_CHAIN_SIZE > AXI_PCIE_SG_SIZE) {
+        printk(KERN_CRIT"%s: Init: descChain crosses AXI:BAR0 aperture\n", DEVICE_NAME);
         return (CRIT_ERR);
     }
-    printk(KERN_CRIT"%s: Init: Descriptor chain buffer allocated: 0x%016lX, Phy:0x%016lX\n",
-            DEVICE_NAME, (size_t) (gDescChain), (size_t) gDescChainHWAddr);
+    dev->descChainAddr = AXI_PCIE_SG_ADDR + (dev->descChainHWAddr & (AXI_PCIE_SG_SIZE - 1));
+    printk(KERN_CRIT"%s: Init: Descriptor chain buffer allocated: 0x%016lX, Phy:0x%016lX, %u bytes\n",
+            DEVICE_NAME, (size_t) (dev->descChain), (size_t) dev->descChainHWAddr, DESC_CHAIN_SIZE);
 
-    // Register driver as a character device.
-    if (0 > register_chrdev(gDrvrMajor, DEVICE_NAME, &xpdma_intf)) {
-        printk(KERN_WARNING"%s: Init: will not register\n", DEVICE_NAME);
+    // Links and translation descriptors of every slot are built once
+    for (c = 0; c < ASYNC_SLOT(dev->asyncDepth); ++c)
+        slot_build(dev, c);
+    slot_build(dev, FAST_SLOT);
+
+    dev->fastBuffer = dma_alloc_coherent( &dev->pdev->dev, FAST_SIZE, &dev->fastHWAddr, GFP_KERNEL );
+    if (NULL == dev->fastBuffer) {
+        printk(KERN_CRIT"%s: Init: Unable to allocate fastBuffer\n", DEVICE_NAME);
         return (CRIT_ERR);
     }
-    printk(KERN_INFO"%s: Init: module registered\n", DEVICE_NAME);
 
-    gStatFlags = gStatFlags | HAVE_KERNEL_REG;
-    printk(KERN_INFO"%s: driver is loaded\n", DEVICE_NAME);
+    // CDMA interrupt through MSI (used by WAIT_MODE_IRQ only)
+    init_completion(&dev->dmaDone);
+    if (0 == pci_enable_msi(dev->pdev)) {
+        if (0 == request_irq(dev->pdev->irq, xpdma_isr, 0, DEVICE_NAME, dev)) {
+            dev->statFlags = dev->statFlags | HAVE_IRQ;
+            printk(KERN_INFO"%s: Init: MSI interrupt %d\n", DEVICE_NAME, dev->pdev->irq);
+        } else {
+            pci_disable_msi(dev->pdev);
+        }
+    }
+    if (!(dev->statFlags & HAVE_IRQ))
+        printk(KERN_INFO"%s: Init: no interrupt, interrupt wait mode falls back to sleep/poll\n", DEVICE_NAME);
 
     // try to reset CDMA
-    if (xpdma_reset()) {
+    if (xpdma_reset(dev)) {
         printk(KERN_INFO"%s: RESET timeout\n", DEVICE_NAME);
         return (CRIT_ERR);
     }
 
+    phase_setup(dev);
+
+    // Register the card as /dev/xpdmaN once it is ready for transfers
+    cdev_init(&dev->cdev, &xpdma_intf);
+    dev->cdev.owner = THIS_MODULE;
+    if (0 > cdev_add(&dev->cdev, MKDEV(MAJOR(gDevNum), dev->index), 1)) {
+        printk(KERN_WARNING"%s: Init: will not register\n", DEVICE_NAME);
+        return (CRIT_ERR);
+    }
+    dev->statFlags = dev->statFlags | HAVE_KERNEL_REG;
+
+    dev->device = device_create(gClass, &dev->pdev->dev, MKDEV(MAJOR(gDevNum), dev->index),
+                                NULL, DEVICE_NAME"%d", dev->index);
+    if (IS_ERR(dev->device)) {
+        dev->device = NULL;
+        printk(KERN_WARNING"%s: Init: no device node for card %d\n", DEVICE_NAME, dev->index);
+        return (CRIT_ERR);
+    }
+    printk(KERN_INFO"%s: card %d registered as %s%d (%d:%d)\n",
+           DEVICE_NAME, dev->index, DEVICE_NAME, dev->index, MAJOR(gDevNum), dev->index);
+
     return (SUCCESS);
 }
 
-static void xpdma_exit (void)
+// No new opens of the card
+static void xpdma_unbind (xpdma_dev_t *dev)
 {
-    // Check if we have a memory region and free it
-    if (gStatFlags & HAVE_MEM_REGION) {
-        (void) release_mem_region(gBaseHdwr, gBaseLen);
+    if (dev->device)
+        device_destroy(gClass, MKDEV(MAJOR(gDevNum), dev->index));
+    dev->device = NULL;
+    if (dev->statFlags & HAVE_KERNEL_REG)
+        cdev_del(&dev->cdev);
+    dev->statFlags &= ~HAVE_KERNEL_REG;
+}
+
+// Card is going away: fail everything queued, stop CDMA and zap the mappings
+// of the open files; they fail with -ENODEV until they are released
+static void xpdma_unplug (xpdma_dev_t *dev)
+{
+    xpdma_file_t *file = NULL;
+    unsigned long flags;
+
+    // the completion records wake up read(), poll() and release waiters
+    spin_lock_irqsave(&dev->asyncLock, flags);
+    WRITE_ONCE(dev->removed, 1);
+    while (dev->asyncRunning + dev->asyncReady) {
+        async_finish(dev, dev->asyncTail, CRIT_ERR);
+        dev->asyncTail = (dev->asyncTail + 1) % dev->asyncDepth;
+        if (dev->asyncRunning)
+            dev->asyncRunning--;
+        else
+            dev->asyncReady--;
+    }
+    spin_unlock_irqrestore(&dev->asyncLock, flags);
+    wake_up(&dev->asyncIdle);
+
+    spin_lock_irqsave(&dev->streamLock, flags);
+    if (dev->streamFile) {
+        dev->streamCtl->status = STREAM_ERROR;
+        wake_up(&dev->streamFile->wait);
+    }
+    spin_unlock_irqrestore(&dev->streamLock, flags);
+
+    // file operations in progress are done, later ones see removed
+    down_write(&dev->removeLock);
+    hrtimer_cancel(&dev->asyncTimer);
+    cancel_work_sync(&dev->asyncFault);
+    hrtimer_cancel(&dev->streamTimer);
+    dev->asyncArmed = 0;
+    dev->asyncResetting = 0;
+    if (dev->baseVirt)
+        xpdma_reset(dev);
+
+    mutex_lock(&dev->filesLock);
+    list_for_each_entry(file, &dev->files, list)
+        unmap_mapping_range(file->filp->f_mapping, 0, 0, 1);
+    mutex_unlock(&dev->filesLock);
+    up_write(&dev->removeLock);
+}
+
+// Undo what ties the card to the system; buffers and MMIO stay until the last
+// open file is released (xpdma_free)
+static void xpdma_detach (xpdma_dev_t *dev)
+{
+    hrtimer_cancel(&dev->asyncTimer);
+    cancel_work_sync(&dev->asyncFault);
+    hrtimer_cancel(&dev->streamTimer);
+    phase_free(dev);
+
+    if (dev->statFlags & HAVE_IRQ) {
+        free_irq(dev->pdev->irq, dev);
+        pci_disable_msi(dev->pdev);
     }
+    dev->statFlags &= ~HAVE_IRQ;
+
+    // CDMA is stopped, no bus mastering into the buffers left
+    if (dev->statFlags & HAVE_PCI_ENABLED)
+        pci_disable_device(dev->pdev);
+    dev->statFlags &= ~HAVE_PCI_ENABLED;
+}
+
+// Release the buffers and MMIO xpdma_setup got, also after a partial setup
+static void xpdma_free (xpdma_dev_t *dev)
+{
+    int c = 0;
+    u32 set = 0;
+    stage_set_t *stage = NULL;
 
-    printk(KERN_INFO"%s: xpdma_exit: erase gReadBuffer\n", DEVICE_NAME);
+    printk(KERN_INFO"%s: xpdma_exit: erase staging buffers\n", DEVICE_NAME);
     // Free Write, Read and Descriptor buffers allocated to use
-    if (NULL != gReadBuffer)
-        dma_free_coherent( &gDev->dev, BUF_SIZE, gReadBuffer, gReadHWAddr);
+    for (set = 0; set < dev->stageSets; ++set) {
+        stage = dev->stageSet[set];
+        for (c = 0; c < STAGE_MAX; ++c) {
+            stage_free(dev, DMA_FROM_DEVICE, stage->readBuffer[c], stage->readHWAddr[c], &stage->readContig[c]);
+            stage_free(dev, DMA_TO_DEVICE, stage->writeBuffer[c], stage->writeHWAddr[c], &stage->writeContig[c]);
+        }
+        kfree(stage);
+        dev->stageSet[set] = NULL;
+    }
+    dev->stageSets = 0;
+    dev->stage = NULL;
+
+    for (c = 0; c < ZC_COUNT; ++c) {
+        kfree(dev->zcWindow[c].pages);
+        kfree(dev->zcWindow[c].sgl);
+        kfree(dev->zcWindow[c].segs);
+        dev->zcWindow[c].pages = NULL;
+        dev->zcWindow[c].sgl = NULL;
+        dev->zcWindow[c].segs = NULL;
+    }
+
+    if (NULL != dev->fastBuffer)
+        dma_free_coherent( &dev->pdev->dev, FAST_SIZE, dev->fastBuffer, dev->fastHWAddr);
+    dev->fastBuffer = NULL;
 
-    printk(KERN_INFO"%s: xpdma_exit: erase gWriteBuffer\n", DEVICE_NAME);
-    if (NULL != gWriteBuffer)
-        dma_free_coherent( &gDev->dev, BUF_SIZE, gWriteBuffer, gWriteHWAddr);
+    for (c = 0; c < POOL_MAX; ++c) {
+        if (NULL != dev->poolBuffer[c])
+            dma_free_coherent( &dev->pdev->dev, BUF_SIZE, dev->poolBuffer[c], dev->poolHWAddr[c]);
+        dev->poolBuffer[c] = NULL;
+        dev->poolOwner[c] = NULL;
+    }
 
-    printk(KERN_INFO"%s: xpdma_exit: erase gDescChain\n", DEVICE_NAME);
-    if (NULL != gWriteBuffer)
-        dma_free_coherent( &gDev->dev, BUF_SIZE, gDescChain, gDescChainHWAddr);
+    printk(KERN_INFO"%s: xpdma_exit: erase descChain\n", DEVICE_NAME);
+    if (NULL != dev->descChain)
+        dma_free_coherent( &dev->pdev->dev, DESC_CHAIN_SIZE, dev->descChain, dev->descChainHWAddr);
 
-    gReadBuffer = NULL;
-    gWriteBuffer = NULL;
-    gDescChain = NULL;
+    dev->descChain = NULL;
 
     // Unmap virtual device address
-    printk(KERN_INFO"%s: xpdma_exit: unmap gBaseVirt\n", DEVICE_NAME);
-    if (gBaseVirt != NULL)
-        iounmap(gBaseVirt);
+    printk(KERN_INFO"%s: xpdma_exit: unmap baseVirt\n", DEVICE_NAME);
+    if (dev->baseVirt != NULL)
+        iounmap(dev->baseVirt);
+
+    dev->baseVirt = NULL;
+
+    // Check if we have a memory region and free it
+    if (dev->statFlags & HAVE_MEM_REGION) {
+        (void) release_mem_region(dev->baseHdwr, dev->baseLen);
+    }
+
+    dev->statFlags = 0;
+}
+
+static int xpdma_probe (struct pci_dev *pdev, const struct pci_device_id *id)
+{
+    int index = 0;
+    xpdma_dev_t *dev = NULL;
+
+    mutex_lock(&gDevicesLock);
+    while (index < MAX_DEVICES && gDevices[index])
+        ++index;
+    if (MAX_DEVICES == index) {
+        mutex_unlock(&gDevicesLock);
+        printk(KERN_WARNING"%s: Probe: more than %d cards\n", DEVICE_NAME, MAX_DEVICES);
+        return (-ENODEV);
+    }
+
+    dev = kzalloc_node(sizeof(xpdma_dev_t), GFP_KERNEL, dev_to_node(&pdev->dev));
+    if (NULL == dev) {
+        mutex_unlock(&gDevicesLock);
+        return (-ENOMEM);
+    }
+    gDevices[index] = dev;
+    mutex_unlock(&gDevicesLock);
+
+    dev->index = index;
+    // the card structure may outlive the binding, so does its PCI device
+    dev->pdev = pci_dev_get(pdev);
+    dev->node = dev_to_node(&pdev->dev);
+    dev->irqSlot = -1;
+    dev->waitMode = WAIT_MODE_POLL;
+    dev->psPerByte = 1000000 / SG_EXPECTED_MBPS;
+    kref_init(&dev->ref);
+    init_rwsem(&dev->removeLock);
+    mutex_init(&dev->filesLock);
+    INIT_LIST_HEAD(&dev->files);
+    // xpdma_detach cancels the timers whatever step of xpdma_setup failed
+    hrtimer_setup(&dev->asyncTimer, async_complete, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    hrtimer_setup(&dev->streamTimer, stream_complete, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    spin_lock_init(&dev->asyncLock);
+    spin_lock_init(&dev->streamLock);
+    mutex_init(&dev->asyncSubmit);
+    init_waitqueue_head(&dev->asyncIdle);
+    INIT_WORK(&dev->asyncFault, async_fault);
+    spin_lock_init(&dev->schedLock);
+    INIT_LIST_HEAD(&dev->schedQueue[SCHED_LATENCY]);
+    INIT_LIST_HEAD(&dev->schedQueue[SCHED_BULK]);
+    init_waitqueue_head(&dev->schedWait);
+    pci_set_drvdata(pdev, dev);
+    printk(KERN_INFO"%s: Probe: card %d at %s\n", DEVICE_NAME, index, pci_name(pdev));
+
+    if (xpdma_setup(dev)) {
+        xpdma_unbind(dev);
+        xpdma_detach(dev);
+        pci_set_drvdata(pdev, NULL);
+        mutex_lock(&gDevicesLock);
+        gDevices[index] = NULL;
+        mutex_unlock(&gDevicesLock);
+        kref_put(&dev->ref, xpdma_devFree);
+        return (-ENODEV);
+    }
+
+    return (SUCCESS);
+}
+
+static void xpdma_remove (struct pci_dev *pdev)
+{
+    xpdma_dev_t *dev = pci_get_drvdata(pdev);
+
+    // No new opens, then nothing is left running on CDMA
+    xpdma_unbind(dev);
+    xpdma_unplug(dev);
+    xpdma_detach(dev);
+    pci_set_drvdata(pdev, NULL);
+
+    mutex_lock(&gDevicesLock);
+    gDevices[dev->index] = NULL;
+    mutex_unlock(&gDevicesLock);
+
+    printk(KERN_INFO"%s: card %d removed\n", DEVICE_NAME, dev->index);
+    // files still open keep the card structure until they are released
+    kref_put(&dev->ref, xpdma_devFree);
+}
+
+static struct pci_device_id xpdma_ids[] = {
+        { PCI_DEVICE(VENDOR_ID, DEVICE_ID) },
+        { 0, }
+};
+MODULE_DEVICE_TABLE(pci, xpdma_ids);
+
+static struct pci_driver xpdma_driver = {
+        name           : DEVICE_NAME,
+        id_table       : xpdma_ids,
+        probe          : xpdma_probe,
+        remove         : xpdma_remove,
+};
+
+static int xpdma_init (void)
+{
+    int err = SUCCESS;
+
+    // Dynamic major, one minor per card
+    err = alloc_chrdev_region(&gDevNum, 0, MAX_DEVICES, DEVICE_NAME);
+    if (0 > err) {
+        printk(KERN_WARNING"%s: Init: no device numbers\n", DEVICE_NAME);
+        return (err);
+    }
 
-    gBaseVirt = NULL;
+    gClass = class_create(DEVICE_NAME);
+    if (IS_ERR(gClass)) {
+        err = PTR_ERR(gClass);
+        unregister_chrdev_region(gDevNum, MAX_DEVICES);
+        return (err);
+    }
+
+    // Phase statistics of the cards, the driver works without debugfs
+    gDebugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+    if (IS_ERR_OR_NULL(gDebugfs))
+        gDebugfs = NULL;
+
+    err = pci_register_driver(&xpdma_driver);
+    if (0 > err) {
+        debugfs_remove_recursive(gDebugfs);
+        class_destroy(gClass);
+        unregister_chrdev_region(gDevNum, MAX_DEVICES);
+        return (err);
+    }
 
-    // Unregister Device Driver
-    if (gStatFlags & HAVE_KERNEL_REG)
-        unregister_chrdev(gDrvrMajor, DEVICE_NAME);
+    printk(KERN_INFO"%s: driver is loaded, major %d\n", DEVICE_NAME, MAJOR(gDevNum));
+    return (SUCCESS);
+}
 
-    gStatFlags = 0;
+static void xpdma_exit (void)
+{
+    pci_unregister_driver(&xpdma_driver);
+    debugfs_remove_recursive(gDebugfs);
+    class_destroy(gClass);
+    unregister_chrdev_region(gDevNum, MAX_DEVICES);
     printk(KERN_ALERT"%s: driver is unloaded\n", DEVICE_NAME);
 }
 
@@ -15,6 +15,30 @@ typedef struct {
     uint32_t value;
 } cdmaReg_t;
 
+// Register access of a batch (IOCTL_REG_BATCH)
+typedef struct {
+    uint32_t reg;       // BAR0 offset (4-byte aligned)
+    uint32_t value;     // in: value to write, out: value read
+    uint32_t write;     // 1 - write value, 0 - read
+    uint32_t reserved;
+} cdmaRegOp_t;
+
+// Struct Used for batched register access, accesses run in order
+typedef struct {
+    cdmaRegOp_t *ops;
+    uint32_t count;     // Accesses (up to REG_BATCH_MAX)
+    uint32_t reserved;
+} cdmaRegBatch_t;
+
+#define REG_BATCH_MAX  4096
+
+// Struct Used for mmap of the BAR0 registers (IOCTL_REG_MAP), mmap size bytes at offset
+typedef struct {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t writable;  // Shared mapping may be writable (regs_writable module parameter)
+} cdmaRegMap_t;
+
 // Struct Used for send/receive data
 typedef struct {
     void *data;
@@ -22,6 +46,187 @@ typedef struct {
     uint32_t addr;
 } cdmaBuffer_t;
 
+// Struct Used for DMA buffer pool (IOCTL_BUF_ALLOC), mmap the buffer at offset
+typedef struct {
+    uint32_t index;
+    uint32_t size;
+    uint64_t offset;
+} cdmaPoolBuffer_t;
+
+// Struct Used for send/receive from a pool buffer (offset and addr 16-byte aligned)
+typedef struct {
+    uint32_t index;
+    uint32_t offset;
+    uint32_t count;
+    uint32_t addr;
+} cdmaBufferRef_t;
+
+// Element of a vectored send/receive (IOCTL_SENDV/IOCTL_RECVV)
+typedef struct {
+    void *data;
+    uint32_t count;
+    uint32_t addr;
+    int32_t status;     // out: SUCCESS or CRIT_ERR (not transferred)
+    uint32_t sgStatus;  // out: error flags from the element's descriptor status words
+                        // (0x40000000 decode, 0x20000000 slave, 0x10000000 internal error)
+} cdmaVec_t;
+
+#define VEC_MAX  1024   // Max elements per vectored request
+
+// Struct Used for vectored send/receive
+typedef struct {
+    cdmaVec_t *vec;
+    uint32_t count;     // Elements
+    uint32_t reserved;
+} cdmaVecBuffer_t;
+
+// Struct Used for copy between DDR3 regions on the card (IOCTL_COPY, addresses 16-byte aligned)
+typedef struct {
+    uint32_t src;
+    uint32_t dst;
+    uint32_t count;
+} cdmaCopy_t;
+
+// Struct Used for file to DDR3 and DDR3 to file transfers (IOCTL_FILE_SEND/IOCTL_FILE_RECV)
+// File data moves between the page cache and the staging buffers, no user buffer in between
+typedef struct {
+    int32_t fd;             // Regular file opened without O_DIRECT
+    uint32_t count;
+    uint64_t offset;        // File offset
+    uint32_t addr;          // DDR3 address (16-byte aligned)
+    uint32_t reserved;
+} cdmaFile_t;
+
+// Struct Used for asynchronous send/receive from a pool buffer (IOCTL_SUBMIT)
+typedef struct {
+    uint64_t cookie;        // Returned in the completion record
+    uint32_t direction;     // REQUEST_SEND or REQUEST_RECV
+    cdmaBufferRef_t buffer;
+} cdmaRequest_t;
+
+// Completion record of an asynchronous request, read() from the device
+typedef struct {
+    uint64_t cookie;
+    int32_t status;         // SUCCESS or CRIT_ERR
+    uint32_t count;         // Bytes transferred
+} cdmaCompletion_t;
+
+// Struct Used for shared submission/completion rings (IOCTL_RING_SETUP)
+typedef struct {
+    uint32_t entries;   // in: requested ring entries, out: power of two
+    uint32_t flags;     // in: RING_SQPOLL
+    uint32_t size;      // out: bytes to mmap
+    uint32_t sqOffset;  // out: submission entries (cdmaRequest_t) from the mapping start
+    uint32_t cqOffset;  // out: completion entries (cdmaCompletion_t) from the mapping start
+    uint32_t reserved;
+    uint64_t offset;    // out: mmap offset of the rings
+} cdmaRingSetup_t;
+
+// Header at the start of the shared rings mapping, indexes run free
+// (entry is index & (entries - 1)); producer and consumer sides on own cache lines
+typedef struct {
+    uint32_t sqHead;    // Submissions taken by the driver
+    uint32_t sqTail;    // Submissions queued by the application
+    uint32_t flags;     // RING_NEED_WAKEUP
+    uint32_t sqPad[13];
+    uint32_t cqHead;    // Completions consumed by the application
+    uint32_t cqTail;    // Completions posted by the driver
+    uint32_t cqPad[14];
+} cdmaRing_t;
+
+#define RING_SQPOLL       0x1 // Setup flag: kernel thread drains the submission ring
+#define RING_NEED_WAKEUP  0x1 // Ring flag: poll thread sleeps, IOCTL_RING_ENTER wakes it up
+
+// Struct Used to start device to host streaming from a DDR3 ring (IOCTL_STREAM_START)
+typedef struct {
+    uint32_t ddrAddr;   // in: DDR3 ring start (16-byte aligned)
+    uint32_t ddrSize;   // in: DDR3 ring size (multiple of slotSize)
+    uint32_t slotSize;  // in: bytes per host ring slot (multiple of 4 KBytes, max 4 MBytes)
+    uint32_t slots;     // in: host ring slots (2 .. STREAM_MAX_SLOTS, limited by BRAM)
+    uint32_t size;      // out: bytes of the stream, control page then the slots
+    uint32_t reserved;
+    uint64_t offset;    // out: mmap offset of the stream, each piece is mapped at its own offset
+} cdmaStreamSetup_t;
+
+#define STREAM_MAX_SLOTS  256
+#define STREAM_CTL_SIZE   4096 // Control page at the start of the stream mapping, slot i follows at STREAM_CTL_SIZE + i * slotSize
+
+// Control page of the stream mapping, indexes run free (slot is index % slots,
+// its data came from DDR3 ddrAddr + index * slotSize % ddrSize)
+typedef struct {
+    uint32_t head;      // Slots filled by the driver
+    uint32_t status;    // STREAM_RUNNING, STREAM_ERROR
+    uint32_t headPad[14];
+    uint32_t tail;      // Slots consumed by the application
+    uint32_t tailPad[15];
+    uint64_t bytes;     // Bytes streamed
+    uint64_t overruns;  // Times CDMA stopped because every slot was still full
+    uint64_t stallNs;   // Time CDMA waited for the application to free a slot
+} cdmaStream_t;
+
+enum {
+    STREAM_RUNNING,
+    STREAM_ERROR,       // CDMA error or timeout, the stream stopped
+};
+
+// Asynchronous request directions
+enum {
+    REQUEST_SEND, // Pool buffer to AXI CDMA
+    REQUEST_RECV, // AXI CDMA to pool buffer
+};
+
+// Struct Used for copy/DMA pipeline statistics (read and cleared by IOCTL_STATS)
+typedef struct {
+    uint64_t bytes;       // Bytes moved by send/receive
+    uint64_t chunks;      // CDMA operations (one descriptor chain each)
+    uint64_t descriptors; // Data descriptors in those chains
+    uint64_t wallNs;      // Time spent in send/receive
+    uint64_t copyNs;      // Time spent copying between user and staging buffers
+    uint64_t dmaNs;       // Time from CDMA kick to observed completion
+    uint64_t overlapNs;   // Copy time hidden behind a running CDMA operation (lower bound)
+    uint64_t dmaWaits;    // Overlapped copies finished before CDMA (DMA bound)
+    uint64_t copyStalls;  // Overlapped copies finished after CDMA (copy bound)
+    uint64_t zeroCopyBytes; // Bytes moved directly from/to pinned user pages
+    uint64_t pinNs;       // Time spent pinning and mapping user pages
+    uint64_t transfers;   // Send/receive requests
+    uint64_t sleepNs;     // Time the caller slept waiting for completion (wallNs - sleepNs is CPU time)
+} cdmaStats_t;
+
+// Struct Used for the scheduling class of a file (IOCTL_SCHED)
+typedef struct {
+    uint32_t priority;  // SCHED_LATENCY, SCHED_BULK or SCHED_AUTO
+    uint32_t weight;    // Share of CDMA time among files of the class (1 .. SCHED_MAX_WEIGHT)
+} cdmaSched_t;
+
+#define SCHED_MAX_WEIGHT  1000
+
+// Scheduling classes of synchronous transfers, latency class runs first
+enum {
+    SCHED_LATENCY,  // Small latency-sensitive transfers
+    SCHED_BULK,     // Bulk loads
+    SCHED_AUTO,     // Class by transfer size (sched_small module parameter), default
+};
+
+#define SCHED_CLASSES     2
+
+// Struct Used for scheduler metrics (read and cleared by IOCTL_SCHED_STATS)
+typedef struct {
+    uint64_t granted[SCHED_CLASSES];   // Transfers given CDMA
+    uint64_t waitNs[SCHED_CLASSES];    // Total time waited for CDMA
+    uint64_t maxWaitNs[SCHED_CLASSES]; // Longest wait for CDMA
+    uint64_t aged;                     // Bulk transfers run ahead of latency ones after starving
+    uint32_t queued[SCHED_CLASSES];    // Transfers waiting now
+    uint32_t maxQueued[SCHED_CLASSES]; // Deepest queue
+} cdmaSchedStats_t;
+
+// Completion wait modes (IOCTL_WAITMODE, wait_mode module parameter)
+enum {
+    WAIT_MODE_DEFAULT, // Use module-wide wait_mode
+    WAIT_MODE_POLL,    // Busy poll of the tail descriptor status
+    WAIT_MODE_SLEEP,   // hrtimer sleep until expected completion, then short polls
+    WAIT_MODE_IRQ,     // Sleep until CDMA interrupt (falls back to sleep mode without MSI)
+};
+
 // ioctl commands
 enum {
     IOCTL_RESET, // Reset CDMA
@@ -35,6 +240,28 @@ enum {
     IOCTL_SEND,      // Send data from Host system to AXI CDMA
     IOCTL_RECV,      // Receive data from AXI CDMA to Host system
     IOCTL_INFO,      // Show debug information
+    IOCTL_STATS,     // Read and clear copy/DMA pipeline statistics
+    IOCTL_WAITMODE,  // Set completion wait mode for the file
+    IOCTL_BUF_ALLOC, // Allocate mmap-able DMA buffer from the pool
+    IOCTL_BUF_FREE,  // Return unmapped DMA buffer to the pool
+    IOCTL_SEND_BUF,  // Send data from a pool buffer to AXI CDMA
+    IOCTL_RECV_BUF,  // Receive data from AXI CDMA to a pool buffer
+    IOCTL_SUBMIT,    // Queue asynchronous request, completion is read() from the device
+    IOCTL_EVENTFD,   // Signal eventfd on every completion of the file (-1 - detach)
+    IOCTL_RING_SETUP, // Create shared submission/completion rings of the file
+    IOCTL_RING_ENTER, // Doorbell: take queued submissions, wait for arg completions
+    IOCTL_SCHED,     // Set scheduling class and weight of the file
+    IOCTL_SCHED_STATS, // Read and clear scheduler metrics
+    IOCTL_COPY,      // Copy between DDR3 regions on the card (MEM2MEM)
+    IOCTL_SENDV,     // Send many records to scattered DDR3 regions
+    IOCTL_RECVV,     // Receive many records from scattered DDR3 regions
+    IOCTL_NODE,      // Read the NUMA node of the card (int, -1 - unknown)
+    IOCTL_STREAM_START, // Start cyclic device to host streaming, the file owns CDMA until stop
+    IOCTL_STREAM_STOP,  // Stop streaming (stream unmapped first)
+    IOCTL_FILE_SEND, // Send a file range to AXI CDMA without a user buffer
+    IOCTL_FILE_RECV, // Receive from AXI CDMA into a file range without a user buffer
+    IOCTL_REG_BATCH, // Read/write many CDMA registers in one call
+    IOCTL_REG_MAP,   // Where to mmap the BAR0 registers
 };
 
 #endif //XPDMA_DRIVER_H
@@ -0,0 +1,114 @@
+//
+// Mock card for tests without hardware: DDR3 is host memory, registers are plain
+// memory with CDMA always idle
+//
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "xpdma.h"
+#include "xpdma_regs.h"
+
+#define MOCK_DDR_SIZE       (1024*1024*1024) // KC705 DDR3, XPDMA_MOCK_DDR overrides
+#define MOCK_REGS_SIZE      (64<<10)         // BAR0
+
+typedef struct {
+    char *ddr;                      // Pages are only backed once written
+    size_t ddrSize;
+    uint32_t regs[MOCK_REGS_SIZE / 4];
+    pthread_mutex_t lock;           // Transfers of a card are serialized like on CDMA
+} xpdma_mock_t;
+
+static void *xpdma_mock_open(int index)
+{
+    xpdma_mock_t *mock;
+    const char *env = getenv("XPDMA_MOCK_DDR");
+
+    (void)index;
+    mock = (xpdma_mock_t *)calloc(1, sizeof(xpdma_mock_t));
+    if (mock == NULL)
+        return NULL;
+
+    mock->ddrSize = env ? strtoull(env, NULL, 0) : MOCK_DDR_SIZE;
+    mock->ddr = (char *)mmap(NULL, mock->ddrSize, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mock->ddr == MAP_FAILED) {
+        free(mock);
+        return NULL;
+    }
+    mock->regs[(CDMA_OFFSET + CDMA_CONTROL_OFFSET) / 4] = CDMA_CR_SG_EN;
+    mock->regs[(CDMA_OFFSET + CDMA_STATUS_OFFSET) / 4] = CDMA_CR_IDLE_MASK;
+    pthread_mutex_init(&mock->lock, NULL);
+    return mock;
+}
+
+static void xpdma_mock_close(void *dev)
+{
+    xpdma_mock_t *mock = (xpdma_mock_t *)dev;
+
+    munmap(mock->ddr, mock->ddrSize);
+    pthread_mutex_destroy(&mock->lock);
+    free(mock);
+}
+
+static int xpdma_mock_transfer(xpdma_mock_t *mock, void *data, unsigned int count, unsigned int addr, int send)
+{
+    // past the end of DDR3 the real CDMA reports a decode error
+    if ((size_t)addr + count > mock->ddrSize) {
+        errno = EIO;
+        return -1;
+    }
+
+    pthread_mutex_lock(&mock->lock);
+    if (send)
+        memcpy(mock->ddr + addr, data, count);
+    else
+        memcpy(data, mock->ddr + addr, count);
+    pthread_mutex_unlock(&mock->lock);
+    return 0;
+}
+
+static int xpdma_mock_send(void *dev, void *data, unsigned int count, unsigned int addr)
+{
+    return xpdma_mock_transfer((xpdma_mock_t *)dev, data, count, addr, 1);
+}
+
+static int xpdma_mock_recv(void *dev, void *data, unsigned int count, unsigned int addr)
+{
+    return xpdma_mock_transfer((xpdma_mock_t *)dev, data, count, addr, 0);
+}
+
+static uint32_t xpdma_mock_readReg(void *dev, uint32_t addr)
+{
+    xpdma_mock_t *mock = (xpdma_mock_t *)dev;
+
+    return (addr < MOCK_REGS_SIZE) ? mock->regs[addr / 4] : 0xFFFFFFFF;
+}
+
+static void xpdma_mock_writeReg(void *dev, uint32_t addr, uint32_t value)
+{
+    xpdma_mock_t *mock = (xpdma_mock_t *)dev;
+
+    // status stays idle, reset completes at once
+    if (addr >= MOCK_REGS_SIZE || addr == CDMA_OFFSET + CDMA_STATUS_OFFSET)
+        return;
+    if (addr == CDMA_OFFSET + CDMA_CONTROL_OFFSET)
+        value &= ~CDMA_CR_RESET_MASK;
+    mock->regs[addr / 4] = value;
+}
+
+const xpdma_backend_t xpdma_backend_mock = {
+    "mock",
+    xpdma_mock_open,
+    xpdma_mock_close,
+    NULL,
+    xpdma_mock_send,
+    xpdma_mock_recv,
+    xpdma_mock_readReg,
+    xpdma_mock_writeReg,
+};
@@ -0,0 +1,70 @@
+#ifndef XPDMA_REGS_H
+#define XPDMA_REGS_H
+
+// Register map and descriptor format of the XAPP1171 design, shared by the kernel
+// driver and the user-space backends of libxpdma
+
+#define MAX_BTT             0x007FFFFF   // 8 MBytes maximum for DMA Transfer
+#define DESCRIPTOR_SIZE     64           // 64-byte aligned Transfer Descriptor
+
+#define AXI_PCIE_DM_SIZE    (4<<20)      // AXI:BAR1 aperture, translation replaces the bits above it
+#define AXI_PCIE_SG_SIZE    (4<<20)      // AXI:BAR0 aperture (SG window), same translation
+#define BRAM_SIZE           0x00008000   // 32 KBytes Translation BRAM
+#define BRAM_VECTORS        (BRAM_SIZE / 0x8) // Translation vectors in BRAM
+
+#define BRAM_OFFSET         0x00000000   // Translation BRAM offset
+#define PCIE_CTL_OFFSET     0x00008000   // AXI PCIe control offset
+#define CDMA_OFFSET         0x0000c000   // AXI CDMA LITE control offset
+
+// AXI CDMA Register Offsets
+#define CDMA_CONTROL_OFFSET	0x00         // Control Register
+#define CDMA_STATUS_OFFSET	0x04         // Status Register
+#define CDMA_CDESC_OFFSET	0x08         // Current descriptor Register
+#define CDMA_TDESC_OFFSET	0x10         // Tail descriptor Register
+#define CDMA_SRCADDR_OFFSET	0x18         // Source Address Register
+#define CDMA_DSTADDR_OFFSET	0x20         // Dest Address Register
+#define CDMA_BTT_OFFSET		0x28         // Bytes to transfer Register
+#define CDMA_REGS_SIZE      0x40         // AXI CDMA register window
+
+#define AXI_PCIE_DM_ADDR    0x80000000   // AXI:BAR1 Address
+#define AXI_PCIE_SG_ADDR    0x80800000   // AXI:BAR0 Address
+#define AXI_BRAM_ADDR       0x81000000   // AXI Translation BRAM Address
+#define AXI_DDR3_ADDR       0x00000000   // AXI DDR3 Address
+
+#define SG_COMPLETE_MASK    0xF0000000   // Scatter Gather Operation Complete status flag mask
+#define SG_DEC_ERR_MASK     0x40000000   // Scatter Gather Operation Decode Error flag mask
+#define SG_SLAVE_ERR_MASK   0x20000000   // Scatter Gather Operation Slave Error flag mask
+#define SG_INT_ERR_MASK     0x10000000   // Scatter Gather Operation Internal Error flag mask
+#define SG_CMPLT_MASK       0x80000000   // Scatter Gather Descriptor Completed flag mask
+#define SG_ERR_MASK         (SG_DEC_ERR_MASK | SG_SLAVE_ERR_MASK | SG_INT_ERR_MASK)
+
+#define BRAM_STEP           0x8          // Translation Vector Length
+#define ADDR_BTT            0x00000008   // 64 bit address translation descriptor control length
+
+#define CDMA_CR_SG_EN       0x00000008   // Scatter gather mode enable
+#define CDMA_CR_IDLE_MASK   0x00000002   // CDMA Idle mask
+#define CDMA_CR_RESET_MASK  0x00000004   // CDMA Reset mask
+#define CDMA_CR_IOC_IRQ_EN  0x00001000   // Interrupt on complete enable
+#define CDMA_CR_DLY_IRQ_EN  0x00002000   // Interrupt on delay timeout enable
+#define CDMA_CR_ERR_IRQ_EN  0x00004000   // Interrupt on error enable
+#define CDMA_CR_IRQ_THRESHOLD(n) ((n) << 16) // Completed descriptors per interrupt (1..255)
+#define CDMA_CR_IRQ_DELAY(n)     ((n) << 24) // Delay timeout after the last completed descriptor
+#define CDMA_SR_IRQ_MASK    0x00007000   // IOC, Delay and Error interrupt status (write 1 to clear)
+#define AXIBAR2PCIEBAR_0U   0x208        // AXI:BAR0 Upper Address Translation (bits [63:32])
+#define AXIBAR2PCIEBAR_0L   0x20C        // AXI:BAR0 Lower Address Translation (bits [31:0])
+#define AXIBAR2PCIEBAR_1U   0x210        // AXI:BAR1 Upper Address Translation (bits [63:32])
+#define AXIBAR2PCIEBAR_1L   0x214        // AXI:BAR1 Lower Address Translation (bits [31:0])
+
+// Scatter Gather Transfer descriptor
+typedef struct {
+    uint32_t nextDesc;  /* 0x00 */
+    uint32_t na1;       /* 0x04 */
+    uint32_t srcAddr;   /* 0x08 */
+    uint32_t na2;       /* 0x0C */
+    uint32_t destAddr;  /* 0x10 */
+    uint32_t na3;       /* 0x14 */
+    uint32_t control;   /* 0x18 */
+    uint32_t status;    /* 0x1C */
+} __attribute__((aligned(DESCRIPTOR_SIZE))) sg_desc_t;
+
+#endif //XPDMA_REGS_H
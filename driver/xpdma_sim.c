@@ -0,0 +1,377 @@
+//
+// Software model of the XAPP1171 card: the driver side (xpdma_vfio.c) programs it
+// exactly like the hardware, a device thread walks the descriptor chains
+//
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include "xpdma.h"
+#include "xpdma_regs.h"
+#include "xpdma_sim.h"
+
+#define SIM_DDR_SIZE        (1024*1024*1024) // KC705 DDR3
+#define SIM_REGS_SIZE       (64<<10)         // BAR0
+#define SIM_MAPS            8                // IOMMU mappings
+#define SIM_SEND_MBS        1050             // KC705 PCIe x8 rates of the README
+#define SIM_RECV_MBS        1170
+#define SIM_LATENCY_NS      2000             // Kick to the first descriptor fetch
+#define SIM_DESC_NS         100              // Descriptor fetch and status write back
+#define SIM_CHAIN_MAX       (1<<20)          // Descriptors per operation before an internal error
+#define SIM_SLEEP_NS        100000           // Longer waits sleep, shorter ones spin
+
+#define SIM_SR_DMA_DEC_ERR  0x00000040       // CDMA status bits the engine reports
+#define SIM_SR_SG_INT_ERR   0x00000100
+#define SIM_SR_SG_DEC_ERR   0x00000400
+#define SIM_SR_IOC_IRQ      0x00001000
+#define SIM_SR_ERR_IRQ      0x00004000
+
+#define SIM_REG(sim, offset) ((sim)->regs[(offset) / 4])
+
+// Where an AXI address of a descriptor lands
+enum {
+    SIM_SPACE_NONE,
+    SIM_SPACE_DDR,
+    SIM_SPACE_PCIE,     // Host memory through AXI:BAR0 or AXI:BAR1
+    SIM_SPACE_REGS,     // Translation BRAM and AXI PCIe control
+};
+
+typedef struct {
+    char *mem;
+    size_t size;
+    uint64_t iova;
+} sim_map_t;
+
+struct xpdma_sim_t {
+    volatile uint32_t regs[SIM_REGS_SIZE / 4];
+    char *ddr;                      // Pages are only backed once written
+    size_t ddrSize;
+    sim_map_t maps[SIM_MAPS];
+    int nmaps;
+    double sendNsPerByte;           // 0 - unlimited
+    double recvNsPerByte;
+    long long latencyNs;
+    long long descNs;
+    long long busyUntil;            // Model time the last operation finished
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t kick;
+    pthread_cond_t idle;
+    int pending;                    // TAILDESC written, the engine has not started
+    int busy;
+    volatile int abort;             // Reset while busy
+    int stop;
+};
+
+static long long sim_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Sleep most of a long wait, spin the rest so the modelled rate stays exact
+static void sim_waitUntil(long long due)
+{
+    struct timespec ts;
+    long long left = due - sim_nsec();
+
+    if (left > SIM_SLEEP_NS) {
+        due -= SIM_SLEEP_NS / 2;
+        ts.tv_sec = due / 1000000000LL;
+        ts.tv_nsec = due % 1000000000LL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        due += SIM_SLEEP_NS / 2;
+    }
+    while (sim_nsec() < due);
+}
+
+static double sim_nsPerByte(const char *name, unsigned long mbs)
+{
+    const char *env = getenv(name);
+
+    if (env != NULL)
+        mbs = strtoul(env, NULL, 0);
+    return mbs ? 1e9 / (mbs * 1024.0 * 1024.0) : 0;
+}
+
+// Host memory behind PCIe bus address bus, the IOMMU faults the rest
+static char *sim_bus(xpdma_sim_t *sim, uint64_t bus, uint32_t count)
+{
+    int c;
+
+    for (c = 0; c < sim->nmaps; ++c) {
+        if (bus >= sim->maps[c].iova && bus + count <= sim->maps[c].iova + sim->maps[c].size)
+            return sim->maps[c].mem + (bus - sim->maps[c].iova);
+    }
+    return NULL;
+}
+
+// AXI:BARn window: the translation register replaces the address bits above the aperture
+static char *sim_window(xpdma_sim_t *sim, uint32_t upper, uint32_t lower, uint64_t offset,
+                        uint32_t count, uint32_t size)
+{
+    uint64_t bus = ((uint64_t)SIM_REG(sim, PCIE_CTL_OFFSET + upper) << 32) | SIM_REG(sim, PCIE_CTL_OFFSET + lower);
+
+    if (offset + count > size)
+        return NULL;
+    return sim_bus(sim, (bus & ~(uint64_t)(size - 1)) + offset, count);
+}
+
+// AXI address map of the design, NULL - decode error
+static char *sim_translate(xpdma_sim_t *sim, uint32_t axi, uint32_t count, int *space)
+{
+    uint64_t end = (uint64_t)axi + count;
+    char *mem = NULL;
+
+    *space = SIM_SPACE_NONE;
+    // DDR3 starts at AXI address 0
+    if (end <= AXI_DDR3_ADDR + (uint64_t)sim->ddrSize) {
+        *space = SIM_SPACE_DDR;
+        mem = sim->ddr + (axi - AXI_DDR3_ADDR);
+    } else if (axi >= AXI_PCIE_DM_ADDR && axi < AXI_PCIE_DM_ADDR + AXI_PCIE_DM_SIZE) {
+        *space = SIM_SPACE_PCIE;
+        mem = sim_window(sim, AXIBAR2PCIEBAR_1U, AXIBAR2PCIEBAR_1L, axi - AXI_PCIE_DM_ADDR, count, AXI_PCIE_DM_SIZE);
+    } else if (axi >= AXI_PCIE_SG_ADDR && axi < AXI_PCIE_SG_ADDR + AXI_PCIE_SG_SIZE) {
+        *space = SIM_SPACE_PCIE;
+        mem = sim_window(sim, AXIBAR2PCIEBAR_0U, AXIBAR2PCIEBAR_0L, axi - AXI_PCIE_SG_ADDR, count, AXI_PCIE_SG_SIZE);
+    } else if (axi >= AXI_BRAM_ADDR && end <= AXI_BRAM_ADDR + (uint64_t)SIM_REGS_SIZE) {
+        *space = SIM_SPACE_REGS;
+        mem = (char *)sim->regs + (axi - AXI_BRAM_ADDR);
+    }
+    return mem;
+}
+
+// Walk the chain from CURDESC to TAILDESC; every status but the last one is written
+// back here, the last one (NULL - no descriptor fetched) after CDMA turned idle
+static uint32_t sim_run(xpdma_sim_t *sim, uint32_t cur, uint32_t tail,
+                        volatile sg_desc_t **last, uint32_t *lastStatus)
+{
+    volatile sg_desc_t *desc;
+    sg_desc_t d;
+    long long due = sim_nsec();
+    unsigned int count = 0;
+    uint32_t btt;
+    char *src;
+    char *dst;
+    int srcSpace;
+    int dstSpace;
+    int space;
+
+    *last = NULL;
+    if (due < sim->busyUntil)
+        due = sim->busyUntil;
+    due += sim->latencyNs;
+
+    while (1) {
+        if (sim->abort)
+            return 0;
+        if (++count > SIM_CHAIN_MAX)
+            return SIM_SR_SG_INT_ERR | SIM_SR_ERR_IRQ;
+
+        desc = (volatile sg_desc_t *)sim_translate(sim, cur, sizeof(sg_desc_t), &space);
+        if (desc == NULL || space != SIM_SPACE_PCIE || (cur & (DESCRIPTOR_SIZE - 1)))
+            return SIM_SR_SG_DEC_ERR | SIM_SR_ERR_IRQ;
+        memcpy(&d, (const void *)desc, sizeof(d));
+        due += sim->descNs;
+
+        btt = d.control & MAX_BTT;
+        src = sim_translate(sim, d.srcAddr, btt, &srcSpace);
+        dst = sim_translate(sim, d.destAddr, btt, &dstSpace);
+        if (!btt || src == NULL || dst == NULL) {
+            sim_waitUntil(due);
+            sim->busyUntil = due;
+            *last = desc;
+            *lastStatus = btt ? SG_DEC_ERR_MASK : SG_INT_ERR_MASK;
+            return SIM_SR_DMA_DEC_ERR | SIM_SR_ERR_IRQ;
+        }
+
+        memmove(dst, src, btt);
+        if (srcSpace == SIM_SPACE_PCIE && dstSpace == SIM_SPACE_DDR)
+            due += (long long)(btt * sim->sendNsPerByte);
+        else if (srcSpace == SIM_SPACE_DDR && dstSpace == SIM_SPACE_PCIE)
+            due += (long long)(btt * sim->recvNsPerByte);
+
+        // data is in place before the driver can see the descriptor completed
+        sim_waitUntil(due);
+        if (cur == tail) {
+            sim->busyUntil = due;
+            *last = desc;
+            *lastStatus = SG_CMPLT_MASK;
+            return SIM_SR_IOC_IRQ;
+        }
+        __atomic_store_n(&desc->status, SG_CMPLT_MASK, __ATOMIC_RELEASE);
+        cur = d.nextDesc;
+    }
+}
+
+static void *sim_engine(void *arg)
+{
+    xpdma_sim_t *sim = (xpdma_sim_t *)arg;
+    volatile sg_desc_t *last;
+    uint32_t lastStatus = 0;
+    uint32_t status;
+    uint32_t cur;
+    uint32_t tail;
+
+    // the timing model needs waits shorter than the default 50 us slack
+    prctl(PR_SET_TIMERSLACK, 1UL);
+
+    pthread_mutex_lock(&sim->lock);
+    while (1) {
+        while (!sim->pending && !sim->stop)
+            pthread_cond_wait(&sim->kick, &sim->lock);
+        if (sim->stop)
+            break;
+        sim->pending = 0;
+        sim->busy = 1;
+        cur = SIM_REG(sim, CDMA_OFFSET + CDMA_CDESC_OFFSET);
+        tail = SIM_REG(sim, CDMA_OFFSET + CDMA_TDESC_OFFSET);
+        pthread_mutex_unlock(&sim->lock);
+
+        status = sim_run(sim, cur, tail, &last, &lastStatus);
+
+        pthread_mutex_lock(&sim->lock);
+        sim->busy = 0;
+        if (!sim->abort) {
+            // idle first: the driver kicks the next operation as soon as it sees the tail
+            if (!(SIM_REG(sim, CDMA_OFFSET + CDMA_CONTROL_OFFSET) & CDMA_CR_IOC_IRQ_EN))
+                status &= ~SIM_SR_IOC_IRQ;
+            if (!(SIM_REG(sim, CDMA_OFFSET + CDMA_CONTROL_OFFSET) & CDMA_CR_ERR_IRQ_EN))
+                status &= ~SIM_SR_ERR_IRQ;
+            SIM_REG(sim, CDMA_OFFSET + CDMA_STATUS_OFFSET) |= status | CDMA_CR_IDLE_MASK;
+            if (last != NULL)
+                __atomic_store_n(&last->status, lastStatus, __ATOMIC_RELEASE);
+        }
+        pthread_cond_broadcast(&sim->idle);
+    }
+    pthread_mutex_unlock(&sim->lock);
+    return NULL;
+}
+
+xpdma_sim_t *xpdma_sim_create(void)
+{
+    xpdma_sim_t *sim;
+    const char *env;
+
+    sim = (xpdma_sim_t *)calloc(1, sizeof(xpdma_sim_t));
+    if (sim == NULL)
+        return NULL;
+
+    env = getenv("XPDMA_SIM_DDR");
+    sim->ddrSize = env ? strtoull(env, NULL, 0) : SIM_DDR_SIZE;
+    sim->ddr = (char *)mmap(NULL, sim->ddrSize, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (sim->ddr == MAP_FAILED) {
+        free(sim);
+        return NULL;
+    }
+
+    sim->sendNsPerByte = sim_nsPerByte("XPDMA_SIM_SEND_MBS", SIM_SEND_MBS);
+    sim->recvNsPerByte = sim_nsPerByte("XPDMA_SIM_RECV_MBS", SIM_RECV_MBS);
+    env = getenv("XPDMA_SIM_LATENCY_NS");
+    sim->latencyNs = env ? strtoll(env, NULL, 0) : SIM_LATENCY_NS;
+    env = getenv("XPDMA_SIM_DESC_NS");
+    sim->descNs = env ? strtoll(env, NULL, 0) : SIM_DESC_NS;
+
+    SIM_REG(sim, CDMA_OFFSET + CDMA_STATUS_OFFSET) = CDMA_CR_IDLE_MASK;
+    pthread_mutex_init(&sim->lock, NULL);
+    pthread_cond_init(&sim->kick, NULL);
+    pthread_cond_init(&sim->idle, NULL);
+    if (pthread_create(&sim->thread, NULL, sim_engine, sim)) {
+        munmap(sim->ddr, sim->ddrSize);
+        free(sim);
+        return NULL;
+    }
+    return sim;
+}
+
+void xpdma_sim_destroy(xpdma_sim_t *sim)
+{
+    pthread_mutex_lock(&sim->lock);
+    sim->stop = 1;
+    sim->abort = 1;
+    pthread_cond_signal(&sim->kick);
+    pthread_mutex_unlock(&sim->lock);
+    pthread_join(sim->thread, NULL);
+
+    pthread_cond_destroy(&sim->kick);
+    pthread_cond_destroy(&sim->idle);
+    pthread_mutex_destroy(&sim->lock);
+    munmap(sim->ddr, sim->ddrSize);
+    free(sim);
+}
+
+volatile uint32_t *xpdma_sim_regs(xpdma_sim_t *sim, size_t *size)
+{
+    *size = SIM_REGS_SIZE;
+    return sim->regs;
+}
+
+void xpdma_sim_writeReg(xpdma_sim_t *sim, uint32_t addr, uint32_t value)
+{
+    if (addr >= SIM_REGS_SIZE)
+        return;
+
+    switch (addr) {
+    case CDMA_OFFSET + CDMA_STATUS_OFFSET:
+        // interrupt bits are write 1 to clear, the rest is read only
+        pthread_mutex_lock(&sim->lock);
+        SIM_REG(sim, addr) &= ~(value & CDMA_SR_IRQ_MASK);
+        pthread_mutex_unlock(&sim->lock);
+        break;
+
+    case CDMA_OFFSET + CDMA_CONTROL_OFFSET:
+        if (!(value & CDMA_CR_RESET_MASK)) {
+            SIM_REG(sim, addr) = value;
+            break;
+        }
+        // reset stops the engine after the current descriptor and completes at once
+        pthread_mutex_lock(&sim->lock);
+        sim->pending = 0;
+        sim->abort = 1;
+        while (sim->busy)
+            pthread_cond_wait(&sim->idle, &sim->lock);
+        sim->abort = 0;
+        SIM_REG(sim, addr) = 0;
+        SIM_REG(sim, CDMA_OFFSET + CDMA_STATUS_OFFSET) = CDMA_CR_IDLE_MASK;
+        pthread_mutex_unlock(&sim->lock);
+        break;
+
+    case CDMA_OFFSET + CDMA_TDESC_OFFSET:
+        pthread_mutex_lock(&sim->lock);
+        SIM_REG(sim, addr) = value;
+        if (SIM_REG(sim, CDMA_OFFSET + CDMA_CONTROL_OFFSET) & CDMA_CR_SG_EN) {
+            SIM_REG(sim, CDMA_OFFSET + CDMA_STATUS_OFFSET) &= ~CDMA_CR_IDLE_MASK;
+            sim->pending = 1;
+            pthread_cond_signal(&sim->kick);
+        }
+        pthread_mutex_unlock(&sim->lock);
+        break;
+
+    default:
+        SIM_REG(sim, addr) = value;
+        break;
+    }
+}
+
+int xpdma_sim_map(xpdma_sim_t *sim, void *mem, size_t size, uint64_t iova)
+{
+    if (sim->nmaps == SIM_MAPS) {
+        errno = ENOSPC;
+        return -1;
+    }
+    sim->maps[sim->nmaps].mem = (char *)mem;
+    sim->maps[sim->nmaps].size = size;
+    sim->maps[sim->nmaps].iova = iova;
+    sim->nmaps++;
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef XPDMA_SIM_H
+#define XPDMA_SIM_H
+
+// Software model of the card for the "sim" backend: BAR0 registers (translation
+// BRAM, AXI PCIe control, CDMA), a CDMA engine walking sg_desc_t chains and DDR3
+// in host memory, with a bandwidth/latency timing model
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct xpdma_sim_t xpdma_sim_t;
+
+/**
+ * Create the model; XPDMA_SIM_DDR (DDR3 bytes), XPDMA_SIM_SEND_MBS and XPDMA_SIM_RECV_MBS
+ * (PCIe bandwidth per direction, 0 - unlimited), XPDMA_SIM_LATENCY_NS (per CDMA
+ * operation) and XPDMA_SIM_DESC_NS (per descriptor) override the defaults
+ */
+xpdma_sim_t *xpdma_sim_create(void);
+
+void xpdma_sim_destroy(xpdma_sim_t *sim);
+
+/**
+ * BAR0 of the model: reads are plain loads, writes go through xpdma_sim_writeReg
+ */
+volatile uint32_t *xpdma_sim_regs(xpdma_sim_t *sim, size_t *size);
+
+/**
+ * Register write, writing CDMA TAILDESC starts the engine
+ */
+void xpdma_sim_writeReg(xpdma_sim_t *sim, uint32_t addr, uint32_t value);
+
+/**
+ * Make host memory visible to the engine at PCIe bus address iova (the IOMMU mapping)
+ */
+int xpdma_sim_map(xpdma_sim_t *sim, void *mem, size_t size, uint64_t iova);
+
+#endif //XPDMA_SIM_H
@@ -0,0 +1,173 @@
+//
+// Tracepoints of the XPDMA driver hot path (trace-cmd/perf: -e 'xpdma:*'),
+// they cost a static branch while disabled
+//
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM xpdma
+
+#if !defined(_XPDMA_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _XPDMA_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "xpdma_regs.h"
+
+// Descriptor status word bits
+#define show_sg_status(status) __print_flags(status, "|",   \
+        { SG_CMPLT_MASK,        "CMPLT" },                  \
+        { SG_DEC_ERR_MASK,      "DEC_ERR" },                \
+        { SG_SLAVE_ERR_MASK,    "SLV_ERR" },                \
+        { SG_INT_ERR_MASK,      "INT_ERR" })
+
+// Request entering the driver: op is send, recv, file_send, pool_recv, copy, ...;
+// count is bytes, records for vec_send/vec_recv
+TRACE_EVENT(xpdma_submit,
+    TP_PROTO(int card, const char *op, u64 count, u32 addr),
+    TP_ARGS(card, op, count, addr),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __string(op, op)
+        __field(u64, count)
+        __field(u32, addr)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __assign_str(op);
+        __entry->count = count;
+        __entry->addr = addr;
+    ),
+    TP_printk("card=%d op=%s count=%llu addr=0x%08x",
+              __entry->card, __get_str(op), __entry->count, __entry->addr)
+);
+
+// Slot chain built over nsegs host segments, translation vectors written
+TRACE_EVENT(xpdma_chain,
+    TP_PROTO(int card, int slot, int direction, u32 nsegs, u32 descs, u32 bytes),
+    TP_ARGS(card, slot, direction, nsegs, descs, bytes),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(int, slot)
+        __field(int, direction)
+        __field(u32, nsegs)
+        __field(u32, descs)
+        __field(u32, bytes)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->slot = slot;
+        __entry->direction = direction;
+        __entry->nsegs = nsegs;
+        __entry->descs = descs;
+        __entry->bytes = bytes;
+    ),
+    TP_printk("card=%d slot=%d dir=%d segs=%u descs=%u bytes=%u",
+              __entry->card, __entry->slot, __entry->direction,
+              __entry->nsegs, __entry->descs, __entry->bytes)
+);
+
+// CURDESC/TAILDESC written, CDMA runs the chain
+TRACE_EVENT(xpdma_kick,
+    TP_PROTO(int card, int slot, u32 curDesc, u32 tailDesc),
+    TP_ARGS(card, slot, curDesc, tailDesc),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(int, slot)
+        __field(u32, curDesc)
+        __field(u32, tailDesc)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->slot = slot;
+        __entry->curDesc = curDesc;
+        __entry->tailDesc = tailDesc;
+    ),
+    TP_printk("card=%d slot=%d cur=0x%08x tail=0x%08x",
+              __entry->card, __entry->slot, __entry->curDesc, __entry->tailDesc)
+);
+
+// Chain end seen by the waiter: tail status word and time since the kick
+DECLARE_EVENT_CLASS(xpdma_status,
+    TP_PROTO(int card, int slot, u32 status, s64 ns),
+    TP_ARGS(card, slot, status, ns),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(int, slot)
+        __field(u32, status)
+        __field(s64, ns)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->slot = slot;
+        __entry->status = status;
+        __entry->ns = ns;
+    ),
+    TP_printk("card=%d slot=%d status=0x%08x (%s) ns=%lld",
+              __entry->card, __entry->slot, __entry->status,
+              show_sg_status(__entry->status), __entry->ns)
+);
+
+DEFINE_EVENT(xpdma_status, xpdma_complete,
+    TP_PROTO(int card, int slot, u32 status, s64 ns),
+    TP_ARGS(card, slot, status, ns)
+);
+
+// Error bits set or timeout (no CMPLT)
+DEFINE_EVENT(xpdma_status, xpdma_error,
+    TP_PROTO(int card, int slot, u32 status, s64 ns),
+    TP_ARGS(card, slot, status, ns)
+);
+
+TRACE_EVENT(xpdma_reset,
+    TP_PROTO(int card, u32 status, int result),
+    TP_ARGS(card, status, result),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(u32, status)
+        __field(int, result)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->status = status;
+        __entry->result = result;
+    ),
+    TP_printk("card=%d cdma_status=0x%08x result=%d",
+              __entry->card, __entry->status, __entry->result)
+);
+
+// BAR0 accesses of the driver (user mappings of BAR0 are not seen)
+DECLARE_EVENT_CLASS(xpdma_reg,
+    TP_PROTO(int card, u32 reg, u32 value),
+    TP_ARGS(card, reg, value),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(u32, reg)
+        __field(u32, value)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->reg = reg;
+        __entry->value = value;
+    ),
+    TP_printk("card=%d reg=0x%08x value=0x%08x",
+              __entry->card, __entry->reg, __entry->value)
+);
+
+DEFINE_EVENT(xpdma_reg, xpdma_reg_read,
+    TP_PROTO(int card, u32 reg, u32 value),
+    TP_ARGS(card, reg, value)
+);
+
+DEFINE_EVENT(xpdma_reg, xpdma_reg_write,
+    TP_PROTO(int card, u32 reg, u32 value),
+    TP_ARGS(card, reg, value)
+);
+
+#endif // _XPDMA_TRACE_H
+
+// This part must be outside the header guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE xpdma_trace
+#include <trace/define_trace.h>
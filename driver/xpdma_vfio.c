@@ -0,0 +1,599 @@
+//
+// User-space driver of the card over VFIO: the chain building and CDMA programming
+// of xpdma_driver.c without kernel transitions, completion is polled by the caller.
+// The "sim" backend runs the same driver against the device model of xpdma_sim.c
+//
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <linux/vfio.h>
+
+#include "xpdma.h"
+#include "xpdma_regs.h"
+#include "xpdma_sim.h"
+
+#define VFIO_STAGES         2                   // Staging buffers (copy/DMA pipeline depth)
+#define VFIO_STAGE_SIZE     (16<<20)            // Bytes per staging buffer and CDMA operation
+#define VFIO_STAGE_PAIRS    (VFIO_STAGE_SIZE / AXI_PCIE_DM_SIZE) // Descriptor pairs (apertures) per stage
+#define VFIO_CHAIN_SIZE     (2<<20)             // Descriptor memory, one huge page
+#define VFIO_IOVA_BASE      (1ULL << 32)        // Descriptors, then staging buffers (aperture aligned)
+#define VFIO_STAGE_IOVA     (VFIO_IOVA_BASE + AXI_PCIE_SG_SIZE)
+#define VFIO_TIMEOUT_NS     (10LL * 1000000000LL) // CDMA operation timeout
+#define VFIO_RESET_LOOP     1000000
+#define VFIO_SIM_CARDS      8                   // Model cards, like /dev/xpdma0 .. /dev/xpdma7
+
+#define PCI_COMMAND_OFFSET  0x04
+#define PCI_COMMAND_MEMORY  0x02
+#define PCI_COMMAND_MASTER  0x04
+
+typedef struct {
+    int container;
+    int group;
+    int device;
+    xpdma_sim_t *sim;               // Device model instead of the card ("sim" backend)
+    volatile uint32_t *regs;        // BAR0
+    size_t regsSize;
+    sg_desc_t *chain;               // VFIO_STAGES chains of VFIO_STAGE_PAIRS pairs
+    char *stage[VFIO_STAGES];
+    char *stageMem;
+    size_t chainMapped;             // Mapping sizes, huge page rounded
+    size_t stageMapped;
+    unsigned int chainLength[VFIO_STAGES]; // Descriptors of the last operation of the stage
+    pthread_mutex_t lock;           // One transfer owns CDMA at a time
+    int index;                      // Model card index ("sim" backend)
+    int refs;                       // Handles sharing the model card
+} xpdma_vfio_t;
+
+// Open model cards: every handle of an index drives the same card, DDR3 and link
+static xpdma_vfio_t *simCards[VFIO_SIM_CARDS];
+static pthread_mutex_t simCardsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint32_t vfio_readReg(xpdma_vfio_t *vfio, uint32_t reg)
+{
+    return vfio->regs[reg / 4];
+}
+
+static inline void vfio_writeReg(xpdma_vfio_t *vfio, uint32_t reg, uint32_t value)
+{
+    if (vfio->sim)
+        xpdma_sim_writeReg(vfio->sim, reg, value);
+    else
+        vfio->regs[reg / 4] = value;
+}
+
+static inline uint32_t vfio_chainAddr(int stage)
+{
+    return AXI_PCIE_SG_ADDR + stage * VFIO_STAGE_PAIRS * 2 * DESCRIPTOR_SIZE;
+}
+
+static long long vfio_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Huge pages when the system has them, small pages otherwise (the IOMMU maps both)
+static void *vfio_allocDma(size_t *size)
+{
+    void *mem;
+
+    *size = (*size + (2<<20) - 1) & ~(size_t)((2<<20) - 1);
+    mem = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem == MAP_FAILED)
+        mem = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (mem == MAP_FAILED) ? NULL : mem;
+}
+
+static int vfio_mapDma(xpdma_vfio_t *vfio, void *mem, size_t size, uint64_t iova)
+{
+    struct vfio_iommu_type1_dma_map map;
+
+    if (vfio->sim)
+        return xpdma_sim_map(vfio->sim, mem, size, iova);
+
+    memset(&map, 0, sizeof(map));
+    map.argsz = sizeof(map);
+    map.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE;
+    map.vaddr = (uintptr_t)mem;
+    map.iova = iova;
+    map.size = size;
+    return ioctl(vfio->container, VFIO_IOMMU_MAP_DMA, &map);
+}
+
+// PCI address of the index-th card bound to vfio-pci
+static int vfio_findCard(int index, char *addr, size_t size)
+{
+    struct dirent **names;
+    char path[512];
+    char link[256];
+    unsigned int vendor = 0;
+    unsigned int device = 0;
+    const char *env = getenv("XPDMA_VFIO_DEVICE");
+    FILE *file;
+    ssize_t len;
+    int count;
+    int found = -1;
+    int c;
+
+    if (env != NULL && index == 0) {
+        snprintf(addr, size, "%s", env);
+        return 0;
+    }
+
+    count = scandir("/sys/bus/pci/devices", &names, NULL, alphasort);
+    for (c = 0; c < count; ++c) {
+        if (found < index && names[c]->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/vendor", names[c]->d_name);
+            file = fopen(path, "r");
+            vendor = 0;
+            if (file) {
+                if (fscanf(file, "%x", &vendor) != 1)
+                    vendor = 0;
+                fclose(file);
+            }
+            snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/device", names[c]->d_name);
+            file = fopen(path, "r");
+            device = 0;
+            if (file) {
+                if (fscanf(file, "%x", &device) != 1)
+                    device = 0;
+                fclose(file);
+            }
+            snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/driver", names[c]->d_name);
+            len = readlink(path, link, sizeof(link) - 1);
+            link[(len > 0) ? len : 0] = 0;
+
+            if (vendor == VENDOR_ID && device == DEVICE_ID && strstr(link, "/vfio-pci") && ++found == index)
+                snprintf(addr, size, "%s", names[c]->d_name);
+        }
+        free(names[c]);
+    }
+    if (count >= 0)
+        free(names);
+
+    return (found == index) ? 0 : -1;
+}
+
+// Container with the IOMMU group of the card, device file of the card
+static int vfio_attach(xpdma_vfio_t *vfio, const char *addr)
+{
+    struct vfio_group_status status;
+    char path[512];
+    char link[256];
+    const char *group;
+    ssize_t len;
+
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/iommu_group", addr);
+    len = readlink(path, link, sizeof(link) - 1);
+    if (len <= 0)
+        return -1;
+    link[len] = 0;
+    group = strrchr(link, '/') ? strrchr(link, '/') + 1 : link;
+
+    vfio->container = open("/dev/vfio/vfio", O_RDWR);
+    if (vfio->container < 0)
+        return -1;
+    if (ioctl(vfio->container, VFIO_GET_API_VERSION) != VFIO_API_VERSION ||
+            !ioctl(vfio->container, VFIO_CHECK_EXTENSION, VFIO_TYPE1_IOMMU))
+        return -1;
+
+    snprintf(path, sizeof(path), "/dev/vfio/%s", group);
+    vfio->group = open(path, O_RDWR);
+    if (vfio->group < 0)
+        return -1;
+
+    memset(&status, 0, sizeof(status));
+    status.argsz = sizeof(status);
+    if (ioctl(vfio->group, VFIO_GROUP_GET_STATUS, &status) || !(status.flags & VFIO_GROUP_FLAGS_VIABLE))
+        return -1;
+    if (ioctl(vfio->group, VFIO_GROUP_SET_CONTAINER, &vfio->container))
+        return -1;
+    if (ioctl(vfio->container, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU))
+        return -1;
+
+    vfio->device = ioctl(vfio->group, VFIO_GROUP_GET_DEVICE_FD, addr);
+    return (vfio->device < 0) ? -1 : 0;
+}
+
+// Map BAR0 and let the card master the bus
+static int vfio_mapBar(xpdma_vfio_t *vfio)
+{
+    struct vfio_region_info info;
+    uint16_t command = 0;
+    void *regs;
+
+    memset(&info, 0, sizeof(info));
+    info.argsz = sizeof(info);
+    info.index = VFIO_PCI_CONFIG_REGION_INDEX;
+    if (ioctl(vfio->device, VFIO_DEVICE_GET_REGION_INFO, &info))
+        return -1;
+    if (pread(vfio->device, &command, sizeof(command), info.offset + PCI_COMMAND_OFFSET) != sizeof(command))
+        return -1;
+    command |= PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER;
+    if (pwrite(vfio->device, &command, sizeof(command), info.offset + PCI_COMMAND_OFFSET) != sizeof(command))
+        return -1;
+
+    memset(&info, 0, sizeof(info));
+    info.argsz = sizeof(info);
+    info.index = VFIO_PCI_BAR0_REGION_INDEX;
+    if (ioctl(vfio->device, VFIO_DEVICE_GET_REGION_INFO, &info) || !(info.flags & VFIO_REGION_INFO_FLAG_MMAP))
+        return -1;
+
+    regs = mmap(NULL, info.size, PROT_READ | PROT_WRITE, MAP_SHARED, vfio->device, info.offset);
+    if (regs == MAP_FAILED)
+        return -1;
+    vfio->regs = (volatile uint32_t *)regs;
+    vfio->regsSize = info.size;
+    return 0;
+}
+
+// Links and translation descriptors of every stage chain, its vectors in BRAM: the
+// staging buffers never move, so only data descriptors change per operation
+static void vfio_buildChains(xpdma_vfio_t *vfio)
+{
+    sg_desc_t *chain;
+    uint64_t pntr;
+    uint32_t vector;
+    int stage;
+    int c;
+
+    for (stage = 0; stage < VFIO_STAGES; ++stage) {
+        chain = vfio->chain + stage * VFIO_STAGE_PAIRS * 2;
+        for (c = 0; c < VFIO_STAGE_PAIRS; ++c) {
+            vector = stage * VFIO_STAGE_PAIRS + c;
+            chain[2 * c].nextDesc     = vfio_chainAddr(stage) + (2 * c + 1) * DESCRIPTOR_SIZE;
+            chain[2 * c].srcAddr      = AXI_BRAM_ADDR + vector * BRAM_STEP;
+            chain[2 * c].destAddr     = AXI_BRAM_ADDR + PCIE_CTL_OFFSET + AXIBAR2PCIEBAR_1U;
+            chain[2 * c].control      = ADDR_BTT;
+            chain[2 * c].status       = 0;
+            chain[2 * c + 1].nextDesc = vfio_chainAddr(stage) + (2 * c + 2) * DESCRIPTOR_SIZE;
+            chain[2 * c + 1].control  = 0;
+            chain[2 * c + 1].status   = 0;
+
+            pntr = VFIO_STAGE_IOVA + (uint64_t)stage * VFIO_STAGE_SIZE + (uint64_t)c * AXI_PCIE_DM_SIZE;
+            vfio_writeReg(vfio, BRAM_OFFSET + vector * BRAM_STEP + 4, (pntr >> 0 ) & 0xFFFFFFFF); // Lower 32 bit
+            vfio_writeReg(vfio, BRAM_OFFSET + vector * BRAM_STEP + 0, (pntr >> 32) & 0xFFFFFFFF); // Upper 32 bit
+        }
+        chain[2 * VFIO_STAGE_PAIRS - 1].nextDesc = vfio_chainAddr(stage);
+    }
+}
+
+// Reset CDMA, select scatter gather mode and point AXI:BAR0 at the chains
+static int vfio_reset(xpdma_vfio_t *vfio)
+{
+    int loop = VFIO_RESET_LOOP;
+
+    vfio_writeReg(vfio, CDMA_OFFSET + CDMA_CONTROL_OFFSET,
+                  vfio_readReg(vfio, CDMA_OFFSET + CDMA_CONTROL_OFFSET) | CDMA_CR_RESET_MASK);
+    while (loop && (vfio_readReg(vfio, CDMA_OFFSET + CDMA_CONTROL_OFFSET) & CDMA_CR_RESET_MASK))
+        loop--;
+    if (!loop)
+        return -1;
+
+    vfio_writeReg(vfio, CDMA_OFFSET + CDMA_CONTROL_OFFSET, CDMA_CR_SG_EN);
+    vfio_writeReg(vfio, PCIE_CTL_OFFSET + AXIBAR2PCIEBAR_0L, (VFIO_IOVA_BASE >> 0 ) & 0xFFFFFFFF);
+    vfio_writeReg(vfio, PCIE_CTL_OFFSET + AXIBAR2PCIEBAR_0U, (VFIO_IOVA_BASE >> 32) & 0xFFFFFFFF);
+    return 0;
+}
+
+// Patch the data descriptors of count bytes from/to the stage buffer and kick CDMA
+static int vfio_operation(xpdma_vfio_t *vfio, int stage, int send, unsigned int count, uint32_t addr)
+{
+    sg_desc_t *chain = vfio->chain + stage * VFIO_STAGE_PAIRS * 2;
+    uint32_t hostAddr = AXI_PCIE_DM_ADDR;
+    uint32_t ddrAddr = AXI_DDR3_ADDR + addr;
+    uint32_t btt;
+    int pairs = 0;
+
+    if (!(vfio_readReg(vfio, CDMA_OFFSET + CDMA_STATUS_OFFSET) & CDMA_CR_IDLE_MASK))
+        return -1;
+
+    // every aperture of the stage starts at the AXI:BAR1 base, its vector does the rest
+    for (pairs = 0; count; ++pairs) {
+        btt = (count < AXI_PCIE_DM_SIZE) ? count : AXI_PCIE_DM_SIZE;
+        chain[2 * pairs].status       = 0;
+        chain[2 * pairs + 1].srcAddr  = send ? hostAddr : ddrAddr;
+        chain[2 * pairs + 1].destAddr = send ? ddrAddr : hostAddr;
+        chain[2 * pairs + 1].control  = btt;
+        chain[2 * pairs + 1].status   = 0;
+        chain[2 * pairs + 1].nextDesc = vfio_chainAddr(stage) + (2 * pairs + 2) * DESCRIPTOR_SIZE;
+        ddrAddr += btt;
+        count -= btt;
+    }
+    chain[2 * pairs - 1].nextDesc = vfio_chainAddr(stage); // tail descriptor pointed to chain head
+    vfio->chainLength[stage] = 2 * pairs;
+
+    // descriptors must be in memory before CDMA fetches them
+    __sync_synchronize();
+    vfio_writeReg(vfio, CDMA_OFFSET + CDMA_CDESC_OFFSET, vfio_chainAddr(stage));
+    vfio_writeReg(vfio, CDMA_OFFSET + CDMA_TDESC_OFFSET,
+                  vfio_chainAddr(stage) + (vfio->chainLength[stage] - 1) * DESCRIPTOR_SIZE);
+    return 0;
+}
+
+// Busy poll the tail status of the stage chain in the calling thread
+static int vfio_wait(xpdma_vfio_t *vfio, int stage)
+{
+    volatile sg_desc_t *tail = vfio->chain + stage * VFIO_STAGE_PAIRS * 2 + vfio->chainLength[stage] - 1;
+    long long deadline = vfio_nsec() + VFIO_TIMEOUT_NS;
+    uint32_t status;
+
+    while (1) {
+        status = tail->status;
+        if (status & SG_ERR_MASK)
+            break;
+        if (status & SG_COMPLETE_MASK)
+            return 0;
+        if (vfio_nsec() > deadline)
+            break;
+    }
+
+    vfio_reset(vfio);
+    errno = EIO;
+    return -1;
+}
+
+static void xpdma_vfio_close(void *dev)
+{
+    xpdma_vfio_t *vfio = (xpdma_vfio_t *)dev;
+
+    if (vfio->sim)
+        xpdma_sim_destroy(vfio->sim);
+    else if (vfio->regs)
+        munmap((void *)vfio->regs, vfio->regsSize);
+    if (vfio->chain)
+        munmap(vfio->chain, vfio->chainMapped);
+    if (vfio->stageMem)
+        munmap(vfio->stageMem, vfio->stageMapped);
+    if (vfio->device >= 0)
+        close(vfio->device);
+    if (vfio->group >= 0)
+        close(vfio->group);
+    if (vfio->container >= 0)
+        close(vfio->container);
+    pthread_mutex_destroy(&vfio->lock);
+    free(vfio);
+}
+
+// Descriptor and staging memory mapped for the card, CDMA reset, chains built
+static int vfio_setup(xpdma_vfio_t *vfio)
+{
+    int c;
+
+    vfio->chainMapped = VFIO_CHAIN_SIZE;
+    vfio->chain = (sg_desc_t *)vfio_allocDma(&vfio->chainMapped);
+    vfio->stageMapped = (size_t)VFIO_STAGES * VFIO_STAGE_SIZE;
+    vfio->stageMem = (char *)vfio_allocDma(&vfio->stageMapped);
+    if (vfio->chain == NULL || vfio->stageMem == NULL)
+        return -1;
+    memset(vfio->chain, 0, vfio->chainMapped);
+    for (c = 0; c < VFIO_STAGES; ++c)
+        vfio->stage[c] = vfio->stageMem + (size_t)c * VFIO_STAGE_SIZE;
+
+    if (vfio_mapDma(vfio, vfio->chain, vfio->chainMapped, VFIO_IOVA_BASE) ||
+            vfio_mapDma(vfio, vfio->stageMem, vfio->stageMapped, VFIO_STAGE_IOVA))
+        return -1;
+
+    if (vfio_reset(vfio))
+        return -1;
+    vfio_buildChains(vfio);
+    return 0;
+}
+
+static void *xpdma_vfio_open(int index)
+{
+    xpdma_vfio_t *vfio;
+    char addr[64];
+
+    if (vfio_findCard(index, addr, sizeof(addr)))
+        return NULL;
+
+    vfio = (xpdma_vfio_t *)calloc(1, sizeof(xpdma_vfio_t));
+    if (vfio == NULL)
+        return NULL;
+    vfio->container = vfio->group = vfio->device = -1;
+    pthread_mutex_init(&vfio->lock, NULL);
+
+    if (vfio_attach(vfio, addr) || vfio_mapBar(vfio) || vfio_setup(vfio)) {
+        xpdma_vfio_close(vfio);
+        return NULL;
+    }
+    return vfio;
+}
+
+// Handles of one index share the model card and take turns on its CDMA, like
+// threads and processes sharing /dev/xpdmaN
+static void *xpdma_sim_open(int index)
+{
+    xpdma_vfio_t *vfio;
+
+    if (index < 0 || index >= VFIO_SIM_CARDS) {
+        errno = ENODEV;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&simCardsLock);
+    vfio = simCards[index];
+    if (vfio != NULL) {
+        vfio->refs++;
+        pthread_mutex_unlock(&simCardsLock);
+        return vfio;
+    }
+
+    vfio = (xpdma_vfio_t *)calloc(1, sizeof(xpdma_vfio_t));
+    if (vfio == NULL) {
+        pthread_mutex_unlock(&simCardsLock);
+        return NULL;
+    }
+    vfio->container = vfio->group = vfio->device = -1;
+    vfio->index = index;
+    vfio->refs = 1;
+    pthread_mutex_init(&vfio->lock, NULL);
+
+    vfio->sim = xpdma_sim_create();
+    if (vfio->sim != NULL)
+        vfio->regs = xpdma_sim_regs(vfio->sim, &vfio->regsSize);
+    if (vfio->sim == NULL || vfio_setup(vfio)) {
+        xpdma_vfio_close(vfio);
+        vfio = NULL;
+    }
+    simCards[index] = vfio;
+    pthread_mutex_unlock(&simCardsLock);
+    return vfio;
+}
+
+// The last handle of the index takes the model card down
+static void xpdma_sim_close(void *dev)
+{
+    xpdma_vfio_t *vfio = (xpdma_vfio_t *)dev;
+
+    pthread_mutex_lock(&simCardsLock);
+    if (--vfio->refs) {
+        pthread_mutex_unlock(&simCardsLock);
+        return;
+    }
+    simCards[vfio->index] = NULL;
+    pthread_mutex_unlock(&simCardsLock);
+    xpdma_vfio_close(vfio);
+}
+
+// Chunk c + 1 is copied to the other staging buffer while CDMA moves chunk c
+static int vfio_send(xpdma_vfio_t *vfio, void *data, unsigned int count, unsigned int addr)
+{
+    const char *src = (const char *)data;
+    unsigned int chunk = (count < VFIO_STAGE_SIZE) ? count : VFIO_STAGE_SIZE;
+    unsigned int next = 0;
+    int stage = 0;
+
+    if (!count)
+        return 0;
+
+    memcpy(vfio->stage[stage], src, chunk);
+    if (vfio_operation(vfio, stage, 1, chunk, addr))
+        return -1;
+
+    while (1) {
+        src += chunk;
+        addr += chunk;
+        count -= chunk;
+        next = (count < VFIO_STAGE_SIZE) ? count : VFIO_STAGE_SIZE;
+        if (next)
+            memcpy(vfio->stage[(stage + 1) % VFIO_STAGES], src, next);
+
+        if (vfio_wait(vfio, stage))
+            return -1;
+        if (!next)
+            return 0;
+
+        stage = (stage + 1) % VFIO_STAGES;
+        chunk = next;
+        if (vfio_operation(vfio, stage, 1, chunk, addr))
+            return -1;
+    }
+}
+
+// CDMA moves chunk c + 1 while chunk c is copied out of its staging buffer
+static int vfio_recv(xpdma_vfio_t *vfio, void *data, unsigned int count, unsigned int addr)
+{
+    char *dst = (char *)data;
+    unsigned int chunk = (count < VFIO_STAGE_SIZE) ? count : VFIO_STAGE_SIZE;
+    unsigned int next = 0;
+    int stage = 0;
+
+    if (!count)
+        return 0;
+
+    if (vfio_operation(vfio, stage, 0, chunk, addr))
+        return -1;
+
+    while (1) {
+        if (vfio_wait(vfio, stage))
+            return -1;
+
+        addr += chunk;
+        count -= chunk;
+        next = (count < VFIO_STAGE_SIZE) ? count : VFIO_STAGE_SIZE;
+        if (next && vfio_operation(vfio, (stage + 1) % VFIO_STAGES, 0, next, addr))
+            return -1;
+
+        memcpy(dst, vfio->stage[stage], chunk);
+        if (!next)
+            return 0;
+
+        dst += chunk;
+        stage = (stage + 1) % VFIO_STAGES;
+        chunk = next;
+    }
+}
+
+static int xpdma_vfio_send(void *dev, void *data, unsigned int count, unsigned int addr)
+{
+    xpdma_vfio_t *vfio = (xpdma_vfio_t *)dev;
+    int ret;
+
+    pthread_mutex_lock(&vfio->lock);
+    ret = vfio_send(vfio, data, count, addr);
+    pthread_mutex_unlock(&vfio->lock);
+    return ret;
+}
+
+static int xpdma_vfio_recv(void *dev, void *data, unsigned int count, unsigned int addr)
+{
+    xpdma_vfio_t *vfio = (xpdma_vfio_t *)dev;
+    int ret;
+
+    pthread_mutex_lock(&vfio->lock);
+    ret = vfio_recv(vfio, data, count, addr);
+    pthread_mutex_unlock(&vfio->lock);
+    return ret;
+}
+
+static uint32_t xpdma_vfio_readReg(void *dev, uint32_t addr)
+{
+    xpdma_vfio_t *vfio = (xpdma_vfio_t *)dev;
+
+    return (addr < vfio->regsSize) ? vfio_readReg(vfio, addr) : 0xFFFFFFFF;
+}
+
+static void xpdma_vfio_writeReg(void *dev, uint32_t addr, uint32_t value)
+{
+    xpdma_vfio_t *vfio = (xpdma_vfio_t *)dev;
+
+    if (addr < vfio->regsSize)
+        vfio_writeReg(vfio, addr, value);
+}
+
+const xpdma_backend_t xpdma_backend_vfio = {
+    "vfio",
+    xpdma_vfio_open,
+    xpdma_vfio_close,
+    NULL,
+    xpdma_vfio_send,
+    xpdma_vfio_recv,
+    xpdma_vfio_readReg,
+    xpdma_vfio_writeReg,
+};
+
+const xpdma_backend_t xpdma_backend_sim = {
+    "sim",
+    xpdma_sim_open,
+    xpdma_sim_close,
+    NULL,
+    xpdma_vfio_send,
+    xpdma_vfio_recv,
+    xpdma_vfio_readReg,
+    xpdma_vfio_writeReg,
+};
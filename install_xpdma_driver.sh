@@ -4,19 +4,16 @@ cd driver
 make
 
 DEVICE="xpdma"
-DEV_PATH="/dev/${DEVICE}"
 
 # Remove module (if loaded)
 sudo make unload
-sudo rm -rf ${DEV_PATH}
-
-# Insert module 
-sudo mknod  ${DEV_PATH} c 241 1
-sudo chown user ${DEV_PATH}
-sudo chmod 0644 ${DEV_PATH}
-ls -al ${DEV_PATH}
 
+# Insert module, udev creates /dev/xpdma0 .. /dev/xpdmaN (one per card, dynamic major)
 sudo make load
+sleep 1
+sudo chown user /dev/${DEVICE}[0-9]*
+sudo chmod 0644 /dev/${DEVICE}[0-9]*
+ls -al /dev/${DEVICE}[0-9]*
 
 cd ../software
 make
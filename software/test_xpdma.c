@@ -1,12 +1,652 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
 #include <string.h>
 #include <malloc.h>
 #include <stddef.h>
 #include "xpdma.h"
 #include <sys/time.h> 
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #define TEST_SIZE   1024*1024*1024 // 1GB test data
 #define TEST_ADDR   0 // offset of DDR start address
+#define RATE_SIZE   4096 // small transfer for the transfers per second test
+#define RATE_COUNT  100000
+#define RING_ENTRIES 256
+#define BULK_SIZE   (16*1024*1024) // bulk load competing with small transfers
+#define BULK_ADDR   (256*1024*1024)
+#define LATENCY_COUNT 1000
+#define VEC_COUNT   64             // scattered records per vectored request
+#define VEC_RECORD  512
+#define VEC_STRIDE  (64*1024)
+#define LATENCY_SIZE 4096          // round trip latency percentiles of small receives
+#define LATENCY_RUNS 100000
+#define COPY_SIZE   (64*1024*1024) // on-card DDR-to-DDR copy
+#define COPY_SRC    (512*1024*1024)
+#define COPY_DST    (768*1024*1024)
+#define PARALLEL_SIZE (256*1024*1024) // user<->DMA buffer copy split across threads
+#define PARALLEL_ADDR (256*1024*1024)
+#define PARALLEL_THREADS 8
+#define STREAM_DDR_SIZE (64*1024*1024) // DDR ring drained by the stream
+#define STREAM_SLOT  (1024*1024)
+#define STREAM_SLOTS 32
+#define STREAM_BYTES (1024LL*1024*1024)
+#define FILE_BYTES  (4096LL*1024*1024) // file load benchmark, file named by XPDMA_FILE
+#define FILE_PIECE  (256*1024*1024)    // loaded piece by piece into the same DDR region
+#define FILE_ADDR   (256*1024*1024)
+#define FILE_METHODS 3
+#define REG_STATUS  0xc004             // CDMA status register polled by the register access test
+#define REG_RUNS    100000
+#define CACHE_BLOCK (64*1024)          // host read cache: hot region re-read, then a sequential scan
+#define CACHE_SIZE  (16*1024*1024)
+#define CACHE_AHEAD 16
+#define CACHE_HOT   (1024*1024)
+#define CACHE_SCAN  (64*1024*1024)
+#define CACHE_READ  4096
+#define CACHE_ADDR  (256*1024*1024)
+
+static void print_stats(const char *name, const cdmaStats_t *stats)
+{
+    double hidden = 0.0;
+    uint64_t bound = (stats->copyNs < stats->dmaNs) ? stats->copyNs : stats->dmaNs;
+
+    if (bound)
+        hidden = 100.0 * stats->overlapNs / bound;
+
+    printf("%s pipeline: %llu chunks (%llu descriptors), copy %.3f ms, dma %.3f ms, wall %.3f ms, overlap %.3f ms (%.1f%%)\n",
+           name, (unsigned long long)stats->chunks, (unsigned long long)stats->descriptors,
+           stats->copyNs / 1e6, stats->dmaNs / 1e6, stats->wallNs / 1e6,
+           stats->overlapNs / 1e6, hidden);
+    printf("%s pipeline: %llu DMA bound steps, %llu copy bound steps\n",
+           name, (unsigned long long)stats->dmaWaits, (unsigned long long)stats->copyStalls);
+    if (stats->transfers)
+        printf("%s CPU time: %.3f ms per transfer (slept %.3f ms)\n", name,
+               (stats->wallNs - stats->sleepNs) / 1e6 / stats->transfers,
+               stats->sleepNs / 1e6 / stats->transfers);
+}
+
+// Send and receive back through an mmap-ed DMA buffer, data is filled in place
+static int test_buffer(xpdma_t *fpga)
+{
+    xpdma_buffer_t *buffer;
+    unsigned int half;
+    unsigned int c;
+    int err_count = 0;
+
+    buffer = xpdma_buffer_alloc(fpga);
+    if (NULL == buffer)
+        return -1;
+
+    half = buffer->size / 2;
+    for (c = 0; c < half; ++c)
+        ((char *)buffer->data)[c] = c * 7;
+    memset((char *)buffer->data + half, 0, half);
+
+    if (xpdma_send_buffer(fpga, buffer, 0, half, TEST_ADDR) ||
+            xpdma_recv_buffer(fpga, buffer, half, half, TEST_ADDR)) {
+        xpdma_buffer_free(fpga, buffer);
+        return -1;
+    }
+
+    for (c = 0; c < half; ++c)
+        err_count += (((char *)buffer->data)[c] != ((char *)buffer->data)[half + c]);
+
+    xpdma_buffer_free(fpga, buffer);
+    return err_count;
+}
+
+// Same round trip queued asynchronously: both requests run back-to-back
+static int test_async(xpdma_t *fpga)
+{
+    xpdma_buffer_t *buffer;
+    cdmaCompletion_t done[2];
+    unsigned int half;
+    unsigned int c;
+    int reaped = 0;
+    int n;
+    int err_count = 0;
+
+    buffer = xpdma_buffer_alloc(fpga);
+    if (NULL == buffer)
+        return -1;
+
+    half = buffer->size / 2;
+    for (c = 0; c < half; ++c)
+        ((char *)buffer->data)[c] = c * 13;
+    memset((char *)buffer->data + half, 0, half);
+
+    if (xpdma_submit(fpga, REQUEST_SEND, buffer, 0, half, TEST_ADDR, 1) ||
+            xpdma_submit(fpga, REQUEST_RECV, buffer, half, half, TEST_ADDR, 2)) {
+        while (xpdma_wait(fpga, done, 2) > 0);
+        xpdma_buffer_free(fpga, buffer);
+        return -1;
+    }
+
+    while (reaped < 2) {
+        n = xpdma_wait(fpga, done, 2);
+        if (n <= 0)
+            break;
+        for (c = 0; c < n; ++c)
+            err_count += (SUCCESS != done[c].status);
+        reaped += n;
+    }
+
+    for (c = 0; c < half; ++c)
+        err_count += (((char *)buffer->data)[c] != ((char *)buffer->data)[half + c]);
+
+    xpdma_buffer_free(fpga, buffer);
+    return err_count;
+}
+
+static double elapsed_ms(struct timeval *from, struct timeval *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_usec - from->tv_usec) / 1000.0;
+}
+
+// 4 KB sends: one ioctl per transfer against batches through the shared rings
+static void test_rate(int sqpoll)
+{
+    xpdma_t *fpga;
+    xpdma_buffer_t *buffer;
+    cdmaCompletion_t done[RING_ENTRIES];
+    struct timeval timers[3];
+    unsigned int queued = 0;
+    unsigned int reaped = 0;
+    unsigned int c;
+    int n;
+    int err_count = 0;
+
+    fpga = xpdma_open(0);
+    if (NULL == fpga)
+        return;
+
+    buffer = xpdma_buffer_alloc(fpga);
+    if (NULL == buffer || xpdma_ring_setup(fpga, RING_ENTRIES, sqpoll)) {
+        printf("Rings not available\n");
+        if (buffer)
+            xpdma_buffer_free(fpga, buffer);
+        xpdma_close(fpga);
+        return;
+    }
+
+    gettimeofday(&timers[0], NULL);
+    for (c = 0; c < RATE_COUNT; ++c)
+        err_count += (0 != xpdma_send_buffer(fpga, buffer, 0, RATE_SIZE, TEST_ADDR));
+    gettimeofday(&timers[1], NULL);
+
+    while (reaped < RATE_COUNT) {
+        while (queued < RATE_COUNT &&
+                !xpdma_ring_queue(fpga, REQUEST_SEND, buffer, 0, RATE_SIZE, TEST_ADDR, queued))
+            queued++;
+        // doorbell per batch waits for a completion, polled rings need no syscall
+        if (xpdma_ring_submit(fpga, sqpoll ? 0 : 1) < 0)
+            break;
+        n = xpdma_ring_reap(fpga, done, RING_ENTRIES);
+        for (c = 0; c < n; ++c)
+            err_count += (SUCCESS != done[c].status);
+        reaped += n;
+    }
+    gettimeofday(&timers[2], NULL);
+
+    printf("%u x %u bytes: ioctl %.0f transfers/s, %s rings %.0f transfers/s, %d errors\n",
+           RATE_COUNT, RATE_SIZE,
+           RATE_COUNT / (elapsed_ms(&timers[0], &timers[1]) / 1000.0),
+           sqpoll ? "polled" : "doorbell",
+           reaped / (elapsed_ms(&timers[1], &timers[2]) / 1000.0), err_count);
+
+    xpdma_buffer_free(fpga, buffer);
+    xpdma_close(fpga);
+}
+
+// Copy between DDR regions on the card, check by reading the destination back
+static int test_copy(xpdma_t *fpga)
+{
+    struct timeval timers[2];
+    char *data_in = (char *)malloc(COPY_SIZE);
+    char *data_out = (char *)malloc(COPY_SIZE);
+    unsigned int c;
+    int err_count = 0;
+
+    if (NULL == data_in || NULL == data_out) {
+        free(data_in);
+        free(data_out);
+        return -1;
+    }
+
+    for (c = 0; c < COPY_SIZE; ++c)
+        data_in[c] = c * 7;
+    memset(data_out, 0, COPY_SIZE);
+
+    xpdma_send(fpga, data_in, COPY_SIZE, COPY_SRC);
+    gettimeofday(&timers[0], NULL);
+    if (xpdma_copy(fpga, COPY_SRC, COPY_DST, COPY_SIZE)) {
+        free(data_in);
+        free(data_out);
+        return -1;
+    }
+    gettimeofday(&timers[1], NULL);
+    xpdma_recv(fpga, data_out, COPY_SIZE, COPY_DST);
+
+    for (c = 0; c < COPY_SIZE; ++c)
+        err_count += (data_in[c] != data_out[c]);
+
+    printf("%.3f ms, %.1f MB/s, ", elapsed_ms(&timers[0], &timers[1]),
+           COPY_SIZE / (1024.0 * 1024.0) / (elapsed_ms(&timers[0], &timers[1]) / 1000.0));
+    free(data_in);
+    free(data_out);
+    return err_count;
+}
+
+// Small receives of a hot region and of a sequential scan through the read cache,
+// a send in between must be seen by the next receive
+static int test_cache(xpdma_t *fpga)
+{
+    xpdma_cache_stats_t stats;
+    struct timeval timers[3];
+    char *data = (char *)malloc(CACHE_SCAN);
+    char read[CACHE_READ];
+    unsigned int round;
+    unsigned int c;
+    int err_count = 0;
+
+    if (NULL == data)
+        return -1;
+    for (c = 0; c < CACHE_SCAN; ++c)
+        data[c] = c * 13;
+    xpdma_send(fpga, data, CACHE_SCAN, CACHE_ADDR);
+
+    if (xpdma_cache_setup(fpga, CACHE_BLOCK, CACHE_SIZE, CACHE_AHEAD)) {
+        free(data);
+        return -1;
+    }
+
+    gettimeofday(&timers[0], NULL);
+    for (round = 0; round < 16; ++round) {
+        for (c = 0; c < CACHE_HOT; c += CACHE_READ) {
+            err_count += (0 != xpdma_recv(fpga, read, CACHE_READ, CACHE_ADDR + c));
+            err_count += (0 != memcmp(read, data + c, CACHE_READ));
+        }
+        // update in the middle of the hot region
+        data[CACHE_HOT / 2] = round;
+        xpdma_send(fpga, data + CACHE_HOT / 2, 16, CACHE_ADDR + CACHE_HOT / 2);
+    }
+    gettimeofday(&timers[1], NULL);
+    for (c = 0; c < CACHE_SCAN; c += CACHE_READ) {
+        err_count += (0 != xpdma_recv(fpga, read, CACHE_READ, CACHE_ADDR + c));
+        err_count += (0 != memcmp(read, data + c, CACHE_READ));
+    }
+    gettimeofday(&timers[2], NULL);
+
+    xpdma_cache_stats(fpga, &stats);
+    printf("hot %.3f ms, scan %.3f ms, hit rate %.1f%%, %llu MB saved, %llu of %llu read-ahead blocks used, ",
+           elapsed_ms(&timers[0], &timers[1]), elapsed_ms(&timers[1], &timers[2]),
+           100.0 * stats.hits / (stats.hits + stats.misses ? stats.hits + stats.misses : 1),
+           (unsigned long long)(stats.bytesSaved >> 20), (unsigned long long)stats.readaheadHits,
+           (unsigned long long)stats.readahead);
+
+    xpdma_cache_setup(fpga, 0, 0, 0);
+    free(data);
+    return err_count;
+}
+
+// Drain the DDR ring continuously and touch every slot like a consumer would
+static void test_stream(xpdma_t *fpga)
+{
+    struct timeval timers[2];
+    cdmaStream_t status;
+    long long streamed = 0;
+    unsigned long long sum = 0;
+    char *slot;
+    unsigned int c;
+
+    if (xpdma_stream_start(fpga, 0, STREAM_DDR_SIZE, STREAM_SLOT, STREAM_SLOTS)) {
+        printf("Stream: not available\n");
+        return;
+    }
+
+    gettimeofday(&timers[0], NULL);
+    while (streamed < STREAM_BYTES) {
+        slot = (char *)xpdma_stream_next(fpga, 1000);
+        if (NULL == slot)
+            break;
+        for (c = 0; c < STREAM_SLOT; c += 64)
+            sum += slot[c];
+        xpdma_stream_release(fpga);
+        streamed += STREAM_SLOT;
+    }
+    gettimeofday(&timers[1], NULL);
+
+    xpdma_stream_status(fpga, &status);
+    printf("Stream: %lld MB in %.3f ms, %.1f MB/s, %llu overruns, stalled %.3f ms%s, checksum %llu\n",
+           streamed >> 20, elapsed_ms(&timers[0], &timers[1]),
+           streamed / (1024.0 * 1024.0) / (elapsed_ms(&timers[0], &timers[1]) / 1000.0),
+           (unsigned long long)status.overruns, status.stallNs / 1e6,
+           (STREAM_ERROR == status.status) ? ", error" : "", sum);
+    xpdma_stream_stop(fpga);
+}
+
+// Register reads through ioctl, the BAR0 mapping, and translation BRAM dumped with one batch
+static void test_regs(xpdma_t *fpga)
+{
+    static cdmaRegOp_t ops[REG_BATCH_MAX];
+    struct timeval timers[4];
+    uint32_t sum = 0;
+    unsigned int c;
+    int mapped;
+    int ret;
+
+    gettimeofday(&timers[0], NULL);
+    for (c = 0; c < REG_RUNS; ++c)
+        sum += xpdma_readReg(fpga, REG_STATUS);
+    gettimeofday(&timers[1], NULL);
+
+    mapped = !xpdma_map_regs(fpga, 0);
+    for (c = 0; c < REG_RUNS && mapped; ++c)
+        sum += xpdma_readReg(fpga, REG_STATUS);
+    gettimeofday(&timers[2], NULL);
+
+    for (c = 0; c < REG_BATCH_MAX; ++c) {
+        ops[c].reg = c * 4;
+        ops[c].write = 0;
+    }
+    ret = xpdma_reg_batch(fpga, ops, REG_BATCH_MAX);
+    gettimeofday(&timers[3], NULL);
+
+    printf("Register read: ioctl %.3f us", elapsed_ms(&timers[0], &timers[1]) * 1000.0 / REG_RUNS);
+    if (mapped)
+        printf(", mmap %.3f us", elapsed_ms(&timers[1], &timers[2]) * 1000.0 / REG_RUNS);
+    else
+        printf(", mmap not available");
+    printf(", %d registers batched in %.3f ms%s (sum %u)\n", REG_BATCH_MAX, elapsed_ms(&timers[2], &timers[3]),
+           ret ? " failed" : "", sum);
+}
+
+// Up to FILE_BYTES of the file to DDR: read() + xpdma_send, in-driver file path, O_DIRECT pipeline
+static void test_file(xpdma_t *fpga)
+{
+    static const char *names[FILE_METHODS] = {"read + send", "driver file path", "O_DIRECT pipeline"};
+    const char *path = getenv("XPDMA_FILE");
+    struct timeval timers[2];
+    struct stat st;
+    long long size = 0;
+    long long done = 0;
+    unsigned int piece = 0;
+    char *buffer = NULL;
+    int method = 0;
+    int fd = -1;
+    int ret = 0;
+
+    if (NULL == path) {
+        printf("File load: set XPDMA_FILE to a 4 GB file to benchmark\n");
+        return;
+    }
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        printf("File load: can't open %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    size = (st.st_size < FILE_BYTES) ? st.st_size : FILE_BYTES;
+    buffer = (char *)xpdma_alloc_local(fpga, FILE_PIECE);
+    if (NULL == buffer) {
+        close(fd);
+        return;
+    }
+
+    for (method = 0; method < FILE_METHODS; ++method) {
+        // every method starts with a cold page cache
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ret = 0;
+        gettimeofday(&timers[0], NULL);
+        for (done = 0; done < size && !ret; done += piece) {
+            piece = (size - done < FILE_PIECE) ? (unsigned int)(size - done) : FILE_PIECE;
+            if (0 == method)
+                ret = (pread(fd, buffer, piece, done) != piece) || xpdma_send(fpga, buffer, piece, FILE_ADDR);
+            else if (1 == method)
+                ret = xpdma_send_file(fpga, fd, done, piece, FILE_ADDR);
+            else
+                ret = xpdma_load_file(fpga, path, done, piece, FILE_ADDR);
+        }
+        gettimeofday(&timers[1], NULL);
+        printf("File load, %s: %lld MB in %.3f ms, %.1f MB/s%s\n", names[method], size >> 20,
+               elapsed_ms(&timers[0], &timers[1]),
+               size / (1024.0 * 1024.0) / (elapsed_ms(&timers[0], &timers[1]) / 1000.0),
+               ret ? ", failed" : "");
+    }
+
+    xpdma_free_local(buffer, FILE_PIECE);
+    close(fd);
+}
+
+// Scaling of the parallel user<->DMA buffer copy with 1..PARALLEL_THREADS threads
+static void test_parallel(xpdma_t *fpga)
+{
+    struct timeval timers[3];
+    char *data_in = (char *)xpdma_alloc_local(fpga, PARALLEL_SIZE);
+    char *data_out = (char *)xpdma_alloc_local(fpga, PARALLEL_SIZE);
+    unsigned int c;
+    int threads;
+    int err_count;
+    int ret;
+
+    if (NULL == data_in || NULL == data_out) {
+        xpdma_free_local(data_in, PARALLEL_SIZE);
+        xpdma_free_local(data_out, PARALLEL_SIZE);
+        return;
+    }
+
+    for (c = 0; c < PARALLEL_SIZE; ++c)
+        data_in[c] = c * 13;
+
+    gettimeofday(&timers[0], NULL);
+    xpdma_send(fpga, data_in, PARALLEL_SIZE, PARALLEL_ADDR);
+    gettimeofday(&timers[1], NULL);
+    xpdma_recv(fpga, data_out, PARALLEL_SIZE, PARALLEL_ADDR);
+    gettimeofday(&timers[2], NULL);
+    printf("Parallel copy, driver staging: send %.1f MB/s, recv %.1f MB/s\n",
+           PARALLEL_SIZE / (1024.0 * 1024.0) / (elapsed_ms(&timers[0], &timers[1]) / 1000.0),
+           PARALLEL_SIZE / (1024.0 * 1024.0) / (elapsed_ms(&timers[1], &timers[2]) / 1000.0));
+
+    for (threads = 1; threads <= PARALLEL_THREADS; threads *= 2) {
+        if (xpdma_set_copy_threads(fpga, threads))
+            break;
+        memset(data_out, 0, PARALLEL_SIZE);
+
+        gettimeofday(&timers[0], NULL);
+        ret = xpdma_send_parallel(fpga, data_in, PARALLEL_SIZE, PARALLEL_ADDR);
+        gettimeofday(&timers[1], NULL);
+        ret |= xpdma_recv_parallel(fpga, data_out, PARALLEL_SIZE, PARALLEL_ADDR);
+        gettimeofday(&timers[2], NULL);
+
+        err_count = 0;
+        for (c = 0; c < PARALLEL_SIZE; ++c)
+            err_count += (data_in[c] != data_out[c]);
+
+        printf("Parallel copy, %d threads: send %.1f MB/s, recv %.1f MB/s, %s\n", threads,
+               PARALLEL_SIZE / (1024.0 * 1024.0) / (elapsed_ms(&timers[0], &timers[1]) / 1000.0),
+               PARALLEL_SIZE / (1024.0 * 1024.0) / (elapsed_ms(&timers[1], &timers[2]) / 1000.0),
+               ret ? "failed" : (err_count ? "errors" : "Ok"));
+    }
+    xpdma_set_copy_threads(fpga, 0);
+
+    xpdma_free_local(data_in, PARALLEL_SIZE);
+    xpdma_free_local(data_out, PARALLEL_SIZE);
+}
+
+// Scattered records: one vectored request against a transfer per record
+static int test_vec(xpdma_t *fpga)
+{
+    static char data_in[VEC_COUNT][VEC_RECORD];
+    static char data_out[VEC_COUNT][VEC_RECORD];
+    cdmaVec_t vec[VEC_COUNT];
+    struct timeval timers[3];
+    unsigned int c;
+    unsigned int b;
+    int err_count = 0;
+
+    for (c = 0; c < VEC_COUNT; ++c) {
+        for (b = 0; b < VEC_RECORD; ++b)
+            data_in[c][b] = c + b;
+        vec[c].data = data_in[c];
+        vec[c].count = VEC_RECORD;
+        vec[c].addr = TEST_ADDR + c * VEC_STRIDE;
+    }
+    memset(data_out, 0, sizeof(data_out));
+
+    if (xpdma_sendv(fpga, vec, VEC_COUNT))
+        return -1;
+
+    for (c = 0; c < VEC_COUNT; ++c)
+        vec[c].data = data_out[c];
+    gettimeofday(&timers[0], NULL);
+    if (xpdma_recvv(fpga, vec, VEC_COUNT))
+        err_count++;
+    gettimeofday(&timers[1], NULL);
+    for (c = 0; c < VEC_COUNT; ++c)
+        xpdma_recv(fpga, data_out[c], VEC_RECORD, TEST_ADDR + c * VEC_STRIDE);
+    gettimeofday(&timers[2], NULL);
+
+    for (c = 0; c < VEC_COUNT; ++c) {
+        if (SUCCESS != vec[c].status)
+            printf("record %u: status 0x%08X ", c, vec[c].sgStatus);
+        err_count += (0 != memcmp(data_in[c], data_out[c], VEC_RECORD));
+    }
+
+    printf("%u x %u bytes: vectored %.3f ms, one by one %.3f ms, ", VEC_COUNT, VEC_RECORD,
+           elapsed_ms(&timers[0], &timers[1]), elapsed_ms(&timers[1], &timers[2]));
+    return err_count;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Round trip latency of 4 KB receives, the calling thread (the poller) pinned to one CPU
+// (XPDMA_CPU environment variable, default - the CPU it runs on)
+static void test_latency(xpdma_t *fpga)
+{
+    static uint64_t ns[LATENCY_RUNS];
+    char data[LATENCY_SIZE];
+    struct timespec from, to;
+    cpu_set_t cpus;
+    cpu_set_t saved;
+    const char *env = getenv("XPDMA_CPU");
+    int cpu = env ? atoi(env) : sched_getcpu();
+    unsigned int c;
+    int err_count = 0;
+
+    sched_getaffinity(0, sizeof(saved), &saved);
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus))
+        cpu = -1;
+
+    // warm up caches, TLB and the driver path
+    for (c = 0; c < 1000; ++c)
+        xpdma_recv(fpga, data, LATENCY_SIZE, TEST_ADDR);
+
+    for (c = 0; c < LATENCY_RUNS; ++c) {
+        clock_gettime(CLOCK_MONOTONIC, &from);
+        err_count += (0 != xpdma_recv(fpga, data, LATENCY_SIZE, TEST_ADDR));
+        clock_gettime(CLOCK_MONOTONIC, &to);
+        ns[c] = (to.tv_sec - from.tv_sec) * 1000000000ULL + to.tv_nsec - from.tv_nsec;
+    }
+    qsort(ns, LATENCY_RUNS, sizeof(ns[0]), compare_ns);
+
+    printf("%u x %u bytes receive latency (cpu %d): p50 %.2f us, p99 %.2f us, p99.9 %.2f us, max %.2f us, %d errors\n",
+           LATENCY_RUNS, LATENCY_SIZE, cpu, ns[LATENCY_RUNS / 2] / 1e3, ns[LATENCY_RUNS * 99 / 100] / 1e3,
+           ns[LATENCY_RUNS * 999 / 1000] / 1e3, ns[LATENCY_RUNS - 1] / 1e3, err_count);
+    sched_setaffinity(0, sizeof(saved), &saved);
+}
+
+static volatile int bulk_stop;
+
+// Bulk loads from a second handle until stopped
+static void *bulk_load(void *arg)
+{
+    xpdma_t *fpga = (xpdma_t *)arg;
+    char *data = (char *)malloc(BULK_SIZE);
+
+    if (NULL == data)
+        return NULL;
+    memset(data, 0x5A, BULK_SIZE);
+    while (!bulk_stop)
+        xpdma_send(fpga, data, BULK_SIZE, BULK_ADDR);
+    free(data);
+    return NULL;
+}
+
+// Small receives of the latency class while another process-like handle streams bulk sends
+static void test_sched(void)
+{
+    xpdma_t *fpga;
+    xpdma_t *bulk;
+    pthread_t thread;
+    struct timeval timers[2];
+    cdmaSchedStats_t stats;
+    char data[RATE_SIZE];
+    unsigned int c;
+    int p;
+    int err;
+
+    memset(&stats, 0, sizeof(stats));
+    fpga = xpdma_open(0);
+    bulk = xpdma_open(0);
+    if (NULL == fpga || NULL == bulk) {
+        if (fpga)
+            xpdma_close(fpga);
+        if (bulk)
+            xpdma_close(bulk);
+        return;
+    }
+    xpdma_set_sched(fpga, SCHED_LATENCY, 1);
+    xpdma_set_sched(bulk, SCHED_BULK, 1);
+    // read and clear: the counters below cover this test only
+    xpdma_sched_stats(fpga, &stats);
+
+    bulk_stop = 0;
+    if (pthread_create(&thread, NULL, bulk_load, bulk)) {
+        xpdma_close(bulk);
+        xpdma_close(fpga);
+        return;
+    }
+
+    gettimeofday(&timers[0], NULL);
+    for (c = 0; c < LATENCY_COUNT; ++c)
+        xpdma_recv(fpga, data, RATE_SIZE, TEST_ADDR);
+    gettimeofday(&timers[1], NULL);
+
+    bulk_stop = 1;
+    pthread_join(thread, NULL);
+    err = xpdma_sched_stats(fpga, &stats);
+
+    printf("%u x %u bytes under bulk load: %.3f ms per transfer\n",
+           LATENCY_COUNT, RATE_SIZE, elapsed_ms(&timers[0], &timers[1]) / LATENCY_COUNT);
+    if (err) {
+        printf("Scheduler statistics: not available\n");
+        xpdma_close(bulk);
+        xpdma_close(fpga);
+        return;
+    }
+    for (p = 0; p < SCHED_CLASSES; ++p)
+        printf("%s class: %llu transfers, wait avg %.3f ms, max %.3f ms, max queue %u\n",
+               (SCHED_LATENCY == p) ? "Latency" : "Bulk", (unsigned long long)stats.granted[p],
+               stats.granted[p] ? stats.waitNs[p] / 1e6 / stats.granted[p] : 0.0,
+               stats.maxWaitNs[p] / 1e6, stats.maxQueued[p]);
+    printf("Starving bulk transfers run first: %llu\n", (unsigned long long)stats.aged);
+
+    xpdma_close(bulk);
+    xpdma_close(fpga);
+}
 
 int main() {
     xpdma_t * fpga;
@@ -15,6 +655,7 @@ int main() {
     uint32_t addr_out = TEST_ADDR;
     uint32_t c = 0;
     uint32_t err_count = 0;
+    int pool_err = 0;
 
     char *data_in;
     char *data_out;
@@ -22,62 +663,124 @@ int main() {
     unsigned int len = 0;
     struct timeval _timers[4];
     double time_ms[4];
+    cdmaStats_t stats[2];
 
     printf("Open FPGA: ");
-    fpga = xpdma_open();
+    fpga = xpdma_open(0);
     if (NULL == fpga) {
         printf ("Failed to open XPDMA device\n");
         return 1;
     }
     printf("Successfull\n");
 
-    data_in = (char *)malloc(buf_size);
+    // copies run on the card node, into memory of that node
+    printf("Card NUMA node: %d\n", xpdma_node(fpga));
+    xpdma_bind_node(fpga);
+
+    data_in = (char *)xpdma_alloc_local(fpga, buf_size);
     if (NULL == data_in) {
         printf ("Failed to allocate input buffer memory (size: %lu bytes)\n", buf_size);
         xpdma_close(fpga);
         return 1;
     }
 
-    data_out = (char *)malloc(buf_size);
+    data_out = (char *)xpdma_alloc_local(fpga, buf_size);
     if (NULL == data_out) {
         printf ("Failed to allocate output buffer memory (size: %lu bytes)\n", buf_size);
         xpdma_close(fpga);
         return 1;
     }
 
+    // word at a time, byte loops over 1 GB took longer than the DMA itself
     printf("Fill input data: ");
-    for (c = 0; c < buf_size; ++c)
-        //data_in[c] = rand()%256;
-        data_in[c] = c;
+    for (c = 0; c < buf_size / sizeof(uint64_t); ++c)
+        ((uint64_t *)data_in)[c] = c * 0x9E3779B97F4A7C15ULL;
     printf("Ok\n");
     memset(data_out, 0, buf_size);
 
     printf("Send Data: ");
+    xpdma_stats(fpga, &stats[0]);
     gettimeofday(&_timers[0], NULL);
     xpdma_send(fpga, data_in, buf_size, addr_in);
     gettimeofday(&_timers[1], NULL);
+    xpdma_stats(fpga, &stats[0]);
     printf("Ok\n");
 
     printf("Receive Data: ");
     gettimeofday(&_timers[2], NULL);
     xpdma_recv(fpga, data_out, buf_size, addr_out);
     gettimeofday(&_timers[3], NULL);
+    xpdma_stats(fpga, &stats[1]);
     printf("Ok\n");
 
+    printf("Pool buffer: ");
+    pool_err = test_buffer(fpga);
+    if (pool_err < 0)
+        printf("not available\n");
+    else if (pool_err)
+        printf("%d errors\n", pool_err);
+    else
+        printf("Ok\n");
+
+    printf("Asynchronous pool buffer: ");
+    pool_err = test_async(fpga);
+    if (pool_err < 0)
+        printf("not available\n");
+    else if (pool_err)
+        printf("%d errors\n", pool_err);
+    else
+        printf("Ok\n");
+
+    printf("Vectored records: ");
+    pool_err = test_vec(fpga);
+    if (pool_err < 0)
+        printf("not available\n");
+    else if (pool_err)
+        printf("%d errors\n", pool_err);
+    else
+        printf("Ok\n");
+
+    printf("On-card copy: ");
+    pool_err = test_copy(fpga);
+    if (pool_err < 0)
+        printf("not available\n");
+    else if (pool_err)
+        printf("%d errors\n", pool_err);
+    else
+        printf("Ok\n");
+
+    printf("Read cache: ");
+    pool_err = test_cache(fpga);
+    if (pool_err < 0)
+        printf("not available\n");
+    else if (pool_err)
+        printf("%d errors\n", pool_err);
+    else
+        printf("Ok\n");
+
+    test_latency(fpga);
+    test_regs(fpga);
+    test_parallel(fpga);
+    test_stream(fpga);
+    test_file(fpga);
+    test_rate(0);
+    test_rate(1);
+    test_sched();
+
     printf("Close FPGA\n");
     xpdma_close(fpga);
 
     printf("Check Data: ");
-    for (c = 0; c < buf_size; ++c)
-        err_count += (data_in[c] != data_out[c]);
+    for (c = 0; c < buf_size / sizeof(uint64_t); ++c)
+        err_count += (((uint64_t *)data_in)[c] != ((uint64_t *)data_out)[c]);
 
     if (err_count)
         printf("%lu errors\n", err_count);
     else
         printf("Ok\n");
 
-    free(data_in);
-    free(data_out);
+    xpdma_free_local(data_in, buf_size);
+    xpdma_free_local(data_out, buf_size);
 
     for (c = 0; c < 4; ++c)
         time_ms[c] =
@@ -86,5 +789,7 @@ int main() {
 
     printf("Send speed: %f MB/s (%f ms)\n", buf_size/(1024*1024)/((time_ms[1] - time_ms[0])/1000.0), (time_ms[1] - time_ms[0]));
     printf("Recv speed: %f MB/s (%f ms)\n", buf_size/1024/1024/((time_ms[3] - time_ms[2])/1000.0), (time_ms[3] - time_ms[2]));
+    print_stats("Send", &stats[0]);
+    print_stats("Recv", &stats[1]);
     return 0;
 }
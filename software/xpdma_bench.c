@@ -0,0 +1,656 @@
+//
+// xpdma-bench: throughput, latency percentiles and CPU cost of XPDMA transfers,
+// swept over transfer size, direction, DDR offset, host alignment, queue depth
+// and threads; text, CSV or JSON output; any libxpdma backend (XPDMA_BACKEND or -b)
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "xpdma.h"
+
+#define LIST_MAX        64                      // Values per swept parameter
+#define DDR_SIZE        (1024ULL*1024*1024)     // KC705 DDR3, -m overrides
+#define MEM_CAP         (4096ULL*1024*1024)     // Host buffers of one point, -M overrides
+#define HOST_SLACK      4096                    // Room for the host misalignment
+#define MIN_OPS         8                       // Per thread and point, also when the time is up
+#define MAX_OPS         1000000
+
+enum {
+    DIR_SEND,
+    DIR_RECV,
+    DIR_MIXED,          // send and receive alternate
+    DIR_COUNT
+};
+
+static const char *dir_names[DIR_COUNT] = {"send", "recv", "mixed"};
+
+enum {
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSON,
+};
+
+typedef struct {
+    uint64_t value[LIST_MAX];
+    int count;
+} list_t;
+
+// Command line
+typedef struct {
+    const xpdma_backend_t *backend; // NULL - xpdma_open (XPDMA_BACKEND)
+    const char *backendName;
+    int card;
+    list_t sizes;
+    list_t dirs;
+    list_t offsets;     // DDR3 address offsets (alignment of the card side)
+    list_t aligns;      // Host buffer misalignment in bytes
+    list_t depths;      // 1 - synchronous send/receive, more - asynchronous pool buffer requests
+    list_t threads;     // One handle per thread
+    uint64_t base;      // DDR3 base address of the tested region
+    uint64_t ddrSize;
+    uint64_t memCap;
+    double seconds;     // Minimal time per point
+    uint64_t ops;       // Operations per thread and point, 0 - by time
+    int format;
+    FILE *out;
+} bench_opts_t;
+
+// One measured point
+typedef struct {
+    int dir;
+    uint64_t size;
+    uint64_t offset;
+    uint64_t align;
+    uint64_t depth;
+    uint64_t threads;
+} point_t;
+
+typedef struct {
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t bytes;
+    double seconds;
+    double cpu;         // Process CPU time / wall time, 1.0 - one core busy
+    double mean, p50, p99, p999, max; // Latency, ns
+    const char *skip;   // Reason the point was not run
+} result_t;
+
+// Per thread state
+typedef struct {
+    const bench_opts_t *opts;
+    const point_t *point;
+    int index;
+    pthread_barrier_t *barrier;
+    xpdma_t *fpga;
+    char *host;
+    uint64_t *lat;      // Latency samples, ns
+    uint64_t nlat;
+    uint64_t cap;
+    uint64_t errors;
+    uint64_t bytes;
+    struct timespec end;    // Last operation finished
+    const char *skip;
+} worker_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double ts_diff(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static int ts_before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static int sample(worker_t *w, uint64_t ns)
+{
+    uint64_t *lat;
+
+    if (w->nlat == w->cap) {
+        lat = (uint64_t *)realloc(w->lat, (w->cap ? w->cap * 2 : 4096) * sizeof(uint64_t));
+        if (lat == NULL)
+            return -1;
+        w->lat = lat;
+        w->cap = w->cap ? w->cap * 2 : 4096;
+    }
+    w->lat[w->nlat++] = ns;
+    return 0;
+}
+
+// Operation k of the thread: its DDR3 address and direction; threads and
+// queue slots get their own part of the region while it has room
+static uint32_t op_addr(const worker_t *w, uint64_t k)
+{
+    const point_t *p = w->point;
+    uint64_t fit = (w->opts->ddrSize - w->opts->base - p->offset) / p->size;
+    uint64_t slot = (uint64_t)w->index * p->depth + k % p->depth;
+
+    return (uint32_t)(w->opts->base + p->offset + (slot % fit) * p->size);
+}
+
+static int op_send(const point_t *p, uint64_t k)
+{
+    return (p->dir == DIR_SEND) || (p->dir == DIR_MIXED && !(k & 1));
+}
+
+static int op_done(const worker_t *w, uint64_t k, uint64_t deadline)
+{
+    if (w->opts->ops)
+        return k >= w->opts->ops;
+    return k >= MAX_OPS || (k >= MIN_OPS && now_ns() >= deadline);
+}
+
+// Queue depth 1: synchronous send/receive from a user buffer; every path
+// passes the start barrier once
+static void run_sync(worker_t *w)
+{
+    const point_t *p = w->point;
+    char *data = w->host + p->align;
+    uint64_t deadline;
+    uint64_t k;
+    uint64_t t;
+    int err;
+
+    // warm up the path (pinning, TLB, staging buffers) outside of the timing
+    err = op_send(p, 0) ? xpdma_send(w->fpga, data, p->size, op_addr(w, 0))
+                        : xpdma_recv(w->fpga, data, p->size, op_addr(w, 0));
+    if (err)
+        w->skip = "transfer failed";
+
+    pthread_barrier_wait(w->barrier);
+    if (w->skip)
+        return;
+    deadline = now_ns() + (uint64_t)(w->opts->seconds * 1e9);
+
+    for (k = 0; !op_done(w, k, deadline); ++k) {
+        t = now_ns();
+        err = op_send(p, k) ? xpdma_send(w->fpga, data, p->size, op_addr(w, k))
+                            : xpdma_recv(w->fpga, data, p->size, op_addr(w, k));
+        if (sample(w, now_ns() - t))
+            break;
+        if (err)
+            w->errors++;
+        else
+            w->bytes += p->size;
+    }
+    clock_gettime(CLOCK_MONOTONIC_RAW, &w->end);
+}
+
+// Queue depth N: N asynchronous requests on pool buffer ranges kept in flight,
+// latency is submit to reaped completion
+static void run_async(worker_t *w)
+{
+    const point_t *p = w->point;
+    xpdma_buffer_t *buffers[LIST_MAX];
+    cdmaCompletion_t done[LIST_MAX];
+    uint64_t submitted[LIST_MAX];
+    unsigned int perBuffer = 0;
+    unsigned int nbuffers = 0;
+    uint64_t deadline;
+    uint64_t k = 0;
+    uint64_t inflight = 0;
+    uint64_t slot;
+    int n;
+    int c;
+
+    // every in-flight request owns a range of a pool buffer
+    while (!w->skip && (!nbuffers || nbuffers * perBuffer < p->depth)) {
+        buffers[nbuffers] = xpdma_buffer_alloc(w->fpga);
+        if (buffers[nbuffers] == NULL)
+            w->skip = nbuffers ? "not enough pool buffers for the depth" : "no pool buffers (kernel backend only)";
+        else if (p->size > buffers[nbuffers++]->size)
+            w->skip = "size exceeds the pool buffer";
+        else
+            perBuffer = buffers[0]->size / p->size;
+    }
+
+    pthread_barrier_wait(w->barrier);
+    deadline = now_ns() + (uint64_t)(w->opts->seconds * 1e9);
+
+    // slot s is submitted with cookie s and resubmitted as soon as it completes
+    for (slot = 0; !w->skip && slot < p->depth && !op_done(w, k, deadline); ++slot, ++k) {
+        submitted[slot] = now_ns();
+        if (xpdma_submit(w->fpga, op_send(p, k) ? REQUEST_SEND : REQUEST_RECV,
+                         buffers[slot / perBuffer], (slot % perBuffer) * p->size,
+                         p->size, op_addr(w, k), slot)) {
+            w->errors++;
+            break;
+        }
+        inflight++;
+    }
+
+    while (inflight) {
+        n = xpdma_wait(w->fpga, done, p->depth);
+        if (n <= 0)
+            break;
+        for (c = 0; c < n; ++c) {
+            slot = done[c].cookie;
+            inflight--;
+            sample(w, now_ns() - submitted[slot]);
+            if (done[c].status == SUCCESS)
+                w->bytes += done[c].count;
+            else
+                w->errors++;
+
+            if (op_done(w, k, deadline))
+                continue;
+            submitted[slot] = now_ns();
+            if (xpdma_submit(w->fpga, op_send(p, k) ? REQUEST_SEND : REQUEST_RECV,
+                             buffers[slot / perBuffer], (slot % perBuffer) * p->size,
+                             p->size, op_addr(w, k), slot)) {
+                w->errors++;
+                continue;
+            }
+            inflight++;
+            k++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC_RAW, &w->end);
+
+    while (nbuffers)
+        xpdma_buffer_free(w->fpga, buffers[--nbuffers]);
+}
+
+static void *worker_run(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+
+    if (w->point->depth > 1)
+        run_async(w);
+    else
+        run_sync(w);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double pick(const uint64_t *sorted, uint64_t n, double q)
+{
+    uint64_t i = (uint64_t)(q * n);
+
+    return (double)sorted[i < n ? i : n - 1];
+}
+
+static xpdma_t *bench_open(const bench_opts_t *opts)
+{
+    return opts->backend ? xpdma_open_backend(opts->backend, opts->card) : xpdma_open(opts->card);
+}
+
+static void run_point(const bench_opts_t *opts, const point_t *p, result_t *r)
+{
+    worker_t workers[LIST_MAX];
+    pthread_t threads[LIST_MAX];
+    pthread_barrier_t barrier;
+    struct timespec start, end;
+    uint64_t *all = NULL;
+    uint64_t n = 0;
+    uint64_t t;
+    double cpu;
+    int started = 0;
+
+    memset(r, 0, sizeof(result_t));
+    memset(workers, 0, sizeof(workers));
+    // op_addr divides by the size
+    if (!p->size) {
+        r->skip = "zero size";
+        return;
+    }
+    if (p->threads > LIST_MAX || p->depth > LIST_MAX) {
+        r->skip = "too many threads or too deep";
+        return;
+    }
+    if (p->threads * (p->size + HOST_SLACK) > opts->memCap) {
+        r->skip = "host buffers exceed the memory cap";
+        return;
+    }
+    if (opts->base + p->offset + p->size > opts->ddrSize || p->size > 0xFFFFFFFFULL) {
+        r->skip = "outside DDR3";
+        return;
+    }
+
+    pthread_barrier_init(&barrier, NULL, p->threads + 1);
+    for (t = 0; t < p->threads; ++t) {
+        workers[t].opts = opts;
+        workers[t].point = p;
+        workers[t].index = t;
+        workers[t].barrier = &barrier;
+        workers[t].fpga = bench_open(opts);
+        if (workers[t].fpga == NULL) {
+            r->skip = "open failed";
+            break;
+        }
+        workers[t].host = (char *)xpdma_alloc_local(workers[t].fpga, p->size + HOST_SLACK);
+        if (workers[t].host == NULL) {
+            r->skip = "no host memory";
+            break;
+        }
+        memset(workers[t].host, 0x5A, p->size + HOST_SLACK);
+    }
+
+    for (t = 0; !r->skip && t < p->threads; ++t) {
+        // started threads already wait at the barrier for the missing one
+        if (pthread_create(&threads[t], NULL, worker_run, &workers[t])) {
+            fprintf(stderr, "Failed to create thread %lu\n", t);
+            exit(1);
+        }
+        started++;
+    }
+
+    if (started) {
+        // warm-up and setup of the threads are done once they all passed the barrier
+        pthread_barrier_wait(&barrier);
+        cpu = cpu_seconds();
+        clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+        for (t = 0; t < (uint64_t)started; ++t)
+            pthread_join(threads[t], NULL);
+        cpu = cpu_seconds() - cpu;
+
+        // pool buffers and handles are released after the last operation
+        end = start;
+        for (t = 0; t < (uint64_t)started; ++t) {
+            if (ts_before(&end, &workers[t].end))
+                end = workers[t].end;
+        }
+
+        r->seconds = ts_diff(&start, &end);
+        r->cpu = r->seconds > 0 ? cpu / r->seconds : 0;
+    }
+    pthread_barrier_destroy(&barrier);
+
+    for (t = 0; t < p->threads; ++t) {
+        if (workers[t].skip && !r->skip)
+            r->skip = workers[t].skip;
+        r->errors += workers[t].errors;
+        r->bytes += workers[t].bytes;
+        n += workers[t].nlat;
+    }
+
+    if (!r->skip && n) {
+        all = (uint64_t *)malloc(n * sizeof(uint64_t));
+        n = 0;
+        for (t = 0; all && t < p->threads; ++t) {
+            memcpy(all + n, workers[t].lat, workers[t].nlat * sizeof(uint64_t));
+            n += workers[t].nlat;
+        }
+    }
+    if (all) {
+        qsort(all, n, sizeof(uint64_t), compare_u64);
+        r->ops = n;
+        for (t = 0; t < n; ++t)
+            r->mean += all[t];
+        r->mean /= n;
+        r->p50 = pick(all, n, 0.5);
+        r->p99 = pick(all, n, 0.99);
+        r->p999 = pick(all, n, 0.999);
+        r->max = all[n - 1];
+        free(all);
+    }
+
+    for (t = 0; t < p->threads; ++t) {
+        if (workers[t].host)
+            xpdma_free_local(workers[t].host, p->size + HOST_SLACK);
+        if (workers[t].fpga)
+            xpdma_close(workers[t].fpga);
+        free(workers[t].lat);
+    }
+}
+
+static void print_header(const bench_opts_t *opts)
+{
+    if (opts->format == FORMAT_CSV)
+        fprintf(opts->out, "backend,dir,size,ddr_offset,host_align,depth,threads,ops,errors,seconds,"
+                "mb_s,iops,lat_mean_us,lat_p50_us,lat_p99_us,lat_p999_us,lat_max_us,cpu_pct,skip\n");
+    else if (opts->format == FORMAT_JSON)
+        fprintf(opts->out, "[\n");
+    else
+        fprintf(opts->out, "%-5s %10s %6s %5s %5s %3s %9s %10s %9s %9s %9s %9s %9s %6s\n",
+                "dir", "size", "offset", "align", "depth", "thr", "ops", "MB/s", "IOPS",
+                "p50 us", "p99 us", "p999 us", "max us", "cpu %");
+}
+
+static void print_point(const bench_opts_t *opts, const point_t *p, const result_t *r, int first)
+{
+    double mbs = r->seconds > 0 ? r->bytes / r->seconds / (1024 * 1024) : 0;
+    double iops = r->seconds > 0 ? r->ops / r->seconds : 0;
+
+    if (opts->format == FORMAT_CSV) {
+        fprintf(opts->out, "%s,%s,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%.6f,%.2f,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f,%.1f,%s\n",
+                opts->backendName, dir_names[p->dir], p->size, p->offset, p->align, p->depth, p->threads,
+                r->ops, r->errors, r->seconds, mbs, iops, r->mean / 1e3, r->p50 / 1e3, r->p99 / 1e3,
+                r->p999 / 1e3, r->max / 1e3, r->cpu * 100, r->skip ? r->skip : "");
+    } else if (opts->format == FORMAT_JSON) {
+        fprintf(opts->out, "%s  {\"backend\": \"%s\", \"dir\": \"%s\", \"size\": %lu, \"ddr_offset\": %lu, "
+                "\"host_align\": %lu, \"depth\": %lu, \"threads\": %lu, ",
+                first ? "" : ",\n", opts->backendName, dir_names[p->dir], p->size, p->offset, p->align,
+                p->depth, p->threads);
+        if (r->skip)
+            fprintf(opts->out, "\"skip\": \"%s\"}", r->skip);
+        else
+            fprintf(opts->out, "\"ops\": %lu, \"errors\": %lu, \"seconds\": %.6f, \"mb_s\": %.2f, \"iops\": %.1f, "
+                    "\"lat_mean_us\": %.3f, \"lat_p50_us\": %.3f, \"lat_p99_us\": %.3f, \"lat_p999_us\": %.3f, "
+                    "\"lat_max_us\": %.3f, \"cpu_pct\": %.1f}",
+                    r->ops, r->errors, r->seconds, mbs, iops, r->mean / 1e3, r->p50 / 1e3, r->p99 / 1e3,
+                    r->p999 / 1e3, r->max / 1e3, r->cpu * 100);
+    } else if (r->skip) {
+        fprintf(opts->out, "%-5s %10lu %6lu %5lu %5lu %3lu  skipped: %s\n", dir_names[p->dir], p->size,
+                p->offset, p->align, p->depth, p->threads, r->skip);
+    } else {
+        fprintf(opts->out, "%-5s %10lu %6lu %5lu %5lu %3lu %9lu %10.2f %9.0f %9.2f %9.2f %9.2f %9.2f %6.1f%s\n",
+                dir_names[p->dir], p->size, p->offset, p->align, p->depth, p->threads, r->ops, mbs, iops,
+                r->p50 / 1e3, r->p99 / 1e3, r->p999 / 1e3, r->max / 1e3, r->cpu * 100,
+                r->errors ? "  ERRORS" : "");
+    }
+    fflush(opts->out);
+}
+
+// 4K, 1M, 2G, plain numbers (0x.. too)
+static int parse_size(const char *s, uint64_t *value)
+{
+    char *end;
+
+    *value = strtoull(s, &end, 0);
+    if (end == s)
+        return -1;
+    switch (*end) {
+    case 'k': case 'K': *value <<= 10; end++; break;
+    case 'm': case 'M': *value <<= 20; end++; break;
+    case 'g': case 'G': *value <<= 30; end++; break;
+    }
+    return (*end && *end != ',' && *end != '-' && *end != ':') ? -1 : 0;
+}
+
+// "a,b,c" or "from-to[:factor]" (factor 2 by default)
+static int parse_list(const char *s, list_t *list)
+{
+    const char *dash = strchr(s, '-');
+    const char *colon = strchr(s, ':');
+    uint64_t from, to, factor = 2;
+    const char *p = s;
+
+    list->count = 0;
+    if (dash) {
+        if (parse_size(s, &from) || parse_size(dash + 1, &to) || (colon && parse_size(colon + 1, &factor)))
+            return -1;
+        if (!from || factor < 2)
+            return -1;
+        for (; from <= to && list->count < LIST_MAX; from *= factor)
+            list->value[list->count++] = from;
+        return list->count ? 0 : -1;
+    }
+
+    while (*p && list->count < LIST_MAX) {
+        if (parse_size(p, &list->value[list->count++]))
+            return -1;
+        p = strchr(p, ',');
+        if (p == NULL)
+            break;
+        p++;
+    }
+    return 0;
+}
+
+static int parse_dirs(const char *s, list_t *list)
+{
+    char copy[64];
+    char *tok;
+    char *save;
+    int d;
+
+    list->count = 0;
+    snprintf(copy, sizeof(copy), "%s", s);
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        for (d = 0; d < DIR_COUNT && strcmp(tok, dir_names[d]); ++d);
+        if (d == DIR_COUNT)
+            return -1;
+        list->value[list->count++] = d;
+    }
+    return list->count ? 0 : -1;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options]\n", name);
+    printf("  -b backend   kernel, vfio, mock or sim (XPDMA_BACKEND, default kernel)\n");
+    printf("  -c card      card index (0)\n");
+    printf("  -s sizes     transfer sizes: list 4K,1M or range 4K-1G[:factor] (4K-1G:4)\n");
+    printf("  -d dirs      send,recv,mixed (send,recv)\n");
+    printf("  -o offsets   DDR3 address offsets in bytes (0)\n");
+    printf("  -a aligns    host buffer misalignment in bytes (0)\n");
+    printf("  -q depths    queue depths, above 1 - asynchronous pool buffer requests (1)\n");
+    printf("  -t threads   threads, one handle each (1)\n");
+    printf("  -A addr      DDR3 base address of the tested region (0)\n");
+    printf("  -m bytes     DDR3 size (1G)\n");
+    printf("  -M bytes     host memory cap per point (4G)\n");
+    printf("  -T seconds   minimal time per point (0.5)\n");
+    printf("  -n ops       operations per thread and point instead of time\n");
+    printf("  -f format    text, csv or json (text)\n");
+    printf("  -O file      output file (stdout)\n");
+}
+
+int main(int argc, char **argv)
+{
+    bench_opts_t opts;
+    point_t p;
+    result_t r;
+    int first = 1;
+    int s, d, o, a, q, t;
+    int err;
+    int c;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.backendName = getenv("XPDMA_BACKEND");
+    parse_list("4K-1G:4", &opts.sizes);
+    parse_dirs("send,recv", &opts.dirs);
+    parse_list("0", &opts.offsets);
+    parse_list("0", &opts.aligns);
+    parse_list("1", &opts.depths);
+    parse_list("1", &opts.threads);
+    opts.ddrSize = DDR_SIZE;
+    opts.memCap = MEM_CAP;
+    opts.seconds = 0.5;
+    opts.out = stdout;
+
+    while ((c = getopt(argc, argv, "b:c:s:d:o:a:q:t:A:m:M:T:n:f:O:h")) != -1) {
+        err = 0;
+        switch (c) {
+        case 'b':
+            opts.backend = xpdma_find_backend(optarg);
+            opts.backendName = optarg;
+            if (opts.backend == NULL) {
+                fprintf(stderr, "Unknown backend %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c': opts.card = atoi(optarg); break;
+        case 's': err = parse_list(optarg, &opts.sizes); break;
+        case 'd': err = parse_dirs(optarg, &opts.dirs); break;
+        case 'o': err = parse_list(optarg, &opts.offsets); break;
+        case 'a': err = parse_list(optarg, &opts.aligns); break;
+        case 'q': err = parse_list(optarg, &opts.depths); break;
+        case 't': err = parse_list(optarg, &opts.threads); break;
+        case 'A': err = parse_size(optarg, &opts.base); break;
+        case 'm': err = parse_size(optarg, &opts.ddrSize); break;
+        case 'M': err = parse_size(optarg, &opts.memCap); break;
+        case 'T': opts.seconds = atof(optarg); break;
+        case 'n': err = parse_size(optarg, &opts.ops); break;
+        case 'f':
+            if (!strcmp(optarg, "csv"))
+                opts.format = FORMAT_CSV;
+            else if (!strcmp(optarg, "json"))
+                opts.format = FORMAT_JSON;
+            else if (strcmp(optarg, "text"))
+                err = -1;
+            break;
+        case 'O':
+            opts.out = fopen(optarg, "w");
+            if (opts.out == NULL) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return (c == 'h') ? 0 : 1;
+        }
+        if (err) {
+            fprintf(stderr, "Bad value of -%c: %s\n", c, optarg);
+            return 1;
+        }
+    }
+    if (opts.backendName == NULL || !*opts.backendName)
+        opts.backendName = "kernel";
+
+    print_header(&opts);
+    for (s = 0; s < opts.sizes.count; ++s)
+    for (d = 0; d < opts.dirs.count; ++d)
+    for (o = 0; o < opts.offsets.count; ++o)
+    for (a = 0; a < opts.aligns.count; ++a)
+    for (q = 0; q < opts.depths.count; ++q)
+    for (t = 0; t < opts.threads.count; ++t) {
+        p.size = opts.sizes.value[s];
+        p.dir = (int)opts.dirs.value[d];
+        p.offset = opts.offsets.value[o];
+        p.align = opts.aligns.value[a] % HOST_SLACK;
+        p.depth = opts.depths.value[q] ? opts.depths.value[q] : 1;
+        p.threads = opts.threads.value[t] ? opts.threads.value[t] : 1;
+        run_point(&opts, &p, &r);
+        print_point(&opts, &p, &r, first);
+        first = 0;
+    }
+    if (opts.format == FORMAT_JSON)
+        fprintf(opts.out, "\n]\n");
+
+    if (opts.out != stdout)
+        fclose(opts.out);
+    return 0;
+}
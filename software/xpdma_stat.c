@@ -0,0 +1,217 @@
+//
+// xpdma-stat: live rates and per-phase latency percentiles of an XPDMA card,
+// rendered from the driver phase histograms (debugfs xpdma/xpdmaN/stats)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define DEBUGFS_ROOT    "/sys/kernel/debug/xpdma"
+#define PHASE_MAX       16      // Phases shown, the driver has fewer
+#define HIST_MAX        64      // log2 buckets, bucket b counts [2^(b-1), 2^b) ns
+
+typedef struct {
+    char name[16];
+    uint64_t count;
+    uint64_t sumNs;
+    uint64_t hist[HIST_MAX];
+} phase_t;
+
+typedef struct {
+    uint64_t bytes;
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t timeouts;
+    int phases;
+    int buckets;
+    phase_t phase[PHASE_MAX];
+} snapshot_t;
+
+static int read_stats(const char *path, snapshot_t *snap)
+{
+    FILE *file = fopen(path, "r");
+    char line[4096];
+    char name[16];
+    char *pos = NULL;
+    char *end = NULL;
+    phase_t *phase = NULL;
+    uint64_t value = 0;
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    memset(snap, 0, sizeof(snapshot_t));
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "%15s %lu", name, &value) != 2)
+            continue;
+        if (!strcmp(name, "bytes"))
+            snap->bytes = value;
+        else if (!strcmp(name, "ops"))
+            snap->ops = value;
+        else if (!strcmp(name, "errors"))
+            snap->errors = value;
+        else if (!strcmp(name, "timeouts"))
+            snap->timeouts = value;
+        else if (snap->phases < PHASE_MAX) {
+            // name count sumNs bucket0 .. bucketN
+            phase = &snap->phase[snap->phases++];
+            strcpy(phase->name, name);
+            pos = line + strlen(name);
+            phase->count = strtoull(pos, &pos, 10);
+            phase->sumNs = strtoull(pos, &pos, 10);
+            for (snap->buckets = 0; snap->buckets < HIST_MAX; ++snap->buckets) {
+                value = strtoull(pos, &end, 10);
+                if (end == pos)
+                    break;
+                phase->hist[snap->buckets] = value;
+                pos = end;
+            }
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+// Latency below which the fraction q of the samples falls, linear within the bucket
+static double percentile(const phase_t *phase, int buckets, double q)
+{
+    double target = q * phase->count;
+    double seen = 0;
+    double low = 0;
+    double high = 0;
+    int b = 0;
+
+    for (b = 0; b < buckets; ++b) {
+        if (phase->hist[b] && seen + phase->hist[b] >= target) {
+            low = b ? (double)(1ULL << (b - 1)) : 0;
+            high = (double)(1ULL << b);
+            return low + (high - low) * (target - seen) / phase->hist[b];
+        }
+        seen += phase->hist[b];
+    }
+
+    return (double)(1ULL << (buckets - 1));
+}
+
+static const char *format_ns(double ns, char *buf)
+{
+    if (ns < 1000)
+        sprintf(buf, "%.0fns", ns);
+    else if (ns < 1000000)
+        sprintf(buf, "%.1fus", ns / 1000);
+    else if (ns < 1000000000)
+        sprintf(buf, "%.1fms", ns / 1000000);
+    else
+        sprintf(buf, "%.2fs", ns / 1000000000);
+    return buf;
+}
+
+static void show(const snapshot_t *now, const snapshot_t *prev, double seconds)
+{
+    phase_t delta;
+    char p50[16], p99[16], p999[16], mean[16];
+    int p = 0;
+    int b = 0;
+
+    printf("%10.2f MB/s %10.0f ops/s  errors %lu  timeouts %lu\n",
+           (now->bytes - prev->bytes) / seconds / (1024 * 1024),
+           (now->ops - prev->ops) / seconds,
+           now->errors - prev->errors, now->timeouts - prev->timeouts);
+    printf("  %-10s %12s %10s %10s %10s %10s\n", "phase", "count/s", "mean", "p50", "p99", "p999");
+
+    for (p = 0; p < now->phases; ++p) {
+        delta = now->phase[p];
+        delta.count -= prev->phase[p].count;
+        delta.sumNs -= prev->phase[p].sumNs;
+        for (b = 0; b < now->buckets; ++b)
+            delta.hist[b] -= prev->phase[p].hist[b];
+        if (!delta.count)
+            continue;
+
+        printf("  %-10s %12.0f %10s %10s %10s %10s\n", delta.name, delta.count / seconds,
+               format_ns((double)delta.sumNs / delta.count, mean),
+               format_ns(percentile(&delta, now->buckets, 0.5), p50),
+               format_ns(percentile(&delta, now->buckets, 0.99), p99),
+               format_ns(percentile(&delta, now->buckets, 0.999), p999));
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-c card] [-i seconds] [-n count] [-r]\n", name);
+    printf("  -c card     card index, /dev/xpdmaN (0)\n");
+    printf("  -i seconds  refresh interval (1)\n");
+    printf("  -n count    refreshes before exit (0 - forever)\n");
+    printf("  -r          reset the statistics and exit\n");
+}
+
+int main(int argc, char **argv)
+{
+    snapshot_t snap[2];
+    char path[256];
+    int card = 0;
+    double interval = 1;
+    int count = 0;
+    int reset = 0;
+    int cur = 0;
+    int c = 0;
+    FILE *file = NULL;
+    struct timespec last, now;
+    double seconds = 0;
+
+    while ((c = getopt(argc, argv, "c:i:n:rh")) != -1) {
+        switch (c) {
+        case 'c': card = atoi(optarg); break;
+        case 'i': interval = atof(optarg); break;
+        case 'n': count = atoi(optarg); break;
+        case 'r': reset = 1; break;
+        default:
+            usage(argv[0]);
+            return (c == 'h') ? 0 : 1;
+        }
+    }
+    if (interval <= 0)
+        interval = 1;
+
+    if (reset) {
+        sprintf(path, DEBUGFS_ROOT "/xpdma%d/reset", card);
+        file = fopen(path, "w");
+        if (file == NULL || fputs("1\n", file) < 0) {
+            perror(path);
+            return 1;
+        }
+        fclose(file);
+        return 0;
+    }
+
+    sprintf(path, DEBUGFS_ROOT "/xpdma%d/stats", card);
+    if (read_stats(path, &snap[cur]))
+        return 1;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+
+    for (c = 0; !count || c < count; ++c) {
+        usleep((useconds_t)(interval * 1000000));
+        cur = !cur;
+        if (read_stats(path, &snap[cur]))
+            return 1;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        seconds = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+        last = now;
+
+        // statistics were reset in between: rates start from zero
+        if (snap[cur].ops < snap[!cur].ops)
+            memset(&snap[!cur], 0, sizeof(snapshot_t));
+        show(&snap[cur], &snap[!cur], seconds);
+    }
+
+    return 0;
+}